@@ -0,0 +1,239 @@
+#include "ActivityGate.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "Constants.hh"
+#include "Convert.hh"
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Spectral flatness is only measured over this band, which excludes DC and
+// rumble, and the top of the spectrum where there's usually nothing but noise
+static constexpr double FLATNESS_MIN_FREQ = 100.0;
+static constexpr double FLATNESS_MAX_FREQ = 8000.0;
+
+static size_t window_frames_for_sample_rate(int sample_rate) {
+  // The smallest power of 2 that's at least 10ms, since the FFT needs one
+  size_t ret = 64;
+  while (ret < static_cast<size_t>(sample_rate) / 100) {
+    ret <<= 1;
+  }
+  return ret;
+}
+
+static size_t windows_for_ms(double ms, int sample_rate, size_t window_frames) {
+  double frames = ms * sample_rate / 1000.0;
+  return (frames > 0.0) ? static_cast<size_t>(ceil(frames / window_frames)) : 0;
+}
+
+ActivityGate::ActivityGate(int sample_rate, int format, AudioCapture::BlockCallback block_callback,
+    SegmentCallback segment_callback, const ActivityGateOptions& options)
+    : sample_rate(sample_rate),
+      format(format),
+      frame_bytes(bytes_per_frame(format)),
+      options(options),
+      block_callback(std::move(block_callback)),
+      segment_callback(std::move(segment_callback)),
+      window_frames(window_frames_for_sample_rate(sample_rate)),
+      attack_windows(max<size_t>(windows_for_ms(options.attack_ms, sample_rate, this->window_frames), 1)),
+      release_windows(max<size_t>(windows_for_ms(options.release_ms, sample_rate, this->window_frames), 1)),
+      pre_roll_windows(windows_for_ms(options.pre_roll_ms, sample_rate, this->window_frames)),
+      num_slots(this->pre_roll_windows + this->attack_windows + 1),
+      slot_data(this->num_slots * this->window_frames * this->frame_bytes),
+      slot_info(this->num_slots),
+      next_window_index(0),
+      window_frames_filled(0),
+      next_unemitted_window(0),
+      fft_plan(this->window_frames),
+      mono(this->window_frames),
+      hann(this->window_frames),
+      spectrum(this->window_frames),
+      open(false),
+      consecutive_active(0),
+      consecutive_inactive(0),
+      segment{0, 0, 0, 0},
+      segment_discontinuity_pending(false),
+      open_flag(false),
+      frames_in(0),
+      frames_passed(0),
+      segments(0) {
+  if (sample_rate <= 0) {
+    throw invalid_argument("sample rate must be positive");
+  }
+  if (!this->block_callback) {
+    throw invalid_argument("activity gate requires a block callback");
+  }
+  if (options.close_threshold_db > options.open_threshold_db) {
+    throw invalid_argument("close threshold must not be above open threshold");
+  }
+
+  for (size_t x = 0; x < this->window_frames; x++) {
+    this->hann[x] = 0.5 - 0.5 * cos(2.0 * M_PI * x / this->window_frames);
+  }
+  this->min_flatness_bin = max<size_t>(lround(FLATNESS_MIN_FREQ * this->window_frames / sample_rate), 1);
+  this->max_flatness_bin = min<size_t>(FLATNESS_MAX_FREQ * this->window_frames / sample_rate, this->window_frames / 2 - 1);
+  this->max_flatness_bin = max(this->max_flatness_bin, this->min_flatness_bin);
+}
+
+void ActivityGate::add_frames(const void* data, size_t frame_count, const AudioCapture::BlockInfo& info) {
+  this->frames_in += frame_count;
+
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+  size_t x = 0;
+  while (x < frame_count) {
+    size_t slot = this->next_window_index % this->num_slots;
+    WindowInfo& window_info = this->slot_info[slot];
+    if (this->window_frames_filled == 0) {
+      window_info.frame_index = info.frame_index + x;
+      window_info.timestamp_ns = info.timestamp_ns + (x * 1000000000ULL) / this->sample_rate;
+      window_info.discontinuity = false;
+    }
+    if ((x == 0) && info.discontinuity) {
+      window_info.discontinuity = true;
+    }
+
+    size_t count = min(frame_count - x, this->window_frames - this->window_frames_filled);
+    memcpy(&this->slot_data[(slot * this->window_frames + this->window_frames_filled) * this->frame_bytes],
+        &in[x * this->frame_bytes], count * this->frame_bytes);
+    this->window_frames_filled += count;
+    x += count;
+    if (this->window_frames_filled == this->window_frames) {
+      this->finish_window();
+    }
+  }
+}
+
+AudioCapture::BlockCallback ActivityGate::capture_callback() {
+  return [this](const void* data, size_t frame_count, const AudioCapture::BlockInfo& info) -> void {
+    this->add_frames(data, frame_count, info);
+  };
+}
+
+void ActivityGate::flush() {
+  if (this->open) {
+    if (this->window_frames_filled) {
+      this->emit_window(this->next_window_index, this->window_frames_filled);
+    }
+    this->close_segment();
+  }
+  // A partial window is never analyzed, so if the gate was closed, it's
+  // dropped
+  if (this->window_frames_filled) {
+    this->next_window_index++;
+    this->window_frames_filled = 0;
+  }
+  this->consecutive_active = 0;
+}
+
+bool ActivityGate::is_open() const {
+  return this->open_flag.load();
+}
+
+ActivityGate::Stats ActivityGate::get_stats() const {
+  Stats ret;
+  ret.frames_in = this->frames_in.load();
+  ret.frames_passed = this->frames_passed.load();
+  ret.segments = this->segments.load();
+  return ret;
+}
+
+void ActivityGate::finish_window() {
+  uint64_t window_index = this->next_window_index;
+  bool active = this->analyze_window(&this->slot_data[(window_index % this->num_slots) * this->window_frames * this->frame_bytes]);
+  this->next_window_index++;
+  this->window_frames_filled = 0;
+
+  if (!this->open) {
+    this->consecutive_active = active ? (this->consecutive_active + 1) : 0;
+    if (this->consecutive_active < this->attack_windows) {
+      return;
+    }
+
+    // Open the gate, and emit everything from the start of the pre-roll
+    // through the current window
+    this->open = true;
+    this->open_flag = true;
+    this->segments++;
+    this->consecutive_inactive = 0;
+    uint64_t first_active_window = window_index + 1 - this->attack_windows;
+    uint64_t first_window = first_active_window - min<uint64_t>(this->pre_roll_windows, first_active_window);
+    first_window = max(first_window, this->next_unemitted_window);
+    const auto& first_info = this->slot_info[first_window % this->num_slots];
+    this->segment.start_frame = first_info.frame_index;
+    this->segment.start_timestamp_ns = first_info.timestamp_ns;
+    this->segment_discontinuity_pending = true;
+    for (uint64_t w = first_window; w <= window_index; w++) {
+      this->emit_window(w, this->window_frames);
+    }
+
+  } else {
+    this->emit_window(window_index, this->window_frames);
+    this->consecutive_inactive = active ? 0 : (this->consecutive_inactive + 1);
+    if (this->consecutive_inactive >= this->release_windows) {
+      this->close_segment();
+    }
+  }
+}
+
+bool ActivityGate::analyze_window(const uint8_t* data) {
+  convert_frames(this->mono.data(), AL_FORMAT_MONO_FLOAT32, data, this->format, this->window_frames);
+  double sum_squares = 0.0;
+  for (size_t x = 0; x < this->window_frames; x++) {
+    double v = this->mono[x];
+    sum_squares += v * v;
+    this->spectrum[x] = v * this->hann[x];
+  }
+  double level_db = (sum_squares > 0.0) ? (10.0 * log10(sum_squares / this->window_frames)) : -INFINITY;
+  if (level_db < (this->open ? this->options.close_threshold_db : this->options.open_threshold_db)) {
+    return false;
+  }
+  if (this->options.max_flatness >= 1.0) {
+    return true;
+  }
+
+  // Flatness is the geometric mean of the power spectrum divided by its
+  // arithmetic mean. The small constant keeps log() finite for empty bins.
+  this->fft_plan.transform(this->spectrum.data());
+  double log_sum = 0.0;
+  double sum = 0.0;
+  for (size_t x = this->min_flatness_bin; x <= this->max_flatness_bin; x++) {
+    double power = norm(this->spectrum[x]) + 1e-20;
+    log_sum += log(power);
+    sum += power;
+  }
+  double count = this->max_flatness_bin - this->min_flatness_bin + 1;
+  double flatness = exp(log_sum / count) / (sum / count);
+  return flatness <= this->options.max_flatness;
+}
+
+void ActivityGate::emit_window(uint64_t window_index, size_t frame_count) {
+  size_t slot = window_index % this->num_slots;
+  const WindowInfo& window_info = this->slot_info[slot];
+  AudioCapture::BlockInfo info;
+  info.frame_index = window_info.frame_index;
+  info.timestamp_ns = window_info.timestamp_ns;
+  info.discontinuity = window_info.discontinuity || this->segment_discontinuity_pending;
+  this->segment_discontinuity_pending = false;
+  this->block_callback(&this->slot_data[slot * this->window_frames * this->frame_bytes], frame_count, info);
+  this->frames_passed += frame_count;
+  this->next_unemitted_window = window_index + 1;
+  this->segment.end_frame = window_info.frame_index + frame_count;
+  this->segment.end_timestamp_ns = window_info.timestamp_ns + (frame_count * 1000000000ULL) / this->sample_rate;
+}
+
+void ActivityGate::close_segment() {
+  this->open = false;
+  this->open_flag = false;
+  this->consecutive_active = 0;
+  if (this->segment_callback) {
+    this->segment_callback(this->segment);
+  }
+}
+
+} // namespace phosg_audio
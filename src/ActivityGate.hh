@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <complex>
+#include <functional>
+#include <vector>
+
+#include "Capture.hh"
+#include "FourierTransform.hh"
+
+namespace phosg_audio {
+
+// Parameters for ActivityGate (below)
+struct ActivityGateOptions {
+  // RMS levels in dBFS (a full-scale sine wave is -3dBFS). The gate opens
+  // when windows are at least open_threshold_db, and stays open while they
+  // are at least close_threshold_db.
+  double open_threshold_db = -40.0;
+  double close_threshold_db = -46.0;
+  // Spectral flatness is 0 for a pure tone and near 1 for white noise;
+  // windows flatter than this are never active. 1.0 disables this test.
+  double max_flatness = 0.5;
+  double attack_ms = 30.0;
+  double release_ms = 500.0;
+  double pre_roll_ms = 300.0;
+};
+
+// Passes through only the active parts of a stream of captured blocks, so
+// later stages (analysis, storage, network) can skip silence. The input is
+// analyzed in windows of about 10ms. A window is active if its RMS level is
+// above a threshold and its spectral flatness is below a limit, so steady
+// broadband noise (fans, hiss) doesn't count as activity even when it's loud.
+// The gate opens after attack_ms of consecutive active windows and closes
+// after release_ms of consecutive inactive windows (with a lower level
+// threshold while open, for hysteresis). Each segment also includes the
+// pre_roll_ms of audio before the gate opened, so the beginnings of sounds
+// aren't cut off.
+// Output is delayed by one window plus the attack time, since frames can't be
+// passed on until the gate knows whether they're part of a segment. All
+// memory is allocated by the constructor; add_frames never allocates or
+// blocks, so the gate can run directly in an AudioCapture block callback.
+class ActivityGate {
+public:
+  // Describes a complete segment, including its pre-roll. end_frame is the
+  // index of the frame after the last frame in the segment.
+  struct Segment {
+    uint64_t start_frame;
+    uint64_t end_frame;
+    uint64_t start_timestamp_ns;
+    uint64_t end_timestamp_ns;
+  };
+  using SegmentCallback = std::function<void(const Segment& segment)>;
+
+  // block_callback receives the frames in each segment, with their original
+  // frame indexes and timestamps; info.discontinuity is true on the first
+  // block of each segment (and wherever the capture itself dropped frames).
+  // segment_callback, if given, is called after the last block of each
+  // segment. Both are called on the thread that calls add_frames or flush.
+  ActivityGate(int sample_rate, int format, AudioCapture::BlockCallback block_callback,
+      SegmentCallback segment_callback = nullptr, const ActivityGateOptions& options = ActivityGateOptions());
+  ~ActivityGate() = default;
+
+  ActivityGate(const ActivityGate&) = delete;
+  ActivityGate(ActivityGate&&) = delete;
+  ActivityGate& operator=(const ActivityGate&) = delete;
+  ActivityGate& operator=(ActivityGate&&) = delete;
+
+  // Only one thread may call add_frames and flush. data must be in native
+  // byte order.
+  void add_frames(const void* data, size_t frame_count, const AudioCapture::BlockInfo& info);
+  // Returns a callback that can be passed to AudioCapture's constructor to
+  // gate everything it captures. The gate must outlive the capture.
+  AudioCapture::BlockCallback capture_callback();
+  // Ends the current segment (if any) with whatever frames have been added,
+  // even if they don't fill a window. Call this when the input ends.
+  void flush();
+
+  bool is_open() const;
+
+  // Everything here is read from atomic counters, so this can be called from
+  // any thread.
+  struct Stats {
+    uint64_t frames_in;
+    uint64_t frames_passed; // Including pre-roll
+    uint64_t segments; // Including the current segment, if the gate is open
+  };
+  Stats get_stats() const;
+
+private:
+  struct WindowInfo {
+    uint64_t frame_index;
+    uint64_t timestamp_ns;
+    bool discontinuity;
+  };
+
+  void finish_window();
+  bool analyze_window(const uint8_t* data);
+  void emit_window(uint64_t window_index, size_t frame_count);
+  void close_segment();
+
+  int sample_rate;
+  int format;
+  size_t frame_bytes;
+  ActivityGateOptions options;
+  AudioCapture::BlockCallback block_callback;
+  SegmentCallback segment_callback;
+
+  // Windows are kept in a ring of slots, so that when the gate opens, the
+  // windows from the pre-roll and attack periods can still be emitted
+  size_t window_frames;
+  size_t attack_windows;
+  size_t release_windows;
+  size_t pre_roll_windows;
+  size_t num_slots;
+  std::vector<uint8_t> slot_data;
+  std::vector<WindowInfo> slot_info;
+  uint64_t next_window_index; // The window being filled
+  size_t window_frames_filled;
+  uint64_t next_unemitted_window; // Pre-roll never repeats emitted windows
+
+  // Analysis scratch space
+  FFTPlan fft_plan;
+  std::vector<float> mono;
+  std::vector<double> hann;
+  std::vector<std::complex<double>> spectrum;
+  size_t min_flatness_bin;
+  size_t max_flatness_bin;
+
+  // Gate state
+  bool open;
+  size_t consecutive_active;
+  size_t consecutive_inactive;
+  Segment segment;
+  bool segment_discontinuity_pending;
+
+  std::atomic<bool> open_flag;
+  std::atomic<uint64_t> frames_in;
+  std::atomic<uint64_t> frames_passed;
+  std::atomic<uint64_t> segments;
+};
+
+} // namespace phosg_audio
@@ -0,0 +1,99 @@
+#include "AllocationCounter.hh"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+using namespace std;
+
+namespace phosg_audio {
+
+#ifdef PHOSG_AUDIO_COUNT_ALLOCATIONS
+
+static atomic<size_t> num_allocations(0);
+
+bool allocation_counting_enabled() {
+  return true;
+}
+
+size_t allocation_count() {
+  return num_allocations.load(memory_order_relaxed);
+}
+
+} // namespace phosg_audio
+
+void* operator new(size_t size) {
+  phosg_audio::num_allocations.fetch_add(1, memory_order_relaxed);
+  void* ret = malloc(size ? size : 1);
+  if (!ret) {
+    throw bad_alloc();
+  }
+  return ret;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+  phosg_audio::num_allocations.fetch_add(1, memory_order_relaxed);
+  // posix_memalign requires the alignment to be at least sizeof(void*)
+  size_t align = max(static_cast<size_t>(alignment), sizeof(void*));
+  void* ret = nullptr;
+  if (posix_memalign(&ret, align, size ? size : 1) != 0) {
+    throw bad_alloc();
+  }
+  return ret;
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void operator delete(void* ptr, align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t, align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t, align_val_t) noexcept {
+  free(ptr);
+}
+
+#else
+
+bool allocation_counting_enabled() {
+  return false;
+}
+
+size_t allocation_count() {
+  return 0;
+}
+
+} // namespace phosg_audio
+
+#endif
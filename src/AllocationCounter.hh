@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace phosg_audio {
+
+// Test hook for verifying that hot paths don't allocate. When the library is
+// built with -DPHOSG_AUDIO_COUNT_ALLOCATIONS=ON, every form of the global
+// operator new (including the aligned ones) is replaced with a version that
+// counts calls, and allocation_count() returns the number of allocations made
+// so far by all threads. Otherwise, allocation_count() always returns 0.
+// phosg-audio-bench uses this to check that steady-state
+// AudioStream::add_frames calls don't allocate.
+bool allocation_counting_enabled();
+size_t allocation_count();
+
+} // namespace phosg_audio
@@ -1,26 +1,46 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
 #include <complex>
+#include <condition_variable>
+#include <format>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <phosg/Encoding.hh>
 
+#include "ActivityGate.hh"
+#include "Biquad.hh"
 #include "Capture.hh"
 #include "Constants.hh"
 #include "Convert.hh"
+#include "Format.hh"
 #include "FourierTransform.hh"
+#include "LatencyTest.hh"
+#include "Loudness.hh"
+#include "Loopback.hh"
+#include "Recorder.hh"
 #include "Sound.hh"
 #include "Stream.hh"
+#include "Transcode.hh"
 
 using namespace std;
 
 void print_usage() {
   fprintf(stderr, "\
-audiocat can do three things:\n\
+audiocat can do five things:\n\
   audiocat --listen [options]\n\
       Listen using the default input device and output sound data on stdout.\n\
   audiocat --play [options]\n\
@@ -28,16 +48,86 @@ audiocat can do three things:\n\
   audiocat --wave=WAVE [options]\n\
       Generate a sound and output it on stdout. If --play is also given, play\n\
       the generated sound using the default output device instead.\n\
+  audiocat --measure-latency[=TRIALS] [options]\n\
+      Measure the round-trip latency from the output device to the input device\n\
+      by playing a chirp and finding it in the captured audio. The output must\n\
+      be audible to the input device (e.g. via a cable or a monitor device).\n\
+      Runs 10 trials by default, and exits with status 2 if the chirp was never\n\
+      detected. With --loopback (and no filename), the chirp is rendered on an\n\
+      OpenAL loopback device and found in the rendered output instead; this\n\
+      needs no audio hardware (so it can run in CI) and reports only the delay\n\
+      added by the stream and OpenAL's mixer.\n\
+  audiocat --convert [options] FILENAME [FILENAME ...]\n\
+      Convert WAV or raw files (or stdin, if FILENAME is -) to another format,\n\
+      channel count or sample rate. Reading, converting and writing happen on\n\
+      separate threads, and memory use doesn't depend on the file size. WAV\n\
+      input is detected automatically; other input is raw data described by\n\
+      --format, --sample-rate and --reverse-endian. This doesn't use OpenAL.\n\
 \n\
 Options:\n\
   --verbose\n\
       Show status messages while working.\n\
+  --device=NAME\n\
+      Use this output device instead of the default output device.\n\
+  --capture-device=NAME\n\
+      Use this input device instead of the default input device.\n\
   --buffer-limit=LIMIT\n\
       Store this many samples in each OpenAL buffer (default 2048).\n\
   --buffer-count=COUNT\n\
       Allocate this many OpenAL buffers. audiocat will fill these buffers as\n\
       soon as they become available, so this effectively controls how far\n\
       audiocat reads fomr stdin ahead of the playback device.\n\
+  --threaded\n\
+      When playing, move data into OpenAL buffers on a background thread\n\
+      instead of on the thread that reads stdin. When listening, drain the\n\
+      input device on a background thread and block until each buffer of\n\
+      --buffer-limit samples is ready instead of polling.\n\
+  --adaptive-latency=MIN-MS:MAX-MS\n\
+      When playing, ignore --buffer-limit and --buffer-count and instead size\n\
+      the OpenAL queue automatically, keeping between MIN-MS and MAX-MS\n\
+      milliseconds of audio queued depending on observed underruns.\n\
+  --loopback\n\
+      With --measure-latency, measure on an OpenAL loopback device instead of\n\
+      through the output and input devices (see above).\n\
+  --loopback=FILENAME\n\
+      With --wave and --play, play the sound on an OpenAL loopback device and\n\
+      write the rendered output to this WAV file instead of playing it on an\n\
+      output device. This runs faster than real time and doesn't need any audio\n\
+      hardware. The file is written in the format given by --format (16-bit\n\
+      and float formats only).\n\
+  --filter=TYPE:FREQ[:Q] or --filter=TYPE:FREQ:GAIN-DB[:Q]\n\
+      With --play or --listen, filter the data before playing or writing it.\n\
+      TYPE is lowpass, highpass, bandpass, notch or allpass (which take the\n\
+      first form), or peak, lowshelf or highshelf (which take the second).\n\
+      FREQ is in Hz. Q defaults to 1 for peak filters and 0.707 otherwise.\n\
+      This option may be given multiple times; the filters are applied in\n\
+      the order given.\n\
+  --gate[=OPEN-DB[:CLOSE-DB]]\n\
+      With --listen (binary output only) or --record, only output the active\n\
+      parts of the captured audio. Audio is active when its level is above\n\
+      OPEN-DB dBFS (default -40) and it isn't flat broadband noise; output\n\
+      stops after a period of inactivity or when the level falls below\n\
+      CLOSE-DB (default 6dB below OPEN-DB). With --verbose, the frame range of\n\
+      each active segment is printed to stderr.\n\
+  --gate-pre-roll=MS\n\
+      With --gate, include this much audio from before each active segment\n\
+      (default 300).\n\
+  --gate-release=MS\n\
+      With --gate, end each active segment after this much inactivity\n\
+      (default 500).\n\
+  --stats=INTERVAL\n\
+      With --play or --listen, write a one-line JSON record every INTERVAL\n\
+      seconds (and one more at the end) with the throughput, queue depth,\n\
+      underruns or overruns, time spent waiting for input/output and for\n\
+      OpenAL, peak, RMS and true peak levels, and CPU time for that interval.\n\
+      Each record also has the EBU R128 momentary, short-term and integrated\n\
+      loudness so far.\n\
+  --stats-fd=FD\n\
+      Write --stats records to this file descriptor instead of stderr.\n\
+  --al-trace\n\
+      On exit, print the call count, latency and error count of each OpenAL\n\
+      call site to stderr as JSON. This requires a phosg-audio library built\n\
+      with PHOSG_AUDIO_AL_TRACING.\n\
   --sample-rate=SAMPLE-RATE\n\
       Play or record sound at this sample rate (default 44100).\n\
   --format=FORMAT\n\
@@ -46,6 +136,24 @@ Options:\n\
   --reverse-endian\n\
       For 16-bit and 32-bit formats, byteswap each sample before playing it\n\
       (with --play) or before writing it to stdout (with --listen).\n\
+  --output=FILENAME\n\
+      With --convert and one input file, write the output here (- = stdout,\n\
+      for raw output only).\n\
+  --output-dir=DIRECTORY\n\
+      With --convert, write each output file to this directory, with the input\n\
+      file's name and a .wav or .raw extension.\n\
+  --to-format=FORMAT\n\
+      With --convert, write output in this format (same values as --format).\n\
+      By default, the input's format is kept.\n\
+  --to-sample-rate=SAMPLE-RATE\n\
+      With --convert, resample the output to this rate. By default, the\n\
+      input's sample rate is kept.\n\
+  --to-raw\n\
+      With --convert, write raw sample data instead of WAV files.\n\
+  --to-reverse-endian\n\
+      With --convert and --to-raw, byteswap each output sample.\n\
+  --jobs=COUNT\n\
+      With --convert, convert up to this many files at once (default 1).\n\
   --freq=FREQUENCY\n\
       When generating sounds, generate tones at this frequency.\n\
   --note=NOTE\n\
@@ -53,6 +161,13 @@ Options:\n\
   --duration=DURATION\n\
       Listen or generate sound for this many seconds. No effect when playing;\n\
       audiocat will always play all data from stdin.\n\
+  --record=FILENAME\n\
+      When listening, write the captured audio to this WAV file instead of to\n\
+      stdout. Disk writes happen on a separate thread, so a slow disk doesn't\n\
+      cause captured audio to be lost unless it falls several seconds behind.\n\
+  --segment=SECONDS\n\
+      With --record, start a new file after each SECONDS seconds of audio. The\n\
+      files are named by inserting a segment number before the extension.\n\
   --output-format=DISPLAY-FORMAT\n\
       When listening, output captured audio in this format. Valid formats are\n\
       binary (default), text, and fourier-histogram.\n\
@@ -62,6 +177,328 @@ Options:\n\
 ");
 }
 
+// Reads up to size bytes from fd, returning 0 only at end of input. If fd is
+// nonblocking and no data is available, this waits in poll() instead of
+// spinning.
+static size_t read_input(int fd, void* data, size_t size) {
+  for (;;) {
+    ssize_t bytes_read = read(fd, data, size);
+    if (bytes_read >= 0) {
+      return bytes_read;
+    }
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      poll(&pfd, 1, -1);
+    } else if (errno != EINTR) {
+      throw runtime_error(format("cannot read input: {}", strerror(errno)));
+    }
+  }
+}
+
+// Returns the file that --convert --output-dir writes for input_filename: the
+// same base name in output_dir, with the extension replaced
+static string output_filename_for_input(const string& output_dir, const string& input_filename, bool raw) {
+  size_t slash_pos = input_filename.rfind('/');
+  string name = (slash_pos == string::npos) ? input_filename : input_filename.substr(slash_pos + 1);
+  size_t dot_pos = name.rfind('.');
+  if ((dot_pos != string::npos) && (dot_pos != 0)) {
+    name.resize(dot_pos);
+  }
+  return output_dir + "/" + name + (raw ? ".raw" : ".wav");
+}
+
+// Parses a --filter option's value
+static phosg_audio::BiquadCoefficients filter_for_spec(const string& spec, double sample_rate) {
+  vector<string> tokens;
+  for (size_t offset = 0;;) {
+    size_t colon_pos = spec.find(':', offset);
+    tokens.emplace_back(spec.substr(offset, colon_pos - offset));
+    if (colon_pos == string::npos) {
+      break;
+    }
+    offset = colon_pos + 1;
+  }
+  vector<double> args;
+  for (size_t x = 1; x < tokens.size(); x++) {
+    char* endptr = nullptr;
+    args.emplace_back(strtod(tokens[x].c_str(), &endptr));
+    if (tokens[x].empty() || *endptr) {
+      throw invalid_argument(std::format("invalid number in filter: {}", tokens[x]));
+    }
+  }
+
+  const string& type = tokens[0];
+  if ((type == "lowpass") || (type == "highpass") || (type == "bandpass") || (type == "notch") ||
+      (type == "allpass")) {
+    if ((args.size() < 1) || (args.size() > 2)) {
+      throw invalid_argument(std::format("{} filter requires FREQ[:Q]", type));
+    }
+    double q = (args.size() > 1) ? args[1] : M_SQRT1_2;
+    if (type == "lowpass") {
+      return phosg_audio::BiquadCoefficients::lowpass(sample_rate, args[0], q);
+    } else if (type == "highpass") {
+      return phosg_audio::BiquadCoefficients::highpass(sample_rate, args[0], q);
+    } else if (type == "bandpass") {
+      return phosg_audio::BiquadCoefficients::bandpass(sample_rate, args[0], q);
+    } else if (type == "notch") {
+      return phosg_audio::BiquadCoefficients::notch(sample_rate, args[0], q);
+    } else {
+      return phosg_audio::BiquadCoefficients::allpass(sample_rate, args[0], q);
+    }
+  } else if ((type == "peak") || (type == "lowshelf") || (type == "highshelf")) {
+    if ((args.size() < 2) || (args.size() > 3)) {
+      throw invalid_argument(std::format("{} filter requires FREQ:GAIN-DB[:Q]", type));
+    }
+    if (type == "peak") {
+      return phosg_audio::BiquadCoefficients::peaking(sample_rate, args[0], args[1], (args.size() > 2) ? args[2] : 1.0);
+    }
+    double q = (args.size() > 2) ? args[2] : M_SQRT1_2;
+    if (type == "lowshelf") {
+      return phosg_audio::BiquadCoefficients::low_shelf(sample_rate, args[0], args[1], q);
+    } else {
+      return phosg_audio::BiquadCoefficients::high_shelf(sample_rate, args[0], args[1], q);
+    }
+  } else {
+    throw invalid_argument(std::format("unknown filter type: {}", type));
+  }
+}
+
+// Writes a one-line JSON record to fd every interval_secs seconds describing
+// the data passing through audiocat (for --stats). The data path only calls
+// add_frames and add_io_wait once per block; everything else is read from the
+// attached stream's or capture's atomic counters on the reporting thread. A
+// final record is written by stop(), which must be called before the attached
+// stream or capture is destroyed.
+class StatsReporter {
+public:
+  StatsReporter(int fd, double interval_secs, uint32_t sample_rate, int format)
+      : fd(fd),
+        interval_ns(interval_secs * 1000000000.0),
+        format(format),
+        meter(sample_rate, phosg_audio::is_stereo(format) ? 2 : 1),
+        stream(nullptr),
+        capture(nullptr),
+        start_time_ns(phosg_audio::monotonic_now_ns()),
+        last_report_time_ns(this->start_time_ns),
+        frames(0),
+        io_wait_ns(0),
+        peak(0.0f),
+        true_peak(0.0f),
+        sum_squares(0.0),
+        momentary_lufs(-INFINITY),
+        short_term_lufs(-INFINITY),
+        integrated_lufs(-INFINITY),
+        last_underrun_count(0),
+        last_overrun_count(0),
+        last_dropped_frames(0),
+        last_al_wait_ms(0.0),
+        last_cpu_secs(0.0),
+        should_exit(false) {
+    this->thread = std::thread(&StatsReporter::thread_fn, this);
+  }
+  ~StatsReporter() {
+    this->stop();
+  }
+
+  StatsReporter(const StatsReporter&) = delete;
+  StatsReporter(StatsReporter&&) = delete;
+  StatsReporter& operator=(const StatsReporter&) = delete;
+  StatsReporter& operator=(StatsReporter&&) = delete;
+
+  void attach(const phosg_audio::AudioStream* stream) {
+    this->stream = stream;
+  }
+  void attach(const phosg_audio::AudioCapture* capture) {
+    this->capture = capture;
+  }
+
+  // data must be in native byte order
+  void add_frames(const void* data, size_t frame_count) {
+    // The filtering is done without holding the lock; the lock is only held
+    // to add this block's levels to the totals
+    this->meter.process(data, frame_count, this->format);
+    float block_peak = 0.0f;
+    float block_true_peak = 0.0f;
+    double block_sum_squares = 0.0;
+    size_t num_channels = this->meter.get_num_channels();
+    for (size_t c = 0; c < num_channels; c++) {
+      auto levels = this->meter.levels(c);
+      block_peak = max(block_peak, levels.peak);
+      block_true_peak = max(block_true_peak, levels.true_peak);
+      block_sum_squares += static_cast<double>(levels.rms) * levels.rms * frame_count / num_channels;
+    }
+    this->meter.reset_levels();
+    double momentary_lufs = this->meter.momentary_lufs();
+    double short_term_lufs = this->meter.short_term_lufs();
+    double integrated_lufs = this->meter.integrated_lufs();
+
+    lock_guard<mutex> g(this->lock);
+    this->frames += frame_count;
+    this->peak = max(this->peak, block_peak);
+    this->true_peak = max(this->true_peak, block_true_peak);
+    this->sum_squares += block_sum_squares;
+    this->momentary_lufs = momentary_lufs;
+    this->short_term_lufs = short_term_lufs;
+    this->integrated_lufs = integrated_lufs;
+  }
+
+  void add_io_wait(uint64_t ns) {
+    lock_guard<mutex> g(this->lock);
+    this->io_wait_ns += ns;
+  }
+
+  void stop() {
+    {
+      lock_guard<mutex> g(this->lock);
+      if (this->should_exit) {
+        return;
+      }
+      this->should_exit = true;
+    }
+    this->cv.notify_all();
+    this->thread.join();
+    this->report();
+    this->stream = nullptr;
+    this->capture = nullptr;
+  }
+
+private:
+  void thread_fn() {
+    unique_lock<mutex> g(this->lock);
+    uint64_t next_report_time_ns = this->start_time_ns + this->interval_ns;
+    while (!this->should_exit) {
+      uint64_t now_ns = phosg_audio::monotonic_now_ns();
+      if (now_ns < next_report_time_ns) {
+        this->cv.wait_for(g, chrono::nanoseconds(next_report_time_ns - now_ns));
+        continue;
+      }
+      g.unlock();
+      this->report();
+      g.lock();
+      next_report_time_ns += this->interval_ns;
+    }
+  }
+
+  static string json_db(double db) {
+    return isfinite(db) ? std::format("{:.2f}", db) : "null";
+  }
+
+  void report() {
+    uint64_t now_ns = phosg_audio::monotonic_now_ns();
+    uint64_t frames;
+    uint64_t io_wait_ns;
+    float peak, true_peak;
+    double sum_squares;
+    double momentary_lufs, short_term_lufs, integrated_lufs;
+    {
+      lock_guard<mutex> g(this->lock);
+      frames = this->frames;
+      io_wait_ns = this->io_wait_ns;
+      peak = this->peak;
+      true_peak = this->true_peak;
+      sum_squares = this->sum_squares;
+      // Levels are per interval, but loudness covers the whole run
+      momentary_lufs = this->momentary_lufs;
+      short_term_lufs = this->short_term_lufs;
+      integrated_lufs = this->integrated_lufs;
+      this->frames = 0;
+      this->io_wait_ns = 0;
+      this->peak = 0.0f;
+      this->true_peak = 0.0f;
+      this->sum_squares = 0.0;
+    }
+    double mean_square = frames ? (sum_squares / frames) : 0.0;
+    double interval_secs = static_cast<double>(now_ns - this->last_report_time_ns) / 1000000000.0;
+    this->last_report_time_ns = now_ns;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double user_secs = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0;
+    double system_secs = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+    double cpu_percent = interval_secs ? (100.0 * (user_secs + system_secs - this->last_cpu_secs) / interval_secs) : 0.0;
+    this->last_cpu_secs = user_secs + system_secs;
+
+    string line = std::format(
+        "{{\"time_s\": {:.3f}, \"interval_s\": {:.3f}, \"frames\": {}, \"frames_per_sec\": {:.1f}, "
+        "\"bytes_per_sec\": {:.0f}, \"peak_dbfs\": {}, \"rms_dbfs\": {}, \"true_peak_dbtp\": {}, "
+        "\"momentary_lufs\": {}, \"short_term_lufs\": {}, \"integrated_lufs\": {}, \"io_wait_ms\": {:.3f}",
+        static_cast<double>(now_ns - this->start_time_ns) / 1000000000.0, interval_secs, frames,
+        interval_secs ? (frames / interval_secs) : 0.0,
+        interval_secs ? (frames * phosg_audio::bytes_per_frame(this->format) / interval_secs) : 0.0,
+        json_db(phosg_audio::LoudnessMeter::to_db(peak)), json_db(phosg_audio::LoudnessMeter::to_db(sqrt(mean_square))),
+        json_db(phosg_audio::LoudnessMeter::to_db(true_peak)), json_db(momentary_lufs), json_db(short_term_lufs),
+        json_db(integrated_lufs), static_cast<double>(io_wait_ns) / 1000000.0);
+
+    const auto* stream = this->stream.load();
+    if (stream) {
+      auto stats = stream->get_stats();
+      line += std::format(
+          ", \"queued_buffers\": {}, \"queued_ms\": {:.1f}, \"underruns\": {}, \"al_wait_ms\": {:.3f}",
+          stream->queued_buffer_count(), stats.queued_ms, stats.underrun_count - this->last_underrun_count,
+          stats.producer_wait_ms - this->last_al_wait_ms);
+      this->last_underrun_count = stats.underrun_count;
+      this->last_al_wait_ms = stats.producer_wait_ms;
+    }
+    const auto* capture = this->capture.load();
+    if (capture) {
+      auto stats = capture->get_stats();
+      uint64_t overrun_count = stats.overrun_count + stats.ring_overrun_count;
+      uint64_t dropped_frames = stats.dropped_frames + stats.ring_dropped_frames;
+      line += std::format(", \"overruns\": {}, \"dropped_frames\": {}, \"al_wait_ms\": {:.3f}",
+          overrun_count - this->last_overrun_count, dropped_frames - this->last_dropped_frames,
+          stats.consumer_wait_ms - this->last_al_wait_ms);
+      if (capture->is_threaded()) {
+        line += std::format(", \"queued_frames\": {}", capture->available_frames());
+      }
+      this->last_overrun_count = overrun_count;
+      this->last_dropped_frames = dropped_frames;
+      this->last_al_wait_ms = stats.consumer_wait_ms;
+    }
+
+    line += std::format(", \"cpu_user_s\": {:.3f}, \"cpu_system_s\": {:.3f}, \"cpu_percent\": {:.1f}}}\n",
+        user_secs, system_secs, cpu_percent);
+    // One write per record, so other writers to the same pipe can't split it
+    // (as long as it's shorter than PIPE_BUF)
+    if (write(this->fd, line.data(), line.size()) < 0) {
+      fprintf(stderr, "warning: cannot write stats: %s\n", strerror(errno));
+    }
+  }
+
+  int fd;
+  uint64_t interval_ns;
+  int format;
+  phosg_audio::LoudnessMeter meter; // Only used by add_frames
+  atomic<const phosg_audio::AudioStream*> stream;
+  atomic<const phosg_audio::AudioCapture*> capture;
+  uint64_t start_time_ns;
+
+  // Only used by whichever thread is reporting
+  uint64_t last_report_time_ns;
+
+  // Accumulated since the last report; protected by lock. The loudness
+  // values are the meter's latest, not per interval.
+  uint64_t frames;
+  uint64_t io_wait_ns;
+  float peak;
+  float true_peak;
+  double sum_squares;
+  double momentary_lufs;
+  double short_term_lufs;
+  double integrated_lufs;
+
+  // Counter values at the last report, so each record has per-interval deltas
+  uint64_t last_underrun_count;
+  uint64_t last_overrun_count;
+  uint64_t last_dropped_frames;
+  double last_al_wait_ms;
+  double last_cpu_secs;
+
+  mutex lock;
+  condition_variable cv;
+  bool should_exit;
+  std::thread thread;
+};
+
 enum class OutputFormat {
   Binary = 0,
   Text,
@@ -81,6 +518,31 @@ int main(int argc, char* argv[]) {
   size_t buffer_count = 4;
   size_t fourier_width = 4096;
   bool reverse_endian = false;
+  bool threaded = false;
+  double min_latency_ms = 0.0;
+  double max_latency_ms = 0.0;
+  const char* record_filename = nullptr;
+  double segment_seconds = 0.0;
+  size_t latency_trials = 0;
+  const char* device_name = nullptr;
+  const char* capture_device_name = nullptr;
+  const char* loopback_filename = nullptr;
+  bool loopback_latency = false;
+  bool al_trace = false;
+  bool convert = false;
+  vector<string> input_filenames;
+  const char* output_filename = nullptr;
+  const char* output_dir = nullptr;
+  const char* to_format_name = nullptr;
+  int to_sample_rate = 0;
+  bool to_raw = false;
+  bool to_reverse_endian = false;
+  size_t jobs = 1;
+  vector<string> filter_specs;
+  bool gate = false;
+  phosg_audio::ActivityGateOptions gate_options;
+  double stats_interval = 0.0;
+  int stats_fd = STDERR_FILENO;
   const char* format_name = "mono-i16";
   OutputFormat output_format = OutputFormat::Binary;
   for (int x = 1; x < argc; x++) {
@@ -108,6 +570,30 @@ int main(int argc, char* argv[]) {
       fourier_width = strtoull(&argv[x][16], NULL, 0);
     } else if (!strcmp(argv[x], "--reverse-endian")) {
       reverse_endian = true;
+    } else if (!strcmp(argv[x], "--threaded")) {
+      threaded = true;
+    } else if (!strncmp(argv[x], "--adaptive-latency=", 19)) {
+      char* endptr = nullptr;
+      min_latency_ms = strtod(&argv[x][19], &endptr);
+      max_latency_ms = (*endptr == ':') ? strtod(endptr + 1, nullptr) : min_latency_ms;
+    } else if (!strncmp(argv[x], "--record=", 9)) {
+      record_filename = &argv[x][9];
+    } else if (!strncmp(argv[x], "--segment=", 10)) {
+      segment_seconds = atof(&argv[x][10]);
+    } else if (!strcmp(argv[x], "--measure-latency")) {
+      latency_trials = 10;
+    } else if (!strncmp(argv[x], "--measure-latency=", 18)) {
+      latency_trials = strtoull(&argv[x][18], NULL, 0);
+    } else if (!strncmp(argv[x], "--device=", 9)) {
+      device_name = &argv[x][9];
+    } else if (!strncmp(argv[x], "--capture-device=", 17)) {
+      capture_device_name = &argv[x][17];
+    } else if (!strcmp(argv[x], "--loopback")) {
+      loopback_latency = true;
+    } else if (!strncmp(argv[x], "--loopback=", 11)) {
+      loopback_filename = &argv[x][11];
+    } else if (!strcmp(argv[x], "--al-trace")) {
+      al_trace = true;
     } else if (!strncmp(argv[x], "--wave=", 7)) {
       wave_type = &argv[x][7];
     } else if (!strncmp(argv[x], "--freq=", 7)) {
@@ -117,18 +603,288 @@ int main(int argc, char* argv[]) {
       frequency = phosg_audio::frequency_for_note(note);
     } else if (!strncmp(argv[x], "--duration=", 11)) {
       duration = atof(&argv[x][11]);
+    } else if (!strcmp(argv[x], "--convert")) {
+      convert = true;
+    } else if (!strncmp(argv[x], "--output=", 9)) {
+      output_filename = &argv[x][9];
+    } else if (!strncmp(argv[x], "--output-dir=", 13)) {
+      output_dir = &argv[x][13];
+    } else if (!strncmp(argv[x], "--to-format=", 12)) {
+      to_format_name = &argv[x][12];
+    } else if (!strncmp(argv[x], "--to-sample-rate=", 17)) {
+      to_sample_rate = atoi(&argv[x][17]);
+    } else if (!strcmp(argv[x], "--to-raw")) {
+      to_raw = true;
+    } else if (!strcmp(argv[x], "--to-reverse-endian")) {
+      to_reverse_endian = true;
+    } else if (!strncmp(argv[x], "--filter=", 9)) {
+      filter_specs.emplace_back(&argv[x][9]);
+    } else if (!strcmp(argv[x], "--gate")) {
+      gate = true;
+    } else if (!strncmp(argv[x], "--gate=", 7)) {
+      gate = true;
+      char* endptr = nullptr;
+      gate_options.open_threshold_db = strtod(&argv[x][7], &endptr);
+      gate_options.close_threshold_db = (*endptr == ':')
+          ? strtod(endptr + 1, nullptr)
+          : (gate_options.open_threshold_db - 6.0);
+    } else if (!strncmp(argv[x], "--gate-pre-roll=", 16)) {
+      gate_options.pre_roll_ms = atof(&argv[x][16]);
+    } else if (!strncmp(argv[x], "--gate-release=", 15)) {
+      gate_options.release_ms = atof(&argv[x][15]);
+    } else if (!strncmp(argv[x], "--stats=", 8)) {
+      stats_interval = atof(&argv[x][8]);
+    } else if (!strncmp(argv[x], "--stats-fd=", 11)) {
+      stats_fd = atoi(&argv[x][11]);
+    } else if (!strncmp(argv[x], "--jobs=", 7)) {
+      jobs = strtoull(&argv[x][7], NULL, 0);
+    } else if ((argv[x][0] != '-') || !strcmp(argv[x], "-")) {
+      input_filenames.emplace_back(argv[x]);
     } else {
       fprintf(stderr, "unrecognized option: %s\n", argv[x]);
       return 1;
     }
   }
 
-  phosg_audio::init_al();
+  if (al_trace && !phosg_audio::al_tracing_enabled()) {
+    fprintf(stderr, "--al-trace requires a library built with PHOSG_AUDIO_AL_TRACING\n");
+    return 1;
+  }
+
+  if (gate && (!listen || (!record_filename && (output_format != OutputFormat::Binary)))) {
+    fprintf(stderr, "--gate can only be used with --listen and binary output, or with --record\n");
+    return 1;
+  }
+  if (gate && (gate_options.close_threshold_db > gate_options.open_threshold_db)) {
+    fprintf(stderr, "--gate close threshold must not be above open threshold\n");
+    return 1;
+  }
+
+  if (loopback_latency && !latency_trials) {
+    fprintf(stderr, "--loopback without a filename can only be used with --measure-latency\n");
+    return 1;
+  }
+
+  if (!convert && !input_filenames.empty()) {
+    fprintf(stderr, "filenames can only be given with --convert\n");
+    return 1;
+  }
+
+  if (convert) {
+    if (input_filenames.empty()) {
+      fprintf(stderr, "--convert requires at least one input file\n");
+      return 1;
+    }
+    if (!output_filename == !output_dir) {
+      fprintf(stderr, "exactly one of --output or --output-dir must be given with --convert\n");
+      return 1;
+    }
+    if (output_filename && (input_filenames.size() > 1)) {
+      fprintf(stderr, "--output can only be used with one input file; use --output-dir instead\n");
+      return 1;
+    }
+    if (to_reverse_endian && !to_raw) {
+      fprintf(stderr, "--to-reverse-endian requires --to-raw (WAV files are always little-endian)\n");
+      return 1;
+    }
+    if ((sample_rate <= 0) || (to_sample_rate < 0)) {
+      fprintf(stderr, "sample rates must be positive\n");
+      return 1;
+    }
+
+    endian reversed_endian = (endian::native == endian::little) ? endian::big : endian::little;
+    vector<phosg_audio::TranscodeSpec> specs;
+    for (const auto& input_filename : input_filenames) {
+      auto& spec = specs.emplace_back();
+      spec.input_filename = input_filename;
+      spec.raw_input_format = phosg_audio::sample_format_for_al_format(phosg_audio::format_for_name(format_name));
+      if (reverse_endian) {
+        spec.raw_input_format.byte_order = reversed_endian;
+      }
+      spec.raw_input_sample_rate = sample_rate;
+      if (output_filename) {
+        spec.output_filename = output_filename;
+      } else if (input_filename == "-") {
+        fprintf(stderr, "stdin can only be converted with --output\n");
+        return 1;
+      } else {
+        spec.output_filename = output_filename_for_input(output_dir, input_filename, to_raw);
+      }
+      spec.output_wav = !to_raw;
+      if (to_format_name) {
+        auto to_format = phosg_audio::sample_format_for_al_format(phosg_audio::format_for_name(to_format_name));
+        spec.output_type = to_format.type;
+        spec.output_channels = to_format.num_channels;
+      }
+      spec.output_byte_order = to_reverse_endian ? reversed_endian : endian::native;
+      spec.output_sample_rate = to_sample_rate;
+    }
+
+    // Each worker takes the next unconverted file until there are none left
+    atomic<size_t> next_index(0);
+    atomic<size_t> num_failures(0);
+    mutex stderr_lock;
+    auto convert_files = [&]() {
+      for (size_t index = next_index++; index < specs.size(); index = next_index++) {
+        const auto& spec = specs[index];
+        try {
+          auto result = phosg_audio::transcode(spec);
+          if (verbose) {
+            lock_guard<mutex> g(stderr_lock);
+            fprintf(stderr, "%s (%" PRIu64 " %s frames at %" PRIu32 "Hz) -> %s (%" PRIu64 " %s frames at %" PRIu32 "Hz)\n",
+                spec.input_filename.c_str(), result.input_frames,
+                phosg_audio::name_for_format(phosg_audio::al_format_for_sample_format(result.input_format)),
+                result.input_sample_rate, spec.output_filename.c_str(), result.output_frames,
+                phosg_audio::name_for_format(phosg_audio::al_format_for_sample_format(result.output_format)),
+                result.output_sample_rate);
+          }
+        } catch (const exception& e) {
+          lock_guard<mutex> g(stderr_lock);
+          fprintf(stderr, "%s: %s\n", spec.input_filename.c_str(), e.what());
+          num_failures++;
+        }
+      }
+    };
+    vector<thread> threads;
+    for (size_t x = 1; x < min(jobs, specs.size()); x++) {
+      threads.emplace_back(convert_files);
+    }
+    convert_files();
+    for (auto& t : threads) {
+      t.join();
+    }
+    return num_failures ? 1 : 0;
+  }
+
+  // The loopback device doesn't need a real output device at all
+  if (!loopback_filename && !loopback_latency) {
+    phosg_audio::init_al(device_name);
+  }
 
   int format = phosg_audio::format_for_name(format_name);
   size_t bpf = phosg_audio::bytes_per_frame(format);
 
-  if (listen) {
+  // All the filters run as one cascade per channel
+  unique_ptr<phosg_audio::BiquadFilterBank> filters;
+  if (!filter_specs.empty()) {
+    vector<phosg_audio::BiquadCoefficients> cascade;
+    try {
+      for (const auto& spec : filter_specs) {
+        cascade.emplace_back(filter_for_spec(spec, sample_rate));
+      }
+    } catch (const invalid_argument& e) {
+      fprintf(stderr, "invalid filter: %s\n", e.what());
+      return 1;
+    }
+    filters = make_unique<phosg_audio::BiquadFilterBank>(phosg_audio::is_stereo(format) ? 2 : 1, cascade);
+  }
+  phosg_audio::ActivityGate::SegmentCallback log_gate_segment = nullptr;
+  if (verbose) {
+    log_gate_segment = [&](const phosg_audio::ActivityGate::Segment& segment) -> void {
+      fprintf(stderr, "active segment: frames %" PRIu64 "-%" PRIu64 " (%.3f-%.3f seconds)\n",
+          segment.start_frame, segment.end_frame, static_cast<double>(segment.start_frame) / sample_rate,
+          static_cast<double>(segment.end_frame) / sample_rate);
+    };
+  }
+
+  if (latency_trials) {
+    if (verbose) {
+      fprintf(stderr, "measuring %s latency at %dHz over %zu trials\n",
+          loopback_latency ? "loopback" : "round-trip", sample_rate, latency_trials);
+    }
+    auto result = loopback_latency
+        ? phosg_audio::measure_loopback_latency(sample_rate, latency_trials)
+        : phosg_audio::measure_round_trip_latency(sample_rate, latency_trials, capture_device_name);
+    if (verbose) {
+      for (size_t x = 0; x < result.latencies_ms.size(); x++) {
+        fprintf(stderr, "trial result: %g ms\n", result.latencies_ms[x]);
+      }
+    }
+    if (result.latencies_ms.empty()) {
+      fprintf(stderr, "test signal was not detected in any of %zu trials\n", result.num_trials);
+      return 2;
+    }
+    fprintf(stdout, "%s latency: mean %.2f ms, min %.2f ms, max %.2f ms, jitter %.2f ms (%zu/%zu trials)\n",
+        loopback_latency ? "loopback" : "round-trip", result.mean_ms, result.min_ms, result.max_ms, result.jitter_ms,
+        result.latencies_ms.size(), result.num_trials);
+
+  } else if (listen && record_filename) {
+    if (verbose) {
+      fprintf(stderr, "recording %s data at %dHz to %s\n",
+          phosg_audio::name_for_format(format), sample_rate, record_filename);
+    }
+    phosg_audio::AudioRecorder recorder(record_filename, sample_rate, format, segment_seconds);
+    // The gate must outlive the capture, and is flushed after the capture stops
+    unique_ptr<phosg_audio::ActivityGate> activity_gate;
+    {
+      // The reporter sees each block on the capture thread before the recorder
+      // does, so it has to exist before the capture starts
+      unique_ptr<StatsReporter> reporter;
+      auto capture_callback = recorder.capture_callback();
+      if (gate) {
+        activity_gate = make_unique<phosg_audio::ActivityGate>(
+            sample_rate, format, std::move(capture_callback), log_gate_segment, gate_options);
+        capture_callback = activity_gate->capture_callback();
+      }
+      if (stats_interval > 0.0) {
+        reporter = make_unique<StatsReporter>(stats_fd, stats_interval, sample_rate, format);
+        capture_callback = [next_callback = std::move(capture_callback), reporter = reporter.get()](
+                               const void* data, size_t frame_count,
+                               const phosg_audio::AudioCapture::BlockInfo& info) -> void {
+          reporter->add_frames(data, frame_count);
+          next_callback(data, frame_count, info);
+        };
+      }
+      if (filters) {
+        // Blocks are filtered in a copy, since the capture's buffer is const.
+        // The copy is allocated up front, so the capture thread doesn't have to.
+        vector<uint8_t> filter_buffer(bpf * buffer_limit);
+        capture_callback = [next_callback = std::move(capture_callback), filters = filters.get(), format, bpf,
+                               filter_buffer = std::move(filter_buffer)](
+                               const void* data, size_t frame_count,
+                               const phosg_audio::AudioCapture::BlockInfo& info) mutable -> void {
+          if (filter_buffer.size() < frame_count * bpf) {
+            filter_buffer.resize(frame_count * bpf);
+          }
+          memcpy(filter_buffer.data(), data, frame_count * bpf);
+          filters->process(filter_buffer.data(), frame_count, format);
+          next_callback(filter_buffer.data(), frame_count, info);
+        };
+      }
+      phosg_audio::AudioCapture cap(capture_device_name, sample_rate, format, sample_rate, true, buffer_limit,
+          capture_callback);
+      if (reporter) {
+        reporter->attach(&cap);
+      }
+
+      // Without a duration, this runs until audiocat is killed; the recorder
+      // updates the WAV header periodically, so the file is valid either way
+      double seconds_remaining = duration;
+      while (!duration || (seconds_remaining > 0.0)) {
+        double seconds = (duration && (seconds_remaining < 1.0)) ? seconds_remaining : 1.0;
+        usleep(seconds * 1000000);
+        seconds_remaining -= seconds;
+        if (verbose) {
+          auto stats = recorder.get_stats();
+          fprintf(stderr, "%" PRIu64 " frames recorded, %" PRIu64 " dropped; %zu/%zu blocks queued (max %zu)\n",
+              stats.frames_recorded, stats.frames_dropped, stats.queued_blocks, stats.num_blocks,
+              stats.max_queued_blocks);
+        }
+      }
+      if (reporter) {
+        reporter->stop();
+      }
+    }
+    if (activity_gate) {
+      activity_gate->flush();
+    }
+    recorder.stop();
+
+    if (verbose) {
+      fprintf(stderr, "done recording (%g seconds)\n", duration);
+    }
+
+  } else if (listen) {
     size_t samples_captured = 0;
     {
       if (verbose) {
@@ -142,7 +898,12 @@ int main(int argc, char* argv[]) {
               phosg_audio::name_for_format(format), sample_rate);
         }
       }
-      phosg_audio::AudioCapture cap(NULL, sample_rate, format, sample_rate);
+      phosg_audio::AudioCapture cap(capture_device_name, sample_rate, format, sample_rate, threaded, buffer_limit);
+      unique_ptr<StatsReporter> reporter;
+      if (stats_interval > 0.0) {
+        reporter = make_unique<StatsReporter>(stats_fd, stats_interval, sample_rate, format);
+        reporter->attach(&cap);
+      }
 
       size_t sample_limit = duration * sample_rate;
       if (output_format == OutputFormat::FFTHistogram) {
@@ -153,6 +914,12 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "expected %zu samples, got %zu\n", fourier_width, sample_count);
             throw logic_error("blocking read did not produce enough data");
           }
+          if (filters) {
+            filters->process(buffer, sample_count, format);
+          }
+          if (reporter) {
+            reporter->add_frames(buffer, sample_count);
+          }
           vector<complex<double>> samples_complex = phosg_audio::make_complex_multi(
               reinterpret_cast<const float*>(buffer), fourier_width);
           auto fourier_ret = phosg_audio::compute_fourier_transform(samples_complex);
@@ -181,34 +948,94 @@ int main(int argc, char* argv[]) {
             line_data[x] = intensity_chars[intensity_class];
           }
 
+          uint64_t write_start_time = phosg_audio::monotonic_now_ns();
           fprintf(stdout, "%s\n", line_data.c_str());
           fflush(stdout);
+          if (reporter) {
+            reporter->add_io_wait(phosg_audio::monotonic_now_ns() - write_start_time);
+          }
 
           samples_captured += fourier_width;
         }
         free(buffer);
 
       } else {
-        void* buffer = malloc(bpf * sample_rate);
-        while (!sample_limit || (samples_captured < sample_limit)) {
-          usleep(10000);
-          size_t samples_this_period = sample_limit
-              ? (sample_limit - samples_captured)
-              : sample_rate;
-          size_t sample_count = cap.get_samples(buffer, samples_this_period);
+        void* buffer = malloc(bpf * max<size_t>(sample_rate, buffer_limit));
+        auto write_frames = [&](void* data, size_t frame_count) -> void {
           if (reverse_endian) {
-            phosg_audio::byteswap_samples(buffer, sample_count, format);
+            phosg_audio::byteswap_samples(data, frame_count, format);
+          }
+          uint64_t write_start_time = phosg_audio::monotonic_now_ns();
+          fwrite(data, 1, bpf * frame_count, stdout);
+          fflush(stdout);
+          if (reporter) {
+            reporter->add_io_wait(phosg_audio::monotonic_now_ns() - write_start_time);
           }
-          if (output_format == OutputFormat::Binary) {
-            fwrite(buffer, 1, bpf * sample_count, stdout);
-            fflush(stdout);
+        };
+
+        // The gate's output is const, so it's copied before byteswapping
+        unique_ptr<phosg_audio::ActivityGate> activity_gate;
+        vector<uint8_t> gate_output;
+        if (gate) {
+          activity_gate = make_unique<phosg_audio::ActivityGate>(
+              sample_rate, format,
+              [&](const void* data, size_t frame_count, const phosg_audio::AudioCapture::BlockInfo&) -> void {
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+                gate_output.assign(bytes, bytes + frame_count * bpf);
+                write_frames(gate_output.data(), frame_count);
+              },
+              log_gate_segment, gate_options);
+        }
+
+        while (!sample_limit || (samples_captured < sample_limit)) {
+          size_t sample_count;
+          phosg_audio::AudioCapture::BlockInfo info;
+          if (threaded) {
+            size_t samples_this_period = sample_limit
+                ? min<size_t>(sample_limit - samples_captured, buffer_limit)
+                : buffer_limit;
+            sample_count = cap.get_samples(buffer, samples_this_period, true, &info);
           } else {
+            usleep(10000);
+            size_t samples_this_period = sample_limit
+                ? (sample_limit - samples_captured)
+                : sample_rate;
+            sample_count = cap.get_samples(buffer, samples_this_period, false, &info);
+          }
+          if (filters) {
+            filters->process(buffer, sample_count, format);
+          }
+          if (reporter) {
+            reporter->add_frames(buffer, sample_count);
+          }
+          if (output_format != OutputFormat::Binary) {
             throw logic_error("text output not implemented");
+          } else if (activity_gate) {
+            if (sample_count) {
+              activity_gate->add_frames(buffer, sample_count, info);
+            }
+          } else {
+            write_frames(buffer, sample_count);
           }
           samples_captured += sample_count;
         }
+        if (activity_gate) {
+          activity_gate->flush();
+          if (verbose) {
+            auto stats = activity_gate->get_stats();
+            fprintf(stderr, "gate passed %" PRIu64 "/%" PRIu64 " frames in %" PRIu64 " segments\n",
+                stats.frames_passed, stats.frames_in, stats.segments);
+          }
+        }
         free(buffer);
       }
+
+      if (verbose) {
+        auto stats = cap.get_stats();
+        fprintf(stderr, "%" PRIu64 " overruns (%" PRIu64 " frames dropped); clock drift %+.1f ppm\n",
+            stats.overrun_count + stats.ring_overrun_count,
+            stats.dropped_frames + stats.ring_dropped_frames, stats.drift_ppm);
+      }
     }
 
     if (verbose) {
@@ -216,6 +1043,16 @@ int main(int argc, char* argv[]) {
     }
 
   } else if (wave_type) {
+    // If rendering to a loopback device, the sound has to be created while the
+    // loopback context is bound so it's created in that context
+    shared_ptr<phosg_audio::LoopbackDevice> loopback_device;
+    shared_ptr<phosg_audio::AudioContext> loopback_context;
+    if (play && loopback_filename) {
+      loopback_device = make_shared<phosg_audio::LoopbackDevice>(sample_rate, format);
+      loopback_context = phosg_audio::LoopbackDevice::create_context(loopback_device);
+    }
+    phosg_audio::ScopedContext loopback_scope(loopback_context);
+
     shared_ptr<phosg_audio::GeneratedSound> sound;
     if (!strcmp(wave_type, "sine")) {
       sound.reset(new phosg_audio::SineWave(frequency, duration, 1.0, sample_rate));
@@ -241,7 +1078,11 @@ int main(int argc, char* argv[]) {
             frequency, wave_type, sample_rate, duration);
       }
       sound->play();
-      usleep(duration * 1000000);
+      if (loopback_device) {
+        loopback_device->render_to_wav(loopback_filename, duration * sample_rate);
+      } else {
+        usleep(duration * 1000000);
+      }
 
     } else {
       if (verbose) {
@@ -257,40 +1098,94 @@ int main(int argc, char* argv[]) {
       fprintf(stderr, "playing %s data at %dHz from stdin\n", phosg_audio::name_for_format(format), sample_rate);
     }
 
-    // High watermark: 1 second, low watermark: 1/8 second. This means we try to
-    // read up to 1 second of data at a time, but we'll start playing if we read
-    // 1/8 second or more.
-    size_t buffer_size = bpf * buffer_limit;
-    size_t low_watermark = buffer_limit / 8;
-    void* buffer = malloc(buffer_size);
-
-    // Open a stream and forward samples from stdin to it
-    phosg_audio::AudioStream stream(sample_rate, format, buffer_count);
-    size_t buffer_samples = 0;
-    while (!feof(stdin)) {
-      ssize_t samples_read = fread(
-          ((uint8_t*)buffer) + (buffer_samples * bpf),
-          bpf, buffer_limit - buffer_samples, stdin);
-      if (samples_read <= 0) {
-        continue;
+    // Open a stream and forward data from stdin to it
+    phosg_audio::AudioStream stream(sample_rate, format, buffer_count, threaded, buffer_limit);
+    if (min_latency_ms > 0.0) {
+      stream.enable_adaptive_latency(min_latency_ms, max_latency_ms);
+    }
+    unique_ptr<StatsReporter> reporter;
+    if (stats_interval > 0.0) {
+      reporter = make_unique<StatsReporter>(stats_fd, stats_interval, sample_rate, format);
+      reporter->attach(&stream);
+    }
+    auto read_stdin = [&](void* data, size_t size) -> size_t {
+      if (!reporter) {
+        return read_input(STDIN_FILENO, data, size);
       }
-      buffer_samples += samples_read;
+      uint64_t read_start_time = phosg_audio::monotonic_now_ns();
+      size_t ret = read_input(STDIN_FILENO, data, size);
+      reporter->add_io_wait(phosg_audio::monotonic_now_ns() - read_start_time);
+      return ret;
+    };
 
-      if (buffer_samples >= low_watermark) {
+    // Reads from a pipe can end in the middle of a frame. Only whole frames
+    // are passed to the stream; the rest is carried over to the next read.
+    uint8_t carry[8];
+    size_t carry_bytes = 0;
+    if (stream.is_threaded()) {
+      // Read directly into the stream's ring, so the only copy is the one AL
+      // makes when the feeder thread queues each block
+      for (;;) {
+        size_t max_bytes;
+        uint8_t* region = reinterpret_cast<uint8_t*>(stream.begin_write(&max_bytes));
+        if (!region) {
+          break;
+        }
+        memcpy(region, carry, carry_bytes);
+        size_t bytes_read = read_stdin(region + carry_bytes, max_bytes - carry_bytes);
+        if (bytes_read == 0) {
+          break;
+        }
+        size_t total_bytes = carry_bytes + bytes_read;
+        size_t frame_bytes = total_bytes - (total_bytes % bpf);
+        carry_bytes = total_bytes - frame_bytes;
+        memcpy(carry, region + frame_bytes, carry_bytes);
         if (reverse_endian) {
-          phosg_audio::byteswap_samples(buffer, buffer_samples, format);
+          phosg_audio::byteswap_samples(region, frame_bytes / bpf, format);
+        }
+        if (filters) {
+          filters->process(region, frame_bytes / bpf, format);
+        }
+        if (reporter) {
+          reporter->add_frames(region, frame_bytes / bpf);
         }
-        stream.add_samples(buffer, buffer_samples);
-        buffer_samples = 0;
+        stream.end_write(frame_bytes);
       }
-    }
 
-    // Reached EOF; write any remaining samples
-    if (buffer_samples) {
-      if (reverse_endian) {
-        phosg_audio::byteswap_samples(buffer, buffer_samples, format);
+    } else {
+      // Read up to buffer_limit frames at a time, but start playing once 1/8
+      // of that has been read, so slow input doesn't delay playback
+      vector<uint8_t> buffer(bpf * buffer_limit);
+      size_t low_watermark_bytes = max<size_t>(buffer_limit / 8, 1) * bpf;
+      size_t buffer_bytes = 0;
+      for (;;) {
+        size_t bytes_read = read_stdin(buffer.data() + buffer_bytes, buffer.size() - buffer_bytes);
+        buffer_bytes += bytes_read;
+        if ((buffer_bytes >= low_watermark_bytes) || (bytes_read == 0)) {
+          size_t frame_bytes = buffer_bytes - (buffer_bytes % bpf);
+          if (frame_bytes) {
+            if (reverse_endian) {
+              phosg_audio::byteswap_samples(buffer.data(), frame_bytes / bpf, format);
+            }
+            if (filters) {
+              filters->process(buffer.data(), frame_bytes / bpf, format);
+            }
+            if (reporter) {
+              reporter->add_frames(buffer.data(), frame_bytes / bpf);
+            }
+            stream.add_frames(buffer.data(), frame_bytes / bpf);
+          }
+          memmove(buffer.data(), buffer.data() + frame_bytes, buffer_bytes - frame_bytes);
+          buffer_bytes -= frame_bytes;
+        }
+        if (bytes_read == 0) {
+          break;
+        }
       }
-      stream.add_samples(buffer, buffer_samples);
+      carry_bytes = buffer_bytes;
+    }
+    if (carry_bytes && verbose) {
+      fprintf(stderr, "warning: input ended with a partial frame (%zu bytes); ignoring it\n", carry_bytes);
     }
 
     // Wait for the sound to finish playing
@@ -303,9 +1198,15 @@ int main(int argc, char* argv[]) {
   } else {
     fprintf(stderr, "one of --play, --listen, or --wave must be given\n");
     print_usage();
-    phosg_audio::exit_al();
+    if (!loopback_filename && !loopback_latency) {
+      phosg_audio::exit_al();
+    }
     return 2;
   }
 
+  if (al_trace) {
+    fprintf(stderr, "%s\n", phosg_audio::al_trace_json().c_str());
+  }
+
   return 0;
 }
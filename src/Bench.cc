@@ -0,0 +1,470 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <complex>
+#include <format>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ActivityGate.hh"
+#include "AllocationCounter.hh"
+#include "Biquad.hh"
+#include "Constants.hh"
+#include "Convert.hh"
+#include "Device.hh"
+#include "File.hh"
+#include "Fingerprint.hh"
+#include "FourierTransform.hh"
+#include "Loopback.hh"
+#include "Loudness.hh"
+#include "Sound.hh"
+#include "Stats.hh"
+#include "Stream.hh"
+
+using namespace std;
+
+void print_usage() {
+  fprintf(stderr, "\
+phosg-audio-bench runs micro-benchmarks of phosg-audio's hot paths.\n\
+\n\
+Options:\n\
+  --filter=SUBSTRING\n\
+      Only run benchmarks whose names contain SUBSTRING.\n\
+  --min-time=SECONDS\n\
+      Run each benchmark for at least this long (default 0.5).\n\
+  --json\n\
+      Write the results to stdout as JSON instead of as a table.\n\
+  --json=FILENAME\n\
+      Also write the results to this file as JSON.\n\
+  --temp-dir=DIRECTORY\n\
+      Write the files for the WAV benchmarks here (default /tmp).\n\
+\n\
+The stream and sound benchmarks need ALC_SOFT_loopback, and are skipped if\n\
+OpenAL doesn't support it.\n\
+\n\
+If the library was built with PHOSG_AUDIO_COUNT_ALLOCATIONS, this also checks\n\
+that steady-state AudioStream::add_frames calls (threaded and not) make no\n\
+heap allocations, and exits with status 2 if any do.\n\
+");
+}
+
+// Keeps the compiler from optimizing away the computation of value
+template <typename T>
+static void keep(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct BenchmarkResult {
+  string name;
+  uint64_t samples_per_iteration;
+  uint64_t iterations;
+  uint64_t total_ns;
+
+  double ns_per_sample() const {
+    return static_cast<double>(this->total_ns) / (this->iterations * this->samples_per_iteration);
+  }
+  double samples_per_sec() const {
+    return 1000000000.0 / this->ns_per_sample();
+  }
+};
+
+class BenchmarkRunner {
+public:
+  BenchmarkRunner(const char* filter, double min_time, bool print_table)
+      : filter(filter), min_time_ns(min_time * 1000000000.0), print_table(print_table) {}
+
+  // Calls fn once to warm up, then repeatedly until min_time has passed. Each
+  // call should process samples_per_iteration samples.
+  template <typename FnT>
+  void run(const string& name, uint64_t samples_per_iteration, FnT&& fn) {
+    if (!this->should_run(name)) {
+      return;
+    }
+    fn();
+
+    BenchmarkResult result{name, samples_per_iteration, 0, 0};
+    uint64_t start_ns = phosg_audio::monotonic_now_ns();
+    do {
+      fn();
+      result.iterations++;
+      result.total_ns = phosg_audio::monotonic_now_ns() - start_ns;
+    } while (result.total_ns < this->min_time_ns);
+
+    if (this->print_table) {
+      fprintf(stdout, "%-40s %12" PRIu64 " %10" PRIu64 " %14.0f %12.3f\n", result.name.c_str(),
+          result.samples_per_iteration, result.iterations, result.samples_per_sec(), result.ns_per_sample());
+      fflush(stdout);
+    }
+    this->results.emplace_back(std::move(result));
+  }
+
+  bool should_run(const string& name) const {
+    return !this->filter || (name.find(this->filter) != string::npos);
+  }
+
+  void print_header() const {
+    if (this->print_table) {
+      fprintf(stdout, "%-40s %12s %10s %14s %12s\n", "BENCHMARK", "SAMPLES/ITER", "ITERS", "SAMPLES/SEC", "NS/SAMPLE");
+    }
+  }
+
+  string json() const {
+    string ret = "{\"benchmarks\": [";
+    for (size_t x = 0; x < this->results.size(); x++) {
+      const auto& result = this->results[x];
+      ret += format(
+          "{}\n  {{\"name\": \"{}\", \"samples_per_iteration\": {}, \"iterations\": {}, \"total_ns\": {}, "
+          "\"ns_per_sample\": {:.4f}, \"samples_per_sec\": {:.0f}}}",
+          x ? "," : "", result.name, result.samples_per_iteration, result.iterations, result.total_ns,
+          result.ns_per_sample(), result.samples_per_sec());
+    }
+    ret += "\n]}";
+    return ret;
+  }
+
+private:
+  const char* filter;
+  uint64_t min_time_ns;
+  bool print_table;
+  vector<BenchmarkResult> results;
+};
+
+static vector<float> make_signal(size_t count) {
+  vector<float> ret(count);
+  uint32_t state = 1;
+  for (size_t x = 0; x < count; x++) {
+    state = state * 1664525 + 1013904223;
+    ret[x] = static_cast<float>(static_cast<int32_t>(state)) / 2147483648.0f;
+  }
+  return ret;
+}
+
+template <typename T>
+static vector<T> make_signal_as(size_t count) {
+  auto f32 = make_signal(count);
+  vector<T> ret(count);
+  for (size_t x = 0; x < count; x++) {
+    ret[x] = static_cast<T>(f32[x] * 100.0f);
+  }
+  return ret;
+}
+
+static void run_fourier_benchmarks(BenchmarkRunner& runner) {
+  for (size_t size : {256, 1024, 4096, 16384, 65536}) {
+    auto input = phosg_audio::make_complex_multi(make_signal(size));
+    runner.run(format("compute_fourier_transform_{}", size), size, [&]() {
+      keep(phosg_audio::compute_fourier_transform(input));
+    });
+  }
+}
+
+static void run_conversion_benchmarks(BenchmarkRunner& runner) {
+  static constexpr size_t COUNT = 0x10000;
+  auto f32 = make_signal(COUNT);
+  auto s16 = make_signal_as<int16_t>(COUNT);
+  auto u16 = make_signal_as<uint16_t>(COUNT);
+  auto s8 = make_signal_as<int8_t>(COUNT);
+  auto u8 = make_signal_as<uint8_t>(COUNT);
+
+  runner.run("convert_samples_s16_to_f32", COUNT, [&]() { keep(phosg_audio::convert_samples_s16_to_f32(s16)); });
+  runner.run("convert_samples_u16_to_f32", COUNT, [&]() { keep(phosg_audio::convert_samples_u16_to_f32(u16)); });
+  runner.run("convert_samples_s8_to_f32", COUNT, [&]() { keep(phosg_audio::convert_samples_s8_to_f32(s8)); });
+  runner.run("convert_samples_u8_to_f32", COUNT, [&]() { keep(phosg_audio::convert_samples_u8_to_f32(u8)); });
+  runner.run("convert_samples_f32_to_s16", COUNT, [&]() { keep(phosg_audio::convert_samples_f32_to_s16(f32)); });
+  runner.run("convert_samples_f32_to_u16", COUNT, [&]() { keep(phosg_audio::convert_samples_f32_to_u16(f32)); });
+  runner.run("convert_samples_f32_to_s8", COUNT, [&]() { keep(phosg_audio::convert_samples_f32_to_s8(f32)); });
+  runner.run("convert_samples_f32_to_u8", COUNT, [&]() { keep(phosg_audio::convert_samples_f32_to_u8(f32)); });
+
+  // The non-allocating versions
+  vector<float> f32_out(COUNT);
+  vector<int16_t> s16_out(COUNT);
+  runner.run("convert_samples_s16_to_f32_noalloc", COUNT, [&]() {
+    phosg_audio::convert_samples_s16_to_f32(f32_out.data(), s16.data(), COUNT);
+    keep(f32_out);
+  });
+  runner.run("convert_samples_f32_to_s16_noalloc", COUNT, [&]() {
+    phosg_audio::convert_samples_f32_to_s16(s16_out.data(), f32.data(), COUNT);
+    keep(s16_out);
+  });
+}
+
+static void run_byteswap_benchmarks(BenchmarkRunner& runner) {
+  static constexpr size_t FRAME_COUNT = 0x10000;
+  vector<uint8_t> buffer(FRAME_COUNT * 8, 0x5A);
+  for (int al_format : {AL_FORMAT_MONO16, AL_FORMAT_STEREO16, AL_FORMAT_MONO_FLOAT32, AL_FORMAT_STEREO_FLOAT32}) {
+    size_t sample_count = FRAME_COUNT * (phosg_audio::is_stereo(al_format) ? 2 : 1);
+    runner.run(format("byteswap_samples_{}", phosg_audio::name_for_format(al_format)), sample_count, [&]() {
+      phosg_audio::byteswap_samples(buffer.data(), FRAME_COUNT, al_format);
+      keep(buffer);
+    });
+  }
+}
+
+static void run_biquad_benchmarks(BenchmarkRunner& runner) {
+  static constexpr size_t FRAME_COUNT = 0x1000;
+  static constexpr double SAMPLE_RATE = 48000.0;
+  vector<phosg_audio::BiquadCoefficients> eq = {
+      phosg_audio::BiquadCoefficients::highpass(SAMPLE_RATE, 40.0),
+      phosg_audio::BiquadCoefficients::low_shelf(SAMPLE_RATE, 200.0, 3.0),
+      phosg_audio::BiquadCoefficients::peaking(SAMPLE_RATE, 2500.0, -4.0, 1.4),
+      phosg_audio::BiquadCoefficients::high_shelf(SAMPLE_RATE, 8000.0, 2.0)};
+  for (size_t num_channels : {1, 2, 8}) {
+    auto data = make_signal(FRAME_COUNT * num_channels);
+    phosg_audio::BiquadFilterBank bank(num_channels, eq);
+    runner.run(format("BiquadFilterBank_4stage_{}ch", num_channels), FRAME_COUNT * num_channels, [&]() {
+      bank.process(data.data(), FRAME_COUNT);
+      keep(data);
+    });
+  }
+
+  static constexpr size_t NUM_BANDS = 8;
+  auto in = make_signal(FRAME_COUNT);
+  vector<float> out(FRAME_COUNT * NUM_BANDS);
+  phosg_audio::BiquadFilterBank bands(NUM_BANDS, 1);
+  for (size_t z = 0; z < NUM_BANDS; z++) {
+    bands.set_stage(z, 0, phosg_audio::BiquadCoefficients::bandpass(SAMPLE_RATE, 62.5 * (1 << z), 1.4));
+  }
+  runner.run(format("BiquadFilterBank_parallel_{}band", NUM_BANDS), FRAME_COUNT, [&]() {
+    bands.process_parallel(in.data(), out.data(), FRAME_COUNT);
+    keep(out);
+  });
+}
+
+static void run_activity_gate_benchmarks(BenchmarkRunner& runner) {
+  static constexpr size_t FRAME_COUNT = 0x1000;
+  auto data = make_signal_as<int16_t>(FRAME_COUNT);
+  uint64_t frames_passed = 0;
+  phosg_audio::ActivityGate gate(48000, AL_FORMAT_MONO16,
+      [&](const void*, size_t frame_count, const phosg_audio::AudioCapture::BlockInfo&) -> void {
+        frames_passed += frame_count;
+      });
+  phosg_audio::AudioCapture::BlockInfo info = {0, 0, false};
+  runner.run("ActivityGate_mono16", FRAME_COUNT, [&]() {
+    gate.add_frames(data.data(), FRAME_COUNT, info);
+    info.frame_index += FRAME_COUNT;
+    keep(frames_passed);
+  });
+}
+
+static void run_loudness_benchmarks(BenchmarkRunner& runner) {
+  static constexpr size_t FRAME_COUNT = 0x1000;
+  auto f32 = make_signal(FRAME_COUNT * 2);
+  auto s16 = make_signal_as<int16_t>(FRAME_COUNT * 2);
+  phosg_audio::LoudnessMeter meter(48000, 2);
+  runner.run("LoudnessMeter_f32", FRAME_COUNT * 2, [&]() {
+    meter.process(f32.data(), FRAME_COUNT);
+    keep(meter.momentary_lufs());
+  });
+  runner.run("LoudnessMeter_s16", FRAME_COUNT * 2, [&]() {
+    meter.process(s16.data(), FRAME_COUNT, AL_FORMAT_STEREO16);
+    keep(meter.momentary_lufs());
+  });
+}
+
+static void run_fingerprint_benchmarks(BenchmarkRunner& runner) {
+  if (!runner.should_run("compute_fingerprint") && !runner.should_run("FingerprintIndex_query")) {
+    return;
+  }
+
+  static constexpr size_t SAMPLE_RATE = 44100;
+  static constexpr size_t NUM_SAMPLES = 16;
+  static constexpr size_t SAMPLE_FRAMES = SAMPLE_RATE * 2;
+  auto bank = make_signal(NUM_SAMPLES * SAMPLE_FRAMES);
+  runner.run("compute_fingerprint", SAMPLE_FRAMES, [&]() {
+    keep(phosg_audio::compute_fingerprint(bank.data(), SAMPLE_FRAMES, 1, SAMPLE_RATE));
+  });
+
+  if (!runner.should_run("FingerprintIndex_query")) {
+    return;
+  }
+  phosg_audio::FingerprintIndex index;
+  for (size_t x = 0; x < NUM_SAMPLES; x++) {
+    index.add_sample(format("sample{}", x), bank.data() + x * SAMPLE_FRAMES, SAMPLE_FRAMES, 1, SAMPLE_RATE);
+  }
+  index.finalize();
+  auto clip_hashes = phosg_audio::compute_fingerprint(bank.data() + 5 * SAMPLE_FRAMES + SAMPLE_RATE / 2,
+      SAMPLE_RATE, 1, SAMPLE_RATE, index.get_options());
+  runner.run("FingerprintIndex_query", clip_hashes.size(), [&]() { keep(index.query(clip_hashes)); });
+}
+
+static void run_wav_benchmarks(BenchmarkRunner& runner, const string& temp_dir) {
+  if (!runner.should_run("save_wav_s16") && !runner.should_run("load_wav_s16") &&
+      !runner.should_run("save_wav_f32") && !runner.should_run("load_wav_f32")) {
+    return;
+  }
+
+  static constexpr size_t SAMPLE_RATE = 44100;
+  static constexpr size_t COUNT = SAMPLE_RATE * 2 * 10; // 10 seconds of stereo
+  string filename = temp_dir + "/phosg-audio-bench.XXXXXX";
+  int fd = mkstemp(filename.data());
+  if (fd < 0) {
+    throw runtime_error(format("cannot create temporary file in {}", temp_dir));
+  }
+  close(fd);
+
+  try {
+    auto f32 = make_signal(COUNT);
+    auto s16 = make_signal_as<int16_t>(COUNT);
+    runner.run("save_wav_s16", COUNT, [&]() { phosg_audio::save_wav(filename.c_str(), s16, SAMPLE_RATE, 2); });
+    runner.run("load_wav_s16", COUNT, [&]() { keep(phosg_audio::load_wav(filename.c_str())); });
+    runner.run("save_wav_f32", COUNT, [&]() { phosg_audio::save_wav(filename.c_str(), f32, SAMPLE_RATE, 2); });
+    runner.run("load_wav_f32", COUNT, [&]() { keep(phosg_audio::load_wav(filename.c_str())); });
+  } catch (const exception&) {
+    unlink(filename.c_str());
+    throw;
+  }
+  unlink(filename.c_str());
+}
+
+// These create AL buffers, so they run with a loopback context bound
+static void run_sound_benchmarks(BenchmarkRunner& runner) {
+  static constexpr uint32_t SAMPLE_RATE = 44100;
+  static constexpr float SECONDS = 1.0f;
+  static constexpr size_t COUNT = SAMPLE_RATE * SECONDS;
+
+  runner.run("SineWave", COUNT, [&]() { phosg_audio::SineWave(440.0f, SECONDS, 1.0f, SAMPLE_RATE); });
+  runner.run("SquareWave", COUNT, [&]() { phosg_audio::SquareWave(440.0f, SECONDS, 1.0f, SAMPLE_RATE); });
+  runner.run("TriangleWave", COUNT, [&]() { phosg_audio::TriangleWave(440.0f, SECONDS, 1.0f, SAMPLE_RATE); });
+  runner.run("FrontTriangleWave", COUNT, [&]() {
+    phosg_audio::FrontTriangleWave(440.0f, SECONDS, 1.0f, SAMPLE_RATE);
+  });
+  runner.run("WhiteNoise", COUNT, [&]() { phosg_audio::WhiteNoise(SECONDS, 1.0f, SAMPLE_RATE); });
+  runner.run("SplitNoise", COUNT, [&]() { phosg_audio::SplitNoise(16, SECONDS, 1.0f, false, SAMPLE_RATE); });
+}
+
+// Each iteration adds one block to the stream and renders one block on the
+// loopback device, so the stream's buffers are recycled at the rate they're
+// filled; the times include rendering, hence the name. There's no threaded
+// variant: the feeder thread only notices rendered buffers when its timed
+// wait expires, so that would measure the feeder's sleeps, not add_frames.
+static void run_stream_benchmarks(BenchmarkRunner& runner,
+    shared_ptr<phosg_audio::LoopbackDevice> device, shared_ptr<phosg_audio::AudioContext> context) {
+  static constexpr size_t BLOCK_FRAMES = 1024;
+  int al_format = device->get_format();
+  size_t num_channels = phosg_audio::is_stereo(al_format) ? 2 : 1;
+  auto samples = make_signal_as<int16_t>(BLOCK_FRAMES * num_channels);
+  vector<int16_t> rendered(BLOCK_FRAMES * num_channels);
+
+  if (!runner.should_run("AudioStream_add_frames+render")) {
+    return;
+  }
+  phosg_audio::AudioStream stream(device->get_sample_rate(), al_format, 4, false, BLOCK_FRAMES, context);
+  runner.run("AudioStream_add_frames+render", BLOCK_FRAMES * num_channels, [&]() {
+    stream.add_frames(samples.data(), BLOCK_FRAMES);
+    device->render(rendered.data(), BLOCK_FRAMES);
+    keep(rendered);
+  });
+}
+
+// Checks that add_frames doesn't allocate once the stream is running, in both
+// modes. Only the add_frames calls are counted, not rendering; in threaded
+// mode, this includes whatever the feeder thread does at the same time.
+// Returns false if any allocations were made.
+static bool check_stream_allocations(
+    shared_ptr<phosg_audio::LoopbackDevice> device, shared_ptr<phosg_audio::AudioContext> context) {
+  static constexpr size_t BLOCK_FRAMES = 1024;
+  static constexpr size_t WARMUP_BLOCKS = 16;
+  static constexpr size_t CHECKED_BLOCKS = 64;
+  int al_format = device->get_format();
+  size_t num_channels = phosg_audio::is_stereo(al_format) ? 2 : 1;
+  auto samples = make_signal_as<int16_t>(BLOCK_FRAMES * num_channels);
+  vector<int16_t> rendered(BLOCK_FRAMES * num_channels);
+
+  bool ret = true;
+  for (bool threaded : {false, true}) {
+    phosg_audio::AudioStream stream(device->get_sample_rate(), al_format, 4, threaded, BLOCK_FRAMES, context);
+    for (size_t x = 0; x < WARMUP_BLOCKS; x++) {
+      stream.add_frames(samples.data(), BLOCK_FRAMES);
+      device->render(rendered.data(), BLOCK_FRAMES);
+    }
+    size_t allocations = 0;
+    for (size_t x = 0; x < CHECKED_BLOCKS; x++) {
+      size_t start_count = phosg_audio::allocation_count();
+      stream.add_frames(samples.data(), BLOCK_FRAMES);
+      allocations += phosg_audio::allocation_count() - start_count;
+      device->render(rendered.data(), BLOCK_FRAMES);
+    }
+    const char* mode = threaded ? "threaded" : "unthreaded";
+    if (allocations) {
+      fprintf(stderr, "FAILED: %zu allocations in %zu steady-state %s add_frames calls\n",
+          allocations, CHECKED_BLOCKS, mode);
+      ret = false;
+    } else {
+      fprintf(stderr, "no allocations in %zu steady-state %s add_frames calls\n", CHECKED_BLOCKS, mode);
+    }
+  }
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  const char* filter = nullptr;
+  double min_time = 0.5;
+  bool json_to_stdout = false;
+  const char* json_filename = nullptr;
+  string temp_dir = "/tmp";
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--filter=", 9)) {
+      filter = &argv[x][9];
+    } else if (!strncmp(argv[x], "--min-time=", 11)) {
+      min_time = atof(&argv[x][11]);
+    } else if (!strcmp(argv[x], "--json")) {
+      json_to_stdout = true;
+    } else if (!strncmp(argv[x], "--json=", 7)) {
+      json_filename = &argv[x][7];
+    } else if (!strncmp(argv[x], "--temp-dir=", 11)) {
+      temp_dir = &argv[x][11];
+    } else if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 0;
+    } else {
+      fprintf(stderr, "unrecognized option: %s\n", argv[x]);
+      print_usage();
+      return 1;
+    }
+  }
+
+  bool allocations_ok = true;
+  BenchmarkRunner runner(filter, min_time, !json_to_stdout);
+  runner.print_header();
+  run_fourier_benchmarks(runner);
+  run_conversion_benchmarks(runner);
+  run_byteswap_benchmarks(runner);
+  run_biquad_benchmarks(runner);
+  run_loudness_benchmarks(runner);
+  run_activity_gate_benchmarks(runner);
+  run_fingerprint_benchmarks(runner);
+  run_wav_benchmarks(runner, temp_dir);
+
+  if (phosg_audio::LoopbackDevice::is_supported()) {
+    auto device = make_shared<phosg_audio::LoopbackDevice>(44100, AL_FORMAT_STEREO16);
+    auto context = phosg_audio::LoopbackDevice::create_context(device);
+    phosg_audio::ScopedContext cg(context);
+    run_sound_benchmarks(runner);
+    run_stream_benchmarks(runner, device, context);
+    if (phosg_audio::allocation_counting_enabled() && !check_stream_allocations(device, context)) {
+      allocations_ok = false;
+    }
+  } else {
+    fprintf(stderr, "ALC_SOFT_loopback is not supported; skipping sound and stream benchmarks\n");
+  }
+
+  string json = runner.json();
+  if (json_to_stdout) {
+    fprintf(stdout, "%s\n", json.c_str());
+  }
+  if (json_filename) {
+    FILE* f = fopen(json_filename, "wt");
+    if (!f) {
+      fprintf(stderr, "cannot open %s\n", json_filename);
+      return 1;
+    }
+    fprintf(f, "%s\n", json.c_str());
+    fclose(f);
+  }
+  return allocations_ok ? 0 : 2;
+}
@@ -0,0 +1,394 @@
+#include "Biquad.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <complex>
+#include <stdexcept>
+
+#include "Constants.hh"
+#include "Convert.hh"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PHOSG_AUDIO_BIQUAD_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PHOSG_AUDIO_BIQUAD_NEON
+#endif
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Cookbook designs
+
+struct CookbookParams {
+  double cos_w0;
+  double alpha;
+};
+
+static CookbookParams cookbook_params(double sample_rate, double freq, double q) {
+  if (!(sample_rate > 0.0) || !(freq > 0.0) || !(freq < sample_rate / 2.0)) {
+    throw invalid_argument("filter frequency must be between 0 and the Nyquist frequency");
+  }
+  if (!(q > 0.0)) {
+    throw invalid_argument("filter Q must be positive");
+  }
+  double w0 = 2.0 * M_PI * freq / sample_rate;
+  return {cos(w0), sin(w0) / (2.0 * q)};
+}
+
+static BiquadCoefficients normalized(double b0, double b1, double b2, double a0, double a1, double a2) {
+  BiquadCoefficients ret;
+  ret.b0 = b0 / a0;
+  ret.b1 = b1 / a0;
+  ret.b2 = b2 / a0;
+  ret.a1 = a1 / a0;
+  ret.a2 = a2 / a0;
+  return ret;
+}
+
+BiquadCoefficients BiquadCoefficients::lowpass(double sample_rate, double freq, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  return normalized((1.0 - p.cos_w0) / 2.0, 1.0 - p.cos_w0, (1.0 - p.cos_w0) / 2.0,
+      1.0 + p.alpha, -2.0 * p.cos_w0, 1.0 - p.alpha);
+}
+
+BiquadCoefficients BiquadCoefficients::highpass(double sample_rate, double freq, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  return normalized((1.0 + p.cos_w0) / 2.0, -(1.0 + p.cos_w0), (1.0 + p.cos_w0) / 2.0,
+      1.0 + p.alpha, -2.0 * p.cos_w0, 1.0 - p.alpha);
+}
+
+BiquadCoefficients BiquadCoefficients::bandpass(double sample_rate, double freq, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  return normalized(p.alpha, 0.0, -p.alpha, 1.0 + p.alpha, -2.0 * p.cos_w0, 1.0 - p.alpha);
+}
+
+BiquadCoefficients BiquadCoefficients::notch(double sample_rate, double freq, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  return normalized(1.0, -2.0 * p.cos_w0, 1.0, 1.0 + p.alpha, -2.0 * p.cos_w0, 1.0 - p.alpha);
+}
+
+BiquadCoefficients BiquadCoefficients::allpass(double sample_rate, double freq, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  return normalized(1.0 - p.alpha, -2.0 * p.cos_w0, 1.0 + p.alpha, 1.0 + p.alpha, -2.0 * p.cos_w0, 1.0 - p.alpha);
+}
+
+BiquadCoefficients BiquadCoefficients::peaking(double sample_rate, double freq, double gain_db, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  double a = pow(10.0, gain_db / 40.0);
+  return normalized(1.0 + p.alpha * a, -2.0 * p.cos_w0, 1.0 - p.alpha * a,
+      1.0 + p.alpha / a, -2.0 * p.cos_w0, 1.0 - p.alpha / a);
+}
+
+BiquadCoefficients BiquadCoefficients::low_shelf(double sample_rate, double freq, double gain_db, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  double a = pow(10.0, gain_db / 40.0);
+  double k = 2.0 * sqrt(a) * p.alpha;
+  return normalized(
+      a * ((a + 1.0) - (a - 1.0) * p.cos_w0 + k),
+      2.0 * a * ((a - 1.0) - (a + 1.0) * p.cos_w0),
+      a * ((a + 1.0) - (a - 1.0) * p.cos_w0 - k),
+      (a + 1.0) + (a - 1.0) * p.cos_w0 + k,
+      -2.0 * ((a - 1.0) + (a + 1.0) * p.cos_w0),
+      (a + 1.0) + (a - 1.0) * p.cos_w0 - k);
+}
+
+BiquadCoefficients BiquadCoefficients::high_shelf(double sample_rate, double freq, double gain_db, double q) {
+  auto p = cookbook_params(sample_rate, freq, q);
+  double a = pow(10.0, gain_db / 40.0);
+  double k = 2.0 * sqrt(a) * p.alpha;
+  return normalized(
+      a * ((a + 1.0) + (a - 1.0) * p.cos_w0 + k),
+      -2.0 * a * ((a - 1.0) + (a + 1.0) * p.cos_w0),
+      a * ((a + 1.0) + (a - 1.0) * p.cos_w0 - k),
+      (a + 1.0) - (a - 1.0) * p.cos_w0 + k,
+      2.0 * ((a - 1.0) - (a + 1.0) * p.cos_w0),
+      (a + 1.0) - (a - 1.0) * p.cos_w0 - k);
+}
+
+double BiquadCoefficients::response_db(double sample_rate, double freq) const {
+  complex<double> z1 = polar(1.0, -2.0 * M_PI * freq / sample_rate);
+  complex<double> z2 = z1 * z1;
+  complex<double> h = (static_cast<double>(this->b0) + static_cast<double>(this->b1) * z1 + static_cast<double>(this->b2) * z2) /
+      (1.0 + static_cast<double>(this->a1) * z1 + static_cast<double>(this->a2) * z2);
+  return 20.0 * log10(abs(h));
+}
+
+// Filter bank
+
+// One stage's coefficients and state for a group of lanes, held in registers.
+// Computing b1 * v + s2 before subtracting a1 * y keeps the recursion through
+// s1 down to an add, a multiply and a subtract.
+#if defined(PHOSG_AUDIO_BIQUAD_SSE)
+struct SSEStage {
+  __m128 b0, b1, b2, a1, a2, s1, s2;
+
+  SSEStage(const float* c, const float* s)
+      : b0(_mm_loadu_ps(&c[0])),
+        b1(_mm_loadu_ps(&c[4])),
+        b2(_mm_loadu_ps(&c[8])),
+        a1(_mm_loadu_ps(&c[12])),
+        a2(_mm_loadu_ps(&c[16])),
+        s1(_mm_loadu_ps(&s[0])),
+        s2(_mm_loadu_ps(&s[4])) {}
+
+  inline __m128 step(__m128 v) {
+    __m128 y = _mm_add_ps(_mm_mul_ps(this->b0, v), this->s1);
+    this->s1 = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(this->b1, v), this->s2), _mm_mul_ps(this->a1, y));
+    this->s2 = _mm_sub_ps(_mm_mul_ps(this->b2, v), _mm_mul_ps(this->a2, y));
+    return y;
+  }
+
+  void save(float* s) const {
+    _mm_storeu_ps(&s[0], this->s1);
+    _mm_storeu_ps(&s[4], this->s2);
+  }
+};
+#elif defined(PHOSG_AUDIO_BIQUAD_NEON)
+struct NEONStage {
+  float32x4_t b0, b1, b2, a1, a2, s1, s2;
+
+  NEONStage(const float* c, const float* s)
+      : b0(vld1q_f32(&c[0])),
+        b1(vld1q_f32(&c[4])),
+        b2(vld1q_f32(&c[8])),
+        a1(vld1q_f32(&c[12])),
+        a2(vld1q_f32(&c[16])),
+        s1(vld1q_f32(&s[0])),
+        s2(vld1q_f32(&s[4])) {}
+
+  inline float32x4_t step(float32x4_t v) {
+    float32x4_t y = vmlaq_f32(this->s1, this->b0, v);
+    this->s1 = vmlsq_f32(vmlaq_f32(this->s2, this->b1, v), this->a1, y);
+    this->s2 = vmlsq_f32(vmulq_f32(this->b2, v), this->a2, y);
+    return y;
+  }
+
+  void save(float* s) const {
+    vst1q_f32(&s[0], this->s1);
+    vst1q_f32(&s[4], this->s2);
+  }
+};
+#endif
+
+BiquadFilterBank::BiquadFilterBank(size_t num_lanes, size_t num_stages)
+    : num_lanes(num_lanes),
+      num_stages(num_stages),
+      num_groups((num_lanes + LANES_PER_GROUP - 1) / LANES_PER_GROUP),
+      coeffs(this->num_groups * num_stages * 5 * LANES_PER_GROUP, 0.0f),
+      state(this->num_groups * num_stages * 2 * LANES_PER_GROUP, 0.0f) {
+  if (num_lanes == 0) {
+    throw invalid_argument("filter bank must have at least one lane");
+  }
+  // Unused lanes in the last group are pass-through too, so they never
+  // produce denormals or NaNs
+  for (size_t group = 0; group < this->num_groups; group++) {
+    for (size_t stage = 0; stage < this->num_stages; stage++) {
+      float* c = this->group_coeffs(group, stage);
+      for (size_t z = 0; z < LANES_PER_GROUP; z++) {
+        c[z] = 1.0f;
+      }
+    }
+  }
+}
+
+BiquadFilterBank::BiquadFilterBank(size_t num_lanes, const vector<BiquadCoefficients>& cascade)
+    : BiquadFilterBank(num_lanes, cascade.size()) {
+  for (size_t lane = 0; lane < num_lanes; lane++) {
+    this->set_cascade(lane, cascade);
+  }
+}
+
+size_t BiquadFilterBank::get_num_lanes() const {
+  return this->num_lanes;
+}
+
+size_t BiquadFilterBank::get_num_stages() const {
+  return this->num_stages;
+}
+
+void BiquadFilterBank::set_stage(size_t lane, size_t stage, const BiquadCoefficients& stage_coeffs) {
+  if (lane >= this->num_lanes) {
+    throw out_of_range("invalid lane");
+  }
+  if (stage >= this->num_stages) {
+    throw out_of_range("invalid stage");
+  }
+  float* c = this->group_coeffs(lane / LANES_PER_GROUP, stage) + (lane % LANES_PER_GROUP);
+  c[0 * LANES_PER_GROUP] = stage_coeffs.b0;
+  c[1 * LANES_PER_GROUP] = stage_coeffs.b1;
+  c[2 * LANES_PER_GROUP] = stage_coeffs.b2;
+  c[3 * LANES_PER_GROUP] = stage_coeffs.a1;
+  c[4 * LANES_PER_GROUP] = stage_coeffs.a2;
+}
+
+void BiquadFilterBank::set_cascade(size_t lane, const vector<BiquadCoefficients>& cascade) {
+  if (cascade.size() > this->num_stages) {
+    throw invalid_argument("cascade has too many stages for this filter bank");
+  }
+  for (size_t stage = 0; stage < this->num_stages; stage++) {
+    this->set_stage(lane, stage, (stage < cascade.size()) ? cascade[stage] : BiquadCoefficients());
+  }
+}
+
+void BiquadFilterBank::reset() {
+  fill(this->state.begin(), this->state.end(), 0.0f);
+}
+
+void BiquadFilterBank::process(float* data, size_t frame_count) {
+  for (size_t group = 0; group < this->num_groups; group++) {
+    this->process_group(group, data, this->num_lanes, 1, data, this->num_lanes, frame_count);
+  }
+}
+
+void BiquadFilterBank::process(void* data, size_t frame_count, int format) {
+  if ((is_stereo(format) ? 2 : 1) != this->num_lanes) {
+    throw invalid_argument("format's channel count doesn't match the filter bank's");
+  }
+  int float_format = (this->num_lanes == 2) ? AL_FORMAT_STEREO_FLOAT32 : AL_FORMAT_MONO_FLOAT32;
+  if (format == float_format) {
+    this->process(reinterpret_cast<float*>(data), frame_count);
+    return;
+  }
+  float chunk[CHUNK_FRAMES * 2];
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(data);
+  size_t bpf = bytes_per_frame(format);
+  while (frame_count) {
+    size_t n = min(frame_count, CHUNK_FRAMES);
+    convert_frames(chunk, float_format, bytes, format, n);
+    this->process(chunk, n);
+    convert_frames(bytes, format, chunk, float_format, n);
+    bytes += n * bpf;
+    frame_count -= n;
+  }
+}
+
+void BiquadFilterBank::process_parallel(const float* in, float* out, size_t frame_count) {
+  if ((this->num_lanes > 1) && (in == out)) {
+    throw invalid_argument("parallel filter input and output must not be the same");
+  }
+  for (size_t group = 0; group < this->num_groups; group++) {
+    this->process_group(group, in, 1, 0, out, this->num_lanes, frame_count);
+  }
+}
+
+float* BiquadFilterBank::group_coeffs(size_t group, size_t stage) {
+  return &this->coeffs[(group * this->num_stages + stage) * 5 * LANES_PER_GROUP];
+}
+
+float* BiquadFilterBank::group_state(size_t group, size_t stage) {
+  return &this->state[(group * this->num_stages + stage) * 2 * LANES_PER_GROUP];
+}
+
+void BiquadFilterBank::process_group(size_t group, const float* in, size_t in_stride, size_t in_lane_stride,
+    float* out, size_t out_stride, size_t frame_count) {
+  size_t first_lane = group * LANES_PER_GROUP;
+  size_t group_lanes = min(LANES_PER_GROUP, this->num_lanes - first_lane);
+  in += first_lane * in_lane_stride;
+  out += first_lane;
+
+  // Each chunk is copied into a lane-minor buffer, then run through the
+  // stages, so each stage's coefficients and state stay in registers for the
+  // whole chunk
+  float buf[CHUNK_FRAMES * LANES_PER_GROUP];
+  for (size_t x = 0; x < frame_count;) {
+    size_t n = min(frame_count - x, CHUNK_FRAMES);
+    if ((group_lanes == LANES_PER_GROUP) && (in_lane_stride == 1)) {
+      for (size_t z = 0; z < n; z++) {
+        memcpy(&buf[z * LANES_PER_GROUP], &in[(x + z) * in_stride], sizeof(float) * LANES_PER_GROUP);
+      }
+    } else {
+      for (size_t z = 0; z < n; z++) {
+        for (size_t l = 0; l < LANES_PER_GROUP; l++) {
+          buf[z * LANES_PER_GROUP + l] = (l < group_lanes) ? in[(x + z) * in_stride + l * in_lane_stride] : 0.0f;
+        }
+      }
+    }
+
+    // Stages are run two at a time when possible. A stage's recursion through
+    // s1 is its critical path, so frames can't be processed in parallel, but
+    // the second stage's recursion can overlap with the first's.
+    for (size_t stage = 0; stage < this->num_stages;) {
+      size_t pass_stages = min<size_t>(this->num_stages - stage, 2);
+#if defined(PHOSG_AUDIO_BIQUAD_SSE)
+      SSEStage st0(this->group_coeffs(group, stage), this->group_state(group, stage));
+      if (pass_stages == 2) {
+        SSEStage st1(this->group_coeffs(group, stage + 1), this->group_state(group, stage + 1));
+        for (size_t z = 0; z < n; z++) {
+          _mm_storeu_ps(&buf[z * LANES_PER_GROUP], st1.step(st0.step(_mm_loadu_ps(&buf[z * LANES_PER_GROUP]))));
+        }
+        st1.save(this->group_state(group, stage + 1));
+      } else {
+        for (size_t z = 0; z < n; z++) {
+          _mm_storeu_ps(&buf[z * LANES_PER_GROUP], st0.step(_mm_loadu_ps(&buf[z * LANES_PER_GROUP])));
+        }
+      }
+      st0.save(this->group_state(group, stage));
+#elif defined(PHOSG_AUDIO_BIQUAD_NEON)
+      NEONStage st0(this->group_coeffs(group, stage), this->group_state(group, stage));
+      if (pass_stages == 2) {
+        NEONStage st1(this->group_coeffs(group, stage + 1), this->group_state(group, stage + 1));
+        for (size_t z = 0; z < n; z++) {
+          vst1q_f32(&buf[z * LANES_PER_GROUP], st1.step(st0.step(vld1q_f32(&buf[z * LANES_PER_GROUP]))));
+        }
+        st1.save(this->group_state(group, stage + 1));
+      } else {
+        for (size_t z = 0; z < n; z++) {
+          vst1q_f32(&buf[z * LANES_PER_GROUP], st0.step(vld1q_f32(&buf[z * LANES_PER_GROUP])));
+        }
+      }
+      st0.save(this->group_state(group, stage));
+#else
+      pass_stages = 1;
+      const float* c = this->group_coeffs(group, stage);
+      float* s = this->group_state(group, stage);
+      for (size_t l = 0; l < LANES_PER_GROUP; l++) {
+        float b0 = c[0 * LANES_PER_GROUP + l];
+        float b1 = c[1 * LANES_PER_GROUP + l];
+        float b2 = c[2 * LANES_PER_GROUP + l];
+        float a1 = c[3 * LANES_PER_GROUP + l];
+        float a2 = c[4 * LANES_PER_GROUP + l];
+        float s1 = s[l];
+        float s2 = s[LANES_PER_GROUP + l];
+        for (size_t z = 0; z < n; z++) {
+          float v = buf[z * LANES_PER_GROUP + l];
+          float y = b0 * v + s1;
+          s1 = (b1 * v + s2) - a1 * y;
+          s2 = b2 * v - a2 * y;
+          buf[z * LANES_PER_GROUP + l] = y;
+        }
+        s[l] = s1;
+        s[LANES_PER_GROUP + l] = s2;
+      }
+#endif
+      // When the input goes silent, the state decays toward zero through the
+      // denormal range, which is very slow on some CPUs; cut it off instead
+      for (size_t z = 0; z < pass_stages; z++) {
+        float* s = this->group_state(group, stage + z);
+        for (size_t w = 0; w < 2 * LANES_PER_GROUP; w++) {
+          if (fabsf(s[w]) < 1e-30f) {
+            s[w] = 0.0f;
+          }
+        }
+      }
+      stage += pass_stages;
+    }
+
+    if (group_lanes == LANES_PER_GROUP) {
+      for (size_t z = 0; z < n; z++) {
+        memcpy(&out[(x + z) * out_stride], &buf[z * LANES_PER_GROUP], sizeof(float) * LANES_PER_GROUP);
+      }
+    } else {
+      for (size_t z = 0; z < n; z++) {
+        memcpy(&out[(x + z) * out_stride], &buf[z * LANES_PER_GROUP], sizeof(float) * group_lanes);
+      }
+    }
+    x += n;
+  }
+}
+
+} // namespace phosg_audio
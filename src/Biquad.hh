@@ -0,0 +1,97 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace phosg_audio {
+
+// Normalized biquad coefficients (a0 = 1), for the transfer function
+// H(z) = (b0 + b1 z^-1 + b2 z^-2) / (1 + a1 z^-1 + a2 z^-2). The factory
+// functions are the designs from Robert Bristow-Johnson's Audio EQ Cookbook.
+// freq is in Hz and must be below the Nyquist frequency; gain_db is only used
+// by the peaking and shelf filters. For the shelves, q = 1/sqrt(2) gives the
+// steepest slope without overshoot.
+struct BiquadCoefficients {
+  float b0 = 1.0f;
+  float b1 = 0.0f;
+  float b2 = 0.0f;
+  float a1 = 0.0f;
+  float a2 = 0.0f;
+
+  static BiquadCoefficients lowpass(double sample_rate, double freq, double q = M_SQRT1_2);
+  static BiquadCoefficients highpass(double sample_rate, double freq, double q = M_SQRT1_2);
+  // Constant 0dB peak gain at freq
+  static BiquadCoefficients bandpass(double sample_rate, double freq, double q = M_SQRT1_2);
+  static BiquadCoefficients notch(double sample_rate, double freq, double q = M_SQRT1_2);
+  static BiquadCoefficients allpass(double sample_rate, double freq, double q = M_SQRT1_2);
+  static BiquadCoefficients peaking(double sample_rate, double freq, double gain_db, double q = 1.0);
+  static BiquadCoefficients low_shelf(double sample_rate, double freq, double gain_db, double q = M_SQRT1_2);
+  static BiquadCoefficients high_shelf(double sample_rate, double freq, double gain_db, double q = M_SQRT1_2);
+
+  // Returns the filter's gain at freq, in dB
+  double response_db(double sample_rate, double freq) const;
+};
+
+// A set of independent biquad cascades ("lanes"), all with the same number of
+// stages, implemented in transposed direct form II. Lanes are processed four
+// at a time in SIMD registers, so filtering four channels costs about the same
+// as filtering one. All memory is allocated by the constructor; the process
+// functions work in small chunks on the stack and never allocate, so they can
+// be called on the audio path (e.g. in an AudioCapture block callback, or on
+// each block before AudioStream::add_frames). Changing coefficients between
+// blocks is fine, but this class isn't thread-safe.
+class BiquadFilterBank {
+public:
+  // All stages are initially pass-through
+  BiquadFilterBank(size_t num_lanes, size_t num_stages);
+  // Runs the same cascade on every lane
+  BiquadFilterBank(size_t num_lanes, const std::vector<BiquadCoefficients>& cascade);
+  ~BiquadFilterBank() = default;
+
+  size_t get_num_lanes() const;
+  size_t get_num_stages() const;
+
+  void set_stage(size_t lane, size_t stage, const BiquadCoefficients& coeffs);
+  // If cascade has fewer stages than the bank, the rest are pass-through
+  void set_cascade(size_t lane, const std::vector<BiquadCoefficients>& cascade);
+
+  // Clears the filters' history, but keeps their coefficients
+  void reset();
+
+  // Filters interleaved data in place; lane N filters channel N, so the data
+  // must have exactly num_lanes channels
+  void process(float* data, size_t frame_count);
+  // Same as above, but for data in any AL format (in native byte order); the
+  // data is converted to float and back in small chunks on the stack
+  void process(void* data, size_t frame_count, int format);
+  // Runs every lane on the same mono input, for banks of independent filters
+  // on one channel (e.g. band splitting). out is interleaved, with num_lanes
+  // values per frame. out may be the same as in only if num_lanes is 1.
+  void process_parallel(const float* in, float* out, size_t frame_count);
+
+private:
+  static constexpr size_t LANES_PER_GROUP = 4;
+  static constexpr size_t CHUNK_FRAMES = 0x100;
+
+  // Filters one group of lanes. Lane L's input for frame z is
+  // in[z * in_stride + L * in_lane_stride], so in_lane_stride is 0 for
+  // process_parallel.
+  void process_group(size_t group, const float* in, size_t in_stride, size_t in_lane_stride,
+      float* out, size_t out_stride, size_t frame_count);
+  float* group_coeffs(size_t group, size_t stage);
+  float* group_state(size_t group, size_t stage);
+
+  size_t num_lanes;
+  size_t num_stages;
+  size_t num_groups;
+  // Both of these are stored lane-minor, so each value for a group of lanes
+  // can be loaded as one vector: coeffs is [group][stage][b0 b1 b2 a1 a2][lane]
+  // and state is [group][stage][s1 s2][lane]
+  std::vector<float> coeffs;
+  std::vector<float> state;
+};
+
+} // namespace phosg_audio
@@ -0,0 +1,191 @@
+#include "CallbackStream.hh"
+
+#include <unistd.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace phosg_audio {
+
+#ifndef AL_APIENTRY
+#define AL_APIENTRY
+#endif
+
+// These are from AL_SOFT_callback_buffer. The entry point is looked up at
+// runtime so we don't depend on alext.h.
+typedef ALsizei(AL_APIENTRY* ALBUFFERCALLBACKTYPESOFT)(ALvoid* userptr, ALvoid* sampledata, ALsizei numbytes);
+typedef void(AL_APIENTRY* LPALBUFFERCALLBACKSOFT)(ALuint buffer, ALenum format, ALsizei freq, ALBUFFERCALLBACKTYPESOFT callback, ALvoid* userptr);
+
+static LPALBUFFERCALLBACKSOFT get_buffer_callback_fn() {
+  if (!AL_CALL(alIsExtensionPresent, "AL_SOFT_callback_buffer")) {
+    return nullptr;
+  }
+  return reinterpret_cast<LPALBUFFERCALLBACKSOFT>(AL_CALL(alGetProcAddress, "alBufferCallbackSOFT"));
+}
+
+AudioCallbackStream::AudioCallbackStream(int sample_rate, int format,
+    RenderFn render_fn, size_t block_frames, size_t num_buffers,
+    shared_ptr<AudioContext> context)
+    : sample_rate(sample_rate),
+      format(format),
+      render_fn(std::move(render_fn)),
+      block_frames(block_frames),
+      num_buffers(num_buffers),
+      context(context ? std::move(context) : ScopedContext::current()),
+      finished(false),
+      should_stop(false),
+      started(false),
+      native(false),
+      buffer_id(0),
+      source_id(0) {
+  if (block_frames == 0) {
+    throw invalid_argument("block size must not be zero");
+  }
+
+  ScopedContext cg(this->context.get());
+  auto alBufferCallbackSOFT = get_buffer_callback_fn();
+  if (alBufferCallbackSOFT) {
+    AL_CALL(alGenBuffers, 1, &this->buffer_id);
+    al_check_error();
+    // The result of this call is checked directly, so clear any earlier error
+    // first (in OFF mode, al_check_error doesn't retrieve them)
+    alGetError();
+    AL_CALL(alBufferCallbackSOFT, this->buffer_id, this->format, this->sample_rate,
+        &AudioCallbackStream::native_callback, this);
+    if (alGetError() == AL_NO_ERROR) {
+      AL_CALL(alGenSources, 1, &this->source_id);
+      al_check_error();
+      AL_CALL(alSourcei, this->source_id, AL_BUFFER, this->buffer_id);
+      al_check_error();
+      this->native = true;
+    } else {
+      // The implementation doesn't support callbacks for this format; fall
+      // back to the feeder thread
+      AL_CALL(alDeleteBuffers, 1, &this->buffer_id);
+      this->buffer_id = 0;
+    }
+  }
+
+  if (!this->native) {
+    this->stream = make_unique<AudioStream>(this->sample_rate, this->format, this->num_buffers,
+        false, 1024, this->context);
+  }
+}
+
+AudioCallbackStream::~AudioCallbackStream() {
+  this->stop();
+  ScopedContext cg(this->context.get());
+  if (this->source_id) {
+    AL_CALL(alDeleteSources, 1, &this->source_id);
+  }
+  if (this->buffer_id) {
+    AL_CALL(alDeleteBuffers, 1, &this->buffer_id);
+  }
+}
+
+void AudioCallbackStream::start() {
+  if (this->started) {
+    return;
+  }
+  this->started = true;
+  this->should_stop = false;
+  this->finished = false;
+  if (this->native) {
+    ScopedContext cg(this->context.get());
+    AL_CALL(alSourcePlay, this->source_id);
+    al_check_error();
+  } else {
+    this->fallback_thread = thread(&AudioCallbackStream::fallback_thread_fn, this);
+  }
+}
+
+void AudioCallbackStream::stop() {
+  this->should_stop = true;
+  if (this->native) {
+    if (this->started) {
+      ScopedContext cg(this->context.get());
+      AL_CALL(alSourceStop, this->source_id);
+      // stop() is also called by the destructor
+      al_check_error_nothrow();
+    }
+  } else if (this->fallback_thread.joinable()) {
+    this->fallback_thread.join();
+    // Discard whatever the thread queued but hasn't played yet, so it doesn't
+    // keep playing now or get played first after the next start()
+    ScopedALErrorsNoThrow eg;
+    this->stream->stop();
+  }
+  this->started = false;
+}
+
+void AudioCallbackStream::wait() {
+  if (!this->started) {
+    return;
+  }
+
+  if (this->native) {
+    // The source stops on its own after the callback returns a short block
+    ScopedContext cg(this->context.get());
+    size_t block_usecs = (this->block_frames * 1000000) / this->sample_rate;
+    for (;;) {
+      ALint source_state;
+      AL_CALL(alGetSourcei, this->source_id, AL_SOURCE_STATE, &source_state);
+      al_check_error();
+      if (source_state != AL_PLAYING) {
+        break;
+      }
+      usleep(block_usecs);
+    }
+
+  } else if (this->fallback_thread.joinable()) {
+    this->fallback_thread.join();
+  }
+  this->started = false;
+}
+
+bool AudioCallbackStream::uses_native_callback() const {
+  return this->native;
+}
+
+ALsizei AudioCallbackStream::native_callback(ALvoid* userptr, ALvoid* sampledata, ALsizei numbytes) {
+  auto* s = reinterpret_cast<AudioCallbackStream*>(userptr);
+  if (s->finished || s->should_stop) {
+    return 0;
+  }
+  size_t bpf = bytes_per_frame(s->format);
+  size_t frames_requested = numbytes / bpf;
+  size_t frames_rendered = s->render_fn(sampledata, frames_requested);
+  if (frames_rendered < frames_requested) {
+    s->finished = true;
+  }
+  return frames_rendered * bpf;
+}
+
+void AudioCallbackStream::fallback_thread_fn() {
+  // The only allocation here is the block buffer; add_frames blocks until an
+  // AL buffer is free, so each block is rendered just before it's needed
+  vector<uint8_t> block(this->block_frames * bytes_per_frame(this->format));
+  ScopedALErrorsNoThrow eg;
+  while (!this->should_stop) {
+    size_t frames_rendered = this->render_fn(block.data(), this->block_frames);
+    if (frames_rendered) {
+      this->stream->add_frames(block.data(), frames_rendered);
+    }
+    if (frames_rendered < this->block_frames) {
+      this->finished = true;
+      // Wait for the rest of the data to play, unless stop() is called first
+      while (!this->should_stop) {
+        this->stream->check_buffers();
+        if (this->stream->queued_buffer_count() == 0) {
+          this->stream->wait();
+          break;
+        }
+        usleep(1000);
+      }
+      break;
+    }
+  }
+}
+
+} // namespace phosg_audio
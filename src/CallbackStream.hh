@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Constants.hh"
+#include "Device.hh"
+#include "Stream.hh"
+
+namespace phosg_audio {
+
+// Plays audio produced on demand by a render function. The render function is
+// called with a buffer and a frame count, and should fill the buffer and
+// return the number of frames written; returning fewer frames than requested
+// ends the stream.
+//
+// If the OpenAL implementation supports AL_SOFT_callback_buffer, the render
+// function is called directly from the mixer thread with exactly as much data
+// as the device needs next, so there's no intermediate queueing at all. In
+// that case the function must not block or call AL functions. Otherwise, an
+// internal thread calls the render function for each block of block_frames
+// frames and queues the results on an AudioStream with num_buffers buffers.
+// The stream is bound to a context the same way an AudioStream is.
+class AudioCallbackStream {
+public:
+  using RenderFn = std::function<size_t(void* buffer, size_t frame_count)>;
+
+  AudioCallbackStream(int sample_rate, int format, RenderFn render_fn,
+      size_t block_frames = 1024, size_t num_buffers = 4,
+      std::shared_ptr<AudioContext> context = nullptr);
+  ~AudioCallbackStream();
+
+  AudioCallbackStream(const AudioCallbackStream&) = delete;
+  AudioCallbackStream(AudioCallbackStream&&) = delete;
+  AudioCallbackStream& operator=(const AudioCallbackStream&) = delete;
+  AudioCallbackStream& operator=(AudioCallbackStream&&) = delete;
+
+  void start();
+  void stop();
+  // Waits until the render function has ended the stream and all rendered
+  // data has been played
+  void wait();
+
+  bool uses_native_callback() const;
+
+private:
+  static ALsizei native_callback(ALvoid* userptr, ALvoid* sampledata, ALsizei numbytes);
+  void fallback_thread_fn();
+
+  int sample_rate;
+  int format;
+  RenderFn render_fn;
+  size_t block_frames;
+  size_t num_buffers;
+  std::shared_ptr<AudioContext> context;
+  std::atomic<bool> finished;
+  std::atomic<bool> should_stop;
+  bool started;
+
+  // Native callback mode
+  bool native;
+  ALuint buffer_id;
+  ALuint source_id;
+
+  // Fallback mode
+  std::unique_ptr<AudioStream> stream;
+  std::thread fallback_thread;
+};
+
+} // namespace phosg_audio
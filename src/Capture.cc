@@ -1,57 +1,462 @@
 #include "Capture.hh"
 
+#include <math.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "Stats.hh"
+
 using namespace std;
 
 namespace phosg_audio {
 
+// The drift estimate is too noisy to be useful before this much time has
+// passed, since the device reports captured frames in steps of its update
+// period
+static constexpr double MIN_FIT_SECONDS = 5.0;
+
 AudioCapture::AudioCapture(
     const char* device_name,
     int sample_rate,
     int format,
-    int buffer_size)
-    : format(format) {
-  this->device = alcCaptureOpenDevice(device_name, sample_rate, format, buffer_size);
+    int buffer_size,
+    bool threaded,
+    size_t block_frames,
+    BlockCallback block_callback,
+    shared_ptr<AudioContext> context)
+    : context(context ? std::move(context) : ScopedContext::current()),
+      sample_rate(sample_rate),
+      format(format),
+      buffer_size(buffer_size),
+      next_device_frame(0),
+      last_read_time_ns(0),
+      frames_left_in_device(0),
+      drop_pending(false),
+      pending_gap_frame(0),
+      pending_gap_frames(0),
+      frames_captured(0),
+      overrun_count(0),
+      dropped_frames(0),
+      ring_overrun_count(0),
+      ring_dropped_frames(0),
+      measured_sample_rate(0.0),
+      consumer_wait_ns(0),
+      ring_frames_written(0),
+      ring_frames_read(0),
+      current_record{0, 0, 0, 0.0, 0},
+      next_record{0, 0, 0, 0.0, 0},
+      has_next_record(false),
+      consumer_discontinuity(false),
+      block_frames(block_frames),
+      block_callback(std::move(block_callback)),
+      should_exit(false) {
+  if (threaded && (block_frames == 0)) {
+    throw invalid_argument("block size must be nonzero");
+  }
+  if (!threaded && this->block_callback) {
+    throw invalid_argument("block callbacks require threaded mode");
+  }
+  this->reset_fit(0, 0);
+
+  ScopedContext cg(this->context.get());
+  this->device = AL_CALL(alcCaptureOpenDevice, device_name, sample_rate, format, buffer_size);
   al_check_error();
-  alcCaptureStart(this->device);
+  AL_CALL(alcCaptureStart, this->device);
   al_check_error();
+
+  if (threaded) {
+    size_t bpf = bytes_per_frame(this->format);
+    size_t ring_frames = max<size_t>(this->buffer_size, this->block_frames * 4);
+    this->ring = make_unique<SPSCRingBuffer>(ring_frames * bpf);
+    // There's one record per drain, and each drain usually covers at least
+    // one capture period. If the record ring fills up anyway, frames are
+    // dropped as if the data ring were full.
+    size_t max_records = (ring_frames / max<size_t>(this->capture_period_frames(), 1)) * 2 + 16;
+    this->record_ring = make_unique<SPSCRingBuffer>(max_records * sizeof(RingRecord));
+    this->device_data.resize(this->buffer_size * bpf);
+    if (this->block_callback) {
+      this->block_data.resize(this->block_frames * bpf);
+    }
+    this->capture_thread = thread(&AudioCapture::capture_thread_fn, this);
+  }
 }
 
 AudioCapture::~AudioCapture() {
-  alcCaptureStop(this->device);
+  ScopedContext cg(this->context.get());
+  if (this->capture_thread.joinable()) {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->should_exit = true;
+    }
+    this->capture_cv.notify_all();
+    this->capture_thread.join();
+  }
+  AL_CALL(alcCaptureStop, this->device);
+  al_check_error_nothrow();
+  AL_CALL(alcCaptureCloseDevice, this->device);
+  al_check_error_nothrow();
+}
+
+size_t AudioCapture::get_samples(void* buffer, size_t sample_count, bool wait, BlockInfo* info) {
+  return this->get_frames(buffer, sample_count / (1 + is_stereo(this->format)), wait, info);
+}
+
+size_t AudioCapture::get_frames(void* buffer, size_t frame_count, bool wait, BlockInfo* info) {
+  if (this->block_callback) {
+    throw logic_error("cannot read frames from a capture with a block callback");
+  }
+
+  // Only the first nonempty read fills in info; later reads can only add a
+  // discontinuity
+  BlockInfo later_info;
+  bool info_filled = false;
+  auto next_info = [&]() -> BlockInfo* {
+    return (!info || !info_filled) ? info : &later_info;
+  };
+  auto after_read = [&](size_t frames_read) -> void {
+    if (info && frames_read) {
+      if (info_filled) {
+        info->discontinuity |= later_info.discontinuity;
+      }
+      info_filled = true;
+    }
+  };
+
+  size_t bpf = bytes_per_frame(this->format);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(buffer);
+  size_t frames_remaining = frame_count;
+
+  if (this->ring) {
+    for (;;) {
+      size_t frames_read = this->read_ring(dest, frames_remaining, next_info());
+      after_read(frames_read);
+      dest += frames_read * bpf;
+      frames_remaining -= frames_read;
+      if (!wait || !frames_remaining) {
+        break;
+      }
+
+      // Wait until the rest of the request is available, or until the ring is
+      // half full if the request is larger than that
+      size_t bytes_needed = min(frames_remaining * bpf, this->ring->capacity() / 2);
+      uint64_t wait_start_time = monotonic_now_ns();
+      unique_lock<mutex> g(this->lock);
+      this->client_cv.wait(g, [&]() -> bool {
+        return this->should_exit || (this->ring->size() >= bytes_needed);
+      });
+      this->consumer_wait_ns += monotonic_now_ns() - wait_start_time;
+      if (this->should_exit) {
+        break;
+      }
+    }
+    return frame_count - frames_remaining;
+  }
+
+  ScopedContext cg(this->context.get());
+  for (;;) {
+    size_t frames_read = this->read_device(dest, frames_remaining, next_info());
+    after_read(frames_read);
+    dest += frames_read * bpf;
+    frames_remaining -= frames_read;
+    if (!wait || !frames_remaining) {
+      break;
+    }
+    uint64_t wait_start_time = monotonic_now_ns();
+    usleep(1000); // Don't busy-wait; yield for at least 1ms (usually 10+ ms)
+    this->consumer_wait_ns += monotonic_now_ns() - wait_start_time;
+  }
+  return frame_count - frames_remaining;
+}
+
+size_t AudioCapture::available_frames() const {
+  if (!this->ring) {
+    throw logic_error("available_frames requires threaded mode");
+  }
+  return this->ring->size() / bytes_per_frame(this->format);
+}
+
+size_t AudioCapture::wait_for_frames(size_t frame_count) {
+  if (!this->ring) {
+    throw logic_error("wait_for_frames requires threaded mode");
+  }
+  size_t bpf = bytes_per_frame(this->format);
+  size_t bytes_needed = min(frame_count * bpf, this->ring->capacity() - (this->ring->capacity() % bpf));
+  uint64_t wait_start_time = monotonic_now_ns();
+  unique_lock<mutex> g(this->lock);
+  this->client_cv.wait(g, [&]() -> bool {
+    return this->should_exit || (this->ring->size() >= bytes_needed);
+  });
+  this->consumer_wait_ns += monotonic_now_ns() - wait_start_time;
+  return this->ring->size() / bpf;
+}
+
+bool AudioCapture::is_threaded() const {
+  return this->ring.get() != nullptr;
+}
+
+AudioCapture::Stats AudioCapture::get_stats() const {
+  Stats ret;
+  ret.frames_captured = this->frames_captured.load();
+  ret.overrun_count = this->overrun_count.load();
+  ret.dropped_frames = this->dropped_frames.load();
+  ret.ring_overrun_count = this->ring_overrun_count.load();
+  ret.ring_dropped_frames = this->ring_dropped_frames.load();
+  ret.measured_sample_rate = this->measured_sample_rate.load();
+  ret.drift_ppm = (ret.measured_sample_rate > 0.0)
+      ? ((ret.measured_sample_rate / this->sample_rate) - 1.0) * 1000000.0
+      : 0.0;
+  ret.consumer_wait_ms = static_cast<double>(this->consumer_wait_ns.load()) / 1000000.0;
+  return ret;
+}
+
+size_t AudioCapture::capture_period_frames() const {
+  // Wake up often enough that the device buffer is never more than a quarter
+  // full, and at least once per block so callbacks aren't delayed
+  return max<size_t>(min(this->block_frames, this->buffer_size / 4), 1);
+}
+
+double AudioCapture::current_sample_rate() const {
+  if (this->fit_slope > 0.0) {
+    return this->fit_slope;
+  }
+  double measured = this->measured_sample_rate.load();
+  return (measured > 0.0) ? measured : this->sample_rate;
+}
+
+size_t AudioCapture::read_device(void* buffer, size_t max_frames, BlockInfo* info) {
+  int frames_available_int = 0;
+  AL_CALL(alcGetIntegerv, this->device, ALC_CAPTURE_SAMPLES, sizeof(ALint), &frames_available_int);
   al_check_error();
-  alcCaptureCloseDevice(this->device);
+  uint64_t now = monotonic_now_ns();
+  size_t frames_available = max(frames_available_int, 0);
+
+  // When the device's buffer is full, it discards newly-captured frames, so
+  // there's a gap after the frames it currently holds. We can't tell exactly
+  // how many frames were lost, so estimate it from the time since the last
+  // read.
+  if (this->last_read_time_ns && (frames_available >= this->buffer_size)) {
+    double expected = this->frames_left_in_device +
+        (static_cast<double>(now - this->last_read_time_ns) * this->current_sample_rate()) / 1000000000.0;
+    uint64_t dropped = (expected > frames_available) ? llround(expected - frames_available) : 0;
+    this->overrun_count++;
+    this->dropped_frames += dropped;
+    if (!this->pending_gap_frames) {
+      this->pending_gap_frame = this->next_device_frame + frames_available;
+    }
+    this->pending_gap_frames += dropped;
+    // The frames in the device are no longer evenly spaced in time, so the
+    // fit has to start over
+    this->reset_fit(now, this->next_device_frame + frames_available + this->pending_gap_frames);
+  } else {
+    this->add_fit_point(now, this->next_device_frame + frames_available + this->pending_gap_frames);
+  }
+  this->last_read_time_ns = now;
+
+  // Don't read across a gap, so the frames returned are always contiguous
+  size_t frames_to_read = min(max_frames, frames_available);
+  if (this->pending_gap_frames) {
+    frames_to_read = min<uint64_t>(frames_to_read, this->pending_gap_frame - this->next_device_frame);
+  }
+  this->frames_left_in_device = frames_available - frames_to_read;
+  if (frames_to_read == 0) {
+    return 0;
+  }
+
+  AL_CALL(alcCaptureSamples, this->device, buffer, frames_to_read);
   al_check_error();
+  this->frames_captured += frames_to_read;
+
+  if (info) {
+    uint64_t newest_frame = this->next_device_frame + frames_available + this->pending_gap_frames;
+    info->frame_index = this->next_device_frame;
+    info->timestamp_ns = this->timestamp_for_frame(this->next_device_frame, now, newest_frame);
+    info->discontinuity = this->drop_pending;
+  }
+  this->drop_pending = false;
+
+  this->next_device_frame += frames_to_read;
+  if (this->pending_gap_frames && (this->next_device_frame == this->pending_gap_frame)) {
+    this->next_device_frame += this->pending_gap_frames;
+    this->pending_gap_frames = 0;
+    this->drop_pending = true;
+  }
+  return frames_to_read;
 }
 
-size_t AudioCapture::get_samples(void* buffer, size_t sample_count, bool wait) {
-  return this->get_frames(buffer, sample_count / (1 + is_stereo(this->format)), wait);
+void AudioCapture::reset_fit(uint64_t now_ns, uint64_t device_frames) {
+  this->fit_ref_time_ns = now_ns;
+  this->fit_ref_frame = device_frames;
+  this->fit_n = 0.0;
+  this->fit_sum_x = 0.0;
+  this->fit_sum_y = 0.0;
+  this->fit_sum_xx = 0.0;
+  this->fit_sum_xy = 0.0;
+  this->fit_slope = 0.0;
+  this->fit_intercept = 0.0;
 }
 
-size_t AudioCapture::get_frames(void* buffer, size_t frame_count, bool wait) {
-  size_t frames_read = 0;
-  size_t frames_to_get;
-  do {
-    int frames_available_int = 0;
-    alcGetIntegerv(this->device, ALC_CAPTURE_SAMPLES, sizeof(ALint), &frames_available_int);
-    size_t frames_available = static_cast<size_t>(frames_available_int);
+void AudioCapture::add_fit_point(uint64_t now_ns, uint64_t device_frames) {
+  if (this->fit_n == 0.0) {
+    this->reset_fit(now_ns, device_frames);
+  }
+  // x is in seconds and y is in frames, both relative to the first point, so
+  // the sums stay small enough to be precise
+  double x = static_cast<double>(now_ns - this->fit_ref_time_ns) / 1000000000.0;
+  double y = static_cast<double>(device_frames - this->fit_ref_frame);
+  this->fit_n += 1.0;
+  this->fit_sum_x += x;
+  this->fit_sum_y += y;
+  this->fit_sum_xx += x * x;
+  this->fit_sum_xy += x * y;
+  if (x < MIN_FIT_SECONDS) {
+    return;
+  }
 
-    frames_to_get = (frame_count > frames_available) ? frames_available : frame_count;
-    al_check_error();
-    alcCaptureSamples(this->device, buffer, frames_to_get);
-    frames_read += frames_to_get;
-    frame_count -= frames_to_get;
-    al_check_error();
+  double denominator = this->fit_n * this->fit_sum_xx - this->fit_sum_x * this->fit_sum_x;
+  if (denominator > 0.0) {
+    this->fit_slope = (this->fit_n * this->fit_sum_xy - this->fit_sum_x * this->fit_sum_y) / denominator;
+    this->fit_intercept = (this->fit_sum_y - this->fit_slope * this->fit_sum_x) / this->fit_n;
+    this->measured_sample_rate = this->fit_slope;
+  }
+}
+
+uint64_t AudioCapture::timestamp_for_frame(uint64_t frame, uint64_t now_ns, uint64_t newest_frame) const {
+  // Use the fitted line if there is one, since individual reads are subject
+  // to the device's update period; otherwise, assume the newest frame in the
+  // device was captured just now
+  double offset_seconds;
+  int64_t ref_ns;
+  if (this->fit_slope > 0.0) {
+    double y = static_cast<double>(static_cast<int64_t>(frame - this->fit_ref_frame));
+    offset_seconds = (y - this->fit_intercept) / this->fit_slope;
+    ref_ns = this->fit_ref_time_ns;
+  } else {
+    offset_seconds = -static_cast<double>(newest_frame - frame) / this->current_sample_rate();
+    ref_ns = now_ns;
+  }
+  return ref_ns + llround(offset_seconds * 1000000000.0);
+}
 
-    if (wait && (frames_to_get < frame_count)) {
-      size_t bytes_read = bytes_per_frame(this->format) * frames_to_get;
-      buffer = reinterpret_cast<char*>(buffer) + bytes_read;
+void AudioCapture::drain_device() {
+  BlockInfo info;
+  size_t frames = this->read_device(this->device_data.data(), this->buffer_size, &info);
+  if (frames == 0) {
+    return;
+  }
 
-      usleep(1000); // Don't busy-wait; yield for at least 1ms (usually 10+ ms)
+  // If the consumer has stalled and the ring is full, the newest frames are
+  // dropped. The device must still be drained so it doesn't overflow.
+  size_t bpf = bytes_per_frame(this->format);
+  size_t ring_frames = min(frames, this->ring->space() / bpf);
+  if (this->record_ring->space() < sizeof(RingRecord)) {
+    ring_frames = 0;
+  }
+  if (ring_frames < frames) {
+    this->ring_overrun_count++;
+    this->ring_dropped_frames += frames - ring_frames;
+  }
+
+  if (ring_frames) {
+    // The record must be visible before the frames it describes
+    RingRecord record;
+    record.ring_frame = this->ring_frames_written;
+    record.device_frame = info.frame_index;
+    record.timestamp_ns = info.timestamp_ns;
+    record.sample_rate = this->current_sample_rate();
+    record.discontinuity = info.discontinuity;
+    this->record_ring->write(&record, sizeof(record));
+    this->ring->write(this->device_data.data(), ring_frames * bpf);
+    this->ring_frames_written += ring_frames;
+  } else if (info.discontinuity) {
+    this->drop_pending = true;
+  }
+  if (ring_frames < frames) {
+    this->drop_pending = true;
+  }
+}
+
+bool AudioCapture::peek_ring_record() {
+  if (!this->has_next_record && (this->record_ring->size() >= sizeof(RingRecord))) {
+    this->record_ring->read(&this->next_record, sizeof(RingRecord));
+    this->has_next_record = true;
+  }
+  return this->has_next_record;
+}
+
+size_t AudioCapture::read_ring(void* buffer, size_t max_frames, BlockInfo* info) {
+  size_t bpf = bytes_per_frame(this->format);
+  size_t frames = this->ring->read(buffer, max_frames * bpf) / bpf;
+  if (frames == 0) {
+    return 0;
+  }
+
+  // Find the record covering the first frame, then move through any records
+  // within the block to pick up discontinuities. The records are always
+  // advanced, even if the caller doesn't want the info.
+  uint64_t start = this->ring_frames_read;
+  uint64_t end = start + frames;
+  while (this->peek_ring_record() && (this->next_record.ring_frame <= start)) {
+    this->current_record = this->next_record;
+    this->has_next_record = false;
+    this->consumer_discontinuity |= this->current_record.discontinuity;
+  }
+  if (info) {
+    uint64_t offset = start - this->current_record.ring_frame;
+    info->frame_index = this->current_record.device_frame + offset;
+    info->timestamp_ns = this->current_record.timestamp_ns +
+        llround((static_cast<double>(offset) * 1000000000.0) / this->current_record.sample_rate);
+  }
+  while (this->peek_ring_record() && (this->next_record.ring_frame < end)) {
+    this->current_record = this->next_record;
+    this->has_next_record = false;
+    this->consumer_discontinuity |= this->current_record.discontinuity;
+  }
+  if (info) {
+    info->discontinuity = this->consumer_discontinuity;
+    this->consumer_discontinuity = false;
+  }
+
+  this->ring_frames_read = end;
+  return frames;
+}
+
+void AudioCapture::capture_thread_fn() {
+  ScopedContext cg(this->context.get());
+  ScopedALErrorsNoThrow eg;
+  auto period = chrono::duration_cast<chrono::steady_clock::duration>(
+      chrono::duration<double>(static_cast<double>(this->capture_period_frames()) / this->sample_rate));
+  period = max<chrono::steady_clock::duration>(period, chrono::milliseconds(1));
+
+  // Sleep until a fixed schedule rather than for a fixed time, so the time
+  // spent draining and in callbacks doesn't make the cadence drift
+  auto next_wake = chrono::steady_clock::now();
+  unique_lock<mutex> g(this->lock);
+  while (!this->should_exit) {
+    g.unlock();
+    this->drain_device();
+    if (this->block_callback) {
+      BlockInfo info;
+      while (this->ring->size() >= this->block_data.size()) {
+        this->read_ring(this->block_data.data(), this->block_frames, &info);
+        this->block_callback(this->block_data.data(), this->block_frames, info);
+      }
     }
-  } while (wait && frame_count);
-  return frames_read;
+    g.lock();
+    this->client_cv.notify_all();
+
+    auto now = chrono::steady_clock::now();
+    next_wake += period;
+    if (next_wake < now) {
+      next_wake = now; // We fell behind; don't try to catch up with a burst
+    }
+    this->capture_cv.wait_until(g, next_wake, [&]() -> bool { return this->should_exit; });
+  }
+
+  // Let any blocked readers return
+  this->client_cv.notify_all();
 }
 
 } // namespace phosg_audio
@@ -1,24 +1,186 @@
 #pragma once
 
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "Constants.hh"
+#include "Device.hh"
+#include "RingBuffer.hh"
 
 namespace phosg_audio {
 
 class AudioCapture {
 public:
-  AudioCapture(const char* device_name, int sample_rate, int format, int buffer_size);
+  // Describes the first frame of a block of captured frames
+  struct BlockInfo {
+    // Index of the frame since the device was opened. Frames lost to overruns
+    // are counted, so this advances at the device's sample rate even when
+    // frames are dropped.
+    uint64_t frame_index;
+    // Estimated time (on the monotonic_now_ns() clock) at which the frame was
+    // captured by the device
+    uint64_t timestamp_ns;
+    // True if frames were dropped immediately before or within this block,
+    // so the block's frames are not contiguous with the previous block's
+    bool discontinuity;
+  };
+
+  using BlockCallback = std::function<void(const void* data, size_t frame_count, const BlockInfo& info)>;
+
+  // If threaded is true, a background thread drains the device at a steady
+  // cadence (at least once per block, and often enough that the device buffer
+  // never gets more than a quarter full) into a lock-free ring that holds at
+  // least buffer_size frames. Consumers then read from the ring, and reads
+  // with wait = true block on a condition variable instead of polling.
+  // If block_callback is given, it is called on the capture thread with each
+  // block of exactly block_frames frames, and get_samples/get_frames may not
+  // be used. block_frames and block_callback are ignored if threaded is false.
+  // Capture devices don't have contexts, but AL error checking needs one; if
+  // context is given (or the calling thread has a ScopedContext), the capture
+  // makes it current around its AL calls, including on its own thread.
+  AudioCapture(const char* device_name, int sample_rate, int format, int buffer_size,
+      bool threaded = false, size_t block_frames = 1024, BlockCallback block_callback = nullptr,
+      std::shared_ptr<AudioContext> context = nullptr);
   ~AudioCapture();
 
+  AudioCapture(const AudioCapture&) = delete;
+  AudioCapture(AudioCapture&&) = delete;
+  AudioCapture& operator=(const AudioCapture&) = delete;
+  AudioCapture& operator=(AudioCapture&&) = delete;
+
   // Gets up to frame_count frames from the buffer, returning the number of
   // frames actually read. If wait is true, this function does not return until
   // the requested number of frames has actually been read from the audio
-  // device, even if it has to wait for more frames to be recorded.
-  size_t get_samples(void* buffer, size_t sample_count, bool wait = false);
-  size_t get_frames(void* buffer, size_t frame_count, bool wait = false);
+  // device, even if it has to wait for more frames to be recorded. If info is
+  // given and any frames were read, it's filled in for the first frame read.
+  size_t get_samples(void* buffer, size_t sample_count, bool wait = false, BlockInfo* info = nullptr);
+  size_t get_frames(void* buffer, size_t frame_count, bool wait = false, BlockInfo* info = nullptr);
+
+  // Threaded mode only. Returns the number of frames that can be read without
+  // blocking. wait_for_frames blocks until at least frame_count frames are
+  // available (or the ring is full, if it can't hold that many), then returns
+  // the number available.
+  size_t available_frames() const;
+  size_t wait_for_frames(size_t frame_count);
+
+  bool is_threaded() const;
+
+  // Everything here is read from atomic counters, so this can be called from
+  // any thread without blocking the capture.
+  struct Stats {
+    uint64_t frames_captured; // Frames read from the device
+    // Times the device buffer was found full, and the estimated number of
+    // frames the device discarded as a result
+    uint64_t overrun_count;
+    uint64_t dropped_frames;
+    // Threaded mode only: times the ring was too full to accept all the frames
+    // read from the device (because the consumer stalled), and the number of
+    // frames discarded as a result
+    uint64_t ring_overrun_count;
+    uint64_t ring_dropped_frames;
+    // Device clock rate relative to the system's monotonic clock, from a
+    // least-squares fit of frames captured over time. Positive values mean the
+    // device is running fast. These are 0 until at least 5 seconds of
+    // uninterrupted capture have been observed. The fit restarts after each
+    // overrun, but the previous estimate is reported until the new fit has
+    // enough data.
+    double measured_sample_rate;
+    double drift_ppm;
+    // Total time get_frames, get_samples and wait_for_frames have spent
+    // blocked waiting for frames to be captured
+    double consumer_wait_ms;
+  };
+  Stats get_stats() const;
 
 private:
+  // Ring records map positions in the ring to device frame indexes and times.
+  // The capture thread writes one before each chunk of frames it writes to
+  // the ring.
+  struct RingRecord {
+    uint64_t ring_frame;
+    uint64_t device_frame;
+    uint64_t timestamp_ns;
+    double sample_rate;
+    uint64_t discontinuity;
+  };
+
+  size_t capture_period_frames() const;
+  double current_sample_rate() const;
+  size_t read_device(void* buffer, size_t max_frames, BlockInfo* info);
+  void add_fit_point(uint64_t now_ns, uint64_t device_frames);
+  void reset_fit(uint64_t now_ns, uint64_t device_frames);
+  uint64_t timestamp_for_frame(uint64_t frame, uint64_t now_ns, uint64_t newest_frame) const;
+  void drain_device();
+  size_t read_ring(void* buffer, size_t max_frames, BlockInfo* info);
+  bool peek_ring_record();
+  void capture_thread_fn();
+
   ALCdevice* device;
+  std::shared_ptr<AudioContext> context;
+  int sample_rate;
   int format;
+  size_t buffer_size;
+
+  // Device clock tracking. These are only used by the thread that reads from
+  // the device (the capture thread in threaded mode, or the caller of
+  // get_frames otherwise). next_device_frame counts dropped frames.
+  uint64_t next_device_frame;
+  uint64_t last_read_time_ns; // 0 = nothing read yet
+  size_t frames_left_in_device;
+  bool drop_pending; // Frames were lost before the next frame to be returned
+  // Frames lost to an overrun that haven't been skipped over yet; the gap
+  // starts at pending_gap_frame
+  uint64_t pending_gap_frame;
+  uint64_t pending_gap_frames;
+  // Least-squares fit of device frames (including dropped frames) against
+  // time. The slope is the device's actual sample rate.
+  uint64_t fit_ref_time_ns;
+  uint64_t fit_ref_frame;
+  double fit_n;
+  double fit_sum_x;
+  double fit_sum_y;
+  double fit_sum_xx;
+  double fit_sum_xy;
+  double fit_slope; // 0 if not enough data yet
+  double fit_intercept;
+
+  // Instrumentation; see get_stats()
+  std::atomic<uint64_t> frames_captured;
+  std::atomic<uint64_t> overrun_count;
+  std::atomic<uint64_t> dropped_frames;
+  std::atomic<uint64_t> ring_overrun_count;
+  std::atomic<uint64_t> ring_dropped_frames;
+  std::atomic<double> measured_sample_rate;
+  std::atomic<uint64_t> consumer_wait_ns;
+
+  // Threaded mode only. The capture thread is the rings' only producer; the
+  // consumer is either the caller of get_frames or, if there's a callback, the
+  // capture thread itself. lock only protects should_exit and is used to wait
+  // on the condition variables; the data never passes through it.
+  std::unique_ptr<SPSCRingBuffer> ring;
+  std::unique_ptr<SPSCRingBuffer> record_ring;
+  uint64_t ring_frames_written; // Producer side
+  uint64_t ring_frames_read; // Consumer side
+  RingRecord current_record; // Consumer side
+  RingRecord next_record; // Consumer side; valid if has_next_record
+  bool has_next_record;
+  bool consumer_discontinuity;
+  size_t block_frames;
+  BlockCallback block_callback;
+  std::vector<uint8_t> device_data; // Scratch space for the capture thread
+  std::vector<uint8_t> block_data; // Scratch space for the capture thread
+  mutable std::mutex lock;
+  std::condition_variable capture_cv;
+  std::condition_variable client_cv;
+  bool should_exit;
+  std::thread capture_thread;
 };
 
 } // namespace phosg_audio
@@ -5,17 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <format>
 #include <stdexcept>
 
 using namespace std;
 
 namespace phosg_audio {
 
-static int mono_float32_format = 0;
-static int stereo_float32_format = 0;
-
 set<string> list_audio_device_names() {
-  const char* devices = alcGetString(NULL, ALC_DEVICE_SPECIFIER);
+  const char* devices = AL_CALL(alcGetString, nullptr, ALC_DEVICE_SPECIFIER);
 
   set<string> ret;
   while (*devices) {
@@ -26,31 +24,28 @@ set<string> list_audio_device_names() {
 }
 
 std::string get_current_audio_device_name() {
-  ALCcontext* ctx = alcGetCurrentContext();
-  ALCdevice* dev = alcGetContextsDevice(ctx);
-  return alcGetString(dev, ALC_DEVICE_SPECIFIER);
+  ALCcontext* ctx = AL_CALL(alcGetCurrentContext);
+  ALCdevice* dev = AL_CALL(alcGetContextsDevice, ctx);
+  return AL_CALL(alcGetString, dev, ALC_DEVICE_SPECIFIER);
 }
 
 void init_al(const char* device_name) {
   if (device_name == NULL) {
-    device_name = alcGetString(NULL, ALC_DEFAULT_DEVICE_SPECIFIER);
+    device_name = AL_CALL(alcGetString, nullptr, ALC_DEFAULT_DEVICE_SPECIFIER);
   }
 
-  ALCdevice* dev = alcOpenDevice(device_name);
-  ALCcontext* ctx = alcCreateContext(dev, NULL);
-  alcMakeContextCurrent(ctx);
-
-  mono_float32_format = alGetEnumValue("AL_FORMAT_MONO_FLOAT32");
-  stereo_float32_format = alGetEnumValue("AL_FORMAT_STEREO_FLOAT32");
+  ALCdevice* dev = AL_CALL(alcOpenDevice, device_name);
+  ALCcontext* ctx = AL_CALL(alcCreateContext, dev, nullptr);
+  AL_CALL(alcMakeContextCurrent, ctx);
 }
 
 void exit_al() {
-  ALCcontext* ctx = alcGetCurrentContext();
-  ALCdevice* dev = alcGetContextsDevice(ctx);
+  ALCcontext* ctx = AL_CALL(alcGetCurrentContext);
+  ALCdevice* dev = AL_CALL(alcGetContextsDevice, ctx);
 
-  alcMakeContextCurrent(NULL);
-  alcDestroyContext(ctx);
-  alcCloseDevice(dev);
+  AL_CALL(alcMakeContextCurrent, nullptr);
+  AL_CALL(alcDestroyContext, ctx);
+  AL_CALL(alcCloseDevice, dev);
 }
 
 const char* al_err_str(ALenum err) {
@@ -71,33 +66,35 @@ const char* al_err_str(ALenum err) {
   return "UNKNOWN_ERROR";
 }
 
-bool is_16bit(int format) {
-  return (format == AL_FORMAT_MONO16) || (format == AL_FORMAT_STEREO16);
-}
+al_error::al_error(ALenum code, const char* file, int line)
+    : runtime_error(std::format("AL error {} at {}:{}", al_err_str(code), file, line)),
+      code(code) {}
 
-bool is_32bit(int format) {
-  return (format == mono_float32_format) || (format == stereo_float32_format);
+void print_al_error(ALenum err, const char* file, int line) {
+  record_al_trace_error();
+  fprintf(stderr, "AL error %s at %s:%d\n", al_err_str(err), file, line);
 }
 
-bool is_stereo(int format) {
-  return (format == AL_FORMAT_STEREO8) || (format == AL_FORMAT_STEREO16) || (format == stereo_float32_format);
+static thread_local bool al_errors_nothrow = false;
+
+ScopedALErrorsNoThrow::ScopedALErrorsNoThrow() : prev_nothrow(al_errors_nothrow) {
+  al_errors_nothrow = true;
 }
 
-size_t bytes_per_sample(int format) {
-  return is_32bit(format) ? 4 : (1 << is_16bit(format));
+ScopedALErrorsNoThrow::~ScopedALErrorsNoThrow() {
+  al_errors_nothrow = this->prev_nothrow;
 }
 
-size_t bytes_per_frame(int format) {
-  return bytes_per_sample(format) << is_stereo(format);
+void raise_al_error(ALenum err, const char* file, int line) {
+  if (al_errors_nothrow) {
+    print_al_error(err, file, line);
+  } else {
+    record_al_trace_error();
+    throw al_error(err, file, line);
+  }
 }
 
 const char* name_for_format(int format) {
-  if (format == mono_float32_format) {
-    return "mono-f32";
-  }
-  if (format == stereo_float32_format) {
-    return "stereo-f32";
-  }
   switch (format) {
     case AL_FORMAT_MONO8:
       return "mono-i8";
@@ -107,6 +104,10 @@ const char* name_for_format(int format) {
       return "stereo-i8";
     case AL_FORMAT_STEREO16:
       return "stereo-i16";
+    case AL_FORMAT_MONO_FLOAT32:
+      return "mono-f32";
+    case AL_FORMAT_STEREO_FLOAT32:
+      return "stereo-f32";
     default:
       return "unknown";
   }
@@ -114,9 +115,9 @@ const char* name_for_format(int format) {
 
 int format_for_name(const char* format) {
   if (!strcmp(format, "mono-f32")) {
-    return mono_float32_format;
+    return AL_FORMAT_MONO_FLOAT32;
   } else if (!strcmp(format, "stereo-f32")) {
-    return stereo_float32_format;
+    return AL_FORMAT_STEREO_FLOAT32;
   } else if (!strcmp(format, "mono-i8")) {
     return AL_FORMAT_MONO8;
   } else if (!strcmp(format, "stereo-i8")) {
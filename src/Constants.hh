@@ -8,34 +8,123 @@
 #include <sys/types.h>
 
 #include <set>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "Format.hh"
+#include "Trace.hh"
+
 namespace phosg_audio {
 
 std::set<std::string> list_audio_device_names();
 std::string get_current_audio_device_name();
 
+// These open one device and make a context on it current for the whole
+// process. To use multiple devices, use AudioDevice and AudioContext (in
+// Device.hh) instead.
 void init_al(const char* device_name = NULL);
 void exit_al();
 
 const char* al_err_str(ALenum err);
 
-#define __al_check_error(file, line)                                          \
+// AL error checking is selected at build time by PHOSG_AUDIO_AL_ERROR_MODE
+// (set by the PHOSG_AUDIO_AL_ERROR_CHECKING CMake option, and propagated to
+// everything that links against the library). In OFF mode the
+// checks compile to nothing and errors are not even retrieved; in CHECK mode
+// (the default) errors are printed to stderr; in THROW mode the first error
+// throws al_error. al_check_error_nothrow prints instead of throwing in THROW
+// mode, for use in destructors.
+#define PHOSG_AUDIO_AL_ERRORS_OFF 0
+#define PHOSG_AUDIO_AL_ERRORS_CHECK 1
+#define PHOSG_AUDIO_AL_ERRORS_THROW 2
+#ifndef PHOSG_AUDIO_AL_ERROR_MODE
+#define PHOSG_AUDIO_AL_ERROR_MODE PHOSG_AUDIO_AL_ERRORS_CHECK
+#endif
+
+class al_error : public std::runtime_error {
+public:
+  al_error(ALenum code, const char* file, int line);
+  ALenum code;
+};
+
+// While one of these exists, al_check_error on the same thread prints errors
+// instead of throwing them. Background threads (stream feeders and capture
+// threads) hold one, since they have no caller to report errors to.
+class ScopedALErrorsNoThrow {
+public:
+  ScopedALErrorsNoThrow();
+  ScopedALErrorsNoThrow(const ScopedALErrorsNoThrow&) = delete;
+  ScopedALErrorsNoThrow(ScopedALErrorsNoThrow&&) = delete;
+  ScopedALErrorsNoThrow& operator=(const ScopedALErrorsNoThrow&) = delete;
+  ScopedALErrorsNoThrow& operator=(ScopedALErrorsNoThrow&&) = delete;
+  ~ScopedALErrorsNoThrow();
+
+private:
+  bool prev_nothrow;
+};
+
+void print_al_error(ALenum err, const char* file, int line);
+// Throws al_error, or prints the error if a ScopedALErrorsNoThrow is active
+void raise_al_error(ALenum err, const char* file, int line);
+
+#if PHOSG_AUDIO_AL_ERROR_MODE == PHOSG_AUDIO_AL_ERRORS_OFF
+
+#define __al_check_error(file, line) \
+  do {                               \
+  } while (0)
+#define __al_check_error_nothrow(file, line) \
+  do {                                       \
+  } while (0)
+
+#else
+
+#define __al_check_error_nothrow(file, line)                                  \
   do {                                                                        \
     for (ALenum err = alGetError(); err != AL_NO_ERROR; err = alGetError()) { \
-      fprintf(stderr, "AL error %s at %s:%d\n", al_err_str(err), file, line); \
+      phosg_audio::print_al_error(err, file, line);                           \
     }                                                                         \
   } while (0)
 
+#if PHOSG_AUDIO_AL_ERROR_MODE == PHOSG_AUDIO_AL_ERRORS_THROW
+// AL only stores the first error since the last alGetError call, so there is
+// never more than one error to report here
+#define __al_check_error(file, line)                \
+  do {                                              \
+    ALenum err = alGetError();                      \
+    if (err != AL_NO_ERROR) {                       \
+      phosg_audio::raise_al_error(err, file, line); \
+    }                                               \
+  } while (0)
+#else
+#define __al_check_error(file, line) __al_check_error_nothrow(file, line)
+#endif
+
+#endif
+
 #define al_check_error() \
   __al_check_error(__FILE__, __LINE__)
+#define al_check_error_nothrow() \
+  __al_check_error_nothrow(__FILE__, __LINE__)
 
-bool is_16bit(int format);
-bool is_32bit(int format);
-bool is_stereo(int format);
-size_t bytes_per_sample(int format);
-size_t bytes_per_frame(int format);
+// These take AL format enums and return false or 0 for unknown formats. Code
+// that handles each format differently should use dispatch_al_format (in
+// Format.hh) instead of branching on these per sample.
+constexpr bool is_16bit(int format) {
+  return (format == AL_FORMAT_MONO16) || (format == AL_FORMAT_STEREO16);
+}
+constexpr bool is_32bit(int format) {
+  return (format == AL_FORMAT_MONO_FLOAT32) || (format == AL_FORMAT_STEREO_FLOAT32);
+}
+constexpr bool is_stereo(int format) {
+  return (format == AL_FORMAT_STEREO8) || (format == AL_FORMAT_STEREO16) || (format == AL_FORMAT_STEREO_FLOAT32);
+}
+constexpr size_t bytes_per_sample(int format) {
+  return is_32bit(format) ? 4 : (1 << is_16bit(format));
+}
+constexpr size_t bytes_per_frame(int format) {
+  return bytes_per_sample(format) << is_stereo(format);
+}
 
 const char* name_for_format(int format);
 int format_for_name(const char* format);
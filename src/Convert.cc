@@ -1,4 +1,4 @@
-#include "Constants.hh"
+#include "Convert.hh"
 
 #include <errno.h>
 #include <phosg/Encoding.hh>
@@ -7,6 +7,9 @@
 
 #include <stdexcept>
 
+#include "Constants.hh"
+#include "Format.hh"
+
 using namespace std;
 
 namespace phosg_audio {
@@ -34,25 +37,24 @@ void byteswap_samples32(void* buffer, size_t sample_count, bool stereo) {
 }
 
 void byteswap_samples(void* buffer, size_t sample_count, int format) {
-  if (is_16bit(format)) {
-    byteswap_samples16(buffer, sample_count, is_stereo(format));
-  } else if (is_32bit(format)) {
-    byteswap_samples32(buffer, sample_count, is_stereo(format));
-  }
+  dispatch_al_format(format, [&]<SampleFormat Format>(FormatTag<Format>) {
+    byteswap_frames<Format>(buffer, sample_count);
+  });
 }
 
-// Conversion from f32
-
-static inline int16_t convert_sample_f32_to_s16(float sample) {
-  if (sample >= 1.0f) {
-    return 0x7FFF;
-  } else if (sample <= -1.0f) {
-    return -0x8000;
-  } else {
-    return static_cast<int16_t>(sample * 32767.0f);
-  }
+void convert_frames(void* out, int out_format, const void* in, int in_format, size_t frame_count) {
+  dispatch_al_format(in_format, [&]<SampleFormat InFormat>(FormatTag<InFormat>) {
+    dispatch_al_format(out_format, [&]<SampleFormat OutFormat>(FormatTag<OutFormat>) {
+      convert_frames<InFormat, OutFormat>(out, in, frame_count);
+    });
+  });
 }
 
+// Conversions for the sample types AL doesn't support. The AL types'
+// conversions are in SampleTypeTraits (in Format.hh).
+
+// Conversion from f32
+
 static inline uint16_t convert_sample_f32_to_u16(float sample) {
   if (sample >= 1.0f) {
     return 0xFFFF;
@@ -73,26 +75,8 @@ static inline int8_t convert_sample_f32_to_s8(float sample) {
   }
 }
 
-static inline uint8_t convert_sample_f32_to_u8(float sample) {
-  if (sample >= 1.0f) {
-    return 0xFF;
-  } else if (sample <= -1.0f) {
-    return 0;
-  } else {
-    return static_cast<int16_t>((sample + 1.0) * 127.0f);
-  }
-}
-
 // Conversion to f32
 
-static inline float convert_sample_s16_to_f32(int16_t sample) {
-  if (sample == -0x8000) {
-    return -1.0f;
-  } else {
-    return static_cast<float>(sample) / 32767.0f;
-  }
-}
-
 static inline float convert_sample_u16_to_f32(uint16_t sample) {
   return static_cast<float>(sample) / 32767.0f - 1.0;
 }
@@ -105,10 +89,6 @@ static inline float convert_sample_s8_to_f32(int8_t sample) {
   }
 }
 
-static inline float convert_sample_u8_to_f32(uint8_t sample) {
-  return static_cast<float>(sample) / 127.0f - 1.0;
-}
-
 template <typename InSampleT, typename OutSampleT, OutSampleT (*ConvertFn)(InSampleT)>
 vector<OutSampleT> convert_samples(const vector<InSampleT>& samples) {
   vector<OutSampleT> ret;
@@ -119,8 +99,15 @@ vector<OutSampleT> convert_samples(const vector<InSampleT>& samples) {
   return ret;
 }
 
+template <typename InSampleT, typename OutSampleT, OutSampleT (*ConvertFn)(InSampleT)>
+void convert_samples(OutSampleT* out, const InSampleT* in, size_t count) {
+  for (size_t x = 0; x < count; x++) {
+    out[x] = ConvertFn(in[x]);
+  }
+}
+
 vector<float> convert_samples_s16_to_f32(const vector<int16_t>& samples) {
-  return convert_samples<int16_t, float, convert_sample_s16_to_f32>(samples);
+  return convert_samples<int16_t, float, SampleTypeTraits<SampleType::S16>::to_f32>(samples);
 }
 
 vector<float> convert_samples_u16_to_f32(const vector<uint16_t>& samples) {
@@ -132,11 +119,11 @@ vector<float> convert_samples_s8_to_f32(const vector<int8_t>& samples) {
 }
 
 vector<float> convert_samples_u8_to_f32(const vector<uint8_t>& samples) {
-  return convert_samples<uint8_t, float, convert_sample_u8_to_f32>(samples);
+  return convert_samples<uint8_t, float, SampleTypeTraits<SampleType::U8>::to_f32>(samples);
 }
 
 vector<int16_t> convert_samples_f32_to_s16(const vector<float>& samples) {
-  return convert_samples<float, int16_t, convert_sample_f32_to_s16>(samples);
+  return convert_samples<float, int16_t, SampleTypeTraits<SampleType::S16>::from_f32>(samples);
 }
 
 vector<uint16_t> convert_samples_f32_to_u16(const vector<float>& samples) {
@@ -148,7 +135,15 @@ vector<int8_t> convert_samples_f32_to_s8(const vector<float>& samples) {
 }
 
 vector<uint8_t> convert_samples_f32_to_u8(const vector<float>& samples) {
-  return convert_samples<float, uint8_t, convert_sample_f32_to_u8>(samples);
+  return convert_samples<float, uint8_t, SampleTypeTraits<SampleType::U8>::from_f32>(samples);
+}
+
+void convert_samples_f32_to_s16(int16_t* out, const float* in, size_t count) {
+  convert_samples<float, int16_t, SampleTypeTraits<SampleType::S16>::from_f32>(out, in, count);
+}
+
+void convert_samples_s16_to_f32(float* out, const int16_t* in, size_t count) {
+  convert_samples<int16_t, float, SampleTypeTraits<SampleType::S16>::to_f32>(out, in, count);
 }
 
 } // namespace phosg_audio
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <vector>
@@ -8,8 +9,14 @@ namespace phosg_audio {
 
 void byteswap_samples16(void* buffer, size_t sample_count, bool stereo);
 void byteswap_samples32(void* buffer, size_t sample_count, bool stereo);
+// sample_count is the number of frames, despite the name. Throws
+// invalid_argument if format isn't a known AL format.
 void byteswap_samples(void* buffer, size_t sample_count, int format);
 
+// Converts frame_count frames between any two AL formats (see convert_frames
+// in Format.hh for how channels are mapped). out may be the same as in.
+void convert_frames(void* out, int out_format, const void* in, int in_format, size_t frame_count);
+
 std::vector<float> convert_samples_s16_to_f32(const std::vector<int16_t>& samples);
 std::vector<float> convert_samples_u16_to_f32(const std::vector<uint16_t>& samples);
 std::vector<float> convert_samples_s8_to_f32(const std::vector<int8_t>& samples);
@@ -19,4 +26,8 @@ std::vector<uint16_t> convert_samples_f32_to_u16(const std::vector<float>& sampl
 std::vector<int8_t> convert_samples_f32_to_s8(const std::vector<float>& samples);
 std::vector<uint8_t> convert_samples_f32_to_u8(const std::vector<float>& samples);
 
+// These convert count samples from in to out without allocating
+void convert_samples_f32_to_s16(int16_t* out, const float* in, size_t count);
+void convert_samples_s16_to_f32(float* out, const int16_t* in, size_t count);
+
 } // namespace phosg_audio
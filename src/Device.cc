@@ -0,0 +1,154 @@
+#include "Device.hh"
+
+#include <format>
+#include <stdexcept>
+
+using namespace std;
+
+namespace phosg_audio {
+
+#ifndef ALC_APIENTRY
+#define ALC_APIENTRY
+#endif
+
+// These are from ALC_EXT_thread_local_context. The entry points are looked up
+// at runtime so we don't depend on alext.h.
+typedef ALCboolean(ALC_APIENTRY* PFNALCSETTHREADCONTEXTPROC)(ALCcontext* context);
+typedef ALCcontext*(ALC_APIENTRY* PFNALCGETTHREADCONTEXTPROC)(void);
+
+struct ThreadContextFunctions {
+  PFNALCSETTHREADCONTEXTPROC set;
+  PFNALCGETTHREADCONTEXTPROC get;
+
+  ThreadContextFunctions() : set(nullptr), get(nullptr) {
+    if (AL_CALL(alcIsExtensionPresent, nullptr, "ALC_EXT_thread_local_context")) {
+      this->set = reinterpret_cast<PFNALCSETTHREADCONTEXTPROC>(AL_CALL(alcGetProcAddress, nullptr, "alcSetThreadContext"));
+      this->get = reinterpret_cast<PFNALCGETTHREADCONTEXTPROC>(AL_CALL(alcGetProcAddress, nullptr, "alcGetThreadContext"));
+      if (!this->set || !this->get) {
+        this->set = nullptr;
+        this->get = nullptr;
+      }
+    }
+  }
+};
+
+static const ThreadContextFunctions& thread_context_fns() {
+  static const ThreadContextFunctions fns;
+  return fns;
+}
+
+// The innermost ScopedContext's bound context on each thread
+static thread_local const shared_ptr<AudioContext>* current_bound_context = nullptr;
+
+AudioDevice::AudioDevice(const char* device_name) {
+  this->device = AL_CALL(alcOpenDevice, device_name);
+  if (!this->device) {
+    throw runtime_error(format("cannot open audio device {}", device_name ? device_name : "(default)"));
+  }
+  const char* name = AL_CALL(alcGetString, this->device, ALC_DEVICE_SPECIFIER);
+  this->device_name = name ? name : "";
+}
+
+AudioDevice::AudioDevice(ALCdevice* device, const string& name)
+    : device(device),
+      device_name(name) {}
+
+AudioDevice::~AudioDevice() {
+  AL_CALL(alcCloseDevice, this->device);
+}
+
+ALCdevice* AudioDevice::get() const {
+  return this->device;
+}
+
+const string& AudioDevice::name() const {
+  return this->device_name;
+}
+
+AudioContext::AudioContext(shared_ptr<AudioDevice> device, const ALCint* attributes)
+    : device(std::move(device)) {
+  this->context = AL_CALL(alcCreateContext, this->device->get(), attributes);
+  if (!this->context) {
+    throw runtime_error(format("cannot create context on audio device {}", this->device->name()));
+  }
+}
+
+AudioContext::~AudioContext() {
+  const auto& fns = thread_context_fns();
+  if (fns.get && (AL_CALL(fns.get) == this->context)) {
+    AL_CALL(fns.set, nullptr);
+  }
+  if (AL_CALL(alcGetCurrentContext) == this->context) {
+    AL_CALL(alcMakeContextCurrent, nullptr);
+  }
+  AL_CALL(alcDestroyContext, this->context);
+}
+
+ALCcontext* AudioContext::get() const {
+  return this->context;
+}
+
+const shared_ptr<AudioDevice>& AudioContext::get_device() const {
+  return this->device;
+}
+
+void AudioContext::make_current() {
+  AL_CALL(alcMakeContextCurrent, this->context);
+}
+
+bool AudioContext::thread_local_contexts_supported() {
+  return thread_context_fns().set != nullptr;
+}
+
+ScopedContext::ScopedContext(const shared_ptr<AudioContext>& context)
+    : ScopedContext(context.get()) {
+  if (context) {
+    this->bound_context = context;
+    current_bound_context = &this->bound_context;
+  }
+}
+
+ScopedContext::ScopedContext(AudioContext* context)
+    : context(context ? context->get() : nullptr),
+      prev_context(nullptr),
+      changed(false),
+      prev_bound_context(current_bound_context) {
+  if (!this->context) {
+    return;
+  }
+
+  // Switching contexts isn't free (implementations validate the context under
+  // a global lock), so don't do it if the context is already current
+  const auto& fns = thread_context_fns();
+  if (fns.set) {
+    this->prev_context = AL_CALL(fns.get);
+    if (this->prev_context != this->context) {
+      AL_CALL(fns.set, this->context);
+      this->changed = true;
+    }
+  } else {
+    this->prev_context = AL_CALL(alcGetCurrentContext);
+    if (this->prev_context != this->context) {
+      AL_CALL(alcMakeContextCurrent, this->context);
+      this->changed = true;
+    }
+  }
+}
+
+ScopedContext::~ScopedContext() {
+  current_bound_context = this->prev_bound_context;
+  if (this->changed) {
+    const auto& fns = thread_context_fns();
+    if (fns.set) {
+      AL_CALL(fns.set, this->prev_context);
+    } else {
+      AL_CALL(alcMakeContextCurrent, this->prev_context);
+    }
+  }
+}
+
+shared_ptr<AudioContext> ScopedContext::current() {
+  return current_bound_context ? *current_bound_context : nullptr;
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "Constants.hh"
+
+namespace phosg_audio {
+
+// An open output device. Unlike init_al, this doesn't create a context or
+// change any global state, so any number of devices can be open at once.
+class AudioDevice {
+public:
+  // device_name = NULL opens the default output device
+  explicit AudioDevice(const char* device_name = nullptr);
+  virtual ~AudioDevice();
+
+  AudioDevice(const AudioDevice&) = delete;
+  AudioDevice(AudioDevice&&) = delete;
+  AudioDevice& operator=(const AudioDevice&) = delete;
+  AudioDevice& operator=(AudioDevice&&) = delete;
+
+  ALCdevice* get() const;
+  const std::string& name() const;
+
+protected:
+  // Takes ownership of an already-open device
+  AudioDevice(ALCdevice* device, const std::string& name);
+
+  ALCdevice* device;
+  std::string device_name;
+};
+
+// A context on an AudioDevice. AudioStream, AudioCapture and Sound objects can
+// be bound to a context, in which case they make it current around each AL
+// call, so objects on different devices can be used from different threads at
+// the same time. This requires ALC_EXT_thread_local_context; without it,
+// contexts are made current process-wide instead, which is only safe if all
+// objects are used from the same thread.
+class AudioContext {
+public:
+  // attributes is passed directly to alcCreateContext (NULL = defaults)
+  explicit AudioContext(std::shared_ptr<AudioDevice> device, const ALCint* attributes = nullptr);
+  ~AudioContext();
+
+  AudioContext(const AudioContext&) = delete;
+  AudioContext(AudioContext&&) = delete;
+  AudioContext& operator=(const AudioContext&) = delete;
+  AudioContext& operator=(AudioContext&&) = delete;
+
+  ALCcontext* get() const;
+  const std::shared_ptr<AudioDevice>& get_device() const;
+
+  // Makes this context current for the entire process, like init_al does.
+  // This is only needed for code that doesn't use bound objects.
+  void make_current();
+
+  static bool thread_local_contexts_supported();
+
+private:
+  std::shared_ptr<AudioDevice> device;
+  ALCcontext* context;
+};
+
+// Makes a context current for the calling thread until this object is
+// destroyed, then restores the previously-current context. A null context
+// does nothing, so objects that aren't bound to a context can use this
+// unconditionally. While a ScopedContext is active, new AudioStream,
+// AudioCapture and Sound objects created on the same thread without an
+// explicit context are bound to its context.
+class ScopedContext {
+public:
+  explicit ScopedContext(const std::shared_ptr<AudioContext>& context);
+  explicit ScopedContext(AudioContext* context);
+  ~ScopedContext();
+
+  ScopedContext(const ScopedContext&) = delete;
+  ScopedContext(ScopedContext&&) = delete;
+  ScopedContext& operator=(const ScopedContext&) = delete;
+  ScopedContext& operator=(ScopedContext&&) = delete;
+
+  // Returns the context bound by the innermost ScopedContext constructed
+  // from a shared_ptr on the calling thread, or nullptr if there isn't one
+  static std::shared_ptr<AudioContext> current();
+
+private:
+  ALCcontext* context;
+  ALCcontext* prev_context;
+  bool changed;
+  // Only set if constructed from a shared_ptr
+  std::shared_ptr<AudioContext> bound_context;
+  const std::shared_ptr<AudioContext>* prev_bound_context;
+};
+
+} // namespace phosg_audio
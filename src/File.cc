@@ -1,6 +1,10 @@
 #include "File.hh"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <format>
 #include <phosg/Encoding.hh>
@@ -54,26 +58,185 @@ struct SaveWAVHeader {
 };
 
 void save_wav(const char* filename, const vector<uint8_t>& samples, size_t sample_rate, size_t num_channels) {
-  SaveWAVHeader header(samples.size(), num_channels, sample_rate, 8, false);
+  SaveWAVHeader header(samples.size() / num_channels, num_channels, sample_rate, 8, false);
   auto f = phosg::fopen_unique(filename, "wb");
   phosg::fwritex(f.get(), &header, sizeof(SaveWAVHeader));
   phosg::fwritex(f.get(), samples.data(), sizeof(uint8_t) * samples.size());
 }
 
 void save_wav(const char* filename, const vector<int16_t>& samples, size_t sample_rate, size_t num_channels) {
-  SaveWAVHeader header(samples.size(), num_channels, sample_rate, 16, false);
+  SaveWAVHeader header(samples.size() / num_channels, num_channels, sample_rate, 16, false);
   auto f = phosg::fopen_unique(filename, "wb");
   phosg::fwritex(f.get(), &header, sizeof(SaveWAVHeader));
   phosg::fwritex(f.get(), samples.data(), sizeof(int16_t) * samples.size());
 }
 
 void save_wav(const char* filename, const vector<float>& samples, size_t sample_rate, size_t num_channels) {
-  SaveWAVHeader header(samples.size(), num_channels, sample_rate, 32, true);
+  SaveWAVHeader header(samples.size() / num_channels, num_channels, sample_rate, 32, true);
   auto f = phosg::fopen_unique(filename, "wb");
   phosg::fwritex(f.get(), &header, sizeof(SaveWAVHeader));
   phosg::fwritex(f.get(), samples.data(), sizeof(float) * samples.size());
 }
 
+// Same as SaveWAVHeader, but with a JUNK chunk before the data chunk that pads
+// the header to WAVWriter::ALIGNMENT bytes
+struct AlignedWAVHeader {
+  uint32_t riff_magic; // 0x52494646 ('RIFF')
+  uint32_t file_size; // size of file - 8
+  uint32_t wave_magic; // 0x57415645 ('WAVE')
+
+  uint32_t fmt_magic; // 0x666d7420 ('fmt ')
+  uint32_t fmt_size; // 16
+  uint16_t format; // 1 = PCM, 3 = float
+  uint16_t num_channels;
+  uint32_t sample_rate;
+  uint32_t byte_rate; // num_channels * sample_rate * bits_per_sample / 8
+  uint16_t block_align; // num_channels * bits_per_sample / 8
+  uint16_t bits_per_sample;
+
+  uint32_t junk_magic; // 0x4A554E4B ('JUNK')
+  uint32_t junk_size;
+  uint8_t junk[WAVWriter::ALIGNMENT - 52];
+
+  uint32_t data_magic; // 0x64617461 (data)
+  uint32_t data_size;
+
+  AlignedWAVHeader(uint32_t data_size, uint16_t num_channels,
+      uint32_t sample_rate, uint16_t bits_per_sample, bool is_float) {
+    this->riff_magic = phosg::bswap32(0x52494646);
+    // The data chunk must be padded to an even size, but the pad byte isn't
+    // included in data_size
+    this->file_size = sizeof(AlignedWAVHeader) - 8 + data_size + (data_size & 1);
+    this->wave_magic = phosg::bswap32(0x57415645);
+    this->fmt_magic = phosg::bswap32(0x666d7420);
+    this->fmt_size = 16;
+    this->format = is_float ? 3 : 1;
+    this->num_channels = num_channels;
+    this->sample_rate = sample_rate;
+    this->byte_rate = num_channels * sample_rate * bits_per_sample / 8;
+    this->block_align = num_channels * bits_per_sample / 8;
+    this->bits_per_sample = bits_per_sample;
+    this->junk_magic = phosg::bswap32(0x4A554E4B);
+    this->junk_size = sizeof(this->junk);
+    memset(this->junk, 0, sizeof(this->junk));
+    this->data_magic = phosg::bswap32(0x64617461);
+    this->data_size = data_size;
+  }
+};
+static_assert(sizeof(AlignedWAVHeader) == WAVWriter::ALIGNMENT, "aligned WAV header has incorrect size");
+
+WAVWriter::WAVWriter(const string& filename, size_t sample_rate, size_t num_channels,
+    size_t bits_per_sample, bool is_float, size_t write_size)
+    : filename(filename),
+      fd(-1),
+      sample_rate(sample_rate),
+      num_channels(num_channels),
+      bits_per_sample(bits_per_sample),
+      is_float(is_float),
+      staging(nullptr, free),
+      staging_capacity(max<size_t>((write_size + ALIGNMENT - 1) & ~(ALIGNMENT - 1), ALIGNMENT)),
+      staging_bytes(0),
+      bytes_on_disk(0) {
+  this->staging.reset(reinterpret_cast<uint8_t*>(aligned_alloc(ALIGNMENT, this->staging_capacity)));
+  if (!this->staging) {
+    throw bad_alloc();
+  }
+  this->fd = open(this->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (this->fd < 0) {
+    throw runtime_error(format("cannot open {}: {}", this->filename, strerror(errno)));
+  }
+  this->update_header();
+}
+
+WAVWriter::~WAVWriter() {
+  try {
+    this->close();
+  } catch (const exception&) {
+  }
+}
+
+void WAVWriter::write(const void* data, size_t size) {
+  if (this->fd < 0) {
+    throw logic_error("WAV file is already closed");
+  }
+  if (this->data_bytes() + size > MAX_DATA_BYTES) {
+    throw runtime_error("WAV file is too large");
+  }
+
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+  while (size) {
+    size_t bytes = min(size, this->staging_capacity - this->staging_bytes);
+    memcpy(this->staging.get() + this->staging_bytes, src, bytes);
+    this->staging_bytes += bytes;
+    src += bytes;
+    size -= bytes;
+
+    if (this->staging_bytes == this->staging_capacity) {
+      this->write_at(ALIGNMENT + this->bytes_on_disk, this->staging.get(), this->staging_capacity);
+      this->bytes_on_disk += this->staging_capacity;
+      this->staging_bytes = 0;
+    }
+  }
+}
+
+void WAVWriter::update_header() {
+  if (this->fd < 0) {
+    throw logic_error("WAV file is already closed");
+  }
+  AlignedWAVHeader header(this->bytes_on_disk, this->num_channels, this->sample_rate,
+      this->bits_per_sample, this->is_float);
+  this->write_at(0, &header, sizeof(header));
+}
+
+void WAVWriter::close() {
+  if (this->fd < 0) {
+    return;
+  }
+
+  // The last write is the only one that may be unaligned. Include the pad
+  // byte if the data size is odd.
+  if (this->staging_bytes) {
+    size_t bytes = this->staging_bytes;
+    if ((this->bytes_on_disk + bytes) & 1) {
+      this->staging.get()[bytes++] = 0;
+    }
+    this->write_at(ALIGNMENT + this->bytes_on_disk, this->staging.get(), bytes);
+    this->bytes_on_disk += this->staging_bytes;
+    this->staging_bytes = 0;
+  }
+  this->update_header();
+
+  int fd = this->fd;
+  this->fd = -1;
+  if (::close(fd)) {
+    throw runtime_error(format("cannot close {}: {}", this->filename, strerror(errno)));
+  }
+}
+
+const string& WAVWriter::get_filename() const {
+  return this->filename;
+}
+
+uint64_t WAVWriter::data_bytes() const {
+  return this->bytes_on_disk + this->staging_bytes;
+}
+
+void WAVWriter::write_at(uint64_t offset, const void* data, size_t size) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+  while (size) {
+    ssize_t bytes_written = pwrite(this->fd, src, size, offset);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error(format("cannot write to {}: {}", this->filename, strerror(errno)));
+    }
+    src += bytes_written;
+    size -= bytes_written;
+    offset += bytes_written;
+  }
+}
+
 // Note: this isn't the same as SaveWAVHeader; that structure is only used to
 // write files. When loading files, we might encounter chunks that this library
 // never creates by default, but we should be able to handle them anyway, so the
@@ -4,11 +4,15 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace phosg_audio {
 
 struct WAVLoop {
+  // Offsets into WAVContents::samples (so for stereo files, these are twice
+  // the frame index). end is inclusive.
   size_t start;
   size_t end;
   uint8_t type;
@@ -33,4 +37,51 @@ void save_wav(const char* filename, const std::vector<uint8_t>& samples, size_t
 void save_wav(const char* filename, const std::vector<int16_t>& samples, size_t sample_rate, size_t num_channels);
 void save_wav(const char* filename, const std::vector<float>& samples, size_t sample_rate, size_t num_channels);
 
+// Writes a WAV file incrementally, for recordings whose length isn't known in
+// advance. Data is staged in memory and written in large chunks at aligned
+// file offsets (the header is padded with a JUNK chunk to one alignment unit,
+// so the sample data starts on an aligned boundary). update_header() rewrites
+// the sizes in the header to cover everything written to disk so far, so an
+// interrupted recording is still a valid file up to the last update.
+class WAVWriter {
+public:
+  static constexpr size_t ALIGNMENT = 0x1000;
+  // WAV sizes are 32-bit, so files can't hold more sample data than this
+  static constexpr uint64_t MAX_DATA_BYTES = 0xFFFFFFFF - ALIGNMENT;
+
+  // write_size is rounded up to a multiple of ALIGNMENT
+  WAVWriter(const std::string& filename, size_t sample_rate, size_t num_channels,
+      size_t bits_per_sample, bool is_float, size_t write_size = 0x100000);
+  ~WAVWriter();
+
+  WAVWriter(const WAVWriter&) = delete;
+  WAVWriter(WAVWriter&&) = delete;
+  WAVWriter& operator=(const WAVWriter&) = delete;
+  WAVWriter& operator=(WAVWriter&&) = delete;
+
+  void write(const void* data, size_t size);
+  void update_header();
+  // Writes any staged data, finalizes the header, and closes the file. The
+  // destructor does this if it hasn't been done already, but ignores errors.
+  void close();
+
+  const std::string& get_filename() const;
+  // Sample data bytes written so far, including data not yet on disk
+  uint64_t data_bytes() const;
+
+private:
+  void write_at(uint64_t offset, const void* data, size_t size);
+
+  std::string filename;
+  int fd;
+  size_t sample_rate;
+  size_t num_channels;
+  size_t bits_per_sample;
+  bool is_float;
+  std::unique_ptr<uint8_t, void (*)(void*)> staging;
+  size_t staging_capacity;
+  size_t staging_bytes;
+  uint64_t bytes_on_disk; // Sample data only; the header isn't included
+};
+
 } // namespace phosg_audio
@@ -0,0 +1,590 @@
+#include "Fingerprint.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <complex>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "FourierTransform.hh"
+#include "Resampler.hh"
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Peaks are picked separately in each of these bands (in Hz), so loud low
+// frequencies don't hide everything else. Bands above the Nyquist frequency
+// are dropped.
+static const double BAND_EDGES_HZ[] = {100, 150, 220, 330, 500, 750, 1100, 1600, 2400, 3500, 5000, 7500};
+
+static void validate_options(const FingerprintOptions& options) {
+  if (options.sample_rate == 0) {
+    throw invalid_argument("fingerprint sample rate must be nonzero");
+  }
+  if ((options.window_frames < 64) || (options.window_frames > 2048) ||
+      (options.window_frames & (options.window_frames - 1))) {
+    throw invalid_argument("fingerprint window size must be a power of 2 between 64 and 2048");
+  }
+  if ((options.hop_frames == 0) || (options.hop_frames > options.window_frames)) {
+    throw invalid_argument("fingerprint hop size must be between 1 and the window size");
+  }
+  if (options.fan_out == 0) {
+    throw invalid_argument("fingerprint fan-out must be nonzero");
+  }
+  if ((options.max_pair_distance == 0) || (options.max_pair_distance > 0xFFF)) {
+    throw invalid_argument("fingerprint pair distance must be between 1 and 4095");
+  }
+}
+
+static vector<float> mono_at_rate(const float* samples, size_t frame_count, size_t num_channels,
+    uint32_t sample_rate, uint32_t target_rate) {
+  if (num_channels == 0) {
+    throw invalid_argument("audio must have at least one channel");
+  }
+  if (sample_rate == 0) {
+    throw invalid_argument("sample rate must be nonzero");
+  }
+
+  vector<float> mono(frame_count);
+  float scale = 1.0f / num_channels;
+  for (size_t z = 0; z < frame_count; z++) {
+    float sum = 0.0f;
+    for (size_t c = 0; c < num_channels; c++) {
+      sum += samples[z * num_channels + c];
+    }
+    mono[z] = sum * scale;
+  }
+  if (sample_rate == target_rate) {
+    return mono;
+  }
+
+  Resampler resampler(sample_rate, target_rate, 1);
+  vector<float> ret;
+  ret.reserve(resampler.max_output_frames(frame_count) + 0x100);
+  resampler.process(mono.data(), frame_count, ret);
+  resampler.flush(ret);
+  return ret;
+}
+
+static size_t wav_frame_count(const WAVContents& wav) {
+  if (wav.num_channels == 0) {
+    throw invalid_argument("audio must have at least one channel");
+  }
+  return wav.samples.size() / wav.num_channels;
+}
+
+static vector<FingerprintHash> fingerprint_mono(const vector<float>& mono, const FingerprintOptions& options) {
+  size_t window_frames = options.window_frames;
+  size_t num_windows;
+  if (mono.empty()) {
+    return vector<FingerprintHash>();
+  } else if (mono.size() <= window_frames) {
+    num_windows = 1;
+  } else {
+    num_windows = 1 + (mono.size() - window_frames) / options.hop_frames;
+  }
+
+  vector<size_t> band_edges;
+  for (double hz : BAND_EDGES_HZ) {
+    size_t bin = lround(hz * window_frames / options.sample_rate);
+    if (bin >= window_frames / 2) {
+      break;
+    }
+    if (band_edges.empty() || (bin > band_edges.back())) {
+      band_edges.emplace_back(bin);
+    }
+  }
+  if (band_edges.size() < 2) {
+    return vector<FingerprintHash>();
+  }
+  size_t num_bands = band_edges.size() - 1;
+
+  // Find the loudest bin in each band of each window. Levels are in dB
+  // relative to the peak of a full-scale sine wave, which is window_frames / 4
+  // after the Hann window.
+  struct BandPeak {
+    uint32_t bin;
+    float db;
+  };
+  vector<BandPeak> band_peaks(num_windows * num_bands);
+  {
+    FFTPlan plan(window_frames);
+    vector<double> hann(window_frames);
+    for (size_t x = 0; x < window_frames; x++) {
+      hann[x] = 0.5 - 0.5 * cos(2.0 * M_PI * x / window_frames);
+    }
+    double reference_db = 20.0 * log10(window_frames / 4.0);
+    vector<complex<double>> spectrum(window_frames);
+    for (size_t w = 0; w < num_windows; w++) {
+      size_t start = w * options.hop_frames;
+      size_t count = min<size_t>(window_frames, mono.size() - start);
+      for (size_t x = 0; x < count; x++) {
+        spectrum[x] = mono[start + x] * hann[x];
+      }
+      for (size_t x = count; x < window_frames; x++) {
+        spectrum[x] = 0.0;
+      }
+      plan.transform(spectrum.data());
+
+      for (size_t b = 0; b < num_bands; b++) {
+        size_t max_bin = band_edges[b];
+        double max_power = norm(spectrum[max_bin]);
+        for (size_t bin = band_edges[b] + 1; bin < band_edges[b + 1]; bin++) {
+          double power = norm(spectrum[bin]);
+          if (power > max_power) {
+            max_bin = bin;
+            max_power = power;
+          }
+        }
+        auto& peak = band_peaks[w * num_bands + b];
+        peak.bin = max_bin;
+        peak.db = (max_power > 0.0) ? (10.0 * log10(max_power) - reference_db) : -INFINITY;
+      }
+    }
+  }
+
+  // Keep only the band peaks that are also the loudest in their band within
+  // the neighborhood. Ties go to the earliest window, so a steady tone gives
+  // one peak per neighborhood instead of one per window.
+  struct Peak {
+    uint32_t window;
+    uint32_t bin;
+  };
+  vector<Peak> peaks;
+  for (size_t w = 0; w < num_windows; w++) {
+    size_t start_w = (w > options.peak_neighborhood) ? (w - options.peak_neighborhood) : 0;
+    size_t end_w = min<size_t>(num_windows, w + options.peak_neighborhood + 1);
+    for (size_t b = 0; b < num_bands; b++) {
+      const auto& peak = band_peaks[w * num_bands + b];
+      if (peak.db < options.min_peak_db) {
+        continue;
+      }
+      bool is_peak = true;
+      for (size_t other_w = start_w; is_peak && (other_w < end_w); other_w++) {
+        float other_db = band_peaks[other_w * num_bands + b].db;
+        is_peak = (other_db < peak.db) || ((other_db == peak.db) && (other_w >= w));
+      }
+      if (is_peak) {
+        peaks.emplace_back(Peak{static_cast<uint32_t>(w), peak.bin});
+      }
+    }
+  }
+
+  // Pair each peak with the next few peaks in later windows. The hash is
+  // 10 bits of each frequency and 12 bits of the time difference.
+  vector<FingerprintHash> ret;
+  ret.reserve(peaks.size() * options.fan_out);
+  for (size_t x = 0; x < peaks.size(); x++) {
+    const auto& anchor = peaks[x];
+    size_t paired = 0;
+    for (size_t y = x + 1; (y < peaks.size()) && (paired < options.fan_out); y++) {
+      const auto& target = peaks[y];
+      uint32_t delta = target.window - anchor.window;
+      if (delta == 0) {
+        continue;
+      }
+      if (delta > options.max_pair_distance) {
+        break;
+      }
+      uint32_t hash = ((anchor.bin & 0x3FF) << 22) | ((target.bin & 0x3FF) << 12) | delta;
+      ret.emplace_back(FingerprintHash{hash, anchor.window});
+      paired++;
+    }
+  }
+  return ret;
+}
+
+vector<FingerprintHash> compute_fingerprint(const float* samples, size_t frame_count, size_t num_channels,
+    uint32_t sample_rate, const FingerprintOptions& options) {
+  validate_options(options);
+  return fingerprint_mono(mono_at_rate(samples, frame_count, num_channels, sample_rate, options.sample_rate), options);
+}
+
+vector<FingerprintHash> compute_fingerprint(const WAVContents& wav, const FingerprintOptions& options) {
+  return compute_fingerprint(wav.samples.data(), wav_frame_count(wav), wav.num_channels,
+      wav.sample_rate, options);
+}
+
+// The index file is this header, then the entries, then for each sample its
+// analysis_frames (uint64_t), name length (uint32_t) and name
+static constexpr uint32_t INDEX_FILE_MAGIC = 0x50414650; // 'PAFP'
+static constexpr uint32_t INDEX_FILE_VERSION = 1;
+
+struct IndexFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t window_frames;
+  uint32_t hop_frames;
+  uint32_t peak_neighborhood;
+  double min_peak_db;
+  uint32_t fan_out;
+  uint32_t max_pair_distance;
+  uint64_t num_samples;
+  uint64_t num_entries;
+};
+static_assert(sizeof(IndexFileHeader) == 0x38);
+
+FingerprintIndex::FingerprintIndex(const FingerprintOptions& options)
+    : options(options),
+      entries(nullptr),
+      entry_count(0),
+      sorted_count(0),
+      mapped_data(nullptr),
+      mapped_size(0) {
+  validate_options(this->options);
+}
+
+FingerprintIndex::FingerprintIndex(const string& filename)
+    : entries(nullptr),
+      entry_count(0),
+      sorted_count(0),
+      mapped_data(nullptr),
+      mapped_size(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw runtime_error(format("cannot open {}: {}", filename, strerror(errno)));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    throw runtime_error(format("cannot stat {}: {}", filename, strerror(error)));
+  }
+  if (static_cast<size_t>(st.st_size) < sizeof(IndexFileHeader)) {
+    close(fd);
+    throw runtime_error(format("{} is not a fingerprint index", filename));
+  }
+  this->mapped_size = st.st_size;
+  void* data = mmap(nullptr, this->mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+  int error = errno;
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw runtime_error(format("cannot map {}: {}", filename, strerror(error)));
+  }
+  this->mapped_data = data;
+
+  try {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(this->mapped_data);
+    IndexFileHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (header.magic == __builtin_bswap32(INDEX_FILE_MAGIC)) {
+      throw runtime_error(format("{} was written on a machine with a different byte order", filename));
+    }
+    if (header.magic != INDEX_FILE_MAGIC) {
+      throw runtime_error(format("{} is not a fingerprint index", filename));
+    }
+    if (header.version != INDEX_FILE_VERSION) {
+      throw runtime_error(format("{} has unsupported version {}", filename, header.version));
+    }
+    this->options.sample_rate = header.sample_rate;
+    this->options.window_frames = header.window_frames;
+    this->options.hop_frames = header.hop_frames;
+    this->options.peak_neighborhood = header.peak_neighborhood;
+    this->options.min_peak_db = header.min_peak_db;
+    this->options.fan_out = header.fan_out;
+    this->options.max_pair_distance = header.max_pair_distance;
+    validate_options(this->options);
+
+    size_t offset = sizeof(IndexFileHeader);
+    if (header.num_entries > (this->mapped_size - offset) / sizeof(Entry)) {
+      throw runtime_error(format("{} is truncated", filename));
+    }
+    this->entries = reinterpret_cast<const Entry*>(bytes + offset);
+    this->entry_count = header.num_entries;
+    this->sorted_count = header.num_entries;
+    offset += header.num_entries * sizeof(Entry);
+
+    for (uint64_t z = 0; z < header.num_samples; z++) {
+      uint64_t analysis_frames;
+      uint32_t name_size;
+      if (this->mapped_size - offset < sizeof(analysis_frames) + sizeof(name_size)) {
+        throw runtime_error(format("{} is truncated", filename));
+      }
+      memcpy(&analysis_frames, bytes + offset, sizeof(analysis_frames));
+      memcpy(&name_size, bytes + offset + sizeof(analysis_frames), sizeof(name_size));
+      offset += sizeof(analysis_frames) + sizeof(name_size);
+      if (this->mapped_size - offset < name_size) {
+        throw runtime_error(format("{} is truncated", filename));
+      }
+      this->samples.emplace_back(SampleInfo{
+          string(reinterpret_cast<const char*>(bytes + offset), name_size), analysis_frames});
+      offset += name_size;
+    }
+  } catch (const exception&) {
+    munmap(this->mapped_data, this->mapped_size);
+    throw;
+  }
+}
+
+FingerprintIndex::~FingerprintIndex() {
+  if (this->mapped_data) {
+    munmap(this->mapped_data, this->mapped_size);
+  }
+}
+
+const FingerprintOptions& FingerprintIndex::get_options() const {
+  return this->options;
+}
+
+void FingerprintIndex::unmap() {
+  if (!this->mapped_data) {
+    return;
+  }
+  this->owned_entries.assign(this->entries, this->entries + this->entry_count);
+  this->entries = this->owned_entries.data();
+  munmap(this->mapped_data, this->mapped_size);
+  this->mapped_data = nullptr;
+  this->mapped_size = 0;
+}
+
+size_t FingerprintIndex::add_sample(const string& name, const float* samples, size_t frame_count,
+    size_t num_channels, uint32_t sample_rate) {
+  size_t sample_id = this->samples.size();
+  if (sample_id > 0xFFFFFFFF) {
+    throw runtime_error("too many samples in fingerprint index");
+  }
+  auto mono = mono_at_rate(samples, frame_count, num_channels, sample_rate, this->options.sample_rate);
+  auto hashes = fingerprint_mono(mono, this->options);
+
+  this->unmap();
+  this->owned_entries.reserve(this->owned_entries.size() + hashes.size());
+  for (const auto& hash : hashes) {
+    this->owned_entries.emplace_back(Entry{hash.hash, static_cast<uint32_t>(sample_id), hash.window});
+  }
+  this->entries = this->owned_entries.data();
+  this->entry_count = this->owned_entries.size();
+  this->samples.emplace_back(SampleInfo{name, mono.size()});
+  return sample_id;
+}
+
+size_t FingerprintIndex::add_sample(const string& name, const WAVContents& wav) {
+  return this->add_sample(name, wav.samples.data(), wav_frame_count(wav), wav.num_channels,
+      wav.sample_rate);
+}
+
+size_t FingerprintIndex::add_wav(const string& filename) {
+  return this->add_sample(filename, load_wav(filename.c_str()));
+}
+
+void FingerprintIndex::finalize() {
+  if (this->sorted_count == this->entry_count) {
+    return;
+  }
+  // Only the new entries need to be sorted; they're then merged with the
+  // entries that were already sorted
+  auto entry_less = [](const Entry& a, const Entry& b) -> bool {
+    if (a.hash != b.hash) {
+      return a.hash < b.hash;
+    }
+    return (a.sample_id != b.sample_id) ? (a.sample_id < b.sample_id) : (a.window < b.window);
+  };
+  auto mid = this->owned_entries.begin() + this->sorted_count;
+  sort(mid, this->owned_entries.end(), entry_less);
+  inplace_merge(this->owned_entries.begin(), mid, this->owned_entries.end(), entry_less);
+  this->sorted_count = this->entry_count;
+}
+
+size_t FingerprintIndex::num_samples() const {
+  return this->samples.size();
+}
+
+const string& FingerprintIndex::sample_name(size_t sample_id) const {
+  return this->samples.at(sample_id).name;
+}
+
+double FingerprintIndex::sample_duration_ms(size_t sample_id) const {
+  return this->samples.at(sample_id).analysis_frames * 1000.0 / this->options.sample_rate;
+}
+
+size_t FingerprintIndex::num_hashes() const {
+  return this->entry_count;
+}
+
+void FingerprintIndex::save(const string& filename) const {
+  static_assert(sizeof(Entry) == 12);
+  if (this->sorted_count != this->entry_count) {
+    throw logic_error("fingerprint index must be finalized before it can be saved");
+  }
+
+  IndexFileHeader header;
+  header.magic = INDEX_FILE_MAGIC;
+  header.version = INDEX_FILE_VERSION;
+  header.sample_rate = this->options.sample_rate;
+  header.window_frames = this->options.window_frames;
+  header.hop_frames = this->options.hop_frames;
+  header.peak_neighborhood = this->options.peak_neighborhood;
+  header.min_peak_db = this->options.min_peak_db;
+  header.fan_out = this->options.fan_out;
+  header.max_pair_distance = this->options.max_pair_distance;
+  header.num_samples = this->samples.size();
+  header.num_entries = this->entry_count;
+
+  auto f = phosg::fopen_unique(filename, "wb");
+  phosg::fwritex(f.get(), &header, sizeof(header));
+  phosg::fwritex(f.get(), this->entries, this->entry_count * sizeof(Entry));
+  for (const auto& sample : this->samples) {
+    uint32_t name_size = sample.name.size();
+    phosg::fwritex(f.get(), &sample.analysis_frames, sizeof(sample.analysis_frames));
+    phosg::fwritex(f.get(), &name_size, sizeof(name_size));
+    phosg::fwritex(f.get(), sample.name);
+  }
+}
+
+vector<FingerprintIndex::Match> FingerprintIndex::query(const float* samples, size_t frame_count,
+    size_t num_channels, uint32_t sample_rate, size_t max_results, size_t min_score) const {
+  return this->query(compute_fingerprint(samples, frame_count, num_channels, sample_rate, this->options),
+      max_results, min_score);
+}
+
+vector<FingerprintIndex::Match> FingerprintIndex::query(const WAVContents& wav, size_t max_results,
+    size_t min_score) const {
+  return this->query(compute_fingerprint(wav, this->options), max_results, min_score);
+}
+
+vector<FingerprintIndex::Match> FingerprintIndex::query(const vector<FingerprintHash>& clip_hashes,
+    size_t max_results, size_t min_score) const {
+  if (this->sorted_count != this->entry_count) {
+    throw logic_error("fingerprint index must be finalized before it can be queried");
+  }
+
+  // Every index entry with the same hash as one of the clip's hashes is a vote
+  // for the clip appearing in that sample at the offset between the two
+  auto make_key = [](uint32_t sample_id, int32_t offset) -> uint64_t {
+    return (static_cast<uint64_t>(sample_id) << 32) | static_cast<uint32_t>(offset);
+  };
+  unordered_map<uint64_t, uint32_t> votes;
+  const Entry* entries_end = this->entries + this->entry_count;
+  for (const auto& clip_hash : clip_hashes) {
+    const Entry* it = lower_bound(this->entries, entries_end, clip_hash.hash,
+        [](const Entry& e, uint32_t hash) -> bool { return e.hash < hash; });
+    for (; (it != entries_end) && (it->hash == clip_hash.hash); it++) {
+      votes[make_key(it->sample_id, static_cast<int32_t>(it->window - clip_hash.window))]++;
+    }
+  }
+
+  // The clip's windows generally don't line up exactly with the sample's, so
+  // some peaks land one window early or late; count those votes too, and
+  // choose the best offset for each sample
+  struct Candidate {
+    size_t score;
+    uint32_t center_votes;
+    int32_t offset;
+  };
+  unordered_map<uint32_t, Candidate> candidates;
+  for (const auto& [key, count] : votes) {
+    uint32_t sample_id = key >> 32;
+    int32_t offset = static_cast<int32_t>(key & 0xFFFFFFFF);
+    size_t score = count;
+    for (int32_t neighbor : {offset - 1, offset + 1}) {
+      auto neighbor_it = votes.find(make_key(sample_id, neighbor));
+      if (neighbor_it != votes.end()) {
+        score += neighbor_it->second;
+      }
+    }
+    auto [candidate_it, inserted] = candidates.emplace(sample_id, Candidate{score, count, offset});
+    auto& candidate = candidate_it->second;
+    if (!inserted && ((score > candidate.score) || ((score == candidate.score) &&
+                         ((count > candidate.center_votes) ||
+                             ((count == candidate.center_votes) && (offset < candidate.offset)))))) {
+      candidate = Candidate{score, count, offset};
+    }
+  }
+
+  vector<Match> ret;
+  double ms_per_window = this->options.hop_frames * 1000.0 / this->options.sample_rate;
+  for (const auto& [sample_id, candidate] : candidates) {
+    if (candidate.score < min_score) {
+      continue;
+    }
+    double confidence = min<double>(1.0, static_cast<double>(candidate.score) / clip_hashes.size());
+    ret.emplace_back(Match{sample_id, candidate.score, confidence, candidate.offset * ms_per_window});
+  }
+  sort(ret.begin(), ret.end(), [](const Match& a, const Match& b) -> bool {
+    return (a.score != b.score) ? (a.score > b.score) : (a.sample_id < b.sample_id);
+  });
+  if (ret.size() > max_results) {
+    ret.resize(max_results);
+  }
+  return ret;
+}
+
+OffsetRefinement refine_offset(const vector<float>& reference, const vector<float>& clip, uint32_t sample_rate,
+    double approx_offset_ms, double search_ms) {
+  if (clip.empty()) {
+    throw invalid_argument("cannot refine the offset of an empty clip");
+  }
+  if (sample_rate == 0) {
+    throw invalid_argument("sample rate must be nonzero");
+  }
+
+  // signal is the part of the reference that the clip could overlap at any of
+  // the lags being searched, padded with silence where it extends past either
+  // end of the reference
+  int64_t approx_frames = llround(approx_offset_ms * sample_rate / 1000.0);
+  int64_t search_frames = llround(fabs(search_ms) * sample_rate / 1000.0);
+  int64_t start = approx_frames - search_frames;
+  size_t num_lags = 2 * search_frames + 1;
+  vector<float> signal(num_lags - 1 + clip.size(), 0.0f);
+  for (size_t x = 0; x < signal.size(); x++) {
+    int64_t reference_index = start + static_cast<int64_t>(x);
+    if ((reference_index >= 0) && (reference_index < static_cast<int64_t>(reference.size()))) {
+      signal[x] = reference[reference_index];
+    }
+  }
+  auto correlation = cross_correlate(signal, clip);
+
+  // Normalize by the energy of the clip and of the part of the signal it
+  // overlaps at each lag, so loud parts of the reference aren't favored
+  double clip_energy = 0.0;
+  for (float v : clip) {
+    clip_energy += static_cast<double>(v) * v;
+  }
+  double window_energy = 0.0;
+  for (size_t x = 0; x < clip.size(); x++) {
+    window_energy += static_cast<double>(signal[x]) * signal[x];
+  }
+  size_t best_lag = 0;
+  double best_correlation = -INFINITY;
+  for (size_t lag = 0; lag < num_lags; lag++) {
+    if (lag > 0) {
+      double entering = signal[lag + clip.size() - 1];
+      double leaving = signal[lag - 1];
+      window_energy += entering * entering - leaving * leaving;
+    }
+    double denominator = clip_energy * window_energy;
+    double normalized = (denominator > 1e-20) ? (correlation[lag] / sqrt(denominator)) : 0.0;
+    if (normalized > best_correlation) {
+      best_lag = lag;
+      best_correlation = normalized;
+    }
+  }
+
+  OffsetRefinement ret;
+  ret.offset_frames = start + static_cast<int64_t>(best_lag);
+  ret.offset_ms = ret.offset_frames * 1000.0 / sample_rate;
+  ret.correlation = min(1.0, max(-1.0, best_correlation));
+  return ret;
+}
+
+OffsetRefinement refine_offset(const WAVContents& reference, const WAVContents& clip, double approx_offset_ms,
+    double search_ms) {
+  auto reference_mono = mono_at_rate(reference.samples.data(), wav_frame_count(reference),
+      reference.num_channels, reference.sample_rate, reference.sample_rate);
+  auto clip_mono = mono_at_rate(clip.samples.data(), wav_frame_count(clip), clip.num_channels,
+      clip.sample_rate, reference.sample_rate);
+  return refine_offset(reference_mono, clip_mono, reference.sample_rate, approx_offset_ms, search_ms);
+}
+
+} // namespace phosg_audio
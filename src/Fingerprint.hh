@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "File.hh"
+
+namespace phosg_audio {
+
+// Parameters for computing fingerprints. Clips must be fingerprinted with the
+// same options as the index they're matched against; FingerprintIndex does
+// this automatically.
+struct FingerprintOptions {
+  // Audio is downmixed to mono and resampled to this rate before analysis.
+  // 11025Hz keeps everything below about 5kHz, which is where most of the
+  // stable spectral peaks are.
+  uint32_t sample_rate = 11025;
+  // The FFT size, which must be a power of 2 between 64 and 2048, and the
+  // number of frames between the starts of consecutive FFT windows. The hop
+  // size is the resolution of match offsets before refinement.
+  size_t window_frames = 1024;
+  size_t hop_frames = 256;
+  // The spectrum is split into bands of about half an octave, and each band
+  // contributes at most one peak per window. A peak must also be the loudest
+  // point in its band for this many windows on either side.
+  size_t peak_neighborhood = 3;
+  // Peaks quieter than this are ignored (0dB is a full-scale sine wave)
+  double min_peak_db = -60.0;
+  // Each peak is paired with up to this many later peaks, at most
+  // max_pair_distance windows later, to make hashes
+  size_t fan_out = 5;
+  size_t max_pair_distance = 64;
+};
+
+struct FingerprintHash {
+  // Encodes the frequencies of both peaks and the time between them, so it
+  // doesn't depend on the absolute time or level of the audio
+  uint32_t hash;
+  // The index of the window containing the first peak in the pair
+  uint32_t window;
+};
+
+// Computes the constellation hashes for some audio in interleaved float
+// format. The result is sorted by window.
+std::vector<FingerprintHash> compute_fingerprint(const float* samples, size_t frame_count, size_t num_channels,
+    uint32_t sample_rate, const FingerprintOptions& options = FingerprintOptions());
+std::vector<FingerprintHash> compute_fingerprint(const WAVContents& wav,
+    const FingerprintOptions& options = FingerprintOptions());
+
+// An index of the fingerprints of a bank of samples, for finding which sample
+// a clip came from and where in that sample it starts. The index is one sorted
+// array of 12-byte entries, searched by binary search. It can be saved to a
+// file, and opening the file maps it into memory instead of reading it, so
+// large banks are usable immediately and share memory between processes.
+// Queries are const and can be run from multiple threads at once, but adding
+// samples or finalizing can't overlap with anything else.
+class FingerprintIndex {
+public:
+  explicit FingerprintIndex(const FingerprintOptions& options = FingerprintOptions());
+  // Opens an index previously written by save()
+  explicit FingerprintIndex(const std::string& filename);
+  ~FingerprintIndex();
+
+  FingerprintIndex(const FingerprintIndex&) = delete;
+  FingerprintIndex(FingerprintIndex&&) = delete;
+  FingerprintIndex& operator=(const FingerprintIndex&) = delete;
+  FingerprintIndex& operator=(FingerprintIndex&&) = delete;
+
+  const FingerprintOptions& get_options() const;
+
+  // These all return the new sample's ID. The samples aren't searchable until
+  // finalize() is called; it's much faster to add many samples and then
+  // finalize once than to finalize after each one.
+  size_t add_sample(const std::string& name, const float* samples, size_t frame_count, size_t num_channels,
+      uint32_t sample_rate);
+  size_t add_sample(const std::string& name, const WAVContents& wav);
+  // Uses the filename as the sample's name
+  size_t add_wav(const std::string& filename);
+  void finalize();
+
+  size_t num_samples() const;
+  const std::string& sample_name(size_t sample_id) const;
+  double sample_duration_ms(size_t sample_id) const;
+  size_t num_hashes() const;
+
+  // Writes the index in the host's byte order. The index must be finalized.
+  void save(const std::string& filename) const;
+
+  struct Match {
+    size_t sample_id;
+    // The number of the clip's hashes that agree on this offset
+    size_t score;
+    // score as a fraction of the clip's hashes, from 0 to 1. Unrelated
+    // samples usually score a few percent at most; the clip's source usually
+    // scores above 0.1, even with some noise or level changes.
+    double confidence;
+    // Where the clip starts in the sample, to within one hop. This is
+    // negative if the clip starts before the sample does.
+    double offset_ms;
+  };
+  // Returns up to max_results matches with at least min_score hashes, best
+  // first. The clip can be in any format and sample rate. Throws logic_error
+  // if the index isn't finalized.
+  std::vector<Match> query(const float* samples, size_t frame_count, size_t num_channels, uint32_t sample_rate,
+      size_t max_results = 5, size_t min_score = 5) const;
+  std::vector<Match> query(const WAVContents& wav, size_t max_results = 5, size_t min_score = 5) const;
+  std::vector<Match> query(const std::vector<FingerprintHash>& clip_hashes,
+      size_t max_results = 5, size_t min_score = 5) const;
+
+private:
+  struct Entry {
+    uint32_t hash;
+    uint32_t sample_id;
+    uint32_t window;
+  };
+  struct SampleInfo {
+    std::string name;
+    uint64_t analysis_frames; // At options.sample_rate
+  };
+
+  // Copies the entries out of the mapped file, so more can be added
+  void unmap();
+
+  FingerprintOptions options;
+  std::vector<SampleInfo> samples;
+  // entries points to either owned_entries.data() or into the mapped file.
+  // The first sorted_count entries are sorted by hash; the rest haven't been
+  // finalized yet.
+  std::vector<Entry> owned_entries;
+  const Entry* entries;
+  size_t entry_count;
+  size_t sorted_count;
+  void* mapped_data;
+  size_t mapped_size;
+};
+
+// Finds exactly where clip starts within reference, searching within
+// search_ms either side of approx_offset_ms (e.g. a Match's offset_ms). Both
+// are mono and at the same sample rate. This cross-correlates the clip with
+// that part of the reference using FFTs, and picks the lag with the highest
+// normalized correlation, so it's accurate to one frame.
+struct OffsetRefinement {
+  int64_t offset_frames;
+  double offset_ms;
+  // Normalized correlation at the chosen offset, from -1 to 1. Values near 1
+  // mean the clip is an (optionally scaled) copy of that part of the
+  // reference.
+  double correlation;
+};
+OffsetRefinement refine_offset(const std::vector<float>& reference, const std::vector<float>& clip,
+    uint32_t sample_rate, double approx_offset_ms, double search_ms = 50.0);
+// Same as above, but for audio in any channel count; both are downmixed to
+// mono, and the clip is resampled to the reference's rate if necessary
+OffsetRefinement refine_offset(const WAVContents& reference, const WAVContents& clip,
+    double approx_offset_ms, double search_ms = 50.0);
+
+} // namespace phosg_audio
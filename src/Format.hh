@@ -0,0 +1,287 @@
+#pragma once
+
+#include <al.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <bit>
+#include <stdexcept>
+
+// AL_EXT_float32 format enums. The values are fixed by the extension, so they
+// don't have to be looked up with alGetEnumValue (which needs a context).
+#ifndef AL_FORMAT_MONO_FLOAT32
+#define AL_FORMAT_MONO_FLOAT32 0x10010
+#endif
+#ifndef AL_FORMAT_STEREO_FLOAT32
+#define AL_FORMAT_STEREO_FLOAT32 0x10011
+#endif
+
+namespace phosg_audio {
+
+// The sample types OpenAL supports. 8-bit samples are unsigned; 16-bit samples
+// are signed.
+enum class SampleType {
+  U8 = 0,
+  S16,
+  F32,
+};
+
+// Describes the layout of interleaved sample data. This is a structural type,
+// so it can be used as a template argument to instantiate kernels for one
+// specific format.
+struct SampleFormat {
+  SampleType type;
+  uint8_t num_channels;
+  std::endian byte_order = std::endian::native;
+
+  constexpr size_t bytes_per_sample() const {
+    return (this->type == SampleType::F32) ? 4 : ((this->type == SampleType::S16) ? 2 : 1);
+  }
+  constexpr size_t bytes_per_frame() const {
+    return this->bytes_per_sample() * this->num_channels;
+  }
+  constexpr bool is_stereo() const {
+    return this->num_channels == 2;
+  }
+  // True if samples must be byteswapped before they can be used natively
+  constexpr bool is_swapped() const {
+    return (this->byte_order != std::endian::native) && (this->bytes_per_sample() > 1);
+  }
+  constexpr SampleFormat with_byte_order(std::endian byte_order) const {
+    return SampleFormat{this->type, this->num_channels, byte_order};
+  }
+
+  constexpr bool operator==(const SampleFormat& other) const = default;
+};
+
+// AL formats are always native-endian. This throws invalid_argument if the
+// format isn't one of the six mono/stereo 8-bit/16-bit/float formats.
+constexpr SampleFormat sample_format_for_al_format(int al_format) {
+  switch (al_format) {
+    case AL_FORMAT_MONO8:
+      return SampleFormat{SampleType::U8, 1};
+    case AL_FORMAT_STEREO8:
+      return SampleFormat{SampleType::U8, 2};
+    case AL_FORMAT_MONO16:
+      return SampleFormat{SampleType::S16, 1};
+    case AL_FORMAT_STEREO16:
+      return SampleFormat{SampleType::S16, 2};
+    case AL_FORMAT_MONO_FLOAT32:
+      return SampleFormat{SampleType::F32, 1};
+    case AL_FORMAT_STEREO_FLOAT32:
+      return SampleFormat{SampleType::F32, 2};
+  }
+  throw std::invalid_argument("unsupported AL format");
+}
+
+// Ignores the format's byte order, since AL has no byteswapped formats
+constexpr int al_format_for_sample_format(SampleFormat format) {
+  if ((format.num_channels != 1) && (format.num_channels != 2)) {
+    throw std::invalid_argument("AL formats must be mono or stereo");
+  }
+  bool stereo = format.is_stereo();
+  switch (format.type) {
+    case SampleType::U8:
+      return stereo ? AL_FORMAT_STEREO8 : AL_FORMAT_MONO8;
+    case SampleType::S16:
+      return stereo ? AL_FORMAT_STEREO16 : AL_FORMAT_MONO16;
+    case SampleType::F32:
+      return stereo ? AL_FORMAT_STEREO_FLOAT32 : AL_FORMAT_MONO_FLOAT32;
+  }
+  throw std::invalid_argument("unknown sample type");
+}
+
+// Per-sample-type traits. to_f32 and from_f32 are the scalar conversions used
+// by all the conversion functions in Convert.hh; from_f32 clamps to [-1, 1].
+template <SampleType Type>
+struct SampleTypeTraits;
+
+template <>
+struct SampleTypeTraits<SampleType::U8> {
+  using sample_t = uint8_t;
+  using storage_t = uint8_t;
+
+  static constexpr float to_f32(uint8_t sample) {
+    return static_cast<float>(sample) / 127.0f - 1.0f;
+  }
+  static constexpr uint8_t from_f32(float sample) {
+    if (sample >= 1.0f) {
+      return 0xFF;
+    } else if (sample <= -1.0f) {
+      return 0;
+    } else {
+      return static_cast<uint8_t>((sample + 1.0f) * 127.0f);
+    }
+  }
+  static constexpr uint8_t byteswap(uint8_t v) {
+    return v;
+  }
+};
+
+template <>
+struct SampleTypeTraits<SampleType::S16> {
+  using sample_t = int16_t;
+  using storage_t = uint16_t;
+
+  static constexpr float to_f32(int16_t sample) {
+    return (sample == -0x8000) ? -1.0f : (static_cast<float>(sample) / 32767.0f);
+  }
+  static constexpr int16_t from_f32(float sample) {
+    if (sample >= 1.0f) {
+      return 0x7FFF;
+    } else if (sample <= -1.0f) {
+      return -0x8000;
+    } else {
+      return static_cast<int16_t>(sample * 32767.0f);
+    }
+  }
+  static constexpr uint16_t byteswap(uint16_t v) {
+    return static_cast<uint16_t>((v << 8) | (v >> 8));
+  }
+};
+
+template <>
+struct SampleTypeTraits<SampleType::F32> {
+  using sample_t = float;
+  using storage_t = uint32_t;
+
+  static constexpr float to_f32(float sample) {
+    return sample;
+  }
+  static constexpr float from_f32(float sample) {
+    return sample;
+  }
+  static constexpr uint32_t byteswap(uint32_t v) {
+    return ((v & 0x000000FF) << 24) | ((v & 0x0000FF00) << 8) |
+        ((v & 0x00FF0000) >> 8) | ((v & 0xFF000000) >> 24);
+  }
+};
+
+template <SampleFormat Format>
+struct FormatTraits : SampleTypeTraits<Format.type> {
+  static constexpr SampleFormat format = Format;
+  static constexpr size_t num_channels = Format.num_channels;
+  static constexpr size_t bytes_per_sample = Format.bytes_per_sample();
+  static constexpr size_t bytes_per_frame = Format.bytes_per_frame();
+};
+
+template <SampleFormat Format>
+struct FormatTag {
+  static constexpr SampleFormat format = Format;
+};
+
+// Calls fn(FormatTag<F>()), where F is the descriptor for al_format. This is
+// the one place where a runtime format becomes a compile-time one; kernels
+// called from fn are instantiated for exactly one format. All instantiations
+// of fn must return the same type.
+template <typename FnT>
+decltype(auto) dispatch_al_format(int al_format, FnT&& fn) {
+  switch (al_format) {
+    case AL_FORMAT_MONO8:
+      return fn(FormatTag<SampleFormat{SampleType::U8, 1}>());
+    case AL_FORMAT_STEREO8:
+      return fn(FormatTag<SampleFormat{SampleType::U8, 2}>());
+    case AL_FORMAT_MONO16:
+      return fn(FormatTag<SampleFormat{SampleType::S16, 1}>());
+    case AL_FORMAT_STEREO16:
+      return fn(FormatTag<SampleFormat{SampleType::S16, 2}>());
+    case AL_FORMAT_MONO_FLOAT32:
+      return fn(FormatTag<SampleFormat{SampleType::F32, 1}>());
+    case AL_FORMAT_STEREO_FLOAT32:
+      return fn(FormatTag<SampleFormat{SampleType::F32, 2}>());
+  }
+  throw std::invalid_argument("unsupported AL format");
+}
+
+// Kernels. These take untyped buffers since the data often comes straight from
+// a file or pipe; buffers must still be aligned for the format's sample type.
+
+template <SampleFormat Format>
+void byteswap_frames(void* buffer, size_t frame_count) {
+  using Traits = FormatTraits<Format>;
+  if constexpr (Traits::bytes_per_sample > 1) {
+    auto* samples = reinterpret_cast<typename Traits::storage_t*>(buffer);
+    size_t sample_count = frame_count * Traits::num_channels;
+    for (size_t x = 0; x < sample_count; x++) {
+      samples[x] = Traits::byteswap(samples[x]);
+    }
+  }
+}
+
+template <SampleFormat Format>
+typename FormatTraits<Format>::sample_t load_sample(const void* buffer, size_t index) {
+  using Traits = FormatTraits<Format>;
+  typename Traits::storage_t v = reinterpret_cast<const typename Traits::storage_t*>(buffer)[index];
+  if constexpr (Format.is_swapped()) {
+    v = Traits::byteswap(v);
+  }
+  return std::bit_cast<typename Traits::sample_t>(v);
+}
+
+template <SampleFormat Format>
+void store_sample(void* buffer, size_t index, typename FormatTraits<Format>::sample_t sample) {
+  using Traits = FormatTraits<Format>;
+  auto v = std::bit_cast<typename Traits::storage_t>(sample);
+  if constexpr (Format.is_swapped()) {
+    v = Traits::byteswap(v);
+  }
+  reinterpret_cast<typename Traits::storage_t*>(buffer)[index] = v;
+}
+
+// Converts between any two formats with one or two channels, possibly in place
+// (out == in). Mono input is copied to both output channels; stereo input is
+// averaged for mono output. Samples of the same type are copied without going
+// through float, so same-type conversions are lossless except for downmixing.
+template <SampleFormat InFormat, SampleFormat OutFormat>
+void convert_frames(void* out, const void* in, size_t frame_count) {
+  using InTraits = FormatTraits<InFormat>;
+  using OutTraits = FormatTraits<OutFormat>;
+  static_assert((InTraits::num_channels == 1) || (InTraits::num_channels == 2));
+  static_assert((OutTraits::num_channels == 1) || (OutTraits::num_channels == 2));
+
+  if constexpr (InFormat == OutFormat) {
+    memmove(out, in, frame_count * InTraits::bytes_per_frame);
+
+  } else if constexpr ((InFormat.type == OutFormat.type) && (InTraits::num_channels == OutTraits::num_channels)) {
+    // Only the byte order differs
+    for (size_t x = 0; x < frame_count * InTraits::num_channels; x++) {
+      store_sample<OutFormat>(out, x, load_sample<InFormat>(in, x));
+    }
+
+  } else {
+    // The output may alias the input, so frames are converted back to front
+    // when output frames are larger than input frames
+    auto convert_frame = [&](size_t x) {
+      if constexpr ((InTraits::num_channels == 2) && (OutTraits::num_channels == 1)) {
+        float l = InTraits::to_f32(load_sample<InFormat>(in, x * 2));
+        float r = InTraits::to_f32(load_sample<InFormat>(in, x * 2 + 1));
+        store_sample<OutFormat>(out, x, OutTraits::from_f32((l + r) * 0.5f));
+      } else {
+        typename OutTraits::sample_t samples[InTraits::num_channels];
+        for (size_t c = 0; c < InTraits::num_channels; c++) {
+          auto sample = load_sample<InFormat>(in, x * InTraits::num_channels + c);
+          if constexpr (InFormat.type == OutFormat.type) {
+            samples[c] = sample;
+          } else {
+            samples[c] = OutTraits::from_f32(InTraits::to_f32(sample));
+          }
+        }
+        for (size_t c = 0; c < OutTraits::num_channels; c++) {
+          store_sample<OutFormat>(out, x * OutTraits::num_channels + c, samples[c % InTraits::num_channels]);
+        }
+      }
+    };
+    if constexpr (OutTraits::bytes_per_frame > InTraits::bytes_per_frame) {
+      for (size_t x = frame_count; x > 0; x--) {
+        convert_frame(x - 1);
+      }
+    } else {
+      for (size_t x = 0; x < frame_count; x++) {
+        convert_frame(x);
+      }
+    }
+  }
+}
+
+} // namespace phosg_audio
@@ -1,5 +1,7 @@
 #include "FourierTransform.hh"
 
+#include <stdexcept>
+
 using namespace std;
 
 namespace phosg_audio {
@@ -52,4 +54,101 @@ vector<complex<double>> compute_fourier_transform(const vector<complex<double>>&
   return output;
 }
 
+vector<complex<double>> compute_inverse_fourier_transform(const vector<complex<double>>& input) {
+  // ifft(x) = conj(fft(conj(x))) / N
+  vector<complex<double>> conjugated;
+  conjugated.reserve(input.size());
+  for (const auto& v : input) {
+    conjugated.emplace_back(conj(v));
+  }
+  auto output = compute_fourier_transform(conjugated);
+  double scale = 1.0 / output.size();
+  for (auto& v : output) {
+    v = conj(v) * scale;
+  }
+  return output;
+}
+
+FFTPlan::FFTPlan(size_t size) : n(size) {
+  if ((size == 0) || (size & (size - 1)) || (size > 0x80000000)) {
+    throw invalid_argument("FFT size must be a power of 2");
+  }
+  this->roots.reserve(size / 2);
+  for (size_t x = 0; x < size / 2; x++) {
+    this->roots.emplace_back(polar(1.0, (-2.0 * pi * x) / size));
+  }
+  size_t bits = 0;
+  while ((static_cast<size_t>(1) << bits) < size) {
+    bits++;
+  }
+  for (size_t x = 0; x < size; x++) {
+    size_t reversed = 0;
+    for (size_t b = 0; b < bits; b++) {
+      reversed |= ((x >> b) & 1) << (bits - b - 1);
+    }
+    if (x < reversed) {
+      this->swaps.emplace_back(x, reversed);
+    }
+  }
+}
+
+size_t FFTPlan::size() const {
+  return this->n;
+}
+
+void FFTPlan::transform(complex<double>* data) const {
+  for (const auto& swap : this->swaps) {
+    std::swap(data[swap.first], data[swap.second]);
+  }
+  // Iterative radix-2 decimation in time; at each level, the roots for a
+  // span of length len are every (n / len)th entry in roots
+  for (size_t len = 2; len <= this->n; len <<= 1) {
+    size_t half = len / 2;
+    size_t root_step = this->n / len;
+    for (size_t start = 0; start < this->n; start += len) {
+      for (size_t z = 0; z < half; z++) {
+        complex<double> v = this->roots[z * root_step] * data[start + z + half];
+        complex<double> t = data[start + z];
+        data[start + z] = t + v;
+        data[start + z + half] = t - v;
+      }
+    }
+  }
+}
+
+vector<double> cross_correlate(const vector<float>& signal, const vector<float>& reference) {
+  if (signal.empty() || reference.empty()) {
+    return vector<double>(signal.size(), 0.0);
+  }
+
+  // Pad both inputs so the circular correlation doesn't wrap around for any
+  // of the lags we return
+  size_t size = 1;
+  while (size < signal.size() + reference.size()) {
+    size <<= 1;
+  }
+  vector<complex<double>> signal_c(size);
+  vector<complex<double>> reference_c(size);
+  for (size_t x = 0; x < signal.size(); x++) {
+    signal_c[x] = signal[x];
+  }
+  for (size_t x = 0; x < reference.size(); x++) {
+    reference_c[x] = reference[x];
+  }
+
+  auto signal_f = compute_fourier_transform(signal_c);
+  auto reference_f = compute_fourier_transform(reference_c);
+  for (size_t x = 0; x < size; x++) {
+    signal_f[x] *= conj(reference_f[x]);
+  }
+  auto correlation = compute_inverse_fourier_transform(signal_f);
+
+  vector<double> ret;
+  ret.reserve(signal.size());
+  for (size_t x = 0; x < signal.size(); x++) {
+    ret.emplace_back(correlation[x].real());
+  }
+  return ret;
+}
+
 } // namespace phosg_audio
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <complex>
 #include <vector>
 
@@ -9,5 +12,29 @@ std::vector<std::complex<double>> make_complex_multi(const std::vector<float>& i
 std::vector<std::complex<double>> make_complex_multi(const float* input, size_t count);
 
 std::vector<std::complex<double>> compute_fourier_transform(const std::vector<std::complex<double>>& input);
+std::vector<std::complex<double>> compute_inverse_fourier_transform(const std::vector<std::complex<double>>& input);
+
+// Precomputed roots of unity and bit-reversal permutation for repeatedly
+// transforming data of one power-of-2 size. transform() works in place and
+// doesn't allocate, so this can be used on audio threads.
+class FFTPlan {
+public:
+  explicit FFTPlan(size_t size);
+  ~FFTPlan() = default;
+
+  size_t size() const;
+  void transform(std::complex<double>* data) const;
+
+private:
+  size_t n;
+  std::vector<std::complex<double>> roots; // roots[x] = e^(-2 pi i x / n)
+  std::vector<std::pair<uint32_t, uint32_t>> swaps; // Bit-reversal permutation
+};
+
+// Computes the cross-correlation of signal with reference at every lag from 0
+// to signal.size() - 1 (that is, ret[lag] is the sum over x of
+// signal[x + lag] * reference[x]) using FFTs. The inputs don't need to be
+// powers of 2 in size; they're zero-padded internally.
+std::vector<double> cross_correlate(const std::vector<float>& signal, const std::vector<float>& reference);
 
 } // namespace phosg_audio
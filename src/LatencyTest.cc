@@ -0,0 +1,202 @@
+#include "LatencyTest.hh"
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "Capture.hh"
+#include "Convert.hh"
+#include "FourierTransform.hh"
+#include "Loopback.hh"
+#include "Stats.hh"
+#include "Stream.hh"
+
+using namespace std;
+
+namespace phosg_audio {
+
+static const double pi = 3.14159265358979323846;
+
+// A linear chirp's autocorrelation has a single narrow peak, so its position
+// in the captured audio can be found precisely even with noise and filtering.
+// The ends are faded to avoid clicks, which would correlate with other things.
+static vector<float> generate_chirp(int sample_rate, size_t frame_count,
+    double start_freq, double end_freq, float volume) {
+  vector<float> ret(frame_count);
+  double duration = static_cast<double>(frame_count) / sample_rate;
+  double sweep_rate = (end_freq - start_freq) / duration;
+  size_t fade_frames = frame_count / 10;
+  for (size_t x = 0; x < frame_count; x++) {
+    double t = static_cast<double>(x) / sample_rate;
+    double phase = 2.0 * pi * (start_freq * t + 0.5 * sweep_rate * t * t);
+    double envelope = 1.0;
+    if (x < fade_frames) {
+      envelope = 0.5 - 0.5 * cos((pi * x) / fade_frames);
+    } else if (x >= frame_count - fade_frames) {
+      envelope = 0.5 - 0.5 * cos((pi * (frame_count - 1 - x)) / fade_frames);
+    }
+    ret[x] = volume * envelope * sin(phase);
+  }
+  return ret;
+}
+
+// The test signal: a chirp, preceded by some silence so that the stream is
+// already playing steadily when it starts
+struct LatencyTestSignal {
+  size_t lead_frames;
+  vector<float> chirp;
+  vector<int16_t> playback;
+  // The number of frames to capture after submitting playback, to find the
+  // chirp at any latency up to max_latency_ms
+  size_t window_frames;
+
+  LatencyTestSignal(int sample_rate, double max_latency_ms) {
+    if (max_latency_ms <= 0.0) {
+      throw invalid_argument("maximum latency must be positive");
+    }
+    this->lead_frames = sample_rate / 20;
+    size_t chirp_frames = sample_rate / 10;
+    this->chirp = generate_chirp(sample_rate, chirp_frames, 300.0, min(8000.0, sample_rate * 0.4), 0.5f);
+    this->playback.resize(this->lead_frames + chirp_frames, 0);
+    convert_samples_f32_to_s16(&this->playback[this->lead_frames], this->chirp.data(), chirp_frames);
+    this->window_frames = this->lead_frames + chirp_frames +
+        static_cast<size_t>((max_latency_ms * sample_rate) / 1000.0);
+  }
+
+  // Returns the position of the chirp in captured, or -1 if it wasn't found.
+  // The correlation peak is only accepted if it stands well above the rest of
+  // the correlation (otherwise the chirp probably wasn't captured at all).
+  // Any DC offset is removed first, and only positions where the whole chirp
+  // was captured are considered; otherwise a constant signal would correlate
+  // most strongly with the partial chirp at the end of the window.
+  int64_t find_chirp(const vector<float>& captured) const {
+    if (captured.size() < this->chirp.size()) {
+      return -1;
+    }
+    double mean = 0.0;
+    for (float v : captured) {
+      mean += v;
+    }
+    mean /= captured.size();
+    vector<float> centered(captured.size());
+    for (size_t x = 0; x < captured.size(); x++) {
+      centered[x] = captured[x] - mean;
+    }
+
+    auto correlation = cross_correlate(centered, this->chirp);
+    correlation.resize(captured.size() - this->chirp.size() + 1);
+    size_t peak_lag = 0;
+    double peak = 0.0;
+    double sum_squares = 0.0;
+    for (size_t x = 0; x < correlation.size(); x++) {
+      double v = fabs(correlation[x]);
+      sum_squares += v * v;
+      if (v > peak) {
+        peak = v;
+        peak_lag = x;
+      }
+    }
+    double rms = sqrt(sum_squares / correlation.size());
+    return ((peak == 0.0) || (peak < rms * 8.0)) ? -1 : static_cast<int64_t>(peak_lag);
+  }
+};
+
+static void summarize_latencies(LatencyTestResult& ret) {
+  ret.mean_ms = 0.0;
+  ret.min_ms = 0.0;
+  ret.max_ms = 0.0;
+  ret.jitter_ms = 0.0;
+  if (!ret.latencies_ms.empty()) {
+    ret.min_ms = *min_element(ret.latencies_ms.begin(), ret.latencies_ms.end());
+    ret.max_ms = *max_element(ret.latencies_ms.begin(), ret.latencies_ms.end());
+    for (double v : ret.latencies_ms) {
+      ret.mean_ms += v;
+    }
+    ret.mean_ms /= ret.latencies_ms.size();
+    for (double v : ret.latencies_ms) {
+      ret.jitter_ms += (v - ret.mean_ms) * (v - ret.mean_ms);
+    }
+    ret.jitter_ms = sqrt(ret.jitter_ms / ret.latencies_ms.size());
+  }
+}
+
+LatencyTestResult measure_round_trip_latency(int sample_rate, size_t num_trials,
+    const char* capture_device_name, double max_latency_ms) {
+  LatencyTestSignal signal(sample_rate, max_latency_ms);
+  size_t window_frames = signal.window_frames;
+  vector<int16_t> captured(window_frames);
+  vector<float> captured_f(window_frames);
+
+  AudioCapture capture(capture_device_name, sample_rate, AL_FORMAT_MONO16,
+      max<size_t>(window_frames, sample_rate), true, 256);
+  AudioStream stream(sample_rate, AL_FORMAT_MONO16, 4);
+
+  LatencyTestResult ret;
+  ret.num_trials = num_trials;
+  for (size_t trial = 0; trial < num_trials; trial++) {
+    // Discard anything captured before this trial
+    size_t frames_available;
+    while ((frames_available = capture.available_frames()) != 0) {
+      capture.get_frames(captured.data(), min(frames_available, window_frames));
+    }
+
+    uint64_t submit_time_ns = monotonic_now_ns();
+    stream.add_frames(signal.playback.data(), signal.playback.size());
+    AudioCapture::BlockInfo info;
+    size_t frames_captured = capture.get_frames(captured.data(), window_frames, true, &info);
+    stream.wait();
+    if ((frames_captured < window_frames) || info.discontinuity) {
+      continue;
+    }
+
+    convert_samples_s16_to_f32(captured_f.data(), captured.data(), window_frames);
+    int64_t peak_lag = signal.find_chirp(captured_f);
+    if (peak_lag < 0) {
+      continue;
+    }
+
+    double detect_time_ns = info.timestamp_ns + (peak_lag * 1000000000.0) / sample_rate;
+    double play_time_ns = submit_time_ns + (signal.lead_frames * 1000000000.0) / sample_rate;
+    ret.latencies_ms.emplace_back((detect_time_ns - play_time_ns) / 1000000.0);
+  }
+
+  summarize_latencies(ret);
+  return ret;
+}
+
+LatencyTestResult measure_loopback_latency(int sample_rate, size_t num_trials, double max_latency_ms) {
+  LatencyTestSignal signal(sample_rate, max_latency_ms);
+  size_t window_frames = signal.window_frames;
+  vector<int16_t> rendered(window_frames);
+  vector<float> rendered_f(window_frames);
+
+  auto device = make_shared<LoopbackDevice>(sample_rate, AL_FORMAT_MONO16);
+  auto context = LoopbackDevice::create_context(device);
+  AudioStream stream(sample_rate, AL_FORMAT_MONO16, 4, false, 1024, context);
+
+  LatencyTestResult ret;
+  ret.num_trials = num_trials;
+  for (size_t trial = 0; trial < num_trials; trial++) {
+    // Time only passes when frames are rendered, so the playback starts at the
+    // first rendered frame; rendering the whole window also finishes it
+    stream.add_frames(signal.playback.data(), signal.playback.size());
+    device->render(rendered.data(), window_frames);
+    stream.wait();
+
+    convert_samples_s16_to_f32(rendered_f.data(), rendered.data(), window_frames);
+    int64_t peak_lag = signal.find_chirp(rendered_f);
+    if (peak_lag < 0) {
+      continue;
+    }
+    double latency_frames = static_cast<double>(peak_lag) - static_cast<double>(signal.lead_frames);
+    ret.latencies_ms.emplace_back((latency_frames * 1000.0) / sample_rate);
+  }
+
+  summarize_latencies(ret);
+  return ret;
+}
+
+} // namespace phosg_audio
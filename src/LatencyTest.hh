@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace phosg_audio {
+
+struct LatencyTestResult {
+  size_t num_trials;
+  // One entry for each trial in which the test signal was detected; trials
+  // in which it wasn't (e.g. with a null capture device) are omitted
+  std::vector<double> latencies_ms;
+  double mean_ms;
+  double min_ms;
+  double max_ms;
+  double jitter_ms; // Standard deviation of latencies_ms
+};
+
+// Measures the time from when frames are passed to AudioStream::add_frames to
+// when they're captured by AudioCapture, by playing a chirp through the
+// current AL context's output device and finding it in audio captured from
+// capture_device_name (NULL = the default capture device) by cross-
+// correlation. The output must be audible to the capture device, for example
+// through a cable, a monitor/loopback capture device, or speakers and a
+// microphone. max_latency_ms bounds the search; a trial in which the chirp
+// isn't found within that time doesn't produce a measurement.
+LatencyTestResult measure_round_trip_latency(int sample_rate, size_t num_trials,
+    const char* capture_device_name = nullptr, double max_latency_ms = 1000.0);
+
+// Runs the same test without any audio hardware: the chirp is played on a
+// LoopbackDevice, and the rendered output is searched instead of captured
+// audio. Time only passes on a loopback device when frames are rendered, so
+// the latency is counted in frames rather than measured by the clock; it's
+// the delay added by AudioStream and OpenAL's mixer alone (normally zero).
+// This checks the whole measurement path, so it can run in CI. Throws
+// runtime_error if ALC_SOFT_loopback isn't supported.
+LatencyTestResult measure_loopback_latency(int sample_rate, size_t num_trials, double max_latency_ms = 1000.0);
+
+} // namespace phosg_audio
@@ -0,0 +1,140 @@
+#include "Loopback.hh"
+
+#include <stdexcept>
+
+#include "File.hh"
+
+using namespace std;
+
+namespace phosg_audio {
+
+#ifndef ALC_APIENTRY
+#define ALC_APIENTRY
+#endif
+
+// These are from ALC_SOFT_loopback. The entry points and enums are looked up
+// at runtime so we don't depend on alext.h.
+typedef ALCdevice*(ALC_APIENTRY* LPALCLOOPBACKOPENDEVICESOFT)(const ALCchar* device_name);
+typedef ALCboolean(ALC_APIENTRY* LPALCISRENDERFORMATSUPPORTEDSOFT)(ALCdevice* device, ALCsizei freq, ALCenum channels, ALCenum type);
+typedef void(ALC_APIENTRY* LPALCRENDERSAMPLESSOFT)(ALCdevice* device, ALCvoid* buffer, ALCsizei samples);
+
+struct LoopbackFunctions {
+  LPALCLOOPBACKOPENDEVICESOFT open_device;
+  LPALCISRENDERFORMATSUPPORTEDSOFT is_render_format_supported;
+  LPALCRENDERSAMPLESSOFT render_samples;
+  ALCenum format_channels;
+  ALCenum format_type;
+  ALCenum mono;
+  ALCenum stereo;
+  ALCenum type_short;
+  ALCenum type_float;
+
+  LoopbackFunctions()
+      : open_device(nullptr),
+        is_render_format_supported(nullptr),
+        render_samples(nullptr) {
+    if (!AL_CALL(alcIsExtensionPresent, nullptr, "ALC_SOFT_loopback")) {
+      return;
+    }
+    this->open_device = reinterpret_cast<LPALCLOOPBACKOPENDEVICESOFT>(
+        AL_CALL(alcGetProcAddress, nullptr, "alcLoopbackOpenDeviceSOFT"));
+    this->is_render_format_supported = reinterpret_cast<LPALCISRENDERFORMATSUPPORTEDSOFT>(
+        AL_CALL(alcGetProcAddress, nullptr, "alcIsRenderFormatSupportedSOFT"));
+    this->render_samples = reinterpret_cast<LPALCRENDERSAMPLESSOFT>(
+        AL_CALL(alcGetProcAddress, nullptr, "alcRenderSamplesSOFT"));
+    this->format_channels = AL_CALL(alcGetEnumValue, nullptr, "ALC_FORMAT_CHANNELS_SOFT");
+    this->format_type = AL_CALL(alcGetEnumValue, nullptr, "ALC_FORMAT_TYPE_SOFT");
+    this->mono = AL_CALL(alcGetEnumValue, nullptr, "ALC_MONO_SOFT");
+    this->stereo = AL_CALL(alcGetEnumValue, nullptr, "ALC_STEREO_SOFT");
+    this->type_short = AL_CALL(alcGetEnumValue, nullptr, "ALC_SHORT_SOFT");
+    this->type_float = AL_CALL(alcGetEnumValue, nullptr, "ALC_FLOAT_SOFT");
+    if (!this->open_device || !this->is_render_format_supported || !this->render_samples) {
+      this->open_device = nullptr;
+    }
+  }
+};
+
+static const LoopbackFunctions& loopback_fns() {
+  static const LoopbackFunctions fns;
+  return fns;
+}
+
+LoopbackDevice::LoopbackDevice(int sample_rate, int format)
+    : AudioDevice(open_loopback_device(), "loopback"),
+      sample_rate(sample_rate),
+      format(format) {
+  const auto& fns = loopback_fns();
+  this->channels_enum = is_stereo(this->format) ? fns.stereo : fns.mono;
+  if (is_16bit(this->format)) {
+    this->type_enum = fns.type_short;
+  } else if (is_32bit(this->format)) {
+    this->type_enum = fns.type_float;
+  } else {
+    throw invalid_argument("loopback devices only support 16-bit and float formats");
+  }
+
+  if (!AL_CALL(fns.is_render_format_supported, this->device, this->sample_rate, this->channels_enum, this->type_enum)) {
+    throw runtime_error("loopback device does not support the requested format");
+  }
+}
+
+ALCdevice* LoopbackDevice::open_loopback_device() {
+  const auto& fns = loopback_fns();
+  if (!fns.open_device) {
+    throw runtime_error("loopback devices are not supported");
+  }
+  ALCdevice* device = AL_CALL(fns.open_device, nullptr);
+  if (!device) {
+    throw runtime_error("cannot open loopback device");
+  }
+  return device;
+}
+
+bool LoopbackDevice::is_supported() {
+  return loopback_fns().open_device != nullptr;
+}
+
+vector<ALCint> LoopbackDevice::context_attributes() const {
+  const auto& fns = loopback_fns();
+  return {
+      fns.format_channels, this->channels_enum,
+      fns.format_type, this->type_enum,
+      ALC_FREQUENCY, this->sample_rate,
+      0};
+}
+
+shared_ptr<AudioContext> LoopbackDevice::create_context(shared_ptr<LoopbackDevice> device) {
+  auto attributes = device->context_attributes();
+  return make_shared<AudioContext>(std::move(device), attributes.data());
+}
+
+int LoopbackDevice::get_sample_rate() const {
+  return this->sample_rate;
+}
+
+int LoopbackDevice::get_format() const {
+  return this->format;
+}
+
+void LoopbackDevice::render(void* buffer, size_t frame_count) {
+  AL_CALL(loopback_fns().render_samples, this->device, buffer, frame_count);
+}
+
+void LoopbackDevice::render_to_wav(const string& filename, size_t frame_count, size_t block_frames) {
+  if (block_frames == 0) {
+    throw invalid_argument("block size must not be zero");
+  }
+  size_t bpf = bytes_per_frame(this->format);
+  WAVWriter writer(filename, this->sample_rate, 1 + is_stereo(this->format),
+      bytes_per_sample(this->format) * 8, is_32bit(this->format));
+  vector<uint8_t> block(block_frames * bpf);
+  while (frame_count) {
+    size_t frames = min(frame_count, block_frames);
+    this->render(block.data(), frames);
+    writer.write(block.data(), frames * bpf);
+    frame_count -= frames;
+  }
+  writer.close();
+}
+
+} // namespace phosg_audio
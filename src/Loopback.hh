@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Device.hh"
+
+namespace phosg_audio {
+
+// A device that renders to memory instead of to audio hardware, using
+// ALC_SOFT_loopback. Nothing plays until render() is called, and render()
+// produces frames as fast as the CPU allows, so rendering is deterministic and
+// can run faster than real time on machines with no audio hardware at all.
+//
+// Sounds and streams work on a loopback context exactly as they do on any
+// other context (see AudioContext and ScopedContext), except that time only
+// passes when frames are rendered. In particular, an AudioStream blocks in
+// add_frames and wait() until render() consumes its queued buffers, so a
+// single thread must render between adding buffers, or render on a separate
+// thread.
+class LoopbackDevice : public AudioDevice {
+public:
+  // format is the format that render() produces; it must be one of the
+  // 16-bit or float AL_FORMAT_* constants.
+  LoopbackDevice(int sample_rate, int format);
+  virtual ~LoopbackDevice() = default;
+
+  static bool is_supported();
+
+  // Attributes to pass to AudioContext's constructor; the context must be
+  // created with these (or with the same format attributes) before rendering
+  std::vector<ALCint> context_attributes() const;
+  // Shortcut for creating a context with the above attributes
+  static std::shared_ptr<AudioContext> create_context(std::shared_ptr<LoopbackDevice> device);
+
+  int get_sample_rate() const;
+  int get_format() const;
+
+  // Renders frame_count frames into buffer, advancing time for all sources
+  // on the device's context
+  void render(void* buffer, size_t frame_count);
+  // Renders frame_count frames into a new WAV file, block_frames at a time
+  void render_to_wav(const std::string& filename, size_t frame_count, size_t block_frames = 4096);
+
+private:
+  static ALCdevice* open_loopback_device();
+
+  int sample_rate;
+  int format;
+  ALCint channels_enum;
+  ALCint type_enum;
+};
+
+} // namespace phosg_audio
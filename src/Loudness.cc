@@ -0,0 +1,405 @@
+#include "Loudness.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "Constants.hh"
+#include "Convert.hh"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PHOSG_AUDIO_LOUDNESS_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PHOSG_AUDIO_LOUDNESS_NEON
+#endif
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Sum of squares is accumulated in float vectors for at most this many
+// samples per lane before being added to the double totals
+static constexpr size_t LEVEL_CHUNK_SAMPLES = 0x1000;
+
+LoudnessMeter::LoudnessMeter(uint32_t sample_rate, size_t num_channels)
+    : sample_rate(sample_rate),
+      num_channels(num_channels) {
+  if (sample_rate == 0) {
+    throw invalid_argument("sample rate must be nonzero");
+  }
+  if ((num_channels != 1) && (num_channels != 2)) {
+    throw invalid_argument("loudness meter must be mono or stereo");
+  }
+
+  // K-weighting filters from BS.1770-4, adjusted for the sample rate. These
+  // give exactly the coefficients in the standard at 48kHz.
+  {
+    double f0 = 1681.974450955533;
+    double gain_db = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sample_rate);
+    double vh = pow(10.0, gain_db / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    this->shelf_filter.b0 = (vh + vb * k / q + k * k) / a0;
+    this->shelf_filter.b1 = 2.0 * (k * k - vh) / a0;
+    this->shelf_filter.b2 = (vh - vb * k / q + k * k) / a0;
+    this->shelf_filter.a1 = 2.0 * (k * k - 1.0) / a0;
+    this->shelf_filter.a2 = (1.0 - k / q + k * k) / a0;
+  }
+  {
+    double f0 = 38.13547087602444;
+    double q = 0.5003270373238773;
+    double k = tan(M_PI * f0 / sample_rate);
+    double a0 = 1.0 + k / q + k * k;
+    this->highpass_filter.b0 = 1.0;
+    this->highpass_filter.b1 = -2.0;
+    this->highpass_filter.b2 = 1.0;
+    this->highpass_filter.a1 = 2.0 * (k * k - 1.0) / a0;
+    this->highpass_filter.a2 = (1.0 - k / q + k * k) / a0;
+  }
+
+  // 4x interpolation filter: a Blackman-windowed sinc with its cutoff at the
+  // input's Nyquist frequency. Phase p computes the signal p/4 of the way
+  // from one input sample to the next, with TRUE_PEAK_TAPS / 2 - 1 samples of
+  // delay. Phase 0 lands exactly on input samples, so it reproduces them.
+  for (size_t p = 0; p < TRUE_PEAK_PHASES; p++) {
+    double sum = 0.0;
+    for (size_t k = 0; k < TRUE_PEAK_TAPS; k++) {
+      double d = static_cast<double>(k) - static_cast<double>(TRUE_PEAK_TAPS / 2 - 1) -
+          static_cast<double>(p) / TRUE_PEAK_PHASES;
+      double x = M_PI * d;
+      double sinc = (fabs(x) < 1e-9) ? 1.0 : (sin(x) / x);
+      double w = (d + TRUE_PEAK_TAPS / 2) / TRUE_PEAK_TAPS;
+      double blackman = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      this->true_peak_coeffs[p][k] = sinc * blackman;
+      sum += this->true_peak_coeffs[p][k];
+    }
+    for (size_t k = 0; k < TRUE_PEAK_TAPS; k++) {
+      this->true_peak_coeffs[p][k] /= sum;
+    }
+  }
+
+  this->sub_block_frames = max<size_t>((sample_rate + 5) / 10, 1);
+  this->reset();
+}
+
+void LoudnessMeter::reset() {
+  memset(this->filter_state, 0, sizeof(this->filter_state));
+  memset(this->true_peak_history, 0, sizeof(this->true_peak_history));
+  this->sub_block_frames_done = 0;
+  memset(this->sub_block_energy, 0, sizeof(this->sub_block_energy));
+  memset(this->sub_block_ring, 0, sizeof(this->sub_block_ring));
+  this->sub_block_ring_pos = 0;
+  this->num_sub_blocks = 0;
+  memset(this->histogram_counts, 0, sizeof(this->histogram_counts));
+  memset(this->histogram_energy, 0, sizeof(this->histogram_energy));
+  this->reset_levels();
+}
+
+void LoudnessMeter::reset_levels() {
+  for (size_t c = 0; c < MAX_CHANNELS; c++) {
+    this->peak[c] = 0.0f;
+    this->sum_squares[c] = 0.0;
+    this->true_peak[c] = 0.0f;
+  }
+  this->level_frames = 0;
+}
+
+void LoudnessMeter::process(const float* samples, size_t frame_count) {
+  this->update_levels(samples, frame_count);
+  this->update_true_peak(samples, frame_count);
+
+  // K-weight each channel and accumulate its energy, one sub-block at a time
+  size_t ch = this->num_channels;
+  const Biquad& f1 = this->shelf_filter;
+  const Biquad& f2 = this->highpass_filter;
+  size_t x = 0;
+  while (x < frame_count) {
+    size_t n = min(frame_count - x, this->sub_block_frames - this->sub_block_frames_done);
+    for (size_t c = 0; c < ch; c++) {
+      double* s = this->filter_state[c];
+      double s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+      double energy = 0.0;
+      const float* in = samples + x * ch + c;
+      for (size_t z = 0; z < n; z++) {
+        double v = in[z * ch];
+        double y1 = f1.b0 * v + s0;
+        s0 = f1.b1 * v - f1.a1 * y1 + s1;
+        s1 = f1.b2 * v - f1.a2 * y1;
+        double y2 = f2.b0 * y1 + s2;
+        s2 = f2.b1 * y1 - f2.a1 * y2 + s3;
+        s3 = f2.b2 * y1 - f2.a2 * y2;
+        energy += y2 * y2;
+      }
+      s[0] = s0;
+      s[1] = s1;
+      s[2] = s2;
+      s[3] = s3;
+      this->sub_block_energy[c] += energy;
+    }
+    x += n;
+    this->sub_block_frames_done += n;
+    if (this->sub_block_frames_done == this->sub_block_frames) {
+      this->finish_sub_block();
+    }
+  }
+}
+
+void LoudnessMeter::process(const void* data, size_t frame_count, int format) {
+  if ((is_stereo(format) ? 2 : 1) != this->num_channels) {
+    throw invalid_argument("format's channel count doesn't match the meter's");
+  }
+  static constexpr size_t CHUNK_FRAMES = 0x100;
+  float chunk[CHUNK_FRAMES * MAX_CHANNELS];
+  int float_format = (this->num_channels == 2) ? AL_FORMAT_STEREO_FLOAT32 : AL_FORMAT_MONO_FLOAT32;
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+  size_t bpf = bytes_per_frame(format);
+  while (frame_count) {
+    size_t n = min(frame_count, CHUNK_FRAMES);
+    convert_frames(chunk, float_format, in, format, n);
+    this->process(chunk, n);
+    in += n * bpf;
+    frame_count -= n;
+  }
+}
+
+LoudnessMeter::Levels LoudnessMeter::levels(size_t channel) const {
+  if (channel >= this->num_channels) {
+    throw out_of_range("invalid channel");
+  }
+  Levels ret;
+  ret.peak = this->peak[channel];
+  ret.rms = this->level_frames ? sqrt(this->sum_squares[channel] / this->level_frames) : 0.0f;
+  // The last few samples haven't come out of the interpolation filter yet
+  ret.true_peak = max(this->true_peak[channel], ret.peak);
+  return ret;
+}
+
+double LoudnessMeter::momentary_lufs() const {
+  return (this->num_sub_blocks >= MOMENTARY_SUB_BLOCKS)
+      ? lufs_for_energy(this->mean_energy(MOMENTARY_SUB_BLOCKS))
+      : -numeric_limits<double>::infinity();
+}
+
+double LoudnessMeter::short_term_lufs() const {
+  return (this->num_sub_blocks >= SHORT_TERM_SUB_BLOCKS)
+      ? lufs_for_energy(this->mean_energy(SHORT_TERM_SUB_BLOCKS))
+      : -numeric_limits<double>::infinity();
+}
+
+double LoudnessMeter::integrated_lufs() const {
+  // Everything in the histogram is already above the absolute gate
+  uint64_t count = 0;
+  double energy = 0.0;
+  for (size_t x = 0; x < HISTOGRAM_BINS; x++) {
+    count += this->histogram_counts[x];
+    energy += this->histogram_energy[x];
+  }
+  if (!count) {
+    return -numeric_limits<double>::infinity();
+  }
+
+  // The relative gate is 10 LU below the mean of the blocks above the
+  // absolute gate. Blocks are only binned to 0.1 LU, so blocks in the same
+  // bin as the relative gate are all counted.
+  double relative_gate = lufs_for_energy(energy / count) - 10.0;
+  size_t first_bin = (relative_gate <= ABSOLUTE_GATE_LUFS)
+      ? 0
+      : min<size_t>((relative_gate - ABSOLUTE_GATE_LUFS) * HISTOGRAM_BINS_PER_LU, HISTOGRAM_BINS - 1);
+  count = 0;
+  energy = 0.0;
+  for (size_t x = first_bin; x < HISTOGRAM_BINS; x++) {
+    count += this->histogram_counts[x];
+    energy += this->histogram_energy[x];
+  }
+  return count ? lufs_for_energy(energy / count) : -numeric_limits<double>::infinity();
+}
+
+size_t LoudnessMeter::get_num_channels() const {
+  return this->num_channels;
+}
+
+double LoudnessMeter::to_db(double level) {
+  return (level > 0.0) ? (20.0 * log10(level)) : -numeric_limits<double>::infinity();
+}
+
+void LoudnessMeter::update_levels(const float* samples, size_t frame_count) {
+  size_t ch = this->num_channels;
+  size_t count = frame_count * ch;
+  size_t x = 0;
+
+  // Vector lanes always hold the same channel, since 4 is a multiple of the
+  // channel count
+#if defined(PHOSG_AUDIO_LOUDNESS_SSE)
+  __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 peaks = _mm_setzero_ps();
+  while (x + 4 <= count) {
+    size_t chunk_end = min(count, x + LEVEL_CHUNK_SAMPLES * 4);
+    __m128 sums = _mm_setzero_ps();
+    for (; x + 4 <= chunk_end; x += 4) {
+      __m128 in = _mm_loadu_ps(&samples[x]);
+      peaks = _mm_max_ps(peaks, _mm_and_ps(in, abs_mask));
+      sums = _mm_add_ps(sums, _mm_mul_ps(in, in));
+    }
+    float lane_sums[4];
+    _mm_storeu_ps(lane_sums, sums);
+    for (size_t z = 0; z < 4; z++) {
+      this->sum_squares[z % ch] += lane_sums[z];
+    }
+  }
+  float lane_peaks[4];
+  _mm_storeu_ps(lane_peaks, peaks);
+  for (size_t z = 0; z < 4; z++) {
+    this->peak[z % ch] = max(this->peak[z % ch], lane_peaks[z]);
+  }
+#elif defined(PHOSG_AUDIO_LOUDNESS_NEON)
+  float32x4_t peaks = vdupq_n_f32(0.0f);
+  while (x + 4 <= count) {
+    size_t chunk_end = min(count, x + LEVEL_CHUNK_SAMPLES * 4);
+    float32x4_t sums = vdupq_n_f32(0.0f);
+    for (; x + 4 <= chunk_end; x += 4) {
+      float32x4_t in = vld1q_f32(&samples[x]);
+      peaks = vmaxq_f32(peaks, vabsq_f32(in));
+      sums = vaddq_f32(sums, vmulq_f32(in, in));
+    }
+    float lane_sums[4];
+    vst1q_f32(lane_sums, sums);
+    for (size_t z = 0; z < 4; z++) {
+      this->sum_squares[z % ch] += lane_sums[z];
+    }
+  }
+  float lane_peaks[4];
+  vst1q_f32(lane_peaks, peaks);
+  for (size_t z = 0; z < 4; z++) {
+    this->peak[z % ch] = max(this->peak[z % ch], lane_peaks[z]);
+  }
+#endif
+  for (; x < count; x++) {
+    float v = samples[x];
+    this->peak[x % ch] = max(this->peak[x % ch], fabsf(v));
+    this->sum_squares[x % ch] += v * v;
+  }
+  this->level_frames += frame_count;
+}
+
+void LoudnessMeter::update_true_peak(const float* samples, size_t frame_count) {
+  static constexpr size_t CHUNK_FRAMES = 0x100;
+  static constexpr size_t HISTORY = TRUE_PEAK_TAPS - 1;
+  size_t ch = this->num_channels;
+  for (size_t c = 0; c < ch; c++) {
+    // Deinterleave the channel after its history, so output frame z's window
+    // is window[z] through window[z + TRUE_PEAK_TAPS - 1]. Each vector below
+    // holds one phase for four consecutive frames.
+    float window[HISTORY + CHUNK_FRAMES];
+    memcpy(window, this->true_peak_history[c], sizeof(float) * HISTORY);
+    float peak = 0.0f;
+    for (size_t x = 0; x < frame_count;) {
+      size_t n = min(frame_count - x, CHUNK_FRAMES);
+      for (size_t z = 0; z < n; z++) {
+        window[HISTORY + z] = samples[(x + z) * ch + c];
+      }
+
+      size_t vector_frames = 0;
+#if defined(PHOSG_AUDIO_LOUDNESS_SSE)
+      vector_frames = n & ~3;
+      __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+      __m128 peaks = _mm_setzero_ps();
+      for (size_t p = 0; p < TRUE_PEAK_PHASES; p++) {
+        __m128 coeffs[TRUE_PEAK_TAPS];
+        for (size_t k = 0; k < TRUE_PEAK_TAPS; k++) {
+          coeffs[k] = _mm_set1_ps(this->true_peak_coeffs[p][k]);
+        }
+        for (size_t z = 0; z < vector_frames; z += 4) {
+          // Even and odd taps are summed separately to halve the dependency
+          // chain through the adds
+          __m128 even = _mm_mul_ps(coeffs[0], _mm_loadu_ps(&window[z]));
+          __m128 odd = _mm_mul_ps(coeffs[1], _mm_loadu_ps(&window[z + 1]));
+          for (size_t k = 2; k < TRUE_PEAK_TAPS; k += 2) {
+            even = _mm_add_ps(even, _mm_mul_ps(coeffs[k], _mm_loadu_ps(&window[z + k])));
+            odd = _mm_add_ps(odd, _mm_mul_ps(coeffs[k + 1], _mm_loadu_ps(&window[z + k + 1])));
+          }
+          peaks = _mm_max_ps(peaks, _mm_and_ps(_mm_add_ps(even, odd), abs_mask));
+        }
+      }
+      float lane_peaks[4];
+      _mm_storeu_ps(lane_peaks, peaks);
+      peak = max(peak, max(max(lane_peaks[0], lane_peaks[1]), max(lane_peaks[2], lane_peaks[3])));
+#elif defined(PHOSG_AUDIO_LOUDNESS_NEON)
+      vector_frames = n & ~3;
+      float32x4_t peaks = vdupq_n_f32(0.0f);
+      for (size_t p = 0; p < TRUE_PEAK_PHASES; p++) {
+        const float* coeffs = this->true_peak_coeffs[p];
+        for (size_t z = 0; z < vector_frames; z += 4) {
+          float32x4_t even = vmulq_n_f32(vld1q_f32(&window[z]), coeffs[0]);
+          float32x4_t odd = vmulq_n_f32(vld1q_f32(&window[z + 1]), coeffs[1]);
+          for (size_t k = 2; k < TRUE_PEAK_TAPS; k += 2) {
+            even = vmlaq_n_f32(even, vld1q_f32(&window[z + k]), coeffs[k]);
+            odd = vmlaq_n_f32(odd, vld1q_f32(&window[z + k + 1]), coeffs[k + 1]);
+          }
+          peaks = vmaxq_f32(peaks, vabsq_f32(vaddq_f32(even, odd)));
+        }
+      }
+      float32x2_t pair_peaks = vpmax_f32(vget_low_f32(peaks), vget_high_f32(peaks));
+      peak = max(peak, vget_lane_f32(vpmax_f32(pair_peaks, pair_peaks), 0));
+#endif
+      for (size_t p = 0; p < TRUE_PEAK_PHASES; p++) {
+        const float* coeffs = this->true_peak_coeffs[p];
+        for (size_t z = vector_frames; z < n; z++) {
+          float out = 0.0f;
+          for (size_t k = 0; k < TRUE_PEAK_TAPS; k++) {
+            out += coeffs[k] * window[z + k];
+          }
+          peak = max(peak, fabsf(out));
+        }
+      }
+
+      memmove(window, &window[n], sizeof(float) * HISTORY);
+      x += n;
+    }
+    memcpy(this->true_peak_history[c], window, sizeof(float) * HISTORY);
+    this->true_peak[c] = max(this->true_peak[c], peak);
+  }
+}
+
+void LoudnessMeter::finish_sub_block() {
+  // All channel weights are 1.0 for mono and stereo
+  double energy = 0.0;
+  for (size_t c = 0; c < this->num_channels; c++) {
+    energy += this->sub_block_energy[c] / this->sub_block_frames;
+    this->sub_block_energy[c] = 0.0;
+  }
+  this->sub_block_frames_done = 0;
+  this->sub_block_ring[this->sub_block_ring_pos] = energy;
+  this->sub_block_ring_pos = (this->sub_block_ring_pos + 1) % SHORT_TERM_SUB_BLOCKS;
+  this->num_sub_blocks++;
+
+  if (this->num_sub_blocks >= MOMENTARY_SUB_BLOCKS) {
+    double block_energy = this->mean_energy(MOMENTARY_SUB_BLOCKS);
+    double block_lufs = lufs_for_energy(block_energy);
+    if (block_lufs > ABSOLUTE_GATE_LUFS) {
+      size_t bin = min<size_t>((block_lufs - ABSOLUTE_GATE_LUFS) * HISTOGRAM_BINS_PER_LU, HISTOGRAM_BINS - 1);
+      this->histogram_counts[bin]++;
+      this->histogram_energy[bin] += block_energy;
+    }
+  }
+}
+
+double LoudnessMeter::mean_energy(size_t num_sub_blocks) const {
+  double sum = 0.0;
+  for (size_t x = 1; x <= num_sub_blocks; x++) {
+    sum += this->sub_block_ring[(this->sub_block_ring_pos + SHORT_TERM_SUB_BLOCKS - x) % SHORT_TERM_SUB_BLOCKS];
+  }
+  return sum / num_sub_blocks;
+}
+
+double LoudnessMeter::lufs_for_energy(double energy) {
+  return (energy > 0.0) ? (-0.691 + 10.0 * log10(energy)) : -numeric_limits<double>::infinity();
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace phosg_audio {
+
+// Streaming level and loudness meter for mono or stereo audio. All state is
+// fixed-size, so process() never allocates, and memory use doesn't depend on
+// how long the meter runs. It measures:
+// - Sample peak and RMS level per channel, since the last reset_levels()
+// - True peak per channel, also since the last reset_levels(), by 4x
+//   oversampling as described in ITU-R BS.1770-4 Annex 2
+// - EBU R128 momentary (400ms), short-term (3s) and integrated loudness, with
+//   K-weighting and the BS.1770 absolute and relative gates. These are
+//   updated every 100ms of input.
+// Data is just a stream of frames, so the meter can be fed blocks from
+// AudioCapture, or blocks on their way to AudioStream::add_frames.
+class LoudnessMeter {
+public:
+  LoudnessMeter(uint32_t sample_rate, size_t num_channels);
+  ~LoudnessMeter() = default;
+
+  // samples is interleaved
+  void process(const float* samples, size_t frame_count);
+  // Same as above, but for data in any AL format (in native byte order); the
+  // data is converted to float in small chunks on the stack
+  void process(const void* data, size_t frame_count, int format);
+
+  // Clears everything, as if no data had been processed
+  void reset();
+  // Clears only the peak, RMS and true peak levels
+  void reset_levels();
+
+  struct Levels {
+    float peak;
+    float rms;
+    // Never less than peak, since the oversampled signal includes the
+    // original samples
+    float true_peak;
+  };
+  Levels levels(size_t channel) const;
+
+  // These return -infinity if there isn't enough input yet (400ms for
+  // momentary, 3s for short-term, or one 400ms block above the absolute gate
+  // for integrated loudness)
+  double momentary_lufs() const;
+  double short_term_lufs() const;
+  double integrated_lufs() const;
+
+  size_t get_num_channels() const;
+
+  // Converts a linear level to dB (-infinity for 0)
+  static double to_db(double level);
+
+private:
+  static constexpr size_t MAX_CHANNELS = 2;
+  static constexpr size_t TRUE_PEAK_PHASES = 4;
+  static constexpr size_t TRUE_PEAK_TAPS = 12; // Per phase
+  static constexpr size_t MOMENTARY_SUB_BLOCKS = 4; // 100ms each
+  static constexpr size_t SHORT_TERM_SUB_BLOCKS = 30;
+  // The gating histogram has one bin per 0.1 LU from the absolute gate
+  // (-70 LUFS) up to +5 LUFS; louder blocks go in the last bin
+  static constexpr double ABSOLUTE_GATE_LUFS = -70.0;
+  static constexpr size_t HISTOGRAM_BINS_PER_LU = 10;
+  static constexpr size_t HISTOGRAM_BINS = 75 * HISTOGRAM_BINS_PER_LU;
+
+  struct Biquad {
+    double b0, b1, b2, a1, a2;
+  };
+
+  void update_levels(const float* samples, size_t frame_count);
+  void update_true_peak(const float* samples, size_t frame_count);
+  void finish_sub_block();
+  double mean_energy(size_t num_sub_blocks) const;
+  static double lufs_for_energy(double energy);
+
+  uint32_t sample_rate;
+  size_t num_channels;
+
+  // K-weighting: a high shelf followed by a high-pass filter. The state is
+  // two values per filter (transposed direct form II) for each channel.
+  Biquad shelf_filter;
+  Biquad highpass_filter;
+  double filter_state[MAX_CHANNELS][4];
+
+  // Levels since reset_levels()
+  float peak[MAX_CHANNELS];
+  double sum_squares[MAX_CHANNELS];
+  float true_peak[MAX_CHANNELS];
+  uint64_t level_frames;
+
+  // The true peak filter is polyphase: each phase's taps are applied to the
+  // last TRUE_PEAK_TAPS input samples, so only the last TRUE_PEAK_TAPS - 1
+  // samples of each channel need to be kept between calls.
+  float true_peak_coeffs[TRUE_PEAK_PHASES][TRUE_PEAK_TAPS];
+  float true_peak_history[MAX_CHANNELS][TRUE_PEAK_TAPS - 1];
+
+  // Gating. Each 100ms sub-block's channel-weighted mean square goes into a
+  // ring; each 400ms gating block (4 sub-blocks, so they overlap by 75%) goes
+  // into the histogram.
+  size_t sub_block_frames;
+  size_t sub_block_frames_done;
+  double sub_block_energy[MAX_CHANNELS];
+  double sub_block_ring[SHORT_TERM_SUB_BLOCKS];
+  size_t sub_block_ring_pos;
+  uint64_t num_sub_blocks;
+  uint64_t histogram_counts[HISTOGRAM_BINS];
+  double histogram_energy[HISTOGRAM_BINS];
+};
+
+} // namespace phosg_audio
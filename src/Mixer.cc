@@ -0,0 +1,349 @@
+#include "Mixer.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "Convert.hh"
+#include "Format.hh"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PHOSG_AUDIO_MIXER_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PHOSG_AUDIO_MIXER_NEON
+#endif
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Accumulation kernels. dst is always interleaved stereo. The vector paths
+// do a separate multiply and add per sample, just like the scalar tails, so
+// the result for each frame doesn't depend on where a block boundary falls.
+
+static void accumulate_mono(float* dst, const float* src, size_t frame_count, float left_gain, float right_gain) {
+  size_t x = 0;
+#if defined(PHOSG_AUDIO_MIXER_SSE)
+  __m128 gains = _mm_setr_ps(left_gain, right_gain, left_gain, right_gain);
+  for (; x + 4 <= frame_count; x += 4) {
+    __m128 in = _mm_loadu_ps(&src[x]);
+    __m128 lo = _mm_unpacklo_ps(in, in);
+    __m128 hi = _mm_unpackhi_ps(in, in);
+    _mm_storeu_ps(&dst[x * 2], _mm_add_ps(_mm_loadu_ps(&dst[x * 2]), _mm_mul_ps(lo, gains)));
+    _mm_storeu_ps(&dst[x * 2 + 4], _mm_add_ps(_mm_loadu_ps(&dst[x * 2 + 4]), _mm_mul_ps(hi, gains)));
+  }
+#elif defined(PHOSG_AUDIO_MIXER_NEON)
+  float32x4_t left_gains = vdupq_n_f32(left_gain);
+  float32x4_t right_gains = vdupq_n_f32(right_gain);
+  for (; x + 4 <= frame_count; x += 4) {
+    float32x4_t in = vld1q_f32(&src[x]);
+    float32x4x2_t out = vld2q_f32(&dst[x * 2]);
+    out.val[0] = vaddq_f32(out.val[0], vmulq_f32(in, left_gains));
+    out.val[1] = vaddq_f32(out.val[1], vmulq_f32(in, right_gains));
+    vst2q_f32(&dst[x * 2], out);
+  }
+#endif
+  for (; x < frame_count; x++) {
+    float l = src[x] * left_gain;
+    float r = src[x] * right_gain;
+    dst[x * 2] += l;
+    dst[x * 2 + 1] += r;
+  }
+}
+
+static void accumulate_stereo(float* dst, const float* src, size_t frame_count, float left_gain, float right_gain) {
+  size_t x = 0;
+#if defined(PHOSG_AUDIO_MIXER_SSE)
+  __m128 gains = _mm_setr_ps(left_gain, right_gain, left_gain, right_gain);
+  for (; x + 2 <= frame_count; x += 2) {
+    __m128 in = _mm_loadu_ps(&src[x * 2]);
+    _mm_storeu_ps(&dst[x * 2], _mm_add_ps(_mm_loadu_ps(&dst[x * 2]), _mm_mul_ps(in, gains)));
+  }
+#elif defined(PHOSG_AUDIO_MIXER_NEON)
+  float32x4_t gains = {left_gain, right_gain, left_gain, right_gain};
+  for (; x + 2 <= frame_count; x += 2) {
+    float32x4_t in = vld1q_f32(&src[x * 2]);
+    vst1q_f32(&dst[x * 2], vaddq_f32(vld1q_f32(&dst[x * 2]), vmulq_f32(in, gains)));
+  }
+#endif
+  for (; x < frame_count; x++) {
+    float l = src[x * 2] * left_gain;
+    float r = src[x * 2 + 1] * right_gain;
+    dst[x * 2] += l;
+    dst[x * 2 + 1] += r;
+  }
+}
+
+// These are the same as the above, but also multiply each frame by an envelope
+// value. The envelope is applied before the channel gain in all paths.
+
+static void accumulate_mono_env(float* dst, const float* src, const float* env, size_t frame_count, float left_gain, float right_gain) {
+  size_t x = 0;
+#if defined(PHOSG_AUDIO_MIXER_SSE)
+  __m128 gains = _mm_setr_ps(left_gain, right_gain, left_gain, right_gain);
+  for (; x + 4 <= frame_count; x += 4) {
+    __m128 in = _mm_mul_ps(_mm_loadu_ps(&src[x]), _mm_loadu_ps(&env[x]));
+    __m128 lo = _mm_unpacklo_ps(in, in);
+    __m128 hi = _mm_unpackhi_ps(in, in);
+    _mm_storeu_ps(&dst[x * 2], _mm_add_ps(_mm_loadu_ps(&dst[x * 2]), _mm_mul_ps(lo, gains)));
+    _mm_storeu_ps(&dst[x * 2 + 4], _mm_add_ps(_mm_loadu_ps(&dst[x * 2 + 4]), _mm_mul_ps(hi, gains)));
+  }
+#elif defined(PHOSG_AUDIO_MIXER_NEON)
+  float32x4_t left_gains = vdupq_n_f32(left_gain);
+  float32x4_t right_gains = vdupq_n_f32(right_gain);
+  for (; x + 4 <= frame_count; x += 4) {
+    float32x4_t in = vmulq_f32(vld1q_f32(&src[x]), vld1q_f32(&env[x]));
+    float32x4x2_t out = vld2q_f32(&dst[x * 2]);
+    out.val[0] = vaddq_f32(out.val[0], vmulq_f32(in, left_gains));
+    out.val[1] = vaddq_f32(out.val[1], vmulq_f32(in, right_gains));
+    vst2q_f32(&dst[x * 2], out);
+  }
+#endif
+  for (; x < frame_count; x++) {
+    float in = src[x] * env[x];
+    float l = in * left_gain;
+    float r = in * right_gain;
+    dst[x * 2] += l;
+    dst[x * 2 + 1] += r;
+  }
+}
+
+static void accumulate_stereo_env(float* dst, const float* src, const float* env, size_t frame_count, float left_gain, float right_gain) {
+  size_t x = 0;
+#if defined(PHOSG_AUDIO_MIXER_SSE)
+  __m128 gains = _mm_setr_ps(left_gain, right_gain, left_gain, right_gain);
+  for (; x + 2 <= frame_count; x += 2) {
+    __m128 e = _mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&env[x])));
+    __m128 in = _mm_mul_ps(_mm_loadu_ps(&src[x * 2]), _mm_unpacklo_ps(e, e));
+    _mm_storeu_ps(&dst[x * 2], _mm_add_ps(_mm_loadu_ps(&dst[x * 2]), _mm_mul_ps(in, gains)));
+  }
+#elif defined(PHOSG_AUDIO_MIXER_NEON)
+  float32x4_t gains = {left_gain, right_gain, left_gain, right_gain};
+  for (; x + 2 <= frame_count; x += 2) {
+    float32x2_t e = vld1_f32(&env[x]);
+    float32x4_t in = vmulq_f32(vld1q_f32(&src[x * 2]), vcombine_f32(vdup_lane_f32(e, 0), vdup_lane_f32(e, 1)));
+    vst1q_f32(&dst[x * 2], vaddq_f32(vld1q_f32(&dst[x * 2]), vmulq_f32(in, gains)));
+  }
+#endif
+  for (; x < frame_count; x++) {
+    float in_l = src[x * 2] * env[x];
+    float in_r = src[x * 2 + 1] * env[x];
+    float l = in_l * left_gain;
+    float r = in_r * right_gain;
+    dst[x * 2] += l;
+    dst[x * 2 + 1] += r;
+  }
+}
+
+static float envelope_value(const MixerVoice& voice, size_t offset) {
+  float ret = 1.0f;
+  if (offset < voice.fade_in_frames) {
+    ret = static_cast<float>(offset) / voice.fade_in_frames;
+  }
+  size_t remaining = voice.frame_count - offset;
+  if (remaining < voice.fade_out_frames) {
+    ret = min(ret, static_cast<float>(remaining) / voice.fade_out_frames);
+  }
+  return ret;
+}
+
+Limiter::Limiter(uint32_t sample_rate, float threshold, float release_seconds)
+    : threshold(threshold),
+      release_coeff(expf(-1.0f / (release_seconds * sample_rate))),
+      gain(1.0f) {}
+
+void Limiter::process(float* frames, size_t frame_count) {
+  for (size_t x = 0; x < frame_count; x++) {
+    float* frame = &frames[x * 2];
+    float peak = max(fabsf(frame[0]), fabsf(frame[1]));
+    float target = (peak > this->threshold) ? (this->threshold / peak) : 1.0f;
+    if (target < this->gain) {
+      this->gain = target;
+    } else {
+      this->gain = target + (this->gain - target) * this->release_coeff;
+    }
+    frame[0] *= this->gain;
+    frame[1] *= this->gain;
+  }
+}
+
+void Limiter::reset() {
+  this->gain = 1.0f;
+}
+
+float Limiter::current_gain() const {
+  return this->gain;
+}
+
+SoftwareMixer::SoftwareMixer(uint32_t sample_rate)
+    : sample_rate(sample_rate),
+      limiter_enabled(true),
+      limiter(sample_rate),
+      position(0) {}
+
+size_t SoftwareMixer::add_voice(shared_ptr<const vector<float>> samples,
+    size_t num_channels, size_t start_frame, float gain, float pan) {
+  if ((num_channels != 1) && (num_channels != 2)) {
+    throw invalid_argument("mixer voices must be mono or stereo");
+  }
+  if (pan < -1.0f) {
+    pan = -1.0f;
+  } else if (pan > 1.0f) {
+    pan = 1.0f;
+  }
+
+  auto& voice = this->voices.emplace_back();
+  voice.frame_count = samples->size() / num_channels;
+  voice.samples = std::move(samples);
+  voice.num_channels = num_channels;
+  voice.start_frame = start_frame;
+  voice.gain = gain;
+  voice.pan = pan;
+  voice.fade_in_frames = 0;
+  voice.fade_out_frames = 0;
+  return this->voices.size() - 1;
+}
+
+size_t SoftwareMixer::add_voice(shared_ptr<const WAVContents> wav,
+    size_t start_frame, float gain, float pan) {
+  if (wav->sample_rate != this->sample_rate) {
+    throw invalid_argument("voice sample rate does not match mixer sample rate");
+  }
+  // Share the WAV's sample vector without copying it
+  shared_ptr<const vector<float>> samples(wav, &wav->samples);
+  return this->add_voice(std::move(samples), wav->num_channels, start_frame, gain, pan);
+}
+
+void SoftwareMixer::set_envelope(size_t voice_index, size_t fade_in_frames, size_t fade_out_frames) {
+  auto& voice = this->voices.at(voice_index);
+  voice.fade_in_frames = min(fade_in_frames, voice.frame_count);
+  voice.fade_out_frames = min(fade_out_frames, voice.frame_count);
+}
+
+const vector<MixerVoice>& SoftwareMixer::get_voices() const {
+  return this->voices;
+}
+
+void SoftwareMixer::clear_voices() {
+  this->voices.clear();
+}
+
+void SoftwareMixer::set_limiter_enabled(bool enabled) {
+  this->limiter_enabled = enabled;
+}
+
+void SoftwareMixer::set_limiter(float threshold, float release_seconds) {
+  this->limiter = Limiter(this->sample_rate, threshold, release_seconds);
+}
+
+uint32_t SoftwareMixer::get_sample_rate() const {
+  return this->sample_rate;
+}
+
+size_t SoftwareMixer::total_frames() const {
+  size_t ret = 0;
+  for (const auto& voice : this->voices) {
+    ret = max<size_t>(ret, voice.start_frame + voice.frame_count);
+  }
+  return ret;
+}
+
+void SoftwareMixer::mix(float* output, size_t start_frame, size_t frame_count, vector<float>& scratch) const {
+  memset(output, 0, frame_count * 2 * sizeof(float));
+  size_t end_frame = start_frame + frame_count;
+
+  for (const auto& voice : this->voices) {
+    size_t voice_end_frame = voice.start_frame + voice.frame_count;
+    if ((voice_end_frame <= start_frame) || (voice.start_frame >= end_frame)) {
+      continue;
+    }
+    size_t overlap_start = max(start_frame, voice.start_frame);
+    size_t overlap_end = min(end_frame, voice_end_frame);
+
+    size_t overlap_frames = overlap_end - overlap_start;
+    size_t voice_offset = overlap_start - voice.start_frame;
+    float* dst = &output[(overlap_start - start_frame) * 2];
+    const float* src = voice.samples->data() + voice_offset * voice.num_channels;
+
+    float left_gain, right_gain;
+    if (voice.num_channels == 1) {
+      // Constant-power pan law for mono sources
+      float angle = (voice.pan + 1.0f) * 0.78539816339744831f;
+      left_gain = voice.gain * cosf(angle);
+      right_gain = voice.gain * sinf(angle);
+    } else {
+      // Balance for stereo sources: attenuate the opposite channel
+      left_gain = voice.gain * min(1.0f, 1.0f - voice.pan);
+      right_gain = voice.gain * min(1.0f, 1.0f + voice.pan);
+    }
+
+    if (voice.fade_in_frames || voice.fade_out_frames) {
+      if (scratch.size() < overlap_frames) {
+        scratch.resize(overlap_frames);
+      }
+      for (size_t x = 0; x < overlap_frames; x++) {
+        scratch[x] = envelope_value(voice, voice_offset + x);
+      }
+      if (voice.num_channels == 1) {
+        accumulate_mono_env(dst, src, scratch.data(), overlap_frames, left_gain, right_gain);
+      } else {
+        accumulate_stereo_env(dst, src, scratch.data(), overlap_frames, left_gain, right_gain);
+      }
+    } else if (voice.num_channels == 1) {
+      accumulate_mono(dst, src, overlap_frames, left_gain, right_gain);
+    } else {
+      accumulate_stereo(dst, src, overlap_frames, left_gain, right_gain);
+    }
+  }
+}
+
+void SoftwareMixer::finish(float* frames, size_t frame_count) {
+  if (this->limiter_enabled) {
+    this->limiter.process(frames, frame_count);
+  }
+  this->position += frame_count;
+}
+
+void SoftwareMixer::render(float* output, size_t frame_count) {
+  this->mix(output, this->position, frame_count, this->envelope_scratch);
+  this->finish(output, frame_count);
+}
+
+void SoftwareMixer::render_s16(int16_t* output, size_t frame_count) {
+  this->render_format(output, AL_FORMAT_STEREO16, frame_count);
+}
+
+void SoftwareMixer::render_format(void* output, int format, size_t frame_count) {
+  this->format_scratch.resize(frame_count * 2);
+  this->render(this->format_scratch.data(), frame_count);
+  convert_frames(output, format, this->format_scratch.data(), AL_FORMAT_STEREO_FLOAT32, frame_count);
+}
+
+vector<float> SoftwareMixer::render_all() {
+  size_t total = this->total_frames();
+  size_t frame_count = (total > this->position) ? (total - this->position) : 0;
+  vector<float> ret(frame_count * 2);
+  this->render(ret.data(), frame_count);
+  return ret;
+}
+
+vector<int16_t> SoftwareMixer::render_all_s16() {
+  auto float_samples = this->render_all();
+  vector<int16_t> ret(float_samples.size());
+  convert_samples_f32_to_s16(ret.data(), float_samples.data(), float_samples.size());
+  return ret;
+}
+
+size_t SoftwareMixer::get_position() const {
+  return this->position;
+}
+
+void SoftwareMixer::seek(size_t frame) {
+  this->position = frame;
+  this->limiter.reset();
+}
+
+} // namespace phosg_audio
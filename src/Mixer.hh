@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "File.hh"
+
+namespace phosg_audio {
+
+// Peak limiter for interleaved stereo float data. Gain reduction is applied
+// instantly when a frame would exceed the threshold, so the output never
+// exceeds it; the gain then recovers exponentially with the release time.
+class Limiter {
+public:
+  explicit Limiter(uint32_t sample_rate, float threshold = 1.0f, float release_seconds = 0.05f);
+  ~Limiter() = default;
+
+  void process(float* frames, size_t frame_count);
+  void reset();
+
+  float current_gain() const;
+
+private:
+  float threshold;
+  float release_coeff;
+  float gain;
+};
+
+// A sound placed on the mixer's timeline. Samples are shared, not copied, and
+// must already be at the mixer's sample rate.
+struct MixerVoice {
+  std::shared_ptr<const std::vector<float>> samples; // Interleaved
+  size_t num_channels; // 1 or 2
+  size_t frame_count;
+  size_t start_frame; // Offset into the output, in frames
+  float gain;
+  float pan; // -1.0 = left, 0.0 = center, 1.0 = right
+  // Linear fades at the start and end of the voice. The envelope is computed
+  // from the frame's offset within the voice, so rendering a voice in pieces
+  // gives the same result as rendering it all at once.
+  size_t fade_in_frames;
+  size_t fade_out_frames;
+};
+
+// Mixes any number of voices into interleaved stereo output entirely in
+// software, as fast as the CPU allows. No audio device or AL context is needed.
+class SoftwareMixer {
+public:
+  explicit SoftwareMixer(uint32_t sample_rate);
+  ~SoftwareMixer() = default;
+
+  // These return the index of the new voice
+  size_t add_voice(std::shared_ptr<const std::vector<float>> samples, size_t num_channels,
+      size_t start_frame = 0, float gain = 1.0, float pan = 0.0);
+  size_t add_voice(std::shared_ptr<const WAVContents> wav, size_t start_frame = 0,
+      float gain = 1.0, float pan = 0.0);
+  void set_envelope(size_t voice_index, size_t fade_in_frames, size_t fade_out_frames);
+  const std::vector<MixerVoice>& get_voices() const;
+  void clear_voices();
+
+  void set_limiter_enabled(bool enabled);
+  void set_limiter(float threshold, float release_seconds);
+
+  uint32_t get_sample_rate() const;
+  // Returns the frame at which the last voice ends
+  size_t total_frames() const;
+
+  // Mixes frame_count frames starting at start_frame into output (which must
+  // have room for frame_count * 2 samples), without applying the limiter.
+  // This function has no side effects, so disjoint ranges can be mixed in any
+  // order (or concurrently) and the results are identical to mixing the whole
+  // range at once. scratch is used for envelope computation; concurrent
+  // callers must each pass their own.
+  void mix(float* output, size_t start_frame, size_t frame_count, std::vector<float>& scratch) const;
+  // Applies the limiter (if enabled) to frames that were produced by mix(),
+  // and advances the mixer's position past them. Frames must be passed to
+  // this function in timeline order, starting at the current position.
+  void finish(float* frames, size_t frame_count);
+
+  // These mix and limit the next frame_count frames, advancing the mixer's
+  // position. render_s16 and render_format need no extra allocation after the
+  // first call with a given block size.
+  void render(float* output, size_t frame_count);
+  void render_s16(int16_t* output, size_t frame_count);
+  // Renders in any AL format (mono formats get the average of both channels)
+  void render_format(void* output, int format, size_t frame_count);
+  // Renders from the current position to the end of the last voice
+  std::vector<float> render_all();
+  std::vector<int16_t> render_all_s16();
+
+  size_t get_position() const;
+  void seek(size_t frame);
+
+private:
+  uint32_t sample_rate;
+  std::vector<MixerVoice> voices;
+  bool limiter_enabled;
+  Limiter limiter;
+  size_t position;
+  std::vector<float> envelope_scratch;
+  std::vector<float> format_scratch;
+};
+
+} // namespace phosg_audio
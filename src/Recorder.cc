@@ -0,0 +1,276 @@
+#include "Recorder.hh"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <chrono>
+#include <format>
+#include <stdexcept>
+
+using namespace std;
+
+namespace phosg_audio {
+
+AudioRecorder::AudioRecorder(const string& filename, int sample_rate, int format,
+    double segment_seconds, size_t block_frames, size_t num_blocks,
+    double header_update_seconds)
+    : filename(filename),
+      sample_rate(sample_rate),
+      format(format),
+      frame_bytes(bytes_per_frame(format)),
+      segment_frames(static_cast<uint64_t>(segment_seconds * sample_rate)),
+      header_update_interval_ns(static_cast<uint64_t>(header_update_seconds * 1000000000.0)),
+      block_bytes(block_frames * this->frame_bytes),
+      num_blocks(num_blocks),
+      block_data(nullptr, free),
+      block_sizes(num_blocks, 0),
+      free_blocks(num_blocks * sizeof(uint32_t)),
+      full_blocks(num_blocks * sizeof(uint32_t)),
+      current_block(-1),
+      current_block_bytes(0),
+      segment_index(0),
+      frames_in_segment(0),
+      frames_recorded(0),
+      frames_dropped(0),
+      bytes_written(0),
+      files_written(0),
+      max_queued_blocks(0),
+      should_exit(false),
+      stopped(false) {
+  if ((block_frames == 0) || (num_blocks == 0)) {
+    throw invalid_argument("recorder must have at least one nonempty block");
+  }
+  if (segment_seconds < 0.0) {
+    throw invalid_argument("segment duration must not be negative");
+  }
+
+  size_t pool_bytes = (this->block_bytes * this->num_blocks + WAVWriter::ALIGNMENT - 1) & ~(WAVWriter::ALIGNMENT - 1);
+  this->block_data.reset(reinterpret_cast<uint8_t*>(aligned_alloc(WAVWriter::ALIGNMENT, pool_bytes)));
+  if (!this->block_data) {
+    throw bad_alloc();
+  }
+  for (uint32_t x = 0; x < this->num_blocks; x++) {
+    this->free_blocks.write(&x, sizeof(x));
+  }
+
+  // Open the first file here, so errors like a bad path are reported to the
+  // caller instead of being deferred to stop()
+  this->writer = make_unique<WAVWriter>(this->segment_filename(0), this->sample_rate,
+      1 + is_stereo(this->format), bytes_per_sample(this->format) * 8, is_32bit(this->format));
+  this->files_written++;
+
+  this->io_thread = thread(&AudioRecorder::io_thread_fn, this);
+}
+
+AudioRecorder::~AudioRecorder() {
+  try {
+    this->stop();
+  } catch (const exception&) {
+  }
+}
+
+void AudioRecorder::add_frames(const void* data, size_t frame_count) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+  size_t bytes_remaining = frame_count * this->frame_bytes;
+  while (bytes_remaining) {
+    if (this->current_block < 0) {
+      uint32_t block_index;
+      if (!this->pop_block(this->free_blocks, &block_index)) {
+        this->frames_dropped += bytes_remaining / this->frame_bytes;
+        return;
+      }
+      this->current_block = block_index;
+      this->current_block_bytes = 0;
+    }
+
+    uint8_t* dest = this->block_data.get() + this->current_block * this->block_bytes;
+    size_t bytes = min(bytes_remaining, this->block_bytes - this->current_block_bytes);
+    memcpy(dest + this->current_block_bytes, src, bytes);
+    this->current_block_bytes += bytes;
+    src += bytes;
+    bytes_remaining -= bytes;
+
+    if (this->current_block_bytes == this->block_bytes) {
+      this->push_block();
+    }
+  }
+}
+
+AudioCapture::BlockCallback AudioRecorder::capture_callback() {
+  return [this](const void* data, size_t frame_count, const AudioCapture::BlockInfo&) -> void {
+    this->add_frames(data, frame_count);
+  };
+}
+
+void AudioRecorder::stop() {
+  if (this->stopped) {
+    return;
+  }
+  this->stopped = true;
+
+  if ((this->current_block >= 0) && this->current_block_bytes) {
+    this->push_block();
+  }
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+  }
+  this->io_cv.notify_all();
+  this->io_thread.join();
+
+  if (this->io_error) {
+    rethrow_exception(this->io_error);
+  }
+}
+
+AudioRecorder::Stats AudioRecorder::get_stats() const {
+  Stats ret;
+  ret.frames_recorded = this->frames_recorded.load();
+  ret.frames_dropped = this->frames_dropped.load();
+  ret.bytes_written = this->bytes_written.load();
+  ret.files_written = this->files_written.load();
+  ret.queued_blocks = this->full_blocks.size() / sizeof(uint32_t);
+  ret.max_queued_blocks = this->max_queued_blocks.load();
+  ret.num_blocks = this->num_blocks;
+  ret.write_p50_usecs = static_cast<double>(this->write_durations_ns.percentile(50)) / 1000.0;
+  ret.write_p99_usecs = static_cast<double>(this->write_durations_ns.percentile(99)) / 1000.0;
+  ret.write_max_usecs = static_cast<double>(this->write_durations_ns.max()) / 1000.0;
+  return ret;
+}
+
+const AtomicHistogram& AudioRecorder::write_duration_histogram() const {
+  return this->write_durations_ns;
+}
+
+string AudioRecorder::segment_filename(size_t segment_index) const {
+  if ((this->segment_frames == 0) && (segment_index == 0)) {
+    return this->filename;
+  }
+  size_t base_length = this->filename.size();
+  if ((base_length >= 4) && !strcasecmp(this->filename.c_str() + base_length - 4, ".wav")) {
+    base_length -= 4;
+  }
+  return std::format("{}.{:04}.wav", this->filename.substr(0, base_length), segment_index);
+}
+
+void AudioRecorder::push_block() {
+  uint32_t block_index = this->current_block;
+  this->block_sizes[block_index] = this->current_block_bytes;
+  this->full_blocks.write(&block_index, sizeof(block_index));
+  this->current_block = -1;
+  this->current_block_bytes = 0;
+
+  size_t queued = this->full_blocks.size() / sizeof(uint32_t);
+  size_t prev_max = this->max_queued_blocks.load();
+  while ((queued > prev_max) && !this->max_queued_blocks.compare_exchange_weak(prev_max, queued)) {
+  }
+
+  // This doesn't take the lock, so the I/O thread can occasionally miss the
+  // notification; it also wakes up periodically, so it will catch up soon
+  this->io_cv.notify_one();
+}
+
+bool AudioRecorder::pop_block(SPSCRingBuffer& ring, uint32_t* block_index) {
+  if (ring.size() < sizeof(uint32_t)) {
+    return false;
+  }
+  ring.read(block_index, sizeof(uint32_t));
+  return true;
+}
+
+void AudioRecorder::write_block(const uint8_t* data, size_t size) {
+  while (size) {
+    if (!this->writer) {
+      this->writer = make_unique<WAVWriter>(this->segment_filename(this->segment_index), this->sample_rate,
+          1 + is_stereo(this->format), bytes_per_sample(this->format) * 8, is_32bit(this->format));
+      this->files_written++;
+      this->frames_in_segment = 0;
+    }
+
+    uint64_t max_frames = (WAVWriter::MAX_DATA_BYTES - this->writer->data_bytes()) / this->frame_bytes;
+    if (this->segment_frames) {
+      max_frames = min(max_frames, this->segment_frames - this->frames_in_segment);
+    }
+    size_t frames = min<uint64_t>(size / this->frame_bytes, max_frames);
+    size_t bytes = frames * this->frame_bytes;
+    this->writer->write(data, bytes);
+    this->frames_recorded += frames;
+    this->bytes_written += bytes;
+    this->frames_in_segment += frames;
+    data += bytes;
+    size -= bytes;
+
+    if (frames == max_frames) {
+      this->writer->close();
+      this->writer.reset();
+      this->segment_index++;
+    }
+  }
+}
+
+void AudioRecorder::io_thread_fn() {
+  auto max_sleep = chrono::duration_cast<chrono::steady_clock::duration>(
+      chrono::nanoseconds(min<uint64_t>(this->header_update_interval_ns, 100000000)));
+  uint64_t last_header_update_time = monotonic_now_ns();
+
+  unique_lock<mutex> g(this->lock);
+  for (;;) {
+    // If we're exiting, the producer has already pushed its last block, so
+    // one more pass writes everything
+    bool exiting = this->should_exit;
+    g.unlock();
+
+    uint32_t block_index;
+    while (this->pop_block(this->full_blocks, &block_index)) {
+      const uint8_t* data = this->block_data.get() + block_index * this->block_bytes;
+      size_t size = this->block_sizes[block_index];
+      if (!this->io_error) {
+        uint64_t frames_before = this->frames_recorded.load();
+        uint64_t start = monotonic_now_ns();
+        try {
+          this->write_block(data, size);
+        } catch (const exception&) {
+          this->io_error = current_exception();
+          this->frames_dropped += (size / this->frame_bytes) - (this->frames_recorded.load() - frames_before);
+        }
+        this->write_durations_ns.add(monotonic_now_ns() - start);
+      } else {
+        this->frames_dropped += size / this->frame_bytes;
+      }
+      this->free_blocks.write(&block_index, sizeof(block_index));
+    }
+
+    uint64_t now = monotonic_now_ns();
+    if (!this->io_error && this->writer && (now - last_header_update_time >= this->header_update_interval_ns)) {
+      try {
+        this->writer->update_header();
+      } catch (const exception&) {
+        this->io_error = current_exception();
+      }
+      last_header_update_time = now;
+    }
+
+    g.lock();
+    if (exiting) {
+      break;
+    }
+    this->io_cv.wait_for(g, max_sleep, [&]() -> bool {
+      return this->should_exit || (this->full_blocks.size() >= sizeof(uint32_t));
+    });
+  }
+  g.unlock();
+
+  if (this->writer) {
+    try {
+      this->writer->close();
+    } catch (const exception&) {
+      if (!this->io_error) {
+        this->io_error = current_exception();
+      }
+    }
+    this->writer.reset();
+  }
+}
+
+} // namespace phosg_audio
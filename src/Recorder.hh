@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Capture.hh"
+#include "File.hh"
+#include "RingBuffer.hh"
+#include "Stats.hh"
+
+namespace phosg_audio {
+
+// Records captured audio to WAV files without ever blocking the capture
+// thread on storage. The capture thread copies frames into blocks taken from
+// a fixed pool and hands full blocks to an I/O thread through a lock-free
+// queue; the I/O thread writes them with WAVWriter and returns them to the
+// pool. If the disk falls so far behind that no block is free, frames are
+// dropped (and counted) instead of waiting.
+class AudioRecorder {
+public:
+  // format must be one of the AL_FORMAT_* constants; 8-bit, 16-bit and float
+  // formats are all supported. If segment_seconds is nonzero, a new file is
+  // started each time that much audio has been written, and the files are
+  // named by inserting a 4-digit segment number before the .wav extension
+  // (e.g. rec.wav becomes rec.0000.wav, rec.0001.wav, etc.). A new segment is
+  // also started if a file would exceed the WAV format's size limit. The
+  // header of the current file is updated every header_update_seconds.
+  AudioRecorder(const std::string& filename, int sample_rate, int format,
+      double segment_seconds = 0.0, size_t block_frames = 4096, size_t num_blocks = 64,
+      double header_update_seconds = 1.0);
+  ~AudioRecorder();
+
+  AudioRecorder(const AudioRecorder&) = delete;
+  AudioRecorder(AudioRecorder&&) = delete;
+  AudioRecorder& operator=(const AudioRecorder&) = delete;
+  AudioRecorder& operator=(AudioRecorder&&) = delete;
+
+  // Only one thread may call add_frames. It never blocks or allocates.
+  void add_frames(const void* data, size_t frame_count);
+  // Returns a callback that can be passed to AudioCapture's constructor to
+  // record everything it captures. The recorder must outlive the capture.
+  AudioCapture::BlockCallback capture_callback();
+
+  // Writes everything that has been added, closes the current file, and stops
+  // the I/O thread. add_frames must not be called during or after this call.
+  // If the I/O thread failed to write, this rethrows the error (in that case,
+  // all frames after the error are counted as dropped). The destructor calls
+  // this but ignores errors.
+  void stop();
+
+  struct Stats {
+    uint64_t frames_recorded; // Written to a file (or staged by WAVWriter)
+    uint64_t frames_dropped; // Lost because no block was free, or after an error
+    uint64_t bytes_written;
+    uint64_t files_written; // Including the current file
+    // Back-pressure: blocks waiting to be written now, and the most that have
+    // ever been waiting at once, out of num_blocks
+    size_t queued_blocks;
+    size_t max_queued_blocks;
+    size_t num_blocks;
+    double write_p50_usecs;
+    double write_p99_usecs;
+    double write_max_usecs;
+  };
+  Stats get_stats() const;
+  // Duration of each block's write on the I/O thread, in nanoseconds
+  const AtomicHistogram& write_duration_histogram() const;
+
+  std::string segment_filename(size_t segment_index) const;
+
+private:
+  void push_block();
+  bool pop_block(SPSCRingBuffer& ring, uint32_t* block_index);
+  void write_block(const uint8_t* data, size_t size);
+  void io_thread_fn();
+
+  std::string filename;
+  int sample_rate;
+  int format;
+  size_t frame_bytes;
+  uint64_t segment_frames; // 0 = no segmenting
+  uint64_t header_update_interval_ns;
+  size_t block_bytes;
+  size_t num_blocks;
+
+  // Block pool. free_blocks carries block indexes from the I/O thread to the
+  // producer, and full_blocks carries them back; block_sizes[x] is written by
+  // the producer before block x is pushed to full_blocks.
+  std::unique_ptr<uint8_t, void (*)(void*)> block_data;
+  std::vector<size_t> block_sizes;
+  SPSCRingBuffer free_blocks;
+  SPSCRingBuffer full_blocks;
+  int64_t current_block; // Producer side; -1 = none
+  size_t current_block_bytes; // Producer side
+
+  // I/O thread state
+  std::unique_ptr<WAVWriter> writer;
+  size_t segment_index;
+  uint64_t frames_in_segment;
+  std::exception_ptr io_error;
+
+  std::atomic<uint64_t> frames_recorded;
+  std::atomic<uint64_t> frames_dropped;
+  std::atomic<uint64_t> bytes_written;
+  std::atomic<uint64_t> files_written;
+  std::atomic<size_t> max_queued_blocks;
+  AtomicHistogram write_durations_ns;
+
+  std::mutex lock;
+  std::condition_variable io_cv;
+  bool should_exit;
+  bool stopped;
+  std::thread io_thread;
+};
+
+} // namespace phosg_audio
@@ -0,0 +1,144 @@
+#include "Renderer.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace phosg_audio {
+
+ParallelRenderer::ParallelRenderer(size_t num_threads, size_t chunk_frames)
+    : num_threads(num_threads ? num_threads : max<size_t>(thread::hardware_concurrency(), 1)),
+      chunk_frames(chunk_frames) {
+  if (this->chunk_frames == 0) {
+    throw invalid_argument("chunk size must not be zero");
+  }
+}
+
+void ParallelRenderer::render(SoftwareMixer& mixer, float* output, size_t frame_count) const {
+  size_t num_chunks = (frame_count + this->chunk_frames - 1) / this->chunk_frames;
+  size_t num_workers = min(this->num_threads, num_chunks);
+  if (num_workers <= 1) {
+    mixer.render(output, frame_count);
+    return;
+  }
+
+  size_t start_frame = mixer.get_position();
+  auto chunk_size = [&](size_t chunk) -> size_t {
+    return min(this->chunk_frames, frame_count - chunk * this->chunk_frames);
+  };
+
+  // Each worker starts with a contiguous run of chunks, so worker 0 produces
+  // the beginning of the timeline first and the limiter can start right away
+  struct WorkQueue {
+    mutex lock;
+    deque<size_t> chunks;
+  };
+  vector<WorkQueue> queues(num_workers);
+  for (size_t w = 0; w < num_workers; w++) {
+    size_t begin = (w * num_chunks) / num_workers;
+    size_t end = ((w + 1) * num_chunks) / num_workers;
+    for (size_t chunk = begin; chunk < end; chunk++) {
+      queues[w].chunks.emplace_back(chunk);
+    }
+  }
+
+  // Workers take chunks from the front of their own queue and steal from the
+  // back of other workers' queues when theirs is empty
+  auto take_chunk = [&](size_t w, size_t* chunk) -> bool {
+    {
+      lock_guard<mutex> g(queues[w].lock);
+      if (!queues[w].chunks.empty()) {
+        *chunk = queues[w].chunks.front();
+        queues[w].chunks.pop_front();
+        return true;
+      }
+    }
+    for (size_t offset = 1; offset < num_workers; offset++) {
+      auto& victim = queues[(w + offset) % num_workers];
+      lock_guard<mutex> g(victim.lock);
+      if (!victim.chunks.empty()) {
+        *chunk = victim.chunks.back();
+        victim.chunks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  };
+
+  unique_ptr<bool[]> chunk_done(new bool[num_chunks]());
+  mutex done_lock;
+  condition_variable done_cv;
+  exception_ptr worker_exc;
+
+  auto worker = [&](size_t w) -> void {
+    // Per-thread scratch space, reused for every chunk this worker renders
+    vector<float> scratch;
+    size_t chunk;
+    while (take_chunk(w, &chunk)) {
+      try {
+        mixer.mix(&output[chunk * this->chunk_frames * 2],
+            start_frame + chunk * this->chunk_frames, chunk_size(chunk), scratch);
+      } catch (...) {
+        lock_guard<mutex> g(done_lock);
+        if (!worker_exc) {
+          worker_exc = current_exception();
+        }
+      }
+      {
+        lock_guard<mutex> g(done_lock);
+        chunk_done[chunk] = true;
+      }
+      done_cv.notify_one();
+    }
+  };
+
+  vector<thread> threads;
+  threads.reserve(num_workers);
+  for (size_t w = 0; w < num_workers; w++) {
+    threads.emplace_back(worker, w);
+  }
+
+  // Run the limiter over the chunks in order as they become available
+  for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+    {
+      unique_lock<mutex> g(done_lock);
+      done_cv.wait(g, [&]() { return chunk_done[chunk] || worker_exc; });
+      if (worker_exc) {
+        break;
+      }
+    }
+    mixer.finish(&output[chunk * this->chunk_frames * 2], chunk_size(chunk));
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (worker_exc) {
+    rethrow_exception(worker_exc);
+  }
+}
+
+vector<float> ParallelRenderer::render_all(SoftwareMixer& mixer) const {
+  size_t total = mixer.total_frames();
+  size_t frame_count = (total > mixer.get_position()) ? (total - mixer.get_position()) : 0;
+  vector<float> ret(frame_count * 2);
+  this->render(mixer, ret.data(), frame_count);
+  return ret;
+}
+
+size_t ParallelRenderer::get_num_threads() const {
+  return this->num_threads;
+}
+
+size_t ParallelRenderer::get_chunk_frames() const {
+  return this->chunk_frames;
+}
+
+} // namespace phosg_audio
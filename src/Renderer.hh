@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "Mixer.hh"
+
+namespace phosg_audio {
+
+// Renders a SoftwareMixer's timeline on multiple threads. The timeline is split
+// into fixed-size chunks, which worker threads mix directly into their final
+// place in the output buffer; idle workers steal chunks from busy ones. The
+// calling thread runs the limiter over the chunks in timeline order as they
+// complete, so the output is bit-identical to SoftwareMixer::render.
+class ParallelRenderer {
+public:
+  // If num_threads is 0, one thread is used per hardware thread
+  explicit ParallelRenderer(size_t num_threads = 0, size_t chunk_frames = 0x10000);
+  ~ParallelRenderer() = default;
+
+  // These render from the mixer's current position and advance it, just like
+  // the SoftwareMixer functions of the same names.
+  void render(SoftwareMixer& mixer, float* output, size_t frame_count) const;
+  std::vector<float> render_all(SoftwareMixer& mixer) const;
+
+  size_t get_num_threads() const;
+  size_t get_chunk_frames() const;
+
+private:
+  size_t num_threads;
+  size_t chunk_frames;
+};
+
+} // namespace phosg_audio
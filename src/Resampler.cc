@@ -0,0 +1,140 @@
+#include "Resampler.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+namespace phosg_audio {
+
+// The cutoff is slightly below Nyquist so the transition band (whose width
+// depends on half_taps) is mostly above it
+static constexpr double CUTOFF_RATIO = 0.95;
+
+Resampler::Resampler(uint32_t input_rate, uint32_t output_rate, size_t num_channels, size_t half_taps)
+    : num_channels(num_channels),
+      half_taps(half_taps),
+      history_start(0),
+      input_frames(0),
+      output_frames(0),
+      flushed(false) {
+  if ((input_rate == 0) || (output_rate == 0)) {
+    throw invalid_argument("sample rates must be nonzero");
+  }
+  if (num_channels == 0) {
+    throw invalid_argument("resampler must have at least one channel");
+  }
+  if (half_taps == 0) {
+    throw invalid_argument("resampler must have at least one tap on each side");
+  }
+  uint32_t divisor = gcd(input_rate, output_rate);
+  this->input_rate = input_rate / divisor;
+  this->output_rate = output_rate / divisor;
+
+  // The filter's cutoff is in units of the input's Nyquist frequency, so it
+  // only needs to be lowered when downsampling
+  double cutoff = min(1.0, static_cast<double>(this->output_rate) / this->input_rate) * CUTOFF_RATIO;
+  size_t taps = half_taps * 2;
+  this->table.resize((PHASES + 1) * taps);
+  for (size_t p = 0; p <= PHASES; p++) {
+    float* row = &this->table[p * taps];
+    double frac = static_cast<double>(p) / PHASES;
+    double sum = 0.0;
+    for (size_t j = 0; j < taps; j++) {
+      // Distance from the output position to input frame i0 - (half_taps - 1) + j
+      double d = static_cast<double>(j) - static_cast<double>(half_taps - 1) - frac;
+      double x = M_PI * cutoff * d;
+      double sinc = (fabs(x) < 1e-9) ? 1.0 : (sin(x) / x);
+      double w = (d + half_taps) / taps; // 0 to 1 across the window
+      double blackman = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      row[j] = cutoff * sinc * blackman;
+      sum += row[j];
+    }
+    // Normalize each row so constant input gives exactly the same output
+    for (size_t j = 0; j < taps; j++) {
+      row[j] /= sum;
+    }
+  }
+  this->coeffs.resize(taps);
+
+  // Start with silence before the first frame, so the first output frames
+  // (which are centered on it) have a full window of input
+  this->history.assign((half_taps - 1) * num_channels, 0.0f);
+  this->history_start = -static_cast<int64_t>(half_taps - 1);
+}
+
+void Resampler::process(const float* input, size_t frame_count, vector<float>& output) {
+  if (this->flushed) {
+    throw logic_error("resampler has already been flushed");
+  }
+  this->history.insert(this->history.end(), input, input + frame_count * this->num_channels);
+  this->input_frames += frame_count;
+  this->produce(output, UINT64_MAX);
+}
+
+void Resampler::flush(vector<float>& output) {
+  if (this->flushed) {
+    return;
+  }
+  this->flushed = true;
+  this->history.resize(this->history.size() + this->half_taps * this->num_channels, 0.0f);
+  uint64_t total_output_frames = (this->input_frames * this->output_rate + this->input_rate - 1) / this->input_rate;
+  this->produce(output, total_output_frames);
+}
+
+size_t Resampler::max_output_frames(size_t frame_count) const {
+  return (static_cast<uint64_t>(frame_count) * this->output_rate) / this->input_rate + 2;
+}
+
+void Resampler::produce(vector<float>& output, uint64_t max_output_frame) {
+  size_t taps = this->half_taps * 2;
+  size_t ch = this->num_channels;
+  int64_t history_end = this->history_start + static_cast<int64_t>(this->history.size() / ch);
+
+  while (this->output_frames < max_output_frame) {
+    uint64_t num = this->output_frames * this->input_rate;
+    int64_t i0 = num / this->output_rate;
+    uint64_t rem = num % this->output_rate;
+    // This output frame needs input frames i0 - (half_taps - 1) through
+    // i0 + half_taps
+    if (i0 + static_cast<int64_t>(this->half_taps) >= history_end) {
+      break;
+    }
+
+    double phase = static_cast<double>(rem) * PHASES / this->output_rate;
+    size_t p = static_cast<size_t>(phase);
+    float t = static_cast<float>(phase - p);
+    const float* row0 = &this->table[p * taps];
+    const float* row1 = row0 + taps;
+    for (size_t j = 0; j < taps; j++) {
+      this->coeffs[j] = row0[j] + (row1[j] - row0[j]) * t;
+    }
+
+    const float* in = &this->history[(i0 - (this->half_taps - 1) - this->history_start) * ch];
+    size_t out_offset = output.size();
+    output.resize(out_offset + ch);
+    for (size_t c = 0; c < ch; c++) {
+      float sum = 0.0f;
+      for (size_t j = 0; j < taps; j++) {
+        sum += this->coeffs[j] * in[j * ch + c];
+      }
+      output[out_offset + c] = sum;
+    }
+    this->output_frames++;
+  }
+
+  // Discard input frames that no future output frame needs
+  int64_t first_needed = static_cast<int64_t>((this->output_frames * this->input_rate) / this->output_rate) -
+      static_cast<int64_t>(this->half_taps - 1);
+  if (first_needed > this->history_start) {
+    size_t drop_frames = min<size_t>(first_needed - this->history_start, this->history.size() / ch);
+    this->history.erase(this->history.begin(), this->history.begin() + drop_frames * ch);
+    this->history_start += drop_frames;
+  }
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace phosg_audio {
+
+// Streaming sample rate converter for interleaved float frames. Each output
+// frame is computed with a Blackman-windowed sinc filter whose cutoff is just
+// below the lower of the two Nyquist frequencies, so downsampling doesn't
+// alias. The filter coefficients come from a table of PHASES subsample
+// positions (interpolated between neighbors), and positions are tracked as
+// exact rationals, so there's no drift however long the stream is.
+//
+// The filter's delay is compensated: output frame k corresponds to input time
+// k * input_rate / output_rate. Input can be passed in blocks of any size;
+// after flush(), exactly ceil(input_frames * output_rate / input_rate) frames
+// will have been produced in total.
+class Resampler {
+public:
+  static constexpr size_t PHASES = 256;
+
+  // half_taps is the number of input frames used on each side of each output
+  // frame; higher values give a sharper cutoff at a higher CPU cost
+  Resampler(uint32_t input_rate, uint32_t output_rate, size_t num_channels, size_t half_taps = 16);
+  ~Resampler() = default;
+
+  // Appends all output frames that can be computed from the input so far to
+  // output. This doesn't allocate once output has enough capacity.
+  void process(const float* input, size_t frame_count, std::vector<float>& output);
+  // Appends the remaining output frames, treating the input as silent after
+  // its end. process() must not be called after this.
+  void flush(std::vector<float>& output);
+
+  // Returns (approximately) the number of output frames that a process() call
+  // with frame_count input frames can produce, for sizing buffers
+  size_t max_output_frames(size_t frame_count) const;
+
+private:
+  void produce(std::vector<float>& output, uint64_t max_output_frame);
+
+  uint32_t input_rate; // These two are reduced by their GCD
+  uint32_t output_rate;
+  size_t num_channels;
+  size_t half_taps;
+  // (PHASES + 1) rows of 2 * half_taps coefficients. Row p is the filter for
+  // an output frame p / PHASES of the way from one input frame to the next.
+  std::vector<float> table;
+  std::vector<float> coeffs; // Scratch space for one interpolated row
+  // Input frames that may still be needed. history[0] is input frame
+  // history_start, which is negative at first because the input is
+  // preceded by half_taps - 1 frames of silence.
+  std::vector<float> history;
+  int64_t history_start;
+  uint64_t input_frames;
+  uint64_t output_frames;
+  bool flushed;
+};
+
+} // namespace phosg_audio
@@ -0,0 +1,129 @@
+#include "RingBuffer.hh"
+
+#include <string.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace phosg_audio {
+
+static size_t next_power_of_two(size_t v) {
+  size_t ret = 1;
+  while (ret < v) {
+    ret <<= 1;
+  }
+  return ret;
+}
+
+SPSCRingBuffer::SPSCRingBuffer(size_t min_capacity)
+    : data(next_power_of_two(min_capacity)),
+      mask(this->data.size() - 1),
+      read_offset(0),
+      write_offset(0) {
+  if (min_capacity == 0) {
+    throw invalid_argument("ring buffer capacity must not be zero");
+  }
+}
+
+size_t SPSCRingBuffer::capacity() const {
+  return this->data.size();
+}
+
+size_t SPSCRingBuffer::size() const {
+  // The offsets only ever increase, so the difference is always the number of
+  // readable bytes even after they wrap around. This may be called from any
+  // thread, so read_offset must be loaded first: write_offset can only have
+  // grown since then, so the difference can't go negative. (It can exceed the
+  // capacity if both sides move in between, hence the clamp.)
+  size_t read_offset = this->read_offset.load(memory_order_acquire);
+  size_t write_offset = this->write_offset.load(memory_order_acquire);
+  return min(write_offset - read_offset, this->data.size());
+}
+
+size_t SPSCRingBuffer::space() const {
+  // Same as above, but in the opposite order, since read_offset is the one
+  // that bounds the free space from below
+  size_t write_offset = this->write_offset.load(memory_order_acquire);
+  size_t read_offset = this->read_offset.load(memory_order_acquire);
+  ptrdiff_t used = static_cast<ptrdiff_t>(write_offset - read_offset);
+  return (used <= 0) ? this->data.size() : (this->data.size() - min<size_t>(used, this->data.size()));
+}
+
+size_t SPSCRingBuffer::write(const void* data, size_t size) {
+  size_t write_offset = this->write_offset.load(memory_order_relaxed);
+  size_t read_offset = this->read_offset.load(memory_order_acquire);
+  size_t space = this->data.size() - (write_offset - read_offset);
+  if (size > space) {
+    size = space;
+  }
+
+  size_t start = write_offset & this->mask;
+  size_t first_size = min(size, this->data.size() - start);
+  memcpy(&this->data[start], data, first_size);
+  memcpy(this->data.data(), reinterpret_cast<const uint8_t*>(data) + first_size, size - first_size);
+
+  this->write_offset.store(write_offset + size, memory_order_release);
+  return size;
+}
+
+size_t SPSCRingBuffer::read(void* data, size_t size) {
+  size_t read_offset = this->read_offset.load(memory_order_relaxed);
+  size_t write_offset = this->write_offset.load(memory_order_acquire);
+  size_t available = write_offset - read_offset;
+  if (size > available) {
+    size = available;
+  }
+
+  size_t start = read_offset & this->mask;
+  size_t first_size = min(size, this->data.size() - start);
+  memcpy(data, &this->data[start], first_size);
+  memcpy(reinterpret_cast<uint8_t*>(data) + first_size, this->data.data(), size - first_size);
+
+  this->read_offset.store(read_offset + size, memory_order_release);
+  return size;
+}
+
+size_t SPSCRingBuffer::skip(size_t size) {
+  size_t read_offset = this->read_offset.load(memory_order_relaxed);
+  size_t write_offset = this->write_offset.load(memory_order_acquire);
+  size_t available = write_offset - read_offset;
+  if (size > available) {
+    size = available;
+  }
+  this->read_offset.store(read_offset + size, memory_order_release);
+  return size;
+}
+
+void* SPSCRingBuffer::write_region(size_t* size) {
+  size_t write_offset = this->write_offset.load(memory_order_relaxed);
+  size_t read_offset = this->read_offset.load(memory_order_acquire);
+  size_t space = this->data.size() - (write_offset - read_offset);
+  size_t start = write_offset & this->mask;
+  *size = min(space, this->data.size() - start);
+  return &this->data[start];
+}
+
+void SPSCRingBuffer::commit_write(size_t size) {
+  size_t write_offset = this->write_offset.load(memory_order_relaxed);
+  size_t read_offset = this->read_offset.load(memory_order_acquire);
+  if (size > this->data.size() - (write_offset - read_offset)) {
+    throw logic_error("committed more data than the ring has space for");
+  }
+  this->write_offset.store(write_offset + size, memory_order_release);
+}
+
+const void* SPSCRingBuffer::read_region(size_t* size) const {
+  size_t read_offset = this->read_offset.load(memory_order_relaxed);
+  size_t write_offset = this->write_offset.load(memory_order_acquire);
+  size_t start = read_offset & this->mask;
+  *size = min(write_offset - read_offset, this->data.size() - start);
+  return &this->data[start];
+}
+
+void SPSCRingBuffer::clear() {
+  this->read_offset.store(0, memory_order_relaxed);
+  this->write_offset.store(0, memory_order_relaxed);
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+namespace phosg_audio {
+
+// Lock-free byte ring for exactly one producer thread and one consumer thread.
+// The capacity is rounded up to a power of two. Neither side ever allocates
+// or blocks; callers that need to wait for data or space must arrange that
+// themselves.
+class SPSCRingBuffer {
+public:
+  explicit SPSCRingBuffer(size_t min_capacity);
+  ~SPSCRingBuffer() = default;
+
+  SPSCRingBuffer(const SPSCRingBuffer&) = delete;
+  SPSCRingBuffer(SPSCRingBuffer&&) = delete;
+  SPSCRingBuffer& operator=(const SPSCRingBuffer&) = delete;
+  SPSCRingBuffer& operator=(SPSCRingBuffer&&) = delete;
+
+  size_t capacity() const;
+  // size() and space() may be called from any thread (e.g. for monitoring).
+  // Number of bytes available to read. Exact when called from the consumer;
+  // approximate (but never more than capacity()) from any other thread.
+  size_t size() const;
+  // Number of bytes available to write. Exact when called from the producer;
+  // approximate (but never more than capacity()) from any other thread.
+  size_t space() const;
+
+  // Producer side. Writes up to size bytes and returns the number written.
+  size_t write(const void* data, size_t size);
+  // Consumer side. Reads up to size bytes and returns the number read.
+  size_t read(void* data, size_t size);
+  // Consumer side. Discards up to size bytes and returns the number discarded.
+  size_t skip(size_t size);
+
+  // Zero-copy access. write_region returns the contiguous free space at the
+  // write position and sets *size to its length (which is less than space()
+  // if the free space wraps around). The producer fills some of it, then calls
+  // commit_write to make that many bytes readable. Similarly, read_region
+  // returns the contiguous readable data at the read position; the consumer
+  // releases it with skip() when it's done with it. Each side's region stays
+  // valid while the other side is active.
+  void* write_region(size_t* size);
+  void commit_write(size_t size);
+  const void* read_region(size_t* size) const;
+
+  // Discards all data. Neither side may be active during this call.
+  void clear();
+
+private:
+  std::vector<uint8_t> data;
+  size_t mask;
+  // These are on separate cache lines so the producer and consumer don't
+  // contend on them
+  alignas(64) std::atomic<size_t> read_offset;
+  alignas(64) std::atomic<size_t> write_offset;
+};
+
+} // namespace phosg_audio
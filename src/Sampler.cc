@@ -0,0 +1,273 @@
+#include "Sampler.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "Constants.hh"
+
+using namespace std;
+
+namespace phosg_audio {
+
+SamplerInstrument::SamplerInstrument(WAVContents&& wav) : wav(std::move(wav)) {
+  this->init_from_wav();
+}
+
+SamplerInstrument::SamplerInstrument(const char* filename) : wav(load_wav(filename)) {
+  this->init_from_wav();
+}
+
+SamplerInstrument::SamplerInstrument(const string& filename) : SamplerInstrument(filename.c_str()) {}
+
+void SamplerInstrument::init_from_wav() {
+  if ((this->wav.num_channels != 1) && (this->wav.num_channels != 2)) {
+    throw runtime_error("sampler instruments must be mono or stereo");
+  }
+  if (this->wav.sample_rate == 0) {
+    throw runtime_error("sampler instrument has no sample rate");
+  }
+  this->num_frames = this->wav.samples.size() / this->wav.num_channels;
+
+  // MIDI note 60 (C5 in our naming) is the conventional default unity note
+  this->note = ((this->wav.base_note >= 0) && (this->wav.base_note < 0x80)) ? this->wav.base_note : 60;
+
+  // Only the first loop is used; the smpl chunk's end offset is inclusive.
+  // load_wav gives the loop points in samples, not frames, so they have to be
+  // divided by the channel count.
+  this->loop_enabled = false;
+  this->loop_start_frame = 0;
+  this->loop_end_frame = 0;
+  this->loop_mode = LoopType::Normal;
+  if (!this->wav.loops.empty()) {
+    const auto& loop = this->wav.loops[0];
+    size_t start_frame = loop.start / this->wav.num_channels;
+    size_t end_frame = loop.end / this->wav.num_channels;
+    size_t end = (end_frame < this->num_frames) ? (end_frame + 1) : this->num_frames;
+    if ((loop.type <= 2) && (end > start_frame + 1)) {
+      this->loop_enabled = true;
+      this->loop_start_frame = start_frame;
+      this->loop_end_frame = end;
+      this->loop_mode = static_cast<LoopType>(loop.type);
+    }
+  }
+}
+
+size_t SamplerInstrument::num_channels() const {
+  return this->wav.num_channels;
+}
+
+size_t SamplerInstrument::frame_count() const {
+  return this->num_frames;
+}
+
+size_t SamplerInstrument::sample_rate() const {
+  return this->wav.sample_rate;
+}
+
+uint8_t SamplerInstrument::base_note() const {
+  return this->note;
+}
+
+bool SamplerInstrument::has_loop() const {
+  return this->loop_enabled;
+}
+
+size_t SamplerInstrument::loop_start() const {
+  return this->loop_start_frame;
+}
+
+size_t SamplerInstrument::loop_end() const {
+  return this->loop_end_frame;
+}
+
+LoopType SamplerInstrument::loop_type() const {
+  return this->loop_mode;
+}
+
+double SamplerInstrument::step_for_note(uint8_t note, uint32_t output_sample_rate) const {
+  double pitch_ratio = frequency_for_note(note) / frequency_for_note(this->note);
+  return pitch_ratio * static_cast<double>(this->wav.sample_rate) / output_sample_rate;
+}
+
+Sampler::Voice::Voice()
+    : id(0),
+      position(0.0),
+      step(0.0),
+      volume(0.0f),
+      active(false),
+      reverse(false),
+      sustained(false) {}
+
+Sampler::Sampler(uint32_t sample_rate, size_t num_channels, size_t max_voices)
+    : sample_rate(sample_rate),
+      num_channels(num_channels),
+      next_voice_id(1),
+      voices(max_voices) {
+  if ((num_channels != 1) && (num_channels != 2)) {
+    throw invalid_argument("sampler output must be mono or stereo");
+  }
+  if (max_voices == 0) {
+    throw invalid_argument("sampler must have at least one voice");
+  }
+}
+
+uint64_t Sampler::note_on(shared_ptr<const SamplerInstrument> instrument, uint8_t note, float volume) {
+  // Use a free voice if there is one; otherwise, steal the oldest voice
+  Voice* voice = nullptr;
+  for (auto& v : this->voices) {
+    if (!v.active) {
+      voice = &v;
+      break;
+    }
+    if (!voice || (v.id < voice->id)) {
+      voice = &v;
+    }
+  }
+
+  voice->instrument = std::move(instrument);
+  voice->id = this->next_voice_id++;
+  voice->position = 0.0;
+  voice->step = voice->instrument->step_for_note(note, this->sample_rate);
+  voice->volume = volume;
+  voice->active = true;
+  voice->reverse = false;
+  voice->sustained = true;
+  return voice->id;
+}
+
+void Sampler::note_off(uint64_t voice_id) {
+  Voice* voice = this->find_voice(voice_id);
+  if (voice) {
+    // Leave the loop and play forward through the rest of the sample
+    voice->sustained = false;
+    voice->reverse = false;
+  }
+}
+
+void Sampler::stop(uint64_t voice_id) {
+  Voice* voice = this->find_voice(voice_id);
+  if (voice) {
+    voice->active = false;
+    voice->instrument.reset();
+  }
+}
+
+void Sampler::stop_all() {
+  for (auto& voice : this->voices) {
+    voice.active = false;
+    voice.instrument.reset();
+  }
+}
+
+void Sampler::render(float* output, size_t frame_count) {
+  memset(output, 0, frame_count * this->num_channels * sizeof(float));
+  for (auto& voice : this->voices) {
+    if (voice.active) {
+      this->render_voice(voice, output, frame_count);
+      if (!voice.active) {
+        voice.instrument.reset();
+      }
+    }
+  }
+}
+
+vector<float> Sampler::render(size_t frame_count) {
+  vector<float> ret(frame_count * this->num_channels);
+  this->render(ret.data(), frame_count);
+  return ret;
+}
+
+size_t Sampler::active_voice_count() const {
+  size_t ret = 0;
+  for (const auto& voice : this->voices) {
+    ret += voice.active;
+  }
+  return ret;
+}
+
+uint32_t Sampler::get_sample_rate() const {
+  return this->sample_rate;
+}
+
+size_t Sampler::get_num_channels() const {
+  return this->num_channels;
+}
+
+Sampler::Voice* Sampler::find_voice(uint64_t voice_id) {
+  for (auto& voice : this->voices) {
+    if (voice.active && (voice.id == voice_id)) {
+      return &voice;
+    }
+  }
+  return nullptr;
+}
+
+void Sampler::render_voice(Voice& voice, float* output, size_t frame_count) {
+  const SamplerInstrument& inst = *voice.instrument;
+  bool stereo = (this->num_channels == 2);
+  bool looping = voice.sustained && inst.has_loop();
+  LoopType loop_type = inst.loop_type();
+  size_t loop_start_index = inst.loop_start();
+  size_t loop_end_index = inst.loop_end();
+  double loop_start = loop_start_index;
+  double loop_end = loop_end_index;
+  double loop_last = loop_end - 1.0;
+  double loop_length = loop_end - loop_start;
+  double end = inst.frame_count();
+
+  double pos = voice.position;
+  for (size_t x = 0; x < frame_count; x++) {
+    // Linearly interpolate between the frames around the current position.
+    // In a normal loop, the frame after the end of the loop is the frame at
+    // the start of the loop.
+    size_t index = static_cast<size_t>(pos);
+    float frac = static_cast<float>(pos - index);
+    size_t next_index = index + 1;
+    if (looping && (loop_type == LoopType::Normal) && (next_index == loop_end_index)) {
+      next_index = loop_start_index;
+    }
+    float l0, r0, l1, r1;
+    inst.get_frame(index, stereo, &l0, &r0);
+    inst.get_frame(next_index, stereo, &l1, &r1);
+    float* out = &output[x * this->num_channels];
+    out[0] += (l0 + (l1 - l0) * frac) * voice.volume;
+    if (stereo) {
+      out[1] += (r0 + (r1 - r0) * frac) * voice.volume;
+    }
+
+    pos = voice.reverse ? (pos - voice.step) : (pos + voice.step);
+
+    if (looping) {
+      if (!voice.reverse && (pos >= loop_end)) {
+        if (loop_type == LoopType::Normal) {
+          pos = loop_start + fmod(pos - loop_start, loop_length);
+        } else {
+          // Both ping-pong and reverse loops turn around at the loop end
+          pos = loop_last - (pos - loop_end);
+          voice.reverse = true;
+        }
+      } else if (voice.reverse && (pos < loop_start)) {
+        if (loop_type == LoopType::PingPong) {
+          pos = loop_start + (loop_start - pos);
+          voice.reverse = false;
+        } else {
+          pos = loop_last - (loop_start - pos);
+        }
+      }
+      // If the step is longer than the loop, the reflections above can
+      // overshoot; keep the position inside the loop in that case
+      if ((pos < loop_start) || (pos >= loop_end)) {
+        pos = loop_start;
+      }
+
+    } else if (voice.reverse ? (pos < 0.0) : (pos >= end)) {
+      voice.active = false;
+      break;
+    }
+  }
+  voice.position = pos;
+}
+
+} // namespace phosg_audio
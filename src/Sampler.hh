@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "File.hh"
+
+namespace phosg_audio {
+
+// These values match the loop types in the WAV smpl chunk
+enum class LoopType {
+  Normal = 0,
+  PingPong = 1,
+  Reverse = 2,
+};
+
+// A single decoded sample that can be played at any note. The sample's
+// base_note and first loop (if any) come from the WAV file's smpl chunk; if the
+// file has no base note, C5 (MIDI note 60) is assumed.
+class SamplerInstrument {
+public:
+  explicit SamplerInstrument(WAVContents&& wav);
+  explicit SamplerInstrument(const char* filename);
+  explicit SamplerInstrument(const std::string& filename);
+  ~SamplerInstrument() = default;
+
+  SamplerInstrument(const SamplerInstrument&) = delete;
+  SamplerInstrument(SamplerInstrument&&) = delete;
+  SamplerInstrument& operator=(const SamplerInstrument&) = delete;
+  SamplerInstrument& operator=(SamplerInstrument&&) = delete;
+
+  size_t num_channels() const;
+  size_t frame_count() const;
+  size_t sample_rate() const;
+  uint8_t base_note() const;
+
+  // Loop points are frame indexes (not sample indexes, unlike WAVLoop)
+  bool has_loop() const;
+  size_t loop_start() const;
+  size_t loop_end() const; // Exclusive
+  LoopType loop_type() const;
+
+  // Returns the playback rate (in source frames per output frame) for the
+  // given note when rendering at output_sample_rate.
+  double step_for_note(uint8_t note, uint32_t output_sample_rate) const;
+
+  // Returns the frame at the given index, mixed to the requested channel
+  // layout. Out-of-range indexes return silence.
+  inline void get_frame(size_t index, bool stereo, float* left, float* right) const {
+    if (index >= this->num_frames) {
+      *left = 0.0f;
+      *right = 0.0f;
+      return;
+    }
+    if (this->wav.num_channels == 2) {
+      const float* frame = &this->wav.samples[index * 2];
+      if (stereo) {
+        *left = frame[0];
+        *right = frame[1];
+      } else {
+        *left = (frame[0] + frame[1]) * 0.5f;
+        *right = *left;
+      }
+    } else {
+      *left = this->wav.samples[index];
+      *right = *left;
+    }
+  }
+
+private:
+  void init_from_wav();
+
+  WAVContents wav;
+  size_t num_frames;
+  uint8_t note;
+  bool loop_enabled;
+  size_t loop_start_frame;
+  size_t loop_end_frame;
+  LoopType loop_mode;
+};
+
+// Renders any number of voices of any number of instruments into interleaved
+// float blocks. Voices hold a reference to their instrument and never copy its
+// sample data, so memory use is one sample per instrument regardless of how
+// many notes are playing.
+class Sampler {
+public:
+  Sampler(uint32_t sample_rate, size_t num_channels = 2, size_t max_voices = 64);
+  ~Sampler() = default;
+
+  // Starts a note and returns a voice ID that can be passed to note_off or
+  // stop. If all voices are in use, the oldest voice is replaced.
+  uint64_t note_on(std::shared_ptr<const SamplerInstrument> instrument, uint8_t note, float volume = 1.0);
+  // Exits the sustain loop; the voice plays through to the end of the sample.
+  void note_off(uint64_t voice_id);
+  // Stops the voice immediately.
+  void stop(uint64_t voice_id);
+  void stop_all();
+
+  // Renders frame_count frames of all active voices into output, which must
+  // have room for frame_count * num_channels samples. The output is
+  // overwritten, not mixed into.
+  void render(float* output, size_t frame_count);
+  std::vector<float> render(size_t frame_count);
+
+  size_t active_voice_count() const;
+  uint32_t get_sample_rate() const;
+  size_t get_num_channels() const;
+
+private:
+  struct Voice {
+    std::shared_ptr<const SamplerInstrument> instrument;
+    uint64_t id;
+    double position;
+    double step;
+    float volume;
+    bool active;
+    bool reverse; // Currently playing backward
+    bool sustained; // Still looping (note_off not yet called)
+
+    Voice();
+  };
+
+  Voice* find_voice(uint64_t voice_id);
+  void render_voice(Voice& voice, float* output, size_t frame_count);
+
+  uint32_t sample_rate;
+  size_t num_channels;
+  uint64_t next_voice_id;
+  std::vector<Voice> voices;
+};
+
+} // namespace phosg_audio
@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <math.h>
 
+#include <atomic>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
@@ -13,81 +14,152 @@ using namespace std;
 
 namespace phosg_audio {
 
-Sound::Sound(uint32_t sample_rate)
-    : buffer_id(0), source_id(0), sample_rate(sample_rate) {}
+static atomic<size_t> total_host_bytes(0);
+static atomic<size_t> total_al_buffer_bytes(0);
+
+SoundMemoryUsage get_sound_memory_usage() {
+  return SoundMemoryUsage{
+      .host_bytes = total_host_bytes.load(),
+      .al_buffer_bytes = total_al_buffer_bytes.load(),
+  };
+}
+
+Sound::Sound(uint32_t sample_rate, SampleRetention retention)
+    : context(ScopedContext::current()),
+      buffer_id(0),
+      source_id(0),
+      sample_rate(sample_rate),
+      retention(retention),
+      samples_released(false),
+      accounted_host_bytes(0),
+      accounted_al_buffer_bytes(0) {}
 
 Sound::~Sound() {
+  ScopedContext cg(this->context.get());
   if (this->source_id) {
-    alDeleteSources(1, &this->source_id);
+    AL_CALL(alDeleteSources, 1, &this->source_id);
   }
   if (this->buffer_id) {
-    alDeleteBuffers(1, &this->buffer_id);
+    AL_CALL(alDeleteBuffers, 1, &this->buffer_id);
   }
+  total_host_bytes -= this->accounted_host_bytes;
+  total_al_buffer_bytes -= this->accounted_al_buffer_bytes;
 }
 
 void Sound::print(FILE* stream) const {
-  for (size_t x = 0; x < this->samples.size(); x++) {
-    fprintf(stream, "%zu: %g\n", x, this->samples[x]);
+  vector<float> reload_storage;
+  const auto& samples = this->get_samples(reload_storage);
+  for (size_t x = 0; x < samples.size(); x++) {
+    fprintf(stream, "%zu: %g\n", x, samples[x]);
   }
 }
 
 void Sound::write(FILE* stream) const {
-  fwrite(this->samples.data(), sizeof(this->samples[0]), this->samples.size(),
-      stream);
+  vector<float> reload_storage;
+  const auto& samples = this->get_samples(reload_storage);
+  fwrite(samples.data(), sizeof(samples[0]), samples.size(), stream);
+}
+
+bool Sound::has_host_samples() const {
+  return !this->samples_released;
+}
+
+vector<float> Sound::reload_samples() const {
+  throw runtime_error("sound samples were released after upload and cannot be reloaded");
+}
+
+const vector<float>& Sound::get_samples(vector<float>& reload_storage) const {
+  if (!this->samples_released) {
+    return this->samples;
+  }
+  // The reloaded samples are deliberately not kept; callers that print or
+  // write a released sound repeatedly pay for the reload each time
+  reload_storage = this->reload_samples();
+  return reload_storage;
 }
 
 void Sound::play() {
-  alSourcePlay(this->source_id);
+  ScopedContext cg(this->context.get());
+  AL_CALL(alSourcePlay, this->source_id);
 }
 
 void Sound::set_volume(float volume) {
-  alSourcef(this->source_id, AL_GAIN, volume);
+  ScopedContext cg(this->context.get());
+  AL_CALL(alSourcef, this->source_id, AL_GAIN, volume);
 }
 
 void Sound::create_al_objects() {
-  alGenBuffers(1, &this->buffer_id);
+  ScopedContext cg(this->context.get());
+  AL_CALL(alGenBuffers, 1, &this->buffer_id);
   al_check_error();
 
   // Windows OpenAL doesn't support float32 format, so use int16 instead
 #ifdef WINDOWS
   auto int_samples = convert_samples_to_int(this->samples);
-  alBufferData(this->buffer_id, AL_FORMAT_MONO16, int_samples.data(),
-      int_samples.size() * sizeof(int16_t), this->sample_rate);
+  size_t al_buffer_bytes = int_samples.size() * sizeof(int16_t);
+  AL_CALL(alBufferData, this->buffer_id, AL_FORMAT_MONO16, int_samples.data(),
+      al_buffer_bytes, this->sample_rate);
 #else
-  alBufferData(this->buffer_id, alGetEnumValue("AL_FORMAT_MONO_FLOAT32"),
-      this->samples.data(), this->samples.size() * sizeof(float),
-      this->sample_rate);
+  size_t al_buffer_bytes = this->samples.size() * sizeof(float);
+  AL_CALL(alBufferData, this->buffer_id, AL_FORMAT_MONO_FLOAT32,
+      this->samples.data(), al_buffer_bytes, this->sample_rate);
 #endif
   al_check_error();
 
-  alGenSources(1, &this->source_id);
-  alSourcei(this->source_id, AL_BUFFER, this->buffer_id);
+  AL_CALL(alGenSources, 1, &this->source_id);
+  AL_CALL(alSourcei, this->source_id, AL_BUFFER, this->buffer_id);
   al_check_error();
+
+  // AL has its own copy of the data now, so the host copy can be dropped if
+  // the caller doesn't need it
+  if (this->retention == SampleRetention::ReleaseAfterUpload) {
+    vector<float>().swap(this->samples);
+    this->samples_released = true;
+  }
+
+  this->accounted_host_bytes = this->samples.capacity() * sizeof(float);
+  this->accounted_al_buffer_bytes = al_buffer_bytes;
+  total_host_bytes += this->accounted_host_bytes;
+  total_al_buffer_bytes += this->accounted_al_buffer_bytes;
 }
 
-SampledSound::SampledSound(const char* filename) : Sound(0) {
+SampledSound::SampledSound(const char* filename, SampleRetention retention)
+    : Sound(0, retention) {
   auto wav = load_wav(filename);
   this->sample_rate = wav.sample_rate;
   this->samples = std::move(wav.samples);
+  if (retention == SampleRetention::ReleaseAfterUpload) {
+    this->filename = filename;
+  }
   this->create_al_objects();
 }
 
-SampledSound::SampledSound(const string& filename) : SampledSound(filename.c_str()) {}
+SampledSound::SampledSound(const string& filename, SampleRetention retention)
+    : SampledSound(filename.c_str(), retention) {}
 
-SampledSound::SampledSound(FILE* f) : Sound(0) {
+SampledSound::SampledSound(FILE* f, SampleRetention retention)
+    : Sound(0, retention) {
   auto wav = load_wav(f);
   this->sample_rate = wav.sample_rate;
   this->samples = std::move(wav.samples);
   this->create_al_objects();
 }
 
+vector<float> SampledSound::reload_samples() const {
+  if (this->filename.empty()) {
+    return this->Sound::reload_samples();
+  }
+  return load_wav(this->filename.c_str()).samples;
+}
+
 GeneratedSound::GeneratedSound(float seconds, float volume,
-    uint32_t sample_rate) : Sound(sample_rate), seconds(seconds), volume(volume) {
+    uint32_t sample_rate, SampleRetention retention)
+    : Sound(sample_rate, retention), seconds(seconds), volume(volume) {
   this->samples.resize(this->seconds * this->sample_rate);
 }
 
 SineWave::SineWave(float frequency, float seconds, float volume,
-    uint32_t sample_rate) : GeneratedSound(seconds, volume, sample_rate),
+    uint32_t sample_rate, SampleRetention retention) : GeneratedSound(seconds, volume, sample_rate, retention),
                             frequency(frequency) {
   for (size_t x = 0; x < this->samples.size(); x++) {
     this->samples[x] = sin((6.283185307179586 * this->frequency) / this->sample_rate * x) * this->volume;
@@ -96,7 +168,7 @@ SineWave::SineWave(float frequency, float seconds, float volume,
 }
 
 SquareWave::SquareWave(float frequency, float seconds, float volume,
-    uint32_t sample_rate) : GeneratedSound(seconds, volume, sample_rate),
+    uint32_t sample_rate, SampleRetention retention) : GeneratedSound(seconds, volume, sample_rate, retention),
                             frequency(frequency) {
   for (size_t x = 0; x < this->samples.size(); x++) {
     if ((uint64_t)((2 * this->frequency) / this->sample_rate * x) & 1) {
@@ -109,7 +181,7 @@ SquareWave::SquareWave(float frequency, float seconds, float volume,
 }
 
 TriangleWave::TriangleWave(float frequency, float seconds, float volume,
-    uint32_t sample_rate) : GeneratedSound(seconds, volume, sample_rate),
+    uint32_t sample_rate, SampleRetention retention) : GeneratedSound(seconds, volume, sample_rate, retention),
                             frequency(frequency) {
   size_t period_length = this->sample_rate / (2 * this->frequency);
   for (size_t x = 0; x < this->samples.size(); x++) {
@@ -127,7 +199,7 @@ TriangleWave::TriangleWave(float frequency, float seconds, float volume,
 }
 
 FrontTriangleWave::FrontTriangleWave(float frequency, float seconds,
-    float volume, uint32_t sample_rate) : GeneratedSound(seconds, volume, sample_rate), frequency(frequency) {
+    float volume, uint32_t sample_rate, SampleRetention retention) : GeneratedSound(seconds, volume, sample_rate, retention), frequency(frequency) {
   size_t period_length = this->sample_rate / this->frequency;
   for (size_t x = 0; x < this->samples.size(); x++) {
     double factor = (double)(x % period_length) / period_length;
@@ -137,7 +209,7 @@ FrontTriangleWave::FrontTriangleWave(float frequency, float seconds,
   this->create_al_objects();
 }
 
-WhiteNoise::WhiteNoise(float seconds, float volume, uint32_t sample_rate) : GeneratedSound(seconds, volume, sample_rate) {
+WhiteNoise::WhiteNoise(float seconds, float volume, uint32_t sample_rate, SampleRetention retention) : GeneratedSound(seconds, volume, sample_rate, retention) {
   for (size_t x = 0; x < this->samples.size(); x++) {
     this->samples[x] = (static_cast<float>(rand() * 2) / RAND_MAX) - 1.0;
   }
@@ -145,7 +217,7 @@ WhiteNoise::WhiteNoise(float seconds, float volume, uint32_t sample_rate) : Gene
 }
 
 SplitNoise::SplitNoise(int split_distance, float seconds, float volume,
-    bool fade_out, uint32_t sample_rate) : GeneratedSound(seconds, volume, sample_rate),
+    bool fade_out, uint32_t sample_rate, SampleRetention retention) : GeneratedSound(seconds, volume, sample_rate, retention),
                                            split_distance(split_distance) {
 
   for (size_t x = 0; x < this->samples.size(); x += split_distance) {
@@ -3,12 +3,36 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <memory>
 #include <string>
 
 #include "Constants.hh"
+#include "Device.hh"
 
 namespace phosg_audio {
 
+// Controls what happens to a Sound's samples after they're uploaded to its AL
+// buffer. With ReleaseAfterUpload, the host copy is freed and print() and
+// write() reload the samples from the source file, or throw if there isn't
+// one (e.g. for generated sounds or sounds loaded from a FILE*).
+enum class SampleRetention {
+  Keep = 0,
+  ReleaseAfterUpload,
+};
+
+// Process-wide totals over all live Sound objects. al_buffer_bytes is the
+// amount of data uploaded to AL buffers; host_bytes is the amount still held
+// in Sound::samples after upload.
+struct SoundMemoryUsage {
+  size_t host_bytes;
+  size_t al_buffer_bytes;
+};
+
+SoundMemoryUsage get_sound_memory_usage();
+
+// A Sound is bound to the AudioContext of the ScopedContext active on the
+// calling thread when it's constructed, if there is one; its AL objects are
+// created in that context and all AL calls it makes are made in that context.
 class Sound {
 public:
   virtual ~Sound();
@@ -16,11 +40,13 @@ public:
   void print(FILE* stream) const;
   void write(FILE* stream) const;
 
+  bool has_host_samples() const;
+
   void play();
   void set_volume(float volume);
 
 protected:
-  explicit Sound(uint32_t sample_rate);
+  explicit Sound(uint32_t sample_rate, SampleRetention retention = SampleRetention::Keep);
 
   // These are deleted because I'm lazy. Default copy/move constructors are bad
   // here because of the AL objects.
@@ -31,19 +57,38 @@ protected:
 
   void create_al_objects();
 
+  // Called by print() and write() if the host copy of the samples has been
+  // released. The default implementation throws.
+  virtual std::vector<float> reload_samples() const;
+
+  std::shared_ptr<AudioContext> context;
   ALuint buffer_id;
   ALuint source_id;
 
   uint32_t sample_rate;
   std::vector<float> samples;
+
+private:
+  const std::vector<float>& get_samples(std::vector<float>& reload_storage) const;
+
+  SampleRetention retention;
+  bool samples_released;
+  size_t accounted_host_bytes;
+  size_t accounted_al_buffer_bytes;
 };
 
 class SampledSound : public Sound {
 public:
-  explicit SampledSound(const char* filename);
-  explicit SampledSound(const std::string& filename);
-  explicit SampledSound(FILE* f);
+  explicit SampledSound(const char* filename, SampleRetention retention = SampleRetention::Keep);
+  explicit SampledSound(const std::string& filename, SampleRetention retention = SampleRetention::Keep);
+  explicit SampledSound(FILE* f, SampleRetention retention = SampleRetention::Keep);
   virtual ~SampledSound() = default;
+
+protected:
+  virtual std::vector<float> reload_samples() const;
+
+  // Only set if the sound was loaded from a named file
+  std::string filename;
 };
 
 class GeneratedSound : public Sound {
@@ -51,7 +96,7 @@ public:
   virtual ~GeneratedSound() = default;
 
 protected:
-  explicit GeneratedSound(float seconds, float volume = 1.0, uint32_t sample_rate = 44100);
+  explicit GeneratedSound(float seconds, float volume = 1.0, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
 
   float seconds;
   float volume;
@@ -59,7 +104,7 @@ protected:
 
 class SineWave : public GeneratedSound {
 public:
-  SineWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100);
+  SineWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
   virtual ~SineWave() = default;
 
 protected:
@@ -68,7 +113,7 @@ protected:
 
 class SquareWave : public GeneratedSound {
 public:
-  SquareWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100);
+  SquareWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
   virtual ~SquareWave() = default;
 
 protected:
@@ -77,7 +122,7 @@ protected:
 
 class TriangleWave : public GeneratedSound {
 public:
-  TriangleWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100);
+  TriangleWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
   virtual ~TriangleWave() = default;
 
 protected:
@@ -86,7 +131,7 @@ protected:
 
 class FrontTriangleWave : public GeneratedSound {
 public:
-  FrontTriangleWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100);
+  FrontTriangleWave(float frequency, float seconds, float volume = 1.0, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
   virtual ~FrontTriangleWave() = default;
 
 protected:
@@ -95,13 +140,13 @@ protected:
 
 class WhiteNoise : public GeneratedSound {
 public:
-  WhiteNoise(float seconds, float volume = 1.0, uint32_t sample_rate = 44100);
+  WhiteNoise(float seconds, float volume = 1.0, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
   virtual ~WhiteNoise() = default;
 };
 
 class SplitNoise : public GeneratedSound {
 public:
-  SplitNoise(int split_distance, float seconds, float volume = 1.0, bool fade_out = false, uint32_t sample_rate = 44100);
+  SplitNoise(int split_distance, float seconds, float volume = 1.0, bool fade_out = false, uint32_t sample_rate = 44100, SampleRetention retention = SampleRetention::Keep);
   virtual ~SplitNoise() = default;
 
 protected:
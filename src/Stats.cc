@@ -0,0 +1,105 @@
+#include "Stats.hh"
+
+#include <chrono>
+
+using namespace std;
+
+namespace phosg_audio {
+
+uint64_t monotonic_now_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+AtomicHistogram::AtomicHistogram() {
+  this->clear();
+}
+
+void AtomicHistogram::add(uint64_t value) {
+  this->buckets[this->bucket_for_value(value)].fetch_add(1, memory_order_relaxed);
+  this->total_count.fetch_add(1, memory_order_relaxed);
+  uint64_t prev_max = this->max_value.load(memory_order_relaxed);
+  while ((value > prev_max) &&
+      !this->max_value.compare_exchange_weak(prev_max, value, memory_order_relaxed)) {
+  }
+}
+
+void AtomicHistogram::clear() {
+  for (auto& bucket : this->buckets) {
+    bucket.store(0, memory_order_relaxed);
+  }
+  this->total_count.store(0, memory_order_relaxed);
+  this->max_value.store(0, memory_order_relaxed);
+}
+
+uint64_t AtomicHistogram::count() const {
+  return this->total_count.load(memory_order_relaxed);
+}
+
+uint64_t AtomicHistogram::max() const {
+  return this->max_value.load(memory_order_relaxed);
+}
+
+uint64_t AtomicHistogram::percentile(double p) const {
+  // Sum the buckets first, since the total may have changed since the counts
+  // were read
+  uint64_t counts[NUM_BUCKETS];
+  uint64_t total = 0;
+  for (size_t x = 0; x < NUM_BUCKETS; x++) {
+    counts[x] = this->buckets[x].load(memory_order_relaxed);
+    total += counts[x];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t target = static_cast<uint64_t>((p / 100.0) * total);
+  if (target >= total) {
+    target = total - 1;
+  }
+  // The top bucket's bound can be well above any value actually seen
+  uint64_t max_value = this->max();
+  uint64_t seen = 0;
+  for (size_t x = 0; x < NUM_BUCKETS; x++) {
+    seen += counts[x];
+    if (seen > target) {
+      return min(this->bucket_upper_bound(x), max_value);
+    }
+  }
+  return max_value;
+}
+
+vector<pair<uint64_t, uint64_t>> AtomicHistogram::nonempty_buckets() const {
+  vector<pair<uint64_t, uint64_t>> ret;
+  for (size_t x = 0; x < NUM_BUCKETS; x++) {
+    uint64_t count = this->buckets[x].load(memory_order_relaxed);
+    if (count) {
+      ret.emplace_back(this->bucket_upper_bound(x), count);
+    }
+  }
+  return ret;
+}
+
+size_t AtomicHistogram::bucket_for_value(uint64_t value) {
+  // Values below 4 get their own buckets; above that, the bucket is
+  // determined by the most-significant bit and the two bits below it
+  if (value < 4) {
+    return value;
+  }
+  size_t msb = 63 - __builtin_clzll(value);
+  return (msb << 2) | ((value >> (msb - 2)) & 3);
+}
+
+uint64_t AtomicHistogram::bucket_upper_bound(size_t index) {
+  if (index < 4) {
+    return index;
+  }
+  size_t msb = index >> 2;
+  uint64_t sub = index & 3;
+  // The bucket contains [(4 + sub) << (msb - 2), (5 + sub) << (msb - 2))
+  uint64_t base = (4 + sub) << (msb - 2);
+  return base + (1ULL << (msb - 2)) - 1;
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+namespace phosg_audio {
+
+// Returns the value of a monotonic clock in nanoseconds
+uint64_t monotonic_now_ns();
+
+// Lock-free histogram of nonnegative integer values (usually durations).
+// Buckets are spaced logarithmically with four buckets per power of two, so
+// percentiles are accurate to within about 20%. Any thread may add values or
+// read the histogram at any time.
+class AtomicHistogram {
+public:
+  static constexpr size_t NUM_BUCKETS = 256;
+
+  AtomicHistogram();
+  ~AtomicHistogram() = default;
+
+  void add(uint64_t value);
+  void clear();
+
+  uint64_t count() const;
+  uint64_t max() const;
+  // Returns the upper bound of the bucket containing the given percentile
+  // (0-100), or 0 if the histogram is empty
+  uint64_t percentile(double p) const;
+  // Returns (bucket upper bound, count) for each bucket with a nonzero count
+  std::vector<std::pair<uint64_t, uint64_t>> nonempty_buckets() const;
+
+  static size_t bucket_for_value(uint64_t value);
+  static uint64_t bucket_upper_bound(size_t index);
+
+private:
+  std::atomic<uint64_t> buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> total_count;
+  std::atomic<uint64_t> max_value;
+};
+
+} // namespace phosg_audio
@@ -1,80 +1,444 @@
 #include "Stream.hh"
 
+#include <math.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <chrono>
+#include <stdexcept>
+
 using namespace std;
 
 namespace phosg_audio {
 
-AudioStream::AudioStream(int sample_rate, int format, size_t num_buffers)
-    : sample_rate(sample_rate), format(format), all_buffer_ids(num_buffers) {
-  alGenBuffers(this->all_buffer_ids.size(), this->all_buffer_ids.data());
+AudioStream::AudioStream(int sample_rate, int format, size_t num_buffers,
+    bool threaded, size_t block_frames, shared_ptr<AudioContext> context)
+    : sample_rate(sample_rate),
+      format(format),
+      context(context ? std::move(context) : ScopedContext::current()),
+      all_buffer_ids(num_buffers),
+      buffer_frame_counts(num_buffers, 0),
+      first_queued_index(0),
+      num_queued_buffers(0),
+      unqueue_buffer_ids(num_buffers),
+      stop_expected(false),
+      underrun_count(0),
+      frames_submitted(0),
+      queued_frames(0),
+      last_underrun_time_ns(0),
+      output_latency_ns(-1),
+      producer_wait_ns(0),
+      sec_offset_latency_enum(0),
+      get_sourcedv_fn(nullptr),
+      queue_limit(num_buffers),
+      adaptive(false),
+      min_queue_limit(num_buffers),
+      max_queue_limit(num_buffers),
+      staging_bytes(0),
+      last_add_frames_time_ns(0),
+      mean_add_frames_interval_ns(0.0),
+      producer_jitter_ns(0),
+      last_queue_limit_change_time_ns(0),
+      max_ring_bytes(0),
+      block_frames(block_frames),
+      flush_requested(false),
+      should_exit(false) {
+  if (num_buffers == 0) {
+    throw invalid_argument("stream must have at least one buffer");
+  }
+  if (threaded && (block_frames == 0)) {
+    throw invalid_argument("threaded stream block size must not be zero");
+  }
+
+  ScopedContext cg(this->context.get());
+  AL_CALL(alGenBuffers, this->all_buffer_ids.size(), this->all_buffer_ids.data());
   al_check_error();
 
-  alGenSources(1, &this->source_id);
+  AL_CALL(alGenSources, 1, &this->source_id);
   al_check_error();
 
-  for (ALuint buffer_id : this->all_buffer_ids) {
-    this->available_buffer_ids.emplace(buffer_id);
+  // Output latency is only available with AL_SOFT_source_latency. Its entry
+  // point and enum are looked up at runtime so we don't depend on alext.h.
+  if (AL_CALL(alIsExtensionPresent, "AL_SOFT_source_latency")) {
+    this->sec_offset_latency_enum = AL_CALL(alGetEnumValue, "AL_SEC_OFFSET_LATENCY_SOFT");
+    this->get_sourcedv_fn = reinterpret_cast<void (*)(ALuint, ALenum, ALdouble*)>(
+        AL_CALL(alGetProcAddress, "alGetSourcedvSOFT"));
+  }
+
+  if (threaded) {
+    // The ring holds as much data as the AL buffers do, so the total amount of
+    // buffered audio is twice the AL queue length
+    size_t block_bytes = block_frames * bytes_per_frame(this->format);
+    this->max_ring_bytes = block_bytes * num_buffers;
+    this->ring = make_unique<SPSCRingBuffer>(this->max_ring_bytes);
+    this->block_data.resize(block_bytes);
+    this->feeder_thread = thread(&AudioStream::feeder_thread_fn, this);
   }
 }
 
 AudioStream::~AudioStream() {
-  alDeleteSources(1, &this->source_id);
-  alDeleteBuffers(this->all_buffer_ids.size(), this->all_buffer_ids.data());
+  ScopedContext cg(this->context.get());
+  if (this->feeder_thread.joinable()) {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->should_exit = true;
+    }
+    this->feeder_cv.notify_all();
+    this->feeder_thread.join();
+  }
+  AL_CALL(alDeleteSources, 1, &this->source_id);
+  AL_CALL(alDeleteBuffers, this->all_buffer_ids.size(), this->all_buffer_ids.data());
 }
 
 void AudioStream::add_samples(const void* buffer, size_t sample_count) {
   this->add_frames(buffer, sample_count / (1 + is_stereo(this->format)));
 }
 
-void AudioStream::add_frames(const void* buffer, size_t frame_count) {
-  if (this->available_buffer_ids.empty()) {
-    this->wait_for_buffers(1);
+void AudioStream::enable_adaptive_latency(double min_latency_ms, double max_latency_ms) {
+  if ((min_latency_ms <= 0.0) || (max_latency_ms < min_latency_ms)) {
+    throw invalid_argument("invalid latency range");
+  }
+  ScopedContext cg(this->context.get());
+
+  unique_lock<mutex> g(this->lock, defer_lock);
+  if (this->ring) {
+    g.lock();
+  }
+  if (this->num_queued_buffers || this->staging_bytes || (this->ring && this->ring->size())) {
+    throw logic_error("adaptive mode must be enabled before adding frames");
+  }
+
+  double block_ms = min_latency_ms / 2;
+  this->block_frames = max<size_t>(static_cast<size_t>((block_ms * this->sample_rate) / 1000.0), 1);
+  block_ms = static_cast<double>(this->block_frames * 1000) / this->sample_rate;
+  this->min_queue_limit = 2;
+  this->max_queue_limit = max<size_t>(static_cast<size_t>(ceil(max_latency_ms / block_ms)), 2);
+
+  if (this->all_buffer_ids.size() < this->max_queue_limit) {
+    size_t prev_count = this->all_buffer_ids.size();
+    this->all_buffer_ids.resize(this->max_queue_limit);
+    AL_CALL(alGenBuffers, this->max_queue_limit - prev_count, &this->all_buffer_ids[prev_count]);
+    al_check_error();
+    this->buffer_frame_counts.resize(this->max_queue_limit, 0);
+    this->unqueue_buffer_ids.resize(this->max_queue_limit);
+  }
+  this->first_queued_index = 0;
+
+  size_t block_bytes = this->block_frames * bytes_per_frame(this->format);
+  if (this->ring) {
+    this->ring = make_unique<SPSCRingBuffer>(block_bytes * this->max_queue_limit);
+    this->block_data.resize(block_bytes);
+    // The ring only holds the block currently being assembled, so the queue
+    // limit alone determines the latency
+    this->max_ring_bytes = block_bytes;
   } else {
-    this->check_buffers();
+    this->staging.resize(block_bytes);
   }
 
-  ALuint buffer_id = *this->available_buffer_ids.begin();
+  this->queue_limit = this->min_queue_limit;
+  this->last_queue_limit_change_time_ns = monotonic_now_ns();
+  this->adaptive = true;
+}
+
+bool AudioStream::is_adaptive() const {
+  return this->adaptive;
+}
 
-  string& buffer_data = this->buffer_id_to_data[buffer_id];
-  buffer_data.assign((const char*)buffer, frame_count * bytes_per_frame(this->format));
+void AudioStream::add_frames(const void* buffer, size_t frame_count) {
+  uint64_t start_time = monotonic_now_ns();
+  // In threaded mode, only the feeder thread makes AL calls
+  ScopedContext cg(this->ring ? nullptr : this->context.get());
+  if (this->adaptive) {
+    this->update_producer_jitter(start_time);
+  }
+
+  if (!this->ring && !this->adaptive) {
+    this->wait_for_queue_space();
+    this->queue_buffer(buffer, frame_count);
+    this->frames_submitted += frame_count;
+    this->add_frames_durations_ns.add(monotonic_now_ns() - start_time);
+    return;
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer);
+  size_t bytes_remaining = frame_count * bytes_per_frame(this->format);
+
+  if (!this->ring) {
+    // Adaptive mode without a feeder thread: collect the data into blocks of
+    // the chosen size and queue each one when it's full
+    size_t block_bytes = this->staging.size();
+    while (bytes_remaining) {
+      size_t bytes = min(bytes_remaining, block_bytes - this->staging_bytes);
+      memcpy(&this->staging[this->staging_bytes], data, bytes);
+      this->staging_bytes += bytes;
+      data += bytes;
+      bytes_remaining -= bytes;
+      if (this->staging_bytes == block_bytes) {
+        this->wait_for_queue_space();
+        this->queue_buffer(this->staging.data(), this->block_frames);
+        this->staging_bytes = 0;
+      }
+    }
+    this->frames_submitted += frame_count;
+    this->add_frames_durations_ns.add(monotonic_now_ns() - start_time);
+    return;
+  }
+
+  size_t block_bytes = this->block_data.size();
+  size_t max_ring_bytes = this->max_ring_bytes;
+  while (bytes_remaining) {
+    size_t ring_bytes = this->ring->size();
+    size_t bytes_allowed = (ring_bytes < max_ring_bytes) ? (max_ring_bytes - ring_bytes) : 0;
+    size_t bytes_written = this->ring->write(data, min(bytes_remaining, bytes_allowed));
+    data += bytes_written;
+    bytes_remaining -= bytes_written;
+    if (bytes_written) {
+      // The lock is taken (and immediately released) so that the feeder
+      // thread can't miss the notification between checking the ring and
+      // going to sleep
+      { lock_guard<mutex> g(this->lock); }
+      this->feeder_cv.notify_one();
+    }
+    if (bytes_remaining) {
+      uint64_t wait_start_time = monotonic_now_ns();
+      unique_lock<mutex> g(this->lock);
+      size_t min_space = min(bytes_remaining, block_bytes);
+      this->client_cv.wait(g, [&]() {
+        return (this->ring->size() + min_space <= max_ring_bytes) || this->should_exit;
+      });
+      this->producer_wait_ns += monotonic_now_ns() - wait_start_time;
+      if (this->should_exit) {
+        // The feeder thread is gone, so the space will never appear; drop
+        // the rest of the data, as begin_write does
+        size_t bpf = bytes_per_frame(this->format);
+        this->frames_submitted += frame_count - (bytes_remaining + bpf - 1) / bpf;
+        return;
+      }
+    }
+  }
+  this->frames_submitted += frame_count;
+  this->add_frames_durations_ns.add(monotonic_now_ns() - start_time);
+}
+
+void* AudioStream::begin_write(size_t* max_bytes) {
+  if (!this->ring) {
+    throw logic_error("begin_write requires a threaded stream");
+  }
+  size_t bpf = bytes_per_frame(this->format);
+  size_t max_ring_bytes = this->max_ring_bytes;
+  for (;;) {
+    // Everything in the ring is whole frames and the capacity is a multiple
+    // of the frame size, so the contiguous space is too
+    size_t contiguous_bytes;
+    void* region = this->ring->write_region(&contiguous_bytes);
+    size_t ring_bytes = this->ring->size();
+    size_t bytes_allowed = (ring_bytes < max_ring_bytes) ? (max_ring_bytes - ring_bytes) : 0;
+    *max_bytes = min(contiguous_bytes, bytes_allowed);
+    if (*max_bytes) {
+      return region;
+    }
+
+    uint64_t wait_start_time = monotonic_now_ns();
+    unique_lock<mutex> g(this->lock);
+    this->client_cv.wait(g, [&]() {
+      return (this->ring->size() + bpf <= max_ring_bytes) || this->should_exit;
+    });
+    this->producer_wait_ns += monotonic_now_ns() - wait_start_time;
+    if (this->should_exit) {
+      *max_bytes = 0;
+      return nullptr;
+    }
+  }
+}
+
+void AudioStream::end_write(size_t bytes) {
+  size_t bpf = bytes_per_frame(this->format);
+  if (bytes % bpf) {
+    throw invalid_argument("end_write must be called with whole frames");
+  }
+  if (this->adaptive) {
+    this->update_producer_jitter(monotonic_now_ns());
+  }
+  this->ring->commit_write(bytes);
+  { lock_guard<mutex> g(this->lock); }
+  this->feeder_cv.notify_one();
+  this->frames_submitted += bytes / bpf;
+}
+
+void AudioStream::queue_buffer(const void* buffer, size_t frame_count) {
+  size_t index = (this->first_queued_index + this->num_queued_buffers) % this->all_buffer_ids.size();
+  ALuint buffer_id = this->all_buffer_ids[index];
 
   // Add the new data to the buffer and queue it
-  alBufferData(buffer_id, this->format, buffer_data.data(), buffer_data.size(), this->sample_rate);
+  AL_CALL(alBufferData, buffer_id, this->format, buffer, frame_count * bytes_per_frame(this->format), this->sample_rate);
   al_check_error();
-  alSourceQueueBuffers(this->source_id, 1, &buffer_id);
+  AL_CALL(alSourceQueueBuffers, this->source_id, 1, &buffer_id);
   al_check_error();
-  this->available_buffer_ids.erase(buffer_id);
-  this->queued_buffer_ids.emplace(buffer_id);
+  this->buffer_frame_counts[index] = frame_count;
+  this->num_queued_buffers++;
+  this->queued_frames += frame_count;
 
-  // Start playing the source if it isn't already playing
+  // Start playing the source if it isn't already playing. If it had been
+  // playing before and stopped on its own, it ran out of data.
   ALint source_state;
-  alGetSourcei(this->source_id, AL_SOURCE_STATE, &source_state);
+  AL_CALL(alGetSourcei, this->source_id, AL_SOURCE_STATE, &source_state);
   al_check_error();
+  bool underran = false;
   if (source_state != AL_PLAYING) {
-    alSourcePlay(this->source_id);
+    uint64_t now = monotonic_now_ns();
+    uint64_t last_underrun_time = this->last_underrun_time_ns.load();
+    if ((source_state == AL_STOPPED) && !this->stop_expected && last_underrun_time) {
+      this->underrun_count++;
+      this->underrun_intervals_usecs.add((now - last_underrun_time) / 1000);
+      this->last_underrun_time_ns = now;
+      underran = true;
+    } else if (!last_underrun_time) {
+      this->last_underrun_time_ns = now;
+    }
+    this->stop_expected = false;
+
+    AL_CALL(alSourcePlay, this->source_id);
     al_check_error();
   }
+
+  this->update_output_latency();
+  if (this->adaptive) {
+    this->update_queue_limit(underran);
+  }
+}
+
+void AudioStream::update_producer_jitter(uint64_t now) {
+  // This is the same smoothing as RTP's interarrival jitter (RFC 3550): an
+  // exponential moving average of the deviation from the mean interval
+  if (this->last_add_frames_time_ns) {
+    double interval = static_cast<double>(now - this->last_add_frames_time_ns);
+    if (this->mean_add_frames_interval_ns == 0.0) {
+      this->mean_add_frames_interval_ns = interval;
+    } else {
+      this->mean_add_frames_interval_ns += (interval - this->mean_add_frames_interval_ns) / 16.0;
+    }
+    double jitter = static_cast<double>(this->producer_jitter_ns.load(memory_order_relaxed));
+    jitter += (fabs(interval - this->mean_add_frames_interval_ns) - jitter) / 16.0;
+    this->producer_jitter_ns.store(static_cast<uint64_t>(jitter), memory_order_relaxed);
+  }
+  this->last_add_frames_time_ns = now;
+}
+
+void AudioStream::update_queue_limit(bool underran) {
+  // The queue should be long enough to cover several times the producer's
+  // jitter, plus the block that's currently playing
+  static constexpr double JITTER_MARGIN = 4.0;
+  static constexpr uint64_t STABLE_PERIOD_NS = 10000000000ULL; // 10 seconds
+
+  uint64_t now = monotonic_now_ns();
+  double block_ns = static_cast<double>(this->block_frames) * 1000000000.0 / this->sample_rate;
+  size_t jitter_blocks = static_cast<size_t>(ceil((JITTER_MARGIN * this->producer_jitter_ns.load()) / block_ns)) + 1;
+  size_t limit = this->queue_limit.load();
+  size_t new_limit = limit;
+
+  if (underran) {
+    new_limit = limit + max<size_t>(limit / 2, 1);
+  } else if (jitter_blocks > limit) {
+    new_limit = jitter_blocks;
+  } else if ((jitter_blocks < limit) && (now - this->last_queue_limit_change_time_ns >= STABLE_PERIOD_NS)) {
+    new_limit = limit - 1;
+  }
+
+  new_limit = min(max(new_limit, this->min_queue_limit), this->max_queue_limit);
+  if (underran || (new_limit != limit)) {
+    this->last_queue_limit_change_time_ns = now;
+  }
+  this->queue_limit = new_limit;
+}
+
+void AudioStream::update_output_latency() {
+  if (!this->get_sourcedv_fn) {
+    return;
+  }
+  ALdouble values[2] = {0.0, 0.0};
+  // Errors are sticky and aren't retrieved at all in OFF mode, so clear any
+  // earlier one first; otherwise it would look like this call failed
+  alGetError();
+  AL_CALL(this->get_sourcedv_fn, this->source_id, this->sec_offset_latency_enum, values);
+  if (alGetError() == AL_NO_ERROR) {
+    this->output_latency_ns = static_cast<int64_t>(values[1] * 1000000000.0);
+  }
 }
 
 void AudioStream::wait() {
-  // When all queued buffers are available, the sound is done playing
-  this->wait_for_buffers(this->all_buffer_ids.size());
+  ScopedContext cg(this->context.get());
+  if (!this->ring) {
+    // Queue any partial block left over in adaptive mode
+    if (this->staging_bytes) {
+      this->wait_for_queue_space();
+      this->queue_buffer(this->staging.data(), this->staging_bytes / bytes_per_frame(this->format));
+      this->staging_bytes = 0;
+    }
+    // When all queued buffers are available, the sound is done playing
+    this->wait_for_buffers(this->all_buffer_ids.size());
+    this->stop_expected = true;
+    return;
+  }
+
+  // Have the feeder submit any partial block left in the ring, then wait for
+  // everything to finish playing
+  unique_lock<mutex> g(this->lock);
+  this->flush_requested = true;
+  this->feeder_cv.notify_one();
+  this->client_cv.wait(g, [&]() {
+    return ((this->ring->size() == 0) && (this->num_queued_buffers == 0)) || this->should_exit;
+  });
+  this->flush_requested = false;
+  this->stop_expected = true;
+}
+
+void AudioStream::stop() {
+  ScopedContext cg(this->context.get());
+  unique_lock<mutex> g(this->lock, defer_lock);
+  if (this->ring) {
+    // The feeder thread only reads from the ring while holding the lock, so
+    // it's safe to discard the data here
+    g.lock();
+    this->ring->skip(this->ring->size());
+  }
+  this->staging_bytes = 0;
+
+  // Stopping the source marks all of its buffers as processed, so this
+  // unqueues all of them
+  AL_CALL(alSourceStop, this->source_id);
+  al_check_error();
+  this->check_buffers_locked();
+  this->stop_expected = true;
+
+  if (this->ring) {
+    this->client_cv.notify_all();
+  }
 }
 
 size_t AudioStream::check_buffers() {
+  ScopedContext cg(this->context.get());
+  if (this->ring) {
+    lock_guard<mutex> g(this->lock);
+    return this->check_buffers_locked();
+  }
+  return this->check_buffers_locked();
+}
+
+size_t AudioStream::check_buffers_locked() {
   int buffers_processed;
-  alGetSourcei(this->source_id, AL_BUFFERS_PROCESSED, &buffers_processed);
+  AL_CALL(alGetSourcei, this->source_id, AL_BUFFERS_PROCESSED, &buffers_processed);
   al_check_error();
+  if (buffers_processed > static_cast<int>(this->num_queued_buffers)) {
+    throw logic_error("more buffers were processed than were queued");
+  }
   if (buffers_processed) {
-    vector<ALuint> buffer_ids(buffers_processed);
-    alSourceUnqueueBuffers(this->source_id, buffers_processed, buffer_ids.data());
+    AL_CALL(alSourceUnqueueBuffers, this->source_id, buffers_processed, this->unqueue_buffer_ids.data());
     al_check_error();
-    for (ALuint buffer_id : buffer_ids) {
-      this->available_buffer_ids.emplace(buffer_id);
-      this->queued_buffer_ids.erase(buffer_id);
+    for (int x = 0; x < buffers_processed; x++) {
+      this->queued_frames -= this->buffer_frame_counts[(this->first_queued_index + x) % this->all_buffer_ids.size()];
     }
+    this->first_queued_index = (this->first_queued_index + buffers_processed) % this->all_buffer_ids.size();
+    this->num_queued_buffers -= buffers_processed;
   }
   return buffers_processed;
 }
@@ -84,21 +448,164 @@ size_t AudioStream::buffer_count() const {
 }
 
 size_t AudioStream::available_buffer_count() const {
-  return this->available_buffer_ids.size();
+  return this->all_buffer_ids.size() - this->queued_buffer_count();
 }
 
 size_t AudioStream::queued_buffer_count() const {
-  return this->queued_buffer_ids.size();
+  if (this->ring) {
+    lock_guard<mutex> g(this->lock);
+    return this->num_queued_buffers;
+  }
+  return this->num_queued_buffers;
+}
+
+bool AudioStream::is_threaded() const {
+  return this->ring.get() != nullptr;
+}
+
+AudioStream::Stats AudioStream::get_stats() const {
+  Stats ret;
+  ret.underrun_count = this->underrun_count.load();
+  ret.frames_submitted = this->frames_submitted.load();
+
+  uint64_t last_underrun_time = this->last_underrun_time_ns.load();
+  ret.seconds_since_last_underrun = last_underrun_time
+      ? (static_cast<double>(monotonic_now_ns() - last_underrun_time) / 1000000000.0)
+      : -1.0;
+
+  uint64_t queued_frames = this->queued_frames.load();
+  if (this->ring) {
+    queued_frames += this->ring->size() / bytes_per_frame(this->format);
+  }
+  ret.queued_ms = static_cast<double>(queued_frames * 1000) / this->sample_rate;
+
+  int64_t output_latency_ns = this->output_latency_ns.load();
+  ret.output_latency_ms = (output_latency_ns < 0) ? -1.0 : (static_cast<double>(output_latency_ns) / 1000000.0);
+
+  ret.add_frames_p50_usecs = static_cast<double>(this->add_frames_durations_ns.percentile(50)) / 1000.0;
+  ret.add_frames_p90_usecs = static_cast<double>(this->add_frames_durations_ns.percentile(90)) / 1000.0;
+  ret.add_frames_p99_usecs = static_cast<double>(this->add_frames_durations_ns.percentile(99)) / 1000.0;
+  ret.add_frames_max_usecs = static_cast<double>(this->add_frames_durations_ns.max()) / 1000.0;
+  ret.producer_wait_ms = static_cast<double>(this->producer_wait_ns.load()) / 1000000.0;
+
+  if (this->adaptive) {
+    ret.target_latency_ms = static_cast<double>(this->queue_limit.load() * this->block_frames * 1000) / this->sample_rate;
+    ret.producer_jitter_ms = static_cast<double>(this->producer_jitter_ns.load()) / 1000000.0;
+  } else {
+    ret.target_latency_ms = -1.0;
+    ret.producer_jitter_ms = -1.0;
+  }
+  return ret;
+}
+
+const AtomicHistogram& AudioStream::underrun_interval_histogram() const {
+  return this->underrun_intervals_usecs;
+}
+
+const AtomicHistogram& AudioStream::add_frames_duration_histogram() const {
+  return this->add_frames_durations_ns;
 }
 
 void AudioStream::wait_for_buffers(size_t num_buffers) {
   for (;;) {
     this->check_buffers();
-    if (this->available_buffer_ids.size() >= num_buffers) {
+    if (this->available_buffer_count() >= num_buffers) {
+      return;
+    }
+    usleep(1000);
+  }
+}
+
+void AudioStream::wait_for_queue_space() {
+  for (;;) {
+    this->check_buffers();
+    if (this->num_queued_buffers < this->queue_limit) {
       return;
     }
+    uint64_t wait_start_time = monotonic_now_ns();
     usleep(1000);
+    this->producer_wait_ns += monotonic_now_ns() - wait_start_time;
   }
 }
 
+double AudioStream::seconds_until_next_buffer_processed() {
+  if (this->num_queued_buffers == 0) {
+    return 0.0;
+  }
+  // All processed buffers have been unqueued at this point, so the sample
+  // offset is relative to the start of the oldest queued buffer
+  ALint sample_offset = 0;
+  AL_CALL(alGetSourcei, this->source_id, AL_SAMPLE_OFFSET, &sample_offset);
+  al_check_error();
+  size_t frames = this->buffer_frame_counts[this->first_queued_index];
+  size_t frames_remaining = (static_cast<size_t>(sample_offset) < frames) ? (frames - sample_offset) : 0;
+  return static_cast<double>(frames_remaining) / this->sample_rate;
+}
+
+void AudioStream::feeder_thread_fn() {
+  ScopedContext cg(this->context.get());
+  ScopedALErrorsNoThrow eg;
+  size_t bpf = bytes_per_frame(this->format);
+
+  unique_lock<mutex> g(this->lock);
+  while (!this->should_exit) {
+    // This can change if adaptive mode is enabled
+    size_t block_bytes = this->block_data.size();
+    size_t buffers_processed = this->check_buffers_locked();
+
+    // Move as many full blocks as possible from the ring into AL buffers. If
+    // a flush was requested, also submit whatever partial block remains.
+    bool any_queued = false;
+    while (this->num_queued_buffers < this->queue_limit) {
+      size_t ring_bytes = this->ring->size();
+      size_t bytes = min(ring_bytes, block_bytes);
+      if ((bytes < block_bytes) && !(this->flush_requested && bytes)) {
+        break;
+      }
+      bytes -= bytes % bpf;
+      if (bytes == 0) {
+        break;
+      }
+      // AL copies the data, so if the block doesn't wrap around the end of
+      // the ring it can be queued straight from the ring's memory
+      size_t contiguous_bytes;
+      const void* region = this->ring->read_region(&contiguous_bytes);
+      if (contiguous_bytes >= bytes) {
+        this->queue_buffer(region, bytes / bpf);
+        this->ring->skip(bytes);
+      } else {
+        this->ring->read(this->block_data.data(), bytes);
+        this->queue_buffer(this->block_data.data(), bytes / bpf);
+      }
+      any_queued = true;
+    }
+
+    // Wake up producers waiting for space, and wait() if everything is done
+    if (any_queued || buffers_processed) {
+      this->client_cv.notify_all();
+    }
+
+    // Sleep until the next queued buffer is due to finish, or until more data
+    // arrives if there's room to queue it. If nothing is queued and there's no
+    // data, sleep until a producer wakes us up.
+    auto ready_pred = [&]() -> bool {
+      return this->should_exit ||
+          ((this->num_queued_buffers < this->queue_limit) &&
+              ((this->ring->size() >= block_bytes) || (this->flush_requested && this->ring->size())));
+    };
+    if (this->num_queued_buffers) {
+      // AL updates the play position in steps of the device's update period,
+      // so a buffer can be due but not yet processed; don't spin in that case
+      double seconds = max(this->seconds_until_next_buffer_processed(), 0.001);
+      auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+      this->feeder_cv.wait_until(g, deadline, ready_pred);
+    } else {
+      this->feeder_cv.wait(g, ready_pred);
+    }
+  }
+
+  // Let any blocked producers or waiters return
+  this->client_cv.notify_all();
+}
+
 } // namespace phosg_audio
@@ -3,40 +3,176 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#include <string>
-#include <unordered_map>
-#include <unordered_set>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "Constants.hh"
+#include "Device.hh"
+#include "RingBuffer.hh"
+#include "Stats.hh"
 
 namespace phosg_audio {
 
 class AudioStream {
 public:
-  AudioStream(int sample_rate, int format, size_t num_buffers = 16);
+  // If threaded is true, add_frames copies the data into a lock-free ring and
+  // returns immediately if there's space; a background thread moves the data
+  // into AL buffers of block_frames frames each, waking up when the next
+  // buffer is due to finish playing. In this mode, add_frames and wait block
+  // on a condition variable instead of polling, and add_frames returns without
+  // queueing the rest of its data if the stream is destroyed while it's
+  // waiting. block_frames is ignored if threaded is false.
+  // If context is given, the stream is bound to it (see AudioContext);
+  // otherwise, it's bound to the calling thread's ScopedContext, if any.
+  AudioStream(int sample_rate, int format, size_t num_buffers = 16,
+      bool threaded = false, size_t block_frames = 1024,
+      std::shared_ptr<AudioContext> context = nullptr);
   ~AudioStream();
 
   void add_samples(const void* buffer, size_t sample_count);
   void add_frames(const void* buffer, size_t frame_count);
 
+  // Threaded mode only: a zero-copy alternative to add_frames, for producers
+  // that can generate or read() data directly into the stream's ring.
+  // begin_write waits until there's space for at least one frame, then
+  // returns a pointer to contiguous space and sets *max_bytes to its size (a
+  // multiple of the frame size). end_write makes the first bytes bytes of
+  // that space playable; bytes must also be a multiple of the frame size.
+  // Returns nullptr with *max_bytes = 0 if the stream is being destroyed.
+  void* begin_write(size_t* max_bytes);
+  void end_write(size_t bytes);
+
   void wait();
+  // Stops playback immediately and discards all queued audio, including any
+  // data still in the ring in threaded mode. A wait() in progress on another
+  // thread returns. The next add_frames call starts playing again.
+  void stop();
 
   size_t check_buffers();
   size_t buffer_count() const;
   size_t available_buffer_count() const;
   size_t queued_buffer_count() const;
+  bool is_threaded() const;
+
+  // Enables adaptive mode. Instead of queueing each add_frames call as its own
+  // buffer, the stream re-chunks incoming data into blocks of half of
+  // min_latency_ms, and varies the number of blocks it keeps queued so the
+  // queued audio stays between min_latency_ms and max_latency_ms. The queue
+  // grows when underruns occur or when the time between add_frames calls
+  // becomes more variable, and shrinks again after a period of stability. This
+  // must be called before any frames are added. Additional AL buffers are
+  // allocated if needed to reach max_latency_ms.
+  void enable_adaptive_latency(double min_latency_ms, double max_latency_ms);
+  bool is_adaptive() const;
+
+  // Everything here is read from atomic counters, so this can be called from
+  // any thread (e.g. a monitoring thread) without blocking the stream.
+  struct Stats {
+    uint64_t underrun_count;
+    uint64_t frames_submitted;
+    // Time since the last underrun, or since the stream started playing if
+    // there hasn't been one. -1 if the stream hasn't started yet.
+    double seconds_since_last_underrun;
+    // Audio accepted by the stream but not yet played, including any data
+    // waiting in the ring in threaded mode
+    double queued_ms;
+    // Delay between the source's play position and the speaker, from
+    // AL_SEC_OFFSET_LATENCY_SOFT; -1 if AL_SOFT_source_latency isn't
+    // available. Sampled each time a buffer is queued.
+    double output_latency_ms;
+    double add_frames_p50_usecs;
+    double add_frames_p90_usecs;
+    double add_frames_p99_usecs;
+    double add_frames_max_usecs;
+    // Total time add_frames and begin_write have spent blocked waiting for
+    // the stream to make room for more data
+    double producer_wait_ms;
+    // Adaptive mode only (otherwise -1): the current maximum amount of audio
+    // the stream will keep queued, and the smoothed deviation of the time
+    // between add_frames calls
+    double target_latency_ms;
+    double producer_jitter_ms;
+  };
+  Stats get_stats() const;
+  // Time between consecutive underruns, in microseconds. The first entry is
+  // the time from when the stream started playing to the first underrun.
+  const AtomicHistogram& underrun_interval_histogram() const;
+  // Duration of add_frames calls, in nanoseconds
+  const AtomicHistogram& add_frames_duration_histogram() const;
 
 private:
   void wait_for_buffers(size_t num_buffers = 1);
+  void wait_for_queue_space();
+  void update_producer_jitter(uint64_t now);
+  void update_queue_limit(bool underran);
+  void queue_buffer(const void* buffer, size_t frame_count);
+  size_t check_buffers_locked();
+  void feeder_thread_fn();
+  double seconds_until_next_buffer_processed();
+  void update_output_latency();
 
   int sample_rate;
   int format;
+  std::shared_ptr<AudioContext> context;
 
+  // AL processes queued buffers in FIFO order, so the buffers are used as a
+  // ring: the queued buffers are always the num_queued_buffers entries
+  // starting at first_queued_index (wrapping around), and the rest are
+  // available. AL copies the data in alBufferData, so no copy is kept here.
   std::vector<ALuint> all_buffer_ids;
-  std::unordered_set<ALuint> available_buffer_ids;
-  std::unordered_set<ALuint> queued_buffer_ids;
-  std::unordered_map<ALuint, std::string> buffer_id_to_data;
+  std::vector<size_t> buffer_frame_counts;
+  size_t first_queued_index;
+  size_t num_queued_buffers;
+  std::vector<ALuint> unqueue_buffer_ids; // Scratch space for check_buffers
   ALuint source_id;
+  bool stop_expected; // Set after wait() or stop(), so the next start isn't an underrun
+
+  // Instrumentation; see get_stats()
+  std::atomic<uint64_t> underrun_count;
+  std::atomic<uint64_t> frames_submitted;
+  std::atomic<uint64_t> queued_frames;
+  std::atomic<uint64_t> last_underrun_time_ns; // 0 = not started yet
+  std::atomic<int64_t> output_latency_ns; // -1 = not available
+  AtomicHistogram underrun_intervals_usecs;
+  AtomicHistogram add_frames_durations_ns;
+  std::atomic<uint64_t> producer_wait_ns;
+  ALenum sec_offset_latency_enum;
+  void (*get_sourcedv_fn)(ALuint, ALenum, ALdouble*);
+
+  // At most this many buffers are queued at once. This is the number of
+  // buffers, except in adaptive mode.
+  std::atomic<size_t> queue_limit;
+
+  // Adaptive mode only. staging holds a partial block in non-threaded mode;
+  // in threaded mode the ring does this instead.
+  bool adaptive;
+  size_t min_queue_limit;
+  size_t max_queue_limit;
+  std::vector<uint8_t> staging;
+  size_t staging_bytes;
+  uint64_t last_add_frames_time_ns;
+  double mean_add_frames_interval_ns;
+  std::atomic<uint64_t> producer_jitter_ns;
+  uint64_t last_queue_limit_change_time_ns;
+
+  // Threaded mode only. lock protects the AL objects and the fields above;
+  // the producer only takes it when it has to wait for space in the ring.
+  std::unique_ptr<SPSCRingBuffer> ring;
+  // The ring's capacity is rounded up to a power of 2, so the producer stops
+  // at this many bytes instead (one block in adaptive mode)
+  size_t max_ring_bytes;
+  size_t block_frames;
+  std::vector<uint8_t> block_data; // Scratch space for the feeder thread
+  mutable std::mutex lock;
+  std::condition_variable feeder_cv;
+  std::condition_variable client_cv;
+  bool flush_requested;
+  bool should_exit;
+  std::thread feeder_thread;
 };
 
 } // namespace phosg_audio
@@ -0,0 +1,103 @@
+#include "Trace.hh"
+
+#include <string.h>
+
+#include <format>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Sites are never destroyed, so the registry holds raw pointers
+static mutex sites_lock;
+static vector<ALCallSite*> sites;
+
+static thread_local ALCallSite* last_site = nullptr;
+
+ALCallSite::ALCallSite(const char* function, const char* file, int line)
+    : function(function),
+      file(file),
+      line(line),
+      total_ns(0),
+      error_count(0) {
+  lock_guard<mutex> g(sites_lock);
+  sites.emplace_back(this);
+}
+
+ALCallTimer::ALCallTimer(ALCallSite& site) : site(site), start_ns(monotonic_now_ns()) {}
+
+ALCallTimer::~ALCallTimer() {
+  uint64_t duration_ns = monotonic_now_ns() - this->start_ns;
+  this->site.durations_ns.add(duration_ns);
+  this->site.total_ns.fetch_add(duration_ns, memory_order_relaxed);
+  last_site = &this->site;
+}
+
+bool al_tracing_enabled() {
+#ifdef PHOSG_AUDIO_AL_TRACING
+  return true;
+#else
+  return false;
+#endif
+}
+
+void record_al_trace_error() {
+  if (last_site) {
+    last_site->error_count.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+static string json_escape(const char* s) {
+  string ret;
+  for (; *s; s++) {
+    if ((*s == '\"') || (*s == '\\')) {
+      ret.push_back('\\');
+      ret.push_back(*s);
+    } else if (static_cast<uint8_t>(*s) < 0x20) {
+      ret += format("\\u{:04X}", static_cast<uint8_t>(*s));
+    } else {
+      ret.push_back(*s);
+    }
+  }
+  return ret;
+}
+
+string al_trace_json() {
+  lock_guard<mutex> g(sites_lock);
+  string ret = "[";
+  for (const auto* site : sites) {
+    uint64_t calls = site->durations_ns.count();
+    if (calls == 0) {
+      continue;
+    }
+    // __FILE__ may be an absolute path; only the filename is interesting
+    const char* filename = strrchr(site->file, '/');
+    filename = filename ? (filename + 1) : site->file;
+    if (ret.size() > 1) {
+      ret += ",";
+    }
+    ret += format(
+        "{{\"function\":\"{}\",\"file\":\"{}\",\"line\":{},\"calls\":{},\"errors\":{},"
+        "\"total_ns\":{},\"p50_ns\":{},\"p99_ns\":{},\"max_ns\":{}}}",
+        json_escape(site->function), json_escape(filename), site->line, calls,
+        site->error_count.load(memory_order_relaxed),
+        site->total_ns.load(memory_order_relaxed),
+        site->durations_ns.percentile(50), site->durations_ns.percentile(99),
+        site->durations_ns.max());
+  }
+  ret += "]";
+  return ret;
+}
+
+void reset_al_trace() {
+  lock_guard<mutex> g(sites_lock);
+  for (auto* site : sites) {
+    site->durations_ns.clear();
+    site->total_ns.store(0, memory_order_relaxed);
+    site->error_count.store(0, memory_order_relaxed);
+  }
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <utility>
+
+#include "Stats.hh"
+
+namespace phosg_audio {
+
+// Per-call-site statistics for AL/ALC calls made through AL_CALL. Sites are
+// created on first use (one static instance per call site) and live for the
+// rest of the process.
+struct ALCallSite {
+  const char* function;
+  const char* file;
+  int line;
+  AtomicHistogram durations_ns;
+  std::atomic<uint64_t> total_ns;
+  // Errors reported by al_check_error after this call, on the same thread
+  std::atomic<uint64_t> error_count;
+
+  ALCallSite(const char* function, const char* file, int line);
+  ALCallSite(const ALCallSite&) = delete;
+  ALCallSite(ALCallSite&&) = delete;
+  ALCallSite& operator=(const ALCallSite&) = delete;
+  ALCallSite& operator=(ALCallSite&&) = delete;
+  ~ALCallSite() = default;
+};
+
+// Records the duration of one traced call. The site also becomes the calling
+// thread's most recent site, so errors found by the next al_check_error are
+// attributed to it.
+class ALCallTimer {
+public:
+  explicit ALCallTimer(ALCallSite& site);
+  ALCallTimer(const ALCallTimer&) = delete;
+  ALCallTimer(ALCallTimer&&) = delete;
+  ALCallTimer& operator=(const ALCallTimer&) = delete;
+  ALCallTimer& operator=(ALCallTimer&&) = delete;
+  ~ALCallTimer();
+
+private:
+  ALCallSite& site;
+  uint64_t start_ns;
+};
+
+template <typename FnT, typename... ArgTs>
+auto traced_al_call(ALCallSite& site, FnT fn, ArgTs&&... args) -> decltype(fn(std::forward<ArgTs>(args)...)) {
+  ALCallTimer t(site);
+  return fn(std::forward<ArgTs>(args)...);
+}
+
+// Returns true if the library was built with PHOSG_AUDIO_AL_TRACING
+bool al_tracing_enabled();
+// Attributes an AL error to the calling thread's most recent traced call.
+// Does nothing if tracing is disabled or no traced call was made yet.
+void record_al_trace_error();
+// Returns a JSON array with one object per call site that has been reached:
+// function, file, line, calls, errors, total_ns, p50_ns, p99_ns and max_ns.
+// The array is empty if tracing is disabled.
+std::string al_trace_json();
+// Clears the statistics for all call sites (the sites themselves remain)
+void reset_al_trace();
+
+// Wraps an AL/ALC call, e.g. AL_CALL(alSourcePlay, source_id). Without
+// PHOSG_AUDIO_AL_TRACING this is exactly the plain call.
+#ifdef PHOSG_AUDIO_AL_TRACING
+#define AL_CALL(fn, ...)                                                              \
+  phosg_audio::traced_al_call(                                                        \
+      []() -> phosg_audio::ALCallSite& {                                              \
+        static phosg_audio::ALCallSite site(#fn, __FILE__, __LINE__);                 \
+        return site;                                                                  \
+      }(),                                                                            \
+      fn __VA_OPT__(, ) __VA_ARGS__)
+#else
+#define AL_CALL(fn, ...) fn(__VA_ARGS__)
+#endif
+
+} // namespace phosg_audio
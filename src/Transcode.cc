@@ -0,0 +1,487 @@
+#include "Transcode.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Convert.hh"
+#include "File.hh"
+#include "Resampler.hh"
+
+using namespace std;
+
+namespace phosg_audio {
+
+// Reads a file or stdin. unread() puts back the bytes read while detecting the
+// input type, so the rest of the pipeline sees the input from the start.
+class InputFile {
+public:
+  explicit InputFile(const string& filename) : filename(filename), fd(-1), owns_fd(false) {
+    if (filename == "-") {
+      this->fd = STDIN_FILENO;
+    } else {
+      this->fd = open(filename.c_str(), O_RDONLY);
+      if (this->fd < 0) {
+        throw runtime_error(format("cannot open {}: {}", filename, strerror(errno)));
+      }
+      this->owns_fd = true;
+    }
+  }
+  ~InputFile() {
+    if (this->owns_fd) {
+      close(this->fd);
+    }
+  }
+  InputFile(const InputFile&) = delete;
+  InputFile(InputFile&&) = delete;
+  InputFile& operator=(const InputFile&) = delete;
+  InputFile& operator=(InputFile&&) = delete;
+
+  // Reads size bytes, or fewer only if the input ends first
+  size_t read(void* data, size_t size) {
+    uint8_t* out = reinterpret_cast<uint8_t*>(data);
+    size_t total = min(size, this->pushback.size());
+    memcpy(out, this->pushback.data(), total);
+    this->pushback.erase(this->pushback.begin(), this->pushback.begin() + total);
+
+    while (total < size) {
+      ssize_t bytes_read = ::read(this->fd, out + total, size - total);
+      if (bytes_read > 0) {
+        total += bytes_read;
+      } else if (bytes_read == 0) {
+        break;
+      } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        struct pollfd pfd = {this->fd, POLLIN, 0};
+        poll(&pfd, 1, -1);
+      } else if (errno != EINTR) {
+        throw runtime_error(format("cannot read {}: {}", this->filename, strerror(errno)));
+      }
+    }
+    return total;
+  }
+
+  void unread(const void* data, size_t size) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    this->pushback.insert(this->pushback.begin(), bytes, bytes + size);
+  }
+
+  void skip(size_t size) {
+    uint8_t buf[0x1000];
+    while (size) {
+      size_t bytes = min(size, sizeof(buf));
+      if (this->read(buf, bytes) < bytes) {
+        throw runtime_error(format("{} ended unexpectedly", this->filename));
+      }
+      size -= bytes;
+    }
+  }
+
+private:
+  string filename;
+  int fd;
+  bool owns_fd;
+  vector<uint8_t> pushback;
+};
+
+class OutputFile {
+public:
+  explicit OutputFile(const string& filename) : filename(filename), fd(-1), owns_fd(false) {
+    if (filename == "-") {
+      this->fd = STDOUT_FILENO;
+    } else {
+      this->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (this->fd < 0) {
+        throw runtime_error(format("cannot open {}: {}", filename, strerror(errno)));
+      }
+      this->owns_fd = true;
+    }
+  }
+  ~OutputFile() {
+    if (this->owns_fd) {
+      close(this->fd);
+    }
+  }
+  OutputFile(const OutputFile&) = delete;
+  OutputFile(OutputFile&&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+  OutputFile& operator=(OutputFile&&) = delete;
+
+  void write(const void* data, size_t size) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    while (size) {
+      ssize_t bytes_written = ::write(this->fd, bytes, size);
+      if (bytes_written > 0) {
+        bytes += bytes_written;
+        size -= bytes_written;
+      } else if ((bytes_written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        struct pollfd pfd = {this->fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+      } else if ((bytes_written == 0) || (errno != EINTR)) {
+        throw runtime_error(format("cannot write to {}: {}", this->filename, strerror(errno)));
+      }
+    }
+  }
+
+private:
+  string filename;
+  int fd;
+  bool owns_fd;
+};
+
+static uint16_t le16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+struct WAVStreamInfo {
+  SampleFormat format;
+  uint32_t sample_rate;
+  uint64_t data_bytes; // UINT64_MAX if the header doesn't say (streamed WAVs)
+};
+
+// If the input is a WAV file, reads everything up to the start of its sample
+// data. Otherwise, puts back what it read and returns nullopt. Chunks before
+// the data are read and discarded rather than seeked over, so this works on
+// pipes.
+static optional<WAVStreamInfo> read_wav_header(InputFile& f) {
+  uint8_t riff_header[12];
+  size_t bytes_read = f.read(riff_header, sizeof(riff_header));
+  if ((bytes_read < sizeof(riff_header)) || memcmp(riff_header, "RIFF", 4) || memcmp(riff_header + 8, "WAVE", 4)) {
+    f.unread(riff_header, bytes_read);
+    return nullopt;
+  }
+
+  WAVStreamInfo info;
+  bool have_fmt = false;
+  for (;;) {
+    uint8_t chunk_header[8];
+    if (f.read(chunk_header, sizeof(chunk_header)) < sizeof(chunk_header)) {
+      throw runtime_error("WAV file has no data chunk");
+    }
+    uint32_t chunk_size = le32(chunk_header + 4);
+
+    if (!memcmp(chunk_header, "fmt ", 4)) {
+      if (chunk_size < 16) {
+        throw runtime_error("WAV file has a truncated fmt chunk");
+      }
+      vector<uint8_t> fmt(chunk_size + (chunk_size & 1));
+      if (f.read(fmt.data(), fmt.size()) < fmt.size()) {
+        throw runtime_error("WAV file has a truncated fmt chunk");
+      }
+      uint16_t format_tag = le16(&fmt[0]);
+      uint16_t num_channels = le16(&fmt[2]);
+      uint16_t bits_per_sample = le16(&fmt[14]);
+      // WAVE_FORMAT_EXTENSIBLE; the real format tag starts the subformat GUID
+      if ((format_tag == 0xFFFE) && (chunk_size >= 26)) {
+        format_tag = le16(&fmt[24]);
+      }
+      if ((format_tag == 1) && (bits_per_sample == 8)) {
+        info.format.type = SampleType::U8;
+      } else if ((format_tag == 1) && (bits_per_sample == 16)) {
+        info.format.type = SampleType::S16;
+      } else if ((format_tag == 3) && (bits_per_sample == 32)) {
+        info.format.type = SampleType::F32;
+      } else {
+        throw runtime_error(format(
+            "sample width is not supported (format={}, bits_per_sample={})", format_tag, bits_per_sample));
+      }
+      if ((num_channels != 1) && (num_channels != 2)) {
+        throw runtime_error(format("sound has unsupported channel count ({})", num_channels));
+      }
+      info.format.num_channels = num_channels;
+      info.format.byte_order = endian::little;
+      info.sample_rate = le32(&fmt[4]);
+      have_fmt = true;
+
+    } else if (!memcmp(chunk_header, "data", 4)) {
+      if (!have_fmt) {
+        throw runtime_error("data chunk is before fmt chunk");
+      }
+      // Writers that stream WAVs to pipes can't fill in the size
+      info.data_bytes = ((chunk_size == 0) || (chunk_size == 0xFFFFFFFF)) ? UINT64_MAX : chunk_size;
+      return info;
+
+    } else {
+      f.skip(chunk_size + (chunk_size & 1));
+    }
+  }
+}
+
+struct TranscodeBlock {
+  vector<uint8_t> data;
+  size_t bytes = 0;
+};
+
+// FIFO of blocks between two pipeline stages. Blocks come from fixed pools,
+// so push never has to wait. pop waits for a block; it returns nullptr once
+// the queue is closed and empty, or as soon as the queue is aborted.
+class BlockQueue {
+public:
+  void push(TranscodeBlock* block) {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->blocks.emplace_back(block);
+    }
+    this->cv.notify_one();
+  }
+
+  TranscodeBlock* pop() {
+    unique_lock<mutex> g(this->lock);
+    this->cv.wait(g, [&]() { return this->aborted || this->closed || !this->blocks.empty(); });
+    if (this->aborted || this->blocks.empty()) {
+      return nullptr;
+    }
+    TranscodeBlock* ret = this->blocks.front();
+    this->blocks.pop_front();
+    return ret;
+  }
+
+  void close() {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->closed = true;
+    }
+    this->cv.notify_all();
+  }
+
+  void abort() {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->aborted = true;
+    }
+    this->cv.notify_all();
+  }
+
+private:
+  mutex lock;
+  condition_variable cv;
+  deque<TranscodeBlock*> blocks;
+  bool closed = false;
+  bool aborted = false;
+};
+
+TranscodeResult transcode(const TranscodeSpec& spec) {
+  if ((spec.block_frames == 0) || (spec.queue_blocks == 0)) {
+    throw invalid_argument("block_frames and queue_blocks must be nonzero");
+  }
+  if (spec.output_wav && (spec.output_filename == "-")) {
+    throw invalid_argument("WAV output must be written to a file");
+  }
+
+  InputFile input(spec.input_filename);
+  auto wav_info = read_wav_header(input);
+
+  TranscodeResult result;
+  result.input_format = wav_info ? wav_info->format : spec.raw_input_format;
+  result.input_sample_rate = wav_info ? wav_info->sample_rate : spec.raw_input_sample_rate;
+  result.output_format.type = spec.output_type.value_or(result.input_format.type);
+  result.output_format.num_channels = spec.output_channels ? spec.output_channels : result.input_format.num_channels;
+  result.output_format.byte_order = spec.output_wav ? endian::little : spec.output_byte_order;
+  result.output_sample_rate = spec.output_sample_rate ? spec.output_sample_rate : result.input_sample_rate;
+  result.input_frames = 0;
+  result.output_frames = 0;
+  if ((result.input_sample_rate == 0) || (result.output_sample_rate == 0)) {
+    throw invalid_argument("sample rates must be nonzero");
+  }
+
+  // Each block is byteswapped to native order in place if needed, then
+  // converted between AL formats (this also remixes channels), resampling in
+  // float in between if the rates differ
+  SampleFormat in_format = result.input_format;
+  SampleFormat out_format = result.output_format;
+  int in_al_format = al_format_for_sample_format(in_format);
+  int out_al_format = al_format_for_sample_format(out_format);
+  int float_al_format = out_format.is_stereo() ? AL_FORMAT_STEREO_FLOAT32 : AL_FORMAT_MONO_FLOAT32;
+  size_t in_bpf = in_format.bytes_per_frame();
+  size_t out_bpf = out_format.bytes_per_frame();
+  unique_ptr<Resampler> resampler;
+  if (result.input_sample_rate != result.output_sample_rate) {
+    resampler = make_unique<Resampler>(result.input_sample_rate, result.output_sample_rate, out_format.num_channels);
+  }
+  uint64_t data_bytes_remaining = wav_info ? wav_info->data_bytes : UINT64_MAX;
+
+  // Open the output before starting any threads, so errors like a bad path
+  // are reported without reading any input
+  unique_ptr<WAVWriter> wav_writer;
+  unique_ptr<OutputFile> raw_output;
+  if (spec.output_wav) {
+    wav_writer = make_unique<WAVWriter>(spec.output_filename, result.output_sample_rate,
+        out_format.num_channels, out_format.bytes_per_sample() * 8, out_format.type == SampleType::F32);
+  } else {
+    raw_output = make_unique<OutputFile>(spec.output_filename);
+  }
+
+  size_t max_out_frames = resampler ? resampler->max_output_frames(spec.block_frames) : spec.block_frames;
+  vector<TranscodeBlock> in_blocks(spec.queue_blocks);
+  vector<TranscodeBlock> out_blocks(spec.queue_blocks);
+  BlockQueue free_in, full_in, free_out, full_out;
+  for (auto& block : in_blocks) {
+    block.data.resize(spec.block_frames * in_bpf);
+    free_in.push(&block);
+  }
+  for (auto& block : out_blocks) {
+    block.data.resize(max_out_frames * out_bpf);
+    free_out.push(&block);
+  }
+
+  mutex error_lock;
+  exception_ptr error;
+  auto fail = [&](exception_ptr e) {
+    {
+      lock_guard<mutex> g(error_lock);
+      if (!error) {
+        error = e;
+      }
+    }
+    free_in.abort();
+    full_in.abort();
+    free_out.abort();
+    full_out.abort();
+  };
+
+  thread reader_thread([&]() {
+    try {
+      for (;;) {
+        TranscodeBlock* block = free_in.pop();
+        if (!block) {
+          break;
+        }
+        size_t bytes_wanted = min<uint64_t>(block->data.size(), data_bytes_remaining);
+        block->bytes = input.read(block->data.data(), bytes_wanted);
+        if (data_bytes_remaining != UINT64_MAX) {
+          data_bytes_remaining -= block->bytes;
+        }
+        bool done = (block->bytes < bytes_wanted) || (data_bytes_remaining == 0);
+        // Only the last block can end in a partial frame
+        block->bytes -= block->bytes % in_bpf;
+        result.input_frames += block->bytes / in_bpf;
+        if (block->bytes) {
+          full_in.push(block);
+        }
+        if (done) {
+          break;
+        }
+      }
+      full_in.close();
+    } catch (const exception&) {
+      fail(current_exception());
+    }
+  });
+
+  thread converter_thread([&]() {
+    try {
+      vector<float> decoded;
+      vector<float> resampled;
+      // Converts resampled into an output block and queues it
+      auto queue_resampled = [&]() -> bool {
+        size_t frame_count = resampled.size() / out_format.num_channels;
+        TranscodeBlock* out_block = free_out.pop();
+        if (!out_block) {
+          return false;
+        }
+        if (out_block->data.size() < frame_count * out_bpf) {
+          out_block->data.resize(frame_count * out_bpf);
+        }
+        convert_frames(out_block->data.data(), out_al_format, resampled.data(), float_al_format, frame_count);
+        out_block->bytes = frame_count * out_bpf;
+        if (out_format.is_swapped()) {
+          byteswap_samples(out_block->data.data(), frame_count, out_al_format);
+        }
+        full_out.push(out_block);
+        return true;
+      };
+
+      for (;;) {
+        TranscodeBlock* in_block = full_in.pop();
+        if (!in_block) {
+          break;
+        }
+        size_t frame_count = in_block->bytes / in_bpf;
+        if (in_format.is_swapped()) {
+          byteswap_samples(in_block->data.data(), frame_count, in_al_format);
+        }
+
+        if (resampler) {
+          decoded.resize(frame_count * out_format.num_channels);
+          convert_frames(decoded.data(), float_al_format, in_block->data.data(), in_al_format, frame_count);
+          free_in.push(in_block);
+          resampled.clear();
+          resampler->process(decoded.data(), frame_count, resampled);
+          if (!resampled.empty() && !queue_resampled()) {
+            break;
+          }
+
+        } else {
+          TranscodeBlock* out_block = free_out.pop();
+          if (!out_block) {
+            break;
+          }
+          convert_frames(out_block->data.data(), out_al_format, in_block->data.data(), in_al_format, frame_count);
+          out_block->bytes = frame_count * out_bpf;
+          free_in.push(in_block);
+          if (out_format.is_swapped()) {
+            byteswap_samples(out_block->data.data(), frame_count, out_al_format);
+          }
+          full_out.push(out_block);
+        }
+      }
+
+      if (resampler) {
+        resampled.clear();
+        resampler->flush(resampled);
+        if (!resampled.empty()) {
+          queue_resampled();
+        }
+      }
+      full_out.close();
+    } catch (const exception&) {
+      fail(current_exception());
+    }
+  });
+
+  // The calling thread is the writer
+  try {
+    for (;;) {
+      TranscodeBlock* block = full_out.pop();
+      if (!block) {
+        break;
+      }
+      if (wav_writer) {
+        wav_writer->write(block->data.data(), block->bytes);
+      } else {
+        raw_output->write(block->data.data(), block->bytes);
+      }
+      result.output_frames += block->bytes / out_bpf;
+      free_out.push(block);
+    }
+  } catch (const exception&) {
+    fail(current_exception());
+  }
+
+  reader_thread.join();
+  converter_thread.join();
+  if (error) {
+    rethrow_exception(error);
+  }
+  if (wav_writer) {
+    wav_writer->close();
+  }
+  return result;
+}
+
+} // namespace phosg_audio
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bit>
+#include <optional>
+#include <string>
+
+#include "Format.hh"
+
+namespace phosg_audio {
+
+struct TranscodeSpec {
+  // "-" means stdin. WAV input is detected by its RIFF header; anything else
+  // is raw sample data in raw_input_format at raw_input_sample_rate.
+  std::string input_filename;
+  SampleFormat raw_input_format = SampleFormat{SampleType::S16, 1};
+  uint32_t raw_input_sample_rate = 44100;
+
+  // "-" means stdout, which is only allowed for raw output since WAV output
+  // has to go back and fill in the header at the end
+  std::string output_filename;
+  bool output_wav = true;
+  // If not given, the input's sample type and channel count are kept
+  std::optional<SampleType> output_type;
+  uint8_t output_channels = 0;
+  // Ignored for WAV output, which is always little-endian
+  std::endian output_byte_order = std::endian::native;
+  // 0 = same as the input
+  uint32_t output_sample_rate = 0;
+
+  // The input is read in blocks of this many frames, and each stage of the
+  // pipeline has queue_blocks blocks, so memory use is bounded by roughly
+  // 2 * queue_blocks * block_frames frames regardless of the file's length.
+  size_t block_frames = 0x4000;
+  size_t queue_blocks = 4;
+};
+
+struct TranscodeResult {
+  SampleFormat input_format;
+  uint32_t input_sample_rate;
+  SampleFormat output_format;
+  uint32_t output_sample_rate;
+  uint64_t input_frames;
+  uint64_t output_frames;
+};
+
+// Converts one file, streaming it through three threads: one reads blocks of
+// input, one converts them (byteswap, channel remix, sample type conversion
+// and resampling, as needed), and the calling thread writes the results. If
+// any stage fails, the others stop and the first error is rethrown here. A
+// partial frame at the end of raw input is ignored.
+TranscodeResult transcode(const TranscodeSpec& spec);
+
+} // namespace phosg_audio